@@ -28,6 +28,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <time.h>
 
 typedef struct sddc sddc_t;
 
@@ -75,100 +76,737 @@ int sddc_free_device_info(struct sddc_device_info *sddc_device_infos);
 
 sddc_t *sddc_open(int index, const char* imagefile);
 
-void sddc_close(sddc_t *this);
+void sddc_close(sddc_t *sddc);
 
-enum SDDCStatus sddc_get_status(sddc_t *this);
+enum SDDCStatus sddc_get_status(sddc_t *sddc);
 
-enum SDDCHWModel sddc_get_hw_model(sddc_t *this);
+enum SDDCHWModel sddc_get_hw_model(sddc_t *sddc);
 
-const char *sddc_get_hw_model_name(sddc_t *this);
+const char *sddc_get_hw_model_name(sddc_t *sddc);
 
-uint16_t sddc_get_firmware(sddc_t *this);
+uint16_t sddc_get_firmware(sddc_t *sddc);
 
-const double *sddc_get_frequency_range(sddc_t *this);
+const double *sddc_get_frequency_range(sddc_t *sddc);
 
-enum RFMode sddc_get_rf_mode(sddc_t *this);
+enum RFMode sddc_get_rf_mode(sddc_t *sddc);
 
-int sddc_set_rf_mode(sddc_t *this, enum RFMode rf_mode);
+int sddc_set_rf_mode(sddc_t *sddc, enum RFMode rf_mode);
 
 
 /* LED functions */
-int sddc_led_on(sddc_t *this, uint8_t led_pattern);
+int sddc_led_on(sddc_t *sddc, uint8_t led_pattern);
 
-int sddc_led_off(sddc_t *this, uint8_t led_pattern);
+int sddc_led_off(sddc_t *sddc, uint8_t led_pattern);
 
-int sddc_led_toggle(sddc_t *this, uint8_t led_pattern);
+int sddc_led_toggle(sddc_t *sddc, uint8_t led_pattern);
 
 
 /* ADC functions */
-int sddc_get_adc_dither(sddc_t *this);
+int sddc_get_adc_dither(sddc_t *sddc);
 
-int sddc_set_adc_dither(sddc_t *this, int dither);
+int sddc_set_adc_dither(sddc_t *sddc, int dither);
 
-int sddc_get_adc_random(sddc_t *this);
+int sddc_get_adc_random(sddc_t *sddc);
 
-int sddc_set_adc_random(sddc_t *this, int random);
+/* the ADC randomization is removed from the frames as they are received,
+   before any processing; the frames in flight at a change while
+   streaming are de-randomized with the new setting */
+int sddc_set_adc_random(sddc_t *sddc, int random);
 
 
 /* HF block functions */
-double sddc_get_hf_attenuation(sddc_t *this);
+double sddc_get_hf_attenuation(sddc_t *sddc);
 
-int sddc_set_hf_attenuation(sddc_t *this, double attenuation);
+int sddc_set_hf_attenuation(sddc_t *sddc, double attenuation);
 
-int sddc_get_hf_bias(sddc_t *this);
+int sddc_get_hf_bias(sddc_t *sddc);
 
-int sddc_set_hf_bias(sddc_t *this, int bias);
+int sddc_set_hf_bias(sddc_t *sddc, int bias);
+
+int sddc_get_hf_vga(sddc_t *sddc);
+
+int sddc_set_hf_vga(sddc_t *sddc, int vga);
 
 
 /* VHF block and VHF/UHF tuner functions */
-double sddc_get_tuner_frequency(sddc_t *this);
+double sddc_get_tuner_frequency(sddc_t *sddc);
+
+int sddc_set_tuner_frequency(sddc_t *sddc, double frequency);
+
+int sddc_get_tuner_rf_attenuations(sddc_t *sddc, const double *attenuations[]);
+
+double sddc_get_tuner_rf_attenuation(sddc_t *sddc);
+
+int sddc_set_tuner_rf_attenuation(sddc_t *sddc, double attenuation);
+
+int sddc_get_tuner_if_attenuations(sddc_t *sddc, const double *attenuations[]);
+
+double sddc_get_tuner_if_attenuation(sddc_t *sddc);
 
-int sddc_set_tuner_frequency(sddc_t *this, double frequency);
+int sddc_set_tuner_if_attenuation(sddc_t *sddc, double attenuation);
 
-int sddc_get_tuner_rf_attenuations(sddc_t *this, const double *attenuations[]);
+double sddc_get_tuner_if_frequency(sddc_t *sddc);
 
-double sddc_get_tuner_rf_attenuation(sddc_t *this);
+int sddc_set_tuner_if_frequency(sddc_t *sddc, double if_frequency);
 
-int sddc_set_tuner_rf_attenuation(sddc_t *this, double attenuation);
+int sddc_get_tuner_sideband(sddc_t *sddc);
 
-int sddc_get_tuner_if_attenuations(sddc_t *this, const double *attenuations[]);
+int sddc_set_tuner_sideband(sddc_t *sddc, int sideband);
 
-double sddc_get_tuner_if_attenuation(sddc_t *this);
+int sddc_get_vhf_bias(sddc_t *sddc);
 
-int sddc_set_tuner_if_attenuation(sddc_t *this, double attenuation);
+int sddc_set_vhf_bias(sddc_t *sddc, int bias);
+
+
+/* control queue functions - the setters above can be called from any
+   thread: the changes are queued without blocking and applied in order
+   by the control thread, and the setters wait for theirs and return its
+   status (0 or -1). Within the streaming callbacks they can not wait:
+   they just queue the change and return SDDC_CONTROL_QUEUED, and its
+   failure is only logged; to follow it, use sddc_submit_control()
+   instead, which queues a change and returns right away with a ticket
+   to wait on (outside the callback) */
+enum SDDCControlStatus {
+  SDDC_CONTROL_QUEUED = 1
+};
+
+enum SDDCControl {
+  SDDC_CONTROL_RF_MODE,
+  SDDC_CONTROL_LED_ON,
+  SDDC_CONTROL_LED_OFF,
+  SDDC_CONTROL_LED_TOGGLE,
+  SDDC_CONTROL_ADC_DITHER,
+  SDDC_CONTROL_ADC_RANDOM,
+  SDDC_CONTROL_HF_ATTENUATION,
+  SDDC_CONTROL_HF_BIAS,
+  SDDC_CONTROL_HF_VGA,
+  SDDC_CONTROL_TUNER_FREQUENCY,
+  SDDC_CONTROL_TUNER_RF_ATTENUATION,
+  SDDC_CONTROL_TUNER_IF_ATTENUATION,
+  SDDC_CONTROL_TUNER_SIDEBAND,
+  SDDC_CONTROL_VHF_BIAS
+};
+
+/* returns the ticket, or -1 if the queue is full */
+int64_t sddc_submit_control(sddc_t *sddc, enum SDDCControl control,
+                            double value);
+
+/* timeout in ms (< 0 for no limit, 0 to poll); returns the status of the
+   change (0 or -1), or 1 if it is still pending */
+int sddc_wait_control(sddc_t *sddc, int64_t ticket, int timeout);
+
+/* while streaming, the changes of the tuner frequency and of the HF and
+   R82xx attenuations and gains are tagged with the (ADC) sample indexes
+   they affect, estimated from the times of their control transfers; the
+   tag callback receives them in the streaming thread just before the
+   first frame (or batch) that may hold affected samples. The settle time
+   of each control is measured from the step in the signal level after
+   its changes */
+struct sddc_control_tag {
+  enum SDDCControl control;
+  double value;
+  int status;                     /* 0, or -1 if the change failed */
+  int64_t ticket;
+  uint64_t sample_index;          /* first sample the change may affect */
+  uint64_t complete_index;        /* sample at the transfer completion */
+  uint64_t settled_index;         /* first sample after the change settled */
+  struct timespec submit_time;    /* CLOCK_MONOTONIC */
+  struct timespec complete_time;  /* CLOCK_MONOTONIC */
+};
 
-int sddc_get_vhf_bias(sddc_t *this);
+typedef void (*sddc_control_tag_cb_t)(const struct sddc_control_tag *tags,
+                                      uint32_t ntags, void *context);
+
+int sddc_set_control_tag_callback(sddc_t *sddc, sddc_control_tag_cb_t callback,
+                                  void *callback_context);
+
+/* settle times in samples from the complete index of a change; the
+   settled index of a tag is the complete index plus the max (or, before
+   the first measurement, the latency measured from the times the frames
+   are handed over) */
+struct sddc_control_settle {
+  uint64_t measurements;
+  uint64_t last;
+  uint64_t max;
+  double mean;
+};
 
-int sddc_set_vhf_bias(sddc_t *this, int bias);
+int sddc_get_control_settle(sddc_t *sddc, enum SDDCControl control,
+                            struct sddc_control_settle *settle);
 
 
 /* streaming functions */
 typedef void (*sddc_read_async_cb_t)(uint32_t data_size, uint8_t *data,
                                       void *context);
 
-double sddc_get_sample_rate(sddc_t *this);
+double sddc_get_sample_rate(sddc_t *sddc);
 
-int sddc_set_sample_rate(sddc_t *this, double sample_rate);
+int sddc_set_sample_rate(sddc_t *sddc, double sample_rate);
 
-int sddc_set_async_params(sddc_t *this, uint32_t frame_size, 
+int sddc_set_async_params(sddc_t *sddc, uint32_t frame_size, 
                           uint32_t num_frames, sddc_read_async_cb_t callback,
                           void *callback_context);
 
-int sddc_start_streaming(sddc_t *this);
+/* batched delivery - with small frames the per callback cost adds up, so
+   the frames completed in one sddc_handle_events() pass (up to max_batch,
+   0 for half of num_frames) are handed over together, in order. The
+   frames are valid until the callback returns, and their transfers are
+   resubmitted right after it; frame leases are not available here. With
+   the VHF baseband or the output resampler each batch holds one frame */
+struct sddc_frame_iov {
+  uint8_t *data;
+  uint32_t size;
+  uint64_t sample_index;            /* ADC sample index of the frame */
+};
+
+typedef void (*sddc_read_async_batch_cb_t)(const struct sddc_frame_iov *frames,
+                                           uint32_t count, void *context);
+
+int sddc_set_async_batch_params(sddc_t *sddc, uint32_t frame_size,
+                                uint32_t num_frames, uint32_t max_batch,
+                                sddc_read_async_batch_cb_t callback,
+                                void *callback_context);
+
+/* the usbfs backend (Linux only) submits the bulk transfers directly to
+   the kernel and reaps/resubmits them in batches; it takes effect at the
+   next sddc_set_async_params() */
+enum SDDCStreamingBackend {
+  SDDC_BACKEND_LIBUSB,
+  SDDC_BACKEND_USBFS
+};
+
+int sddc_set_streaming_backend(sddc_t *sddc, enum SDDCStreamingBackend backend);
+
+/* sddc_set_async_params() allocates the USB buffers and
+   sddc_start_streaming() the state of the in-library processing (which
+   depends on settings that can change until then); from the return of
+   sddc_start_streaming() to sddc_stop_streaming() the library does not
+   allocate, free or open files, and logs through a preallocated queue
+   (see sddc_alloc_test) */
+int sddc_start_streaming(sddc_t *sddc);
+
+int sddc_handle_events(sddc_t *sddc);
+
+int sddc_stop_streaming(sddc_t *sddc);
+
+int sddc_reset_status(sddc_t *sddc);
+
+int sddc_read_sync(sddc_t *sddc, uint8_t *data, int length, int *transferred);
+
+/* after a USB transfer error sddc_handle_events() restarts the stream in
+   place; the samples lost during the outage are estimated from its length
+   and skipped in the sample index (the activity detector timestamps) */
+struct sddc_stream_stats {
+  uint64_t sample_index;            /* samples delivered plus gaps */
+  uint64_t transfer_errors;
+  uint64_t recoveries;
+  uint64_t gap_samples;             /* total samples lost in the gaps */
+  uint64_t last_gap_sample_index;   /* sample index at the start of the last gap */
+  uint64_t last_gap_samples;
+  double last_outage;               /* duration of the last outage (s) */
+};
+
+int sddc_get_stream_stats(sddc_t *sddc, struct sddc_stream_stats *stats);
+
+/* frame leases - the streaming callback can keep the frame it was given
+   (raw ADC frames only) past its return: sddc_lease_frame() returns a
+   handle, and sddc_release_frame() (from any thread) gives the buffer
+   back. The transfer goes back to the USB queue at once with a spare
+   buffer from the pool; with no spare left the transfer itself is held
+   back (a stall - fewer transfers in flight), and once half of them are
+   held the lease is refused. Stalls and refusals are signalled to the
+   stall callback. A lease stays valid across sddc_stop_streaming(),
+   which does not wait for it: its transfer is reclaimed when it is
+   released, and all leases must be released before the streaming is
+   started again (sddc_start_streaming() fails otherwise) or the device
+   is closed */
+typedef struct sddc_lease sddc_lease_t;
+
+struct sddc_lease_stats {
+  uint32_t spare_frames;            /* size of the spare pool */
+  uint32_t leased;                  /* frames leased now */
+  uint32_t max_leased;              /* most frames leased at once */
+  uint32_t held_transfers;          /* transfers held back now */
+  uint64_t leases;                  /* leases granted */
+  uint64_t stalls;                  /* leases that held back a transfer */
+  uint64_t refused;                 /* leases refused */
+};
+
+typedef void (*sddc_stall_cb_t)(const struct sddc_lease_stats *stats,
+                                void *context);
+
+/* takes effect at the next sddc_set_async_params(), or at once when the
+   streaming is set up but stopped */
+int sddc_set_spare_frames(sddc_t *sddc, uint32_t num_spare_frames);
+
+sddc_lease_t *sddc_lease_frame(sddc_t *sddc);
+
+void sddc_release_frame(sddc_t *sddc, sddc_lease_t *lease);
+
+int sddc_get_lease_stats(sddc_t *sddc, struct sddc_lease_stats *stats);
+
+int sddc_set_stall_callback(sddc_t *sddc, sddc_stall_cb_t callback,
+                            void *callback_context);
+
+
+/* VHF baseband functions - when enabled in VHF mode, the streaming
+   callback receives the tuner output as complex baseband (interleaved
+   float I/Q) centered on the tuner frequency, instead of the raw ADC
+   samples; a bandwidth of 0 disables the conversion */
+int sddc_set_vhf_baseband(sddc_t *sddc, double bandwidth);
+
+double sddc_get_vhf_baseband_sample_rate(sddc_t *sddc);
+
+
+/* I/Q output functions - when enabled, the streaming callback receives the
+   whole ADC band as complex baseband (interleaved float I/Q) at half the
+   ADC sample rate: ADC frequency fs/4 is at 0 Hz, and the band within
+   +/-0.2 fs of it is flat. The VHF baseband conversion takes precedence
+   when enabled */
+int sddc_set_iq_output(sddc_t *sddc, int enable);
+
+int sddc_get_iq_output(sddc_t *sddc);
+
+
+/* output resampler functions - resample the stream delivered to the
+   callback to an exact output rate: float samples (scaled to +/-1.0) for
+   the raw ADC stream, or interleaved float I/Q with the VHF baseband or
+   the I/Q output. The frequency correction is then applied in the
+   resampler instead of on the ADC clock, so the output rate is exact; a
+   rate of 0 disables it */
+int sddc_set_output_sample_rate(sddc_t *sddc, double sample_rate);
+
+double sddc_get_output_sample_rate(sddc_t *sddc);
+
+
+/* frequency sweep functions - in VHF mode, retune through a list of
+   frequencies while streaming and report the stitched spectrum after
+   each full sweep; bin i of step s is centered at
+   frequencies[s] + (i - bins_per_step / 2) * bin_width. After each retune
+   the samples are dropped until the change has settled in the stream (see
+   sddc_get_control_settle()), and then for settle seconds more. The
+   sweep owns the tuner frequency: other changes to it fail until it is
+   stopped */
+struct sddc_sweep_spectrum {
+  uint32_t nsteps;
+  uint32_t bins_per_step;
+  const double *frequencies;    /* step center frequencies (Hz) */
+  double bin_width;             /* Hz */
+  const float *power;           /* nsteps * bins_per_step values (dBFS) */
+  uint64_t sweep;               /* sweep counter */
+};
+
+typedef void (*sddc_sweep_cb_t)(const struct sddc_sweep_spectrum *spectrum,
+                                void *context);
+
+int sddc_start_sweep(sddc_t *sddc, const double *frequencies, uint32_t nsteps,
+                     double span, double dwell, double settle,
+                     uint32_t fft_size, sddc_sweep_cb_t callback,
+                     void *callback_context);
+
+/* the sweep is closed by the thread handling the events; from another
+   thread this waits up to one second for it (and returns -1 if it is
+   still running then), from a callback it returns right away */
+int sddc_stop_sweep(sddc_t *sddc);
+
+
+/* activity detector functions */
+struct sddc_detector_band {
+  double frequency;   /* band center frequency (Hz) - range: 0 to fs/2 */
+  double bandwidth;   /* band width (Hz) */
+};
+
+enum SDDCActivityEventType {
+  SDDC_ACTIVITY_START,
+  SDDC_ACTIVITY_STOP
+};
+
+struct sddc_activity_event {
+  enum SDDCActivityEventType type;
+  int band;                     /* index into the bands array */
+  double power;                 /* band power (dBFS) */
+  uint64_t sample_index;        /* first sample of the detection block */
+  struct timespec timestamp;    /* CLOCK_REALTIME when the event was detected */
+};
+
+typedef void (*sddc_activity_cb_t)(const struct sddc_activity_event *event,
+                                   void *context);
+
+int sddc_set_activity_detector(sddc_t *sddc, uint32_t block_size,
+                               const struct sddc_detector_band *bands,
+                               int nbands, double on_threshold,
+                               double off_threshold,
+                               sddc_activity_cb_t callback,
+                               void *callback_context);
+
+int sddc_clear_activity_detector(sddc_t *sddc);
+
+
+/* sub-band filter bank functions - overlap-save fast convolution on the
+   ADC stream: one real FFT per block of fft_size samples is shared by all
+   the sub-bands, each filtered and decimated (by a power of two, in the
+   frequency domain) to complex baseband centered on its frequency, which
+   is rounded to a multiple of fs / fft_size. The blocks of a frame are
+   filtered by num_threads threads (the streaming thread included); the
+   callback gets interleaved float I/Q and the ADC sample index of the
+   first sample, which is (ntaps - 1) / 2 samples after the input it is
+   centered on. ntaps = 0 picks fft_size / 4 + 1 taps; nbands = 0 turns
+   the filter bank off. Settings take effect at sddc_start_streaming() */
+struct sddc_subband {
+  double frequency;   /* band center frequency (Hz) - range: 0 to fs/2 */
+  double bandwidth;   /* band width (Hz) */
+};
+
+typedef void (*sddc_subband_cb_t)(uint32_t band, const float *samples,
+                                  uint32_t count, uint64_t sample_index,
+                                  void *context);
+
+int sddc_set_subbands(sddc_t *sddc, const struct sddc_subband *bands,
+                      uint32_t nbands, uint32_t fft_size, uint32_t ntaps,
+                      int num_threads, sddc_subband_cb_t callback,
+                      void *callback_context);
+
+double sddc_get_subband_sample_rate(sddc_t *sddc, uint32_t band);
+
+double sddc_get_subband_frequency(sddc_t *sddc, uint32_t band);
+
+
+/* ADC statistics and HF AGC functions */
+struct sddc_adc_stats {
+  uint64_t frames;
+  uint64_t samples;
+  uint64_t full_scale_samples;        /* samples at ADC full scale */
+  uint64_t near_full_scale_samples;   /* samples within 1dB of full scale */
+  double peak;                        /* peak of the last frame (dBFS) */
+  double rms;                         /* RMS of the last frame (dBFS) */
+  double max_peak;                    /* highest frame peak since reset (dBFS) */
+};
+
+int sddc_get_adc_stats(sddc_t *sddc, struct sddc_adc_stats *stats);
+
+/* the streaming thread clears the statistics with the next frame; reads
+   return them cleared from the call on */
+int sddc_reset_adc_stats(sddc_t *sddc);
+
+int sddc_get_hf_agc(sddc_t *sddc);
+
+int sddc_set_hf_agc(sddc_t *sddc, int enable, double target_peak,
+                    double hysteresis);
+
+
+/* spectrum history functions - an append-only, memory mapped file of
+   power spectra (dB) indexed by time: the spectra as appended, and their
+   mean and peak over each minute and each hour (a pyramid, for reading
+   weeks of history quickly). The rows are stored in chunks, column by
+   column (per bin, delta coded in 1/16 dB steps), so a query only decodes
+   the bins it asks for. Times are nanoseconds since the epoch, and must
+   not go backwards. A read only history can be opened while another
+   process appends to it; it sees the rows written out so far (a chunk
+   of spectra is written every 64 rows and by sddc_history_flush(), a
+   minute or hour row as soon as its period ends) */
+typedef struct sddc_history sddc_history_t;
+
+enum SDDCHistoryLevel {
+  SDDC_HISTORY_AUTO = -1,     /* the finest level that fits max_rows */
+  SDDC_HISTORY_SPECTRA,
+  SDDC_HISTORY_MINUTES,
+  SDDC_HISTORY_HOURS
+};
+
+enum SDDCHistoryStat {
+  SDDC_HISTORY_MEAN,
+  SDDC_HISTORY_PEAK           /* same as the mean for the spectra */
+};
+
+struct sddc_history_info {
+  uint32_t nbins;
+  double frequency;           /* center of bin 0 (Hz) */
+  double bin_width;           /* Hz */
+  uint64_t rows[3];           /* rows written, per level */
+  int64_t first_time;         /* first spectrum */
+  int64_t last_time;          /* last spectrum written */
+  uint64_t file_size;         /* bytes */
+};
+
+/* a new file needs nbins, frequency and bin_width; an existing one is
+   appended to (nbins = 0 takes the bins from the file, otherwise they
+   must match). Only one writer at a time */
+sddc_history_t *sddc_history_open(const char *path, int writable,
+                                  uint32_t nbins, double frequency,
+                                  double bin_width);
+
+/* writes out the rows still in memory, and the current minute and hour;
+   appending to the file again carries on with those two periods */
+int sddc_history_close(sddc_history_t *history);
+
+int sddc_history_append(sddc_history_t *history, int64_t time,
+                        const float *power);
+
+int sddc_history_flush(sddc_history_t *history);
+
+int sddc_history_get_info(sddc_history_t *history,
+                          struct sddc_history_info *info);
+
+/* rows with start_time <= time < end_time, and the bins centered from
+   start_frequency to end_frequency (all of them if end_frequency <=
+   start_frequency): fills times and power (row by row, *nbins values
+   each, from bin *first_bin) with up to max_rows rows, oldest first, and
+   returns the number of rows in the range (-1 on error) */
+int sddc_history_query(sddc_history_t *history, int level, int stat,
+                       int64_t start_time, int64_t end_time,
+                       double start_frequency, double end_frequency,
+                       uint32_t max_rows, int64_t *times, float *power,
+                       uint32_t *first_bin, uint32_t *nbins);
+
+
+/* capture reader functions - a recording (a WAV file from wavewrite, or
+   the raw ADC samples of a record stage) mapped into memory for random
+   access: samples are located by time through an index of segments (a
+   sample and its time, with the samples in between at the nominal rate),
+   and read in place as zero-copy spans. The index comes from the
+   sidecar file <path>.sddcidx if a recorder wrote one (e.g. to mark the
+   gaps of a stream recovery), otherwise from the WAV header. A capture
+   can also be played back into a streaming callback, as fast as it is
+   consumed or paced at a multiple of real time */
+typedef struct sddc_capture sddc_capture_t;
+
+struct sddc_capture_segment {
+  uint64_t sample;            /* sample index in the capture */
+  int64_t time;               /* ns since the epoch */
+};
+
+struct sddc_capture_info {
+  double sample_rate;
+  double center_frequency;    /* from the WAV header (0 if unknown) */
+  uint32_t channels;          /* 1: real ADC samples, 2: I/Q */
+  uint32_t bits_per_sample;   /* 8 or 16 */
+  uint64_t samples;           /* per channel */
+  uint64_t data_offset;       /* file offset of sample 0 */
+  int64_t start_time;         /* time of sample 0 (0 if unknown) */
+  int64_t end_time;           /* time after the last sample */
+  uint32_t segments;          /* entries in the index */
+  int open_ended;             /* WAV data size not final (still being
+                                 recorded, or over 4GB): the samples run
+                                 to the end of the file */
+};
+
+/* sample_rate is only used for raw files without a sidecar index */
+sddc_capture_t *sddc_capture_open(const char *path, double sample_rate);
+
+void sddc_capture_close(sddc_capture_t *capture);
+
+int sddc_capture_get_info(sddc_capture_t *capture,
+                          struct sddc_capture_info *info);
+
+int64_t sddc_capture_get_time(sddc_capture_t *capture, uint64_t sample);
+
+/* the first sample at or after a time (the number of samples if none) */
+uint64_t sddc_capture_find_time(sddc_capture_t *capture, int64_t time);
+
+/* the data of up to count samples from a sample on, read only and valid
+   until the capture is closed; *available is set to the samples in the
+   span, and they are prefetched (0 past the end) */
+const void *sddc_capture_span(sddc_capture_t *capture, uint64_t sample,
+                              uint64_t count, uint64_t *available);
+
+/* feeds count samples from a sample on to a streaming callback, in frames
+   of frame_size bytes (0: about 1ms), copied out of the mapping so that
+   the callback can write to them as to streamed frames. speed is a multiple of real time (0: as fast as the
+   callback returns). Returns the samples played, fewer if
+   sddc_capture_stop() was called (e.g. from the callback) */
+int64_t sddc_capture_play(sddc_capture_t *capture, uint64_t sample,
+                          uint64_t count, uint32_t frame_size, double speed,
+                          sddc_read_async_cb_t callback, void *context);
+
+/* the same with batches of up to max_batch frames (0: 16); the sample
+   indexes are the capture ones */
+int64_t sddc_capture_play_batch(sddc_capture_t *capture, uint64_t sample,
+                                uint64_t count, uint32_t frame_size,
+                                uint32_t max_batch, double speed,
+                                sddc_read_async_batch_cb_t callback,
+                                void *context);
+
+void sddc_capture_stop(sddc_capture_t *capture);
+
+/* writes the sidecar index of a finished capture (sample_rate is only
+   needed for raw files); the segments must be in sample order */
+int sddc_capture_write_index(const char *path, double sample_rate,
+                             const struct sddc_capture_segment *segments,
+                             uint32_t count);
+
+
+/* offline processing functions - runs DSP over a capture of real 16 bit
+   ADC samples on all the cores: the range is split into chunks, each
+   processed by a worker thread with its own copy of the DSP, starting
+   early enough to fill the filters (so the outputs at the chunk edges
+   are the same as in one pass), and the outputs are handed to the
+   callbacks in order, on the thread calling sddc_offline_run() */
+typedef struct sddc_offline sddc_offline_t;
+
+typedef void (*sddc_offline_spectrum_cb_t)(const float *power, uint32_t nbins,
+                                           uint64_t sample_index,
+                                           void *context);
+
+/* num_threads = 0 uses one per online CPU; chunk_size = 0 picks 4M
+   samples (rounded up to whole spectra and detection blocks) */
+sddc_offline_t *sddc_offline_open(sddc_capture_t *capture, int num_threads,
+                                  uint64_t chunk_size);
+
+void sddc_offline_close(sddc_offline_t *offline);
+
+/* a digital down converter to complex baseband (the same as the VHF
+   baseband), with its outputs as sub-band callbacks (band is the index
+   returned here); the filter window of each output ends at its sample
+   index, a multiple of the decimation */
+int sddc_offline_add_ddc(sddc_offline_t *offline, double center_frequency,
+                         double bandwidth, int inverted,
+                         sddc_subband_cb_t callback, void *callback_context);
+
+double sddc_offline_get_ddc_sample_rate(sddc_offline_t *offline, uint32_t band);
+
+/* power spectra (dB, Hann window, fft_size / 2 + 1 bins) averaged over
+   navg blocks; sample_index is the first sample of the first block */
+int sddc_offline_add_spectrum(sddc_offline_t *offline, uint32_t fft_size,
+                              uint32_t navg,
+                              sddc_offline_spectrum_cb_t callback,
+                              void *callback_context);
+
+/* the activity detector; the event timestamps are the capture times of
+   the blocks, and the thresholds are applied in order, across chunks */
+int sddc_offline_add_detector(sddc_offline_t *offline, uint32_t block_size,
+                              const struct sddc_detector_band *bands,
+                              int nbands, double on_threshold,
+                              double off_threshold,
+                              sddc_activity_cb_t callback,
+                              void *callback_context);
+
+/* processes count samples from a sample on; returns the samples
+   processed (-1 on error) */
+int64_t sddc_offline_run(sddc_offline_t *offline, uint64_t sample,
+                         uint64_t count);
+
+
+/* processing pipeline functions - stages connected into a graph are run
+   on a pool of worker threads; the ADC frames enter the graph as
+   reference counted handles to the USB buffers, so every consumer shares
+   the same data without copies. The graph is built while not streaming;
+   a stage with a full input queue drops the frame (and counts it) */
+typedef struct sddc_frame sddc_frame_t;
+typedef struct sddc_stage sddc_stage_t;
+
+enum SDDCFrameFormat {
+  SDDC_FRAME_INT16,           /* ADC samples */
+  SDDC_FRAME_FLOAT,           /* real float samples */
+  SDDC_FRAME_COMPLEX_FLOAT,   /* interleaved float I/Q */
+  SDDC_FRAME_BYTES            /* anything else */
+};
+
+enum SDDCStageFlags {
+  SDDC_STAGE_ORDERED = 0,     /* one frame at a time, in arrival order */
+  SDDC_STAGE_PARALLEL = 1     /* stateless - frames run concurrently and
+                                 may be emitted out of order */
+};
+
+/* the stage callback borrows the frame reference for the duration of the
+   call; results are passed on with sddc_stage_emit() */
+typedef void (*sddc_stage_cb_t)(sddc_stage_t *stage, sddc_frame_t *frame,
+                                void *context);
+
+struct sddc_stage_stats {
+  uint64_t frames;            /* frames processed */
+  uint64_t dropped;           /* frames dropped (input queue full) */
+  uint64_t alloc_failures;    /* output frames not available */
+  uint32_t queued;            /* frames waiting in the input queue */
+};
+
+int sddc_pipeline_set_threads(sddc_t *sddc, int num_threads);
+
+/* output_size > 0 gives the stage a pool of output frames of that size
+   (sddc_stage_alloc_frame()); a stage without it can only forward frames */
+sddc_stage_t *sddc_pipeline_add_stage(sddc_t *sddc, const char *name,
+                                      sddc_stage_cb_t callback, void *context,
+                                      enum SDDCStageFlags flags,
+                                      uint32_t queue_size,
+                                      uint32_t output_size,
+                                      enum SDDCFrameFormat output_format);
+
+/* from = 0 connects the ADC frames to the stage */
+int sddc_pipeline_connect(sddc_t *sddc, sddc_stage_t *from, sddc_stage_t *to);
+
+int sddc_pipeline_clear(sddc_t *sddc);
+
+/* built in stages */
+sddc_stage_t *sddc_pipeline_add_convert(sddc_t *sddc);    /* to float */
+
+sddc_stage_t *sddc_pipeline_add_ddc(sddc_t *sddc, double center_frequency,
+                                    double bandwidth);    /* filter + decimate */
+
+sddc_stage_t *sddc_pipeline_add_fft(sddc_t *sddc, uint32_t fft_size); /* dB */
+
+sddc_stage_t *sddc_pipeline_add_record(sddc_t *sddc, int fd);
+
+/* averages the spectra of an fft stage over interval seconds and appends
+   them to a spectrum history (see below) */
+sddc_stage_t *sddc_pipeline_add_history(sddc_t *sddc,
+                                        sddc_history_t *history,
+                                        double interval);
+
+int sddc_stage_get_stats(sddc_stage_t *stage, struct sddc_stage_stats *stats);
+
+/* functions for the stage callbacks */
+sddc_frame_t *sddc_stage_alloc_frame(sddc_stage_t *stage,
+                                     const sddc_frame_t *input);
+
+int sddc_stage_emit(sddc_stage_t *stage, sddc_frame_t *frame);
+
+const void *sddc_frame_data(const sddc_frame_t *frame);
+
+void *sddc_frame_writable_data(sddc_frame_t *frame);  /* own frames only */
+
+uint32_t sddc_frame_size(const sddc_frame_t *frame);
+
+int sddc_frame_set_size(sddc_frame_t *frame, uint32_t size);
+
+enum SDDCFrameFormat sddc_frame_format(const sddc_frame_t *frame);
+
+uint64_t sddc_frame_sample_index(const sddc_frame_t *frame);
+
+void sddc_frame_ref(sddc_frame_t *frame);
+
+void sddc_frame_unref(sddc_frame_t *frame);
+
+
+/* logging functions - log messages are queued without blocking and
+   written out by a background thread to the sink (stderr by default) */
+enum SDDCLogLevel {
+  SDDC_LOG_ERROR,
+  SDDC_LOG_WARNING,
+  SDDC_LOG_INFO,
+  SDDC_LOG_DEBUG
+};
+
+typedef void (*sddc_log_cb_t)(enum SDDCLogLevel level, const char *message,
+                              void *context);
+
+int sddc_set_log_level(enum SDDCLogLevel level);
+
+int sddc_set_log_sink(sddc_log_cb_t sink, void *context);
 
-int sddc_handle_events(sddc_t *this);
+void sddc_flush_log();
 
-int sddc_stop_streaming(sddc_t *this);
 
-int sddc_reset_status(sddc_t *this);
+/* tracing functions - only available when the library is built with
+   -DENABLE_TRACE=ON; the trace file can be turned into a per-transfer
+   latency timeline with sddc_trace_timeline */
+int sddc_trace_dump(const char *filename);
 
-int sddc_read_sync(sddc_t *this, uint8_t *data, int length, int *transferred);
+int sddc_trace_reset();
 
 
 /* Misc functions */
-double sddc_get_frequency_correction(sddc_t *this);
+double sddc_get_frequency_correction(sddc_t *sddc);
 
-int sddc_set_frequency_correction(sddc_t *this, double correction);
+int sddc_set_frequency_correction(sddc_t *sddc, double correction);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,432 @@
+/*
+ * libsddc.hpp - C++20 interface for libsddc
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Header-only layer over libsddc.h:
+ *  - libsddc::device closes the SDR when it goes out of scope
+ *  - libsddc::stream<Handler> calls handler(std::span<const int16_t>) for
+ *    each frame; the handler type is a template parameter, so the per
+ *    frame dispatch is a direct (inlinable) call
+ *  - libsddc::async_stream is awaitable from a coroutine:
+ *      auto frame = co_await stream.next();
+ *
+ * Buffer lifetime: a frame span points directly into the USB transfer
+ * buffer, which is resubmitted as soon as the handler returns (or, for
+ * async_stream, as soon as the coroutine awaits the next frame), so the
+ * span must not be used after that - copy the samples if needed.
+ *
+ * Each stream registers its own callback with sddc_set_async_params(), so
+ * only the most recently created stream of a device receives frames; the
+ * USB buffers are kept and reused across streams and stop/start cycles.
+ * Exceptions thrown by a handler are caught before they reach libusb and
+ * rethrown from handle_events(). Do not call stop() from a handler or from
+ * a coroutine resumed by a frame; return to the handle_events() loop first.
+ */
+
+#ifndef __LIBSDDC_HPP
+#define __LIBSDDC_HPP
+
+#include <complex>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "libsddc.h"
+
+
+namespace libsddc {
+
+class error : public std::runtime_error {
+public:
+  explicit error(const std::string &what) : std::runtime_error(what) {}
+};
+
+namespace detail {
+
+inline int check(int ret, const char *function)
+{
+  if (ret < 0) {
+    throw error(std::string(function) + "() failed");
+  }
+  return ret;
+}
+
+}  // namespace detail
+
+
+class device {
+public:
+  explicit device(int index = 0, const char *imagefile = nullptr)
+    : handle_(sddc_open(index, imagefile))
+  {
+    if (handle_ == nullptr) {
+      throw error("sddc_open() failed");
+    }
+  }
+
+  ~device() { reset(); }
+
+  device(const device &) = delete;
+  device &operator=(const device &) = delete;
+
+  device(device &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+
+  device &operator=(device &&other) noexcept
+  {
+    if (this != &other) {
+      reset();
+      handle_ = std::exchange(other.handle_, nullptr);
+    }
+    return *this;
+  }
+
+  /* for the functions that are not wrapped here */
+  sddc_t *native_handle() const noexcept { return handle_; }
+
+  SDDCStatus status() const { return sddc_get_status(handle_); }
+  SDDCHWModel hw_model() const { return sddc_get_hw_model(handle_); }
+  uint16_t firmware() const { return sddc_get_firmware(handle_); }
+
+  RFMode rf_mode() const { return sddc_get_rf_mode(handle_); }
+  void set_rf_mode(RFMode rf_mode)
+  {
+    detail::check(sddc_set_rf_mode(handle_, rf_mode), "sddc_set_rf_mode");
+  }
+
+  void set_sample_rate(double sample_rate)
+  {
+    detail::check(sddc_set_sample_rate(handle_, sample_rate), "sddc_set_sample_rate");
+  }
+
+  void set_adc_dither(bool dither)
+  {
+    detail::check(sddc_set_adc_dither(handle_, dither), "sddc_set_adc_dither");
+  }
+
+  void set_adc_random(bool random)
+  {
+    detail::check(sddc_set_adc_random(handle_, random), "sddc_set_adc_random");
+  }
+
+  double hf_attenuation() const { return sddc_get_hf_attenuation(handle_); }
+  void set_hf_attenuation(double attenuation)
+  {
+    detail::check(sddc_set_hf_attenuation(handle_, attenuation), "sddc_set_hf_attenuation");
+  }
+
+  void set_hf_bias(bool bias)
+  {
+    detail::check(sddc_set_hf_bias(handle_, bias), "sddc_set_hf_bias");
+  }
+
+  double tuner_frequency() const { return sddc_get_tuner_frequency(handle_); }
+  void set_tuner_frequency(double frequency)
+  {
+    detail::check(sddc_set_tuner_frequency(handle_, frequency), "sddc_set_tuner_frequency");
+  }
+
+  void set_tuner_rf_attenuation(double attenuation)
+  {
+    detail::check(sddc_set_tuner_rf_attenuation(handle_, attenuation), "sddc_set_tuner_rf_attenuation");
+  }
+
+  void set_tuner_if_attenuation(double attenuation)
+  {
+    detail::check(sddc_set_tuner_if_attenuation(handle_, attenuation), "sddc_set_tuner_if_attenuation");
+  }
+
+  void set_vhf_bias(bool bias)
+  {
+    detail::check(sddc_set_vhf_bias(handle_, bias), "sddc_set_vhf_bias");
+  }
+
+  /* once enabled, stream with std::complex<float> samples */
+  void set_vhf_baseband(double bandwidth)
+  {
+    detail::check(sddc_set_vhf_baseband(handle_, bandwidth), "sddc_set_vhf_baseband");
+  }
+
+  /* once enabled, stream with std::complex<float> samples at half the
+     ADC sample rate */
+  void set_iq_output(bool enable)
+  {
+    detail::check(sddc_set_iq_output(handle_, enable), "sddc_set_iq_output");
+  }
+
+  /* without the VHF baseband or the I/Q output, stream with float samples */
+  void set_output_sample_rate(double sample_rate)
+  {
+    detail::check(sddc_set_output_sample_rate(handle_, sample_rate), "sddc_set_output_sample_rate");
+  }
+
+  sddc_adc_stats adc_stats() const
+  {
+    sddc_adc_stats stats;
+    detail::check(sddc_get_adc_stats(handle_, &stats), "sddc_get_adc_stats");
+    return stats;
+  }
+
+  void set_frequency_correction(double correction)
+  {
+    detail::check(sddc_set_frequency_correction(handle_, correction), "sddc_set_frequency_correction");
+  }
+
+private:
+  void reset() noexcept
+  {
+    if (handle_ != nullptr) {
+      sddc_close(handle_);
+      handle_ = nullptr;
+    }
+  }
+
+  sddc_t *handle_;
+};
+
+
+namespace detail {
+
+/* start/stop/event handling shared by the streams; the streams register
+   their own address as callback context, so they can't be moved */
+class stream_base {
+public:
+  stream_base(const stream_base &) = delete;
+  stream_base &operator=(const stream_base &) = delete;
+
+  void start()
+  {
+    detail::check(sddc_start_streaming(device_.native_handle()), "sddc_start_streaming");
+    streaming_ = true;
+  }
+
+  void stop()
+  {
+    if (streaming_) {
+      streaming_ = false;
+      detail::check(sddc_stop_streaming(device_.native_handle()), "sddc_stop_streaming");
+      detail::check(sddc_reset_status(device_.native_handle()), "sddc_reset_status");
+    }
+  }
+
+  bool streaming() const noexcept { return streaming_; }
+
+  /* runs the handler (or resumes the awaiting coroutine) for each frame */
+  void handle_events()
+  {
+    detail::check(sddc_handle_events(device_.native_handle()), "sddc_handle_events");
+    if (exception_) {
+      std::rethrow_exception(std::exchange(exception_, nullptr));
+    }
+  }
+
+protected:
+  explicit stream_base(device &dev) : device_(dev) {}
+
+  ~stream_base()
+  {
+    if (streaming_) {
+      streaming_ = false;
+      sddc_stop_streaming(device_.native_handle());
+      sddc_reset_status(device_.native_handle());
+    }
+  }
+
+  void configure(sddc_read_async_cb_t callback, uint32_t frame_size,
+                 uint32_t num_frames)
+  {
+    detail::check(sddc_set_async_params(device_.native_handle(), frame_size,
+                                        num_frames, callback, this),
+                  "sddc_set_async_params");
+  }
+
+  device &device_;
+  bool streaming_ = false;
+  std::exception_ptr exception_;
+};
+
+template <typename Sample>
+std::span<const Sample> frame_span(uint32_t data_size, uint8_t *data) noexcept
+{
+  return std::span<const Sample>(reinterpret_cast<const Sample *>(data),
+                                 data_size / sizeof(Sample));
+}
+
+}  // namespace detail
+
+
+/* callback stream: handler(std::span<const Sample>) runs on the thread
+   that calls handle_events() */
+template <typename Handler, typename Sample = int16_t>
+class stream : public detail::stream_base {
+public:
+  stream(device &dev, Handler handler, uint32_t frame_size = 0,
+         uint32_t num_frames = 0)
+    : stream_base(dev), handler_(std::move(handler))
+  {
+    configure(&stream::callback, frame_size, num_frames);
+  }
+
+  ~stream() = default;
+
+private:
+  static void callback(uint32_t data_size, uint8_t *data, void *context) noexcept
+  {
+    auto *self = static_cast<stream *>(static_cast<stream_base *>(context));
+    if (self->exception_) {
+      return;
+    }
+    try {
+      self->handler_(detail::frame_span<Sample>(data_size, data));
+    } catch (...) {
+      self->exception_ = std::current_exception();
+    }
+  }
+
+  Handler handler_;
+};
+
+
+/* coroutine task for consuming an async_stream; it starts running
+   immediately and is resumed by handle_events() */
+class task {
+public:
+  struct promise_type {
+    std::exception_ptr exception;
+
+    task get_return_object()
+    {
+      return task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept { exception = std::current_exception(); }
+  };
+
+  task(task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+  task &operator=(task &&) = delete;
+
+  ~task()
+  {
+    if (handle_) {
+      handle_.destroy();
+    }
+  }
+
+  bool done() const noexcept { return !handle_ || handle_.done(); }
+
+  /* rethrows the exception that ended the coroutine, if any */
+  void get() const
+  {
+    if (handle_ && handle_.promise().exception) {
+      std::rethrow_exception(handle_.promise().exception);
+    }
+  }
+
+private:
+  explicit task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+
+/* awaitable stream: 'co_await stream.next()' suspends until the next frame
+   and returns it (an empty span once the stream has been stopped); frames
+   that arrive while no coroutine is waiting are dropped and counted */
+template <typename Sample = int16_t>
+class basic_async_stream : public detail::stream_base {
+public:
+  explicit basic_async_stream(device &dev, uint32_t frame_size = 0,
+                              uint32_t num_frames = 0)
+    : stream_base(dev)
+  {
+    configure(&basic_async_stream::callback, frame_size, num_frames);
+  }
+
+  ~basic_async_stream() = default;
+
+  class frame_awaiter {
+  public:
+    explicit frame_awaiter(basic_async_stream &owner) noexcept : owner_(owner) {}
+
+    bool await_ready() const noexcept { return owner_.stopped_; }
+    void await_suspend(std::coroutine_handle<> waiter) noexcept
+    {
+      owner_.waiter_ = waiter;
+    }
+    std::span<const Sample> await_resume() const noexcept { return owner_.frame_; }
+
+  private:
+    basic_async_stream &owner_;
+  };
+
+  frame_awaiter next() noexcept { return frame_awaiter(*this); }
+
+  void start()
+  {
+    stopped_ = false;
+    stream_base::start();
+  }
+
+  /* wakes up the waiting coroutine with an empty frame */
+  void stop()
+  {
+    stream_base::stop();
+    stopped_ = true;
+    frame_ = {};
+    if (waiter_) {
+      std::exchange(waiter_, nullptr).resume();
+    }
+  }
+
+  uint64_t dropped_frames() const noexcept { return dropped_frames_; }
+
+private:
+  static void callback(uint32_t data_size, uint8_t *data, void *context) noexcept
+  {
+    auto *self = static_cast<basic_async_stream *>(static_cast<stream_base *>(context));
+    if (!self->waiter_) {
+      self->dropped_frames_++;
+      return;
+    }
+    /* the coroutine runs until its next co_await, inside this callback */
+    self->frame_ = detail::frame_span<Sample>(data_size, data);
+    std::exchange(self->waiter_, nullptr).resume();
+    self->frame_ = {};
+  }
+
+  std::coroutine_handle<> waiter_;
+  std::span<const Sample> frame_;
+  bool stopped_ = false;
+  uint64_t dropped_frames_ = 0;
+};
+
+using async_stream = basic_async_stream<int16_t>;
+using async_baseband_stream = basic_async_stream<std::complex<float>>;
+
+}  // namespace libsddc
+
+#endif /* __LIBSDDC_HPP */
@@ -0,0 +1,485 @@
+# sddc.py - Python bindings for libsddc
+#
+# Copyright (C) 2020 by Franco Venturi
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+"""Python bindings for libsddc.
+
+The streaming callback gets each USB frame as a NumPy array that points
+straight into the libusb buffer (no copy): int16 ADC samples, or complex64
+I/Q with the I/Q output or with the VHF baseband conversion (VHF mode only).
+With an output sample rate set, the raw ADC samples are float32 (from the
+library resampler). The array is only valid until the callback returns - copy it if
+you need to keep it.
+
+ctypes releases the GIL for every call into the library, so other Python
+threads keep running while handle_events() waits for USB transfers.
+
+Example:
+
+    with sddc.Sddc(0, 'SDDC_FX3.img') as radio:
+        radio.set_sample_rate(32e6)
+        frames = radio.read_frames(100)     # shape (100, frame_samples)
+"""
+
+import ctypes
+import ctypes.util
+import os
+
+import numpy as np
+
+
+# constants (see libsddc.h)
+STATUS_OFF = 0
+STATUS_READY = 1
+STATUS_STREAMING = 2
+STATUS_FAILED = 0xff
+
+NO_RF_MODE = 0
+HF_MODE = 1
+VHF_MODE = 2
+
+LED_YELLOW = 0x01
+LED_RED = 0x02
+LED_BLUE = 0x04
+
+LOG_ERROR = 0
+LOG_WARNING = 1
+LOG_INFO = 2
+LOG_DEBUG = 3
+
+
+class SddcError(Exception):
+    pass
+
+
+class AdcStats(ctypes.Structure):
+    _fields_ = [('frames', ctypes.c_uint64),
+                ('samples', ctypes.c_uint64),
+                ('full_scale_samples', ctypes.c_uint64),
+                ('near_full_scale_samples', ctypes.c_uint64),
+                ('peak', ctypes.c_double),
+                ('rms', ctypes.c_double),
+                ('max_peak', ctypes.c_double)]
+
+
+_read_async_cb_t = ctypes.CFUNCTYPE(None, ctypes.c_uint32, ctypes.c_void_p,
+                                    ctypes.c_void_p)
+_log_cb_t = ctypes.CFUNCTYPE(None, ctypes.c_int, ctypes.c_char_p,
+                             ctypes.c_void_p)
+
+_p = ctypes.c_void_p
+_d = ctypes.c_double
+_i = ctypes.c_int
+_u32 = ctypes.c_uint32
+
+# name: (restype, argtypes)
+_prototypes = {
+    'sddc_get_device_count': (_i, []),
+    'sddc_open': (_p, [_i, ctypes.c_char_p]),
+    'sddc_close': (None, [_p]),
+    'sddc_get_status': (_i, [_p]),
+    'sddc_get_firmware': (ctypes.c_uint16, [_p]),
+    'sddc_get_rf_mode': (_i, [_p]),
+    'sddc_set_rf_mode': (_i, [_p, _i]),
+    'sddc_led_on': (_i, [_p, ctypes.c_uint8]),
+    'sddc_led_off': (_i, [_p, ctypes.c_uint8]),
+    'sddc_led_toggle': (_i, [_p, ctypes.c_uint8]),
+    'sddc_get_adc_dither': (_i, [_p]),
+    'sddc_set_adc_dither': (_i, [_p, _i]),
+    'sddc_get_adc_random': (_i, [_p]),
+    'sddc_set_adc_random': (_i, [_p, _i]),
+    'sddc_get_hf_attenuation': (_d, [_p]),
+    'sddc_set_hf_attenuation': (_i, [_p, _d]),
+    'sddc_get_hf_bias': (_i, [_p]),
+    'sddc_set_hf_bias': (_i, [_p, _i]),
+    'sddc_get_hf_vga': (_i, [_p]),
+    'sddc_set_hf_vga': (_i, [_p, _i]),
+    'sddc_get_tuner_frequency': (_d, [_p]),
+    'sddc_set_tuner_frequency': (_i, [_p, _d]),
+    'sddc_get_tuner_rf_attenuation': (_d, [_p]),
+    'sddc_set_tuner_rf_attenuation': (_i, [_p, _d]),
+    'sddc_get_tuner_if_attenuation': (_d, [_p]),
+    'sddc_set_tuner_if_attenuation': (_i, [_p, _d]),
+    'sddc_get_tuner_if_frequency': (_d, [_p]),
+    'sddc_set_tuner_if_frequency': (_i, [_p, _d]),
+    'sddc_get_tuner_sideband': (_i, [_p]),
+    'sddc_set_tuner_sideband': (_i, [_p, _i]),
+    'sddc_get_vhf_bias': (_i, [_p]),
+    'sddc_set_vhf_bias': (_i, [_p, _i]),
+    'sddc_set_sample_rate': (_i, [_p, _d]),
+    'sddc_set_async_params': (_i, [_p, _u32, _u32, _read_async_cb_t, _p]),
+    'sddc_start_streaming': (_i, [_p]),
+    'sddc_handle_events': (_i, [_p]),
+    'sddc_stop_streaming': (_i, [_p]),
+    'sddc_reset_status': (_i, [_p]),
+    'sddc_read_sync': (_i, [_p, _p, _i, ctypes.POINTER(_i)]),
+    'sddc_set_vhf_baseband': (_i, [_p, _d]),
+    'sddc_get_vhf_baseband_sample_rate': (_d, [_p]),
+    'sddc_set_iq_output': (_i, [_p, _i]),
+    'sddc_get_iq_output': (_i, [_p]),
+    'sddc_set_output_sample_rate': (_i, [_p, _d]),
+    'sddc_get_output_sample_rate': (_d, [_p]),
+    'sddc_get_adc_stats': (_i, [_p, ctypes.POINTER(AdcStats)]),
+    'sddc_reset_adc_stats': (_i, [_p]),
+    'sddc_get_hf_agc': (_i, [_p]),
+    'sddc_set_hf_agc': (_i, [_p, _i, _d, _d]),
+    'sddc_set_log_level': (_i, [_i]),
+    'sddc_set_log_sink': (_i, [_log_cb_t, _p]),
+    'sddc_flush_log': (None, []),
+    'sddc_get_frequency_correction': (_d, [_p]),
+    'sddc_set_frequency_correction': (_i, [_p, _d]),
+}
+
+
+def _load_library():
+    path = os.environ.get('LIBSDDC') or ctypes.util.find_library('sddc')
+    if path is None:
+        raise OSError('libsddc not found - set LIBSDDC to its path')
+    lib = ctypes.CDLL(path)
+    for name, (restype, argtypes) in _prototypes.items():
+        function = getattr(lib, name)
+        function.restype = restype
+        function.argtypes = argtypes
+    return lib
+
+
+_lib = _load_library()
+
+
+def _check(ret, function):
+    if ret < 0:
+        raise SddcError(function + '() failed')
+    return ret
+
+
+def get_device_count():
+    return _lib.sddc_get_device_count()
+
+
+def set_log_level(level):
+    _check(_lib.sddc_set_log_level(level), 'sddc_set_log_level')
+
+
+_log_sink = None
+
+def set_log_sink(sink):
+    """Send the library log messages to sink(level, message) instead of
+    stderr; sink=None restores the default."""
+    global _log_sink
+    if sink is None:
+        _log_sink = None
+        _check(_lib.sddc_set_log_sink(_log_cb_t(), None), 'sddc_set_log_sink')
+        return
+    callback = _log_cb_t(lambda level, message, context:
+                         sink(level, message.decode(errors='replace')))
+    _check(_lib.sddc_set_log_sink(callback, None), 'sddc_set_log_sink')
+    _log_sink = callback    # keep the callback alive
+
+
+class Sddc:
+    """An open SDR; mirrors the sddc_* functions in libsddc.h."""
+
+    def __init__(self, index=0, imagefile=None):
+        self._handle = _lib.sddc_open(index, imagefile.encode() if imagefile else None)
+        if not self._handle:
+            raise SddcError('sddc_open() failed')
+        self._callback = None
+        self._c_callback = None
+        self._frame_size = 0
+        self._baseband = False
+        self._iq_output = False
+        self._resampled = False
+        self._error = None
+
+    def close(self):
+        if self._handle:
+            _lib.sddc_close(self._handle)
+            self._handle = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def __del__(self):
+        self.close()
+
+    def _call(self, name, *args):
+        return _check(getattr(_lib, name)(self._handle, *args), name)
+
+    # basic, LED and ADC functions
+    @property
+    def status(self):
+        return _lib.sddc_get_status(self._handle)
+
+    @property
+    def firmware(self):
+        return _lib.sddc_get_firmware(self._handle)
+
+    def get_rf_mode(self):
+        return _lib.sddc_get_rf_mode(self._handle)
+
+    def set_rf_mode(self, rf_mode):
+        self._call('sddc_set_rf_mode', rf_mode)
+
+    def led_on(self, led_pattern):
+        self._call('sddc_led_on', led_pattern)
+
+    def led_off(self, led_pattern):
+        self._call('sddc_led_off', led_pattern)
+
+    def led_toggle(self, led_pattern):
+        self._call('sddc_led_toggle', led_pattern)
+
+    def set_adc_dither(self, dither):
+        self._call('sddc_set_adc_dither', int(dither))
+
+    def set_adc_random(self, random):
+        self._call('sddc_set_adc_random', int(random))
+
+    # HF block functions
+    def get_hf_attenuation(self):
+        return _lib.sddc_get_hf_attenuation(self._handle)
+
+    def set_hf_attenuation(self, attenuation):
+        self._call('sddc_set_hf_attenuation', attenuation)
+
+    def set_hf_bias(self, bias):
+        self._call('sddc_set_hf_bias', int(bias))
+
+    def get_hf_vga(self):
+        return _lib.sddc_get_hf_vga(self._handle)
+
+    def set_hf_vga(self, vga):
+        self._call('sddc_set_hf_vga', vga)
+
+    # VHF block and tuner functions
+    def get_tuner_frequency(self):
+        return _lib.sddc_get_tuner_frequency(self._handle)
+
+    def set_tuner_frequency(self, frequency):
+        self._call('sddc_set_tuner_frequency', frequency)
+
+    def set_tuner_rf_attenuation(self, attenuation):
+        self._call('sddc_set_tuner_rf_attenuation', attenuation)
+
+    def set_tuner_if_attenuation(self, attenuation):
+        self._call('sddc_set_tuner_if_attenuation', attenuation)
+
+    def set_tuner_if_frequency(self, if_frequency):
+        self._call('sddc_set_tuner_if_frequency', if_frequency)
+
+    def set_tuner_sideband(self, sideband):
+        self._call('sddc_set_tuner_sideband', sideband)
+
+    def set_vhf_bias(self, bias):
+        self._call('sddc_set_vhf_bias', int(bias))
+
+    def set_vhf_baseband(self, bandwidth):
+        self._call('sddc_set_vhf_baseband', bandwidth)
+        self._baseband = bandwidth > 0
+
+    def get_vhf_baseband_sample_rate(self):
+        return _lib.sddc_get_vhf_baseband_sample_rate(self._handle)
+
+    def set_iq_output(self, enable):
+        self._call('sddc_set_iq_output', int(enable))
+        self._iq_output = bool(enable)
+
+    def get_iq_output(self):
+        return bool(_lib.sddc_get_iq_output(self._handle))
+
+    def set_output_sample_rate(self, sample_rate):
+        self._call('sddc_set_output_sample_rate', sample_rate)
+        self._resampled = sample_rate > 0
+
+    def get_output_sample_rate(self):
+        return _lib.sddc_get_output_sample_rate(self._handle)
+
+    # ADC statistics and AGC
+    def get_adc_stats(self):
+        stats = AdcStats()
+        self._call('sddc_get_adc_stats', ctypes.byref(stats))
+        return stats
+
+    def reset_adc_stats(self):
+        self._call('sddc_reset_adc_stats')
+
+    def set_hf_agc(self, enable, target_peak=-6.0, hysteresis=3.0):
+        self._call('sddc_set_hf_agc', int(enable), target_peak, hysteresis)
+
+    def set_frequency_correction(self, correction):
+        self._call('sddc_set_frequency_correction', correction)
+
+    # streaming functions
+    def set_sample_rate(self, sample_rate):
+        self._call('sddc_set_sample_rate', sample_rate)
+
+    @property
+    def dtype(self):
+        """NumPy type of the streamed samples."""
+        # the VHF baseband conversion only runs in VHF mode
+        baseband = self._baseband and self.get_rf_mode() == VHF_MODE
+        if baseband or self._iq_output:
+            return np.complex64
+        return np.float32 if self._resampled else np.int16
+
+    def set_async_params(self, callback, frame_size=0, num_frames=0):
+        """callback(samples) is called from handle_events() with each frame
+        as a NumPy array pointing into the USB buffer (no copy)."""
+        self._callback = callback
+        self._c_callback = _read_async_cb_t(self._read_async_callback)
+        self._frame_size = frame_size
+        self._call('sddc_set_async_params', frame_size, num_frames,
+                   self._c_callback, None)
+
+    def start_streaming(self):
+        self._error = None
+        self._call('sddc_start_streaming')
+
+    def handle_events(self):
+        """Handle the USB events (with the GIL released) and call the
+        streaming callback for each completed frame."""
+        self._call('sddc_handle_events')
+        if self._error is not None:
+            error, self._error = self._error, None
+            raise error
+
+    def stop_streaming(self):
+        self._call('sddc_stop_streaming')
+
+    def reset_status(self):
+        self._call('sddc_reset_status')
+
+    def read_sync(self, out):
+        """Synchronous read into the bytes of the array 'out'; returns the
+        number of bytes transferred."""
+        transferred = ctypes.c_int(0)
+        self._call('sddc_read_sync', out.ctypes.data, out.nbytes,
+                   ctypes.byref(transferred))
+        return transferred.value
+
+    def read_frames(self, nframes, out=None):
+        """Stream nframes frames into a single array of shape
+        (nframes, frame_samples) and return it. Pass 'out' to reuse a
+        preallocated array; the frame size is taken from the first frame
+        unless set_async_params() was given one."""
+        frames = {'out': out, 'count': 0}
+
+        def collect(samples):
+            batch = frames['out']
+            if batch is None:
+                batch = np.empty((nframes, len(samples)), dtype=samples.dtype)
+                frames['out'] = batch
+            count = frames['count']
+            if count < nframes:
+                ctypes.memmove(batch[count].ctypes.data, samples.ctypes.data,
+                               min(samples.nbytes, batch[count].nbytes))
+                frames['count'] = count + 1
+
+        previous = self._callback
+        if self._c_callback is None:
+            self.set_async_params(collect, self._frame_size)
+        self._callback = collect
+        try:
+            self.start_streaming()
+            try:
+                while frames['count'] < nframes:
+                    self.handle_events()
+            finally:
+                self.stop_streaming()
+                self.reset_status()
+        finally:
+            self._callback = previous
+        return frames['out']
+
+    def _read_async_callback(self, data_size, data, context):
+        if self._callback is None or self._error is not None:
+            return
+        dtype = self.dtype
+        count = data_size // np.dtype(dtype).itemsize
+        buffer = (ctypes.c_uint8 * data_size).from_address(data)
+        samples = np.frombuffer(buffer, dtype=dtype, count=count)
+        try:
+            self._callback(samples)
+        except BaseException as error:
+            # exceptions cannot propagate through libusb; re-raise them
+            # from handle_events()
+            self._error = error
+
+
+class FileSource:
+    """File-backed stand-in for Sddc streaming: replays a raw capture
+    (int16 ADC samples, or complex64 I/Q) frame by frame through the same
+    callback interface, using a memory map so no frame is copied."""
+
+    def __init__(self, filename, sample_rate, dtype=np.int16, frame_size=131072):
+        self._samples = np.memmap(filename, dtype=dtype, mode='r')
+        self._sample_rate = sample_rate
+        self._frame_samples = frame_size // np.dtype(dtype).itemsize
+        self._callback = None
+        self._position = 0
+        self.dtype = dtype
+
+    def close(self):
+        self._samples = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def get_sample_rate(self):
+        return self._sample_rate
+
+    def set_async_params(self, callback, frame_size=0, num_frames=0):
+        self._callback = callback
+        if frame_size > 0:
+            self._frame_samples = frame_size // np.dtype(self.dtype).itemsize
+
+    def start_streaming(self):
+        self._position = 0
+
+    def handle_events(self):
+        """Deliver the next frame; raises EOFError at the end of the file."""
+        end = self._position + self._frame_samples
+        if end > len(self._samples):
+            raise EOFError('end of capture file')
+        self._callback(self._samples[self._position:end])
+        self._position = end
+
+    def stop_streaming(self):
+        pass
+
+    def reset_status(self):
+        pass
+
+    def read_frames(self, nframes, out=None):
+        """Return the next nframes frames as an array of shape
+        (nframes, frame_samples); a view of the file unless 'out' is given."""
+        end = self._position + nframes * self._frame_samples
+        if end > len(self._samples):
+            raise EOFError('end of capture file')
+        frames = self._samples[self._position:end].reshape(nframes, self._frame_samples)
+        self._position = end
+        if out is None:
+            return frames
+        out[...] = frames
+        return out
@@ -0,0 +1,138 @@
+# test_sddc.py - tests for the Python bindings that need no device
+#
+# Copyright (C) 2020 by Franco Venturi
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#
+# SPDX-License-Identifier: GPL-3.0-or-later
+
+"""Streams raw capture files through FileSource, and checks the sample
+type Sddc picks for each output mode.
+
+    LIBSDDC=build/src/libsddc.so python3 -m pytest python
+"""
+
+import pytest
+
+np = pytest.importorskip('numpy')
+try:
+    import sddc
+except OSError as error:
+    pytest.skip(str(error), allow_module_level=True)
+
+
+FRAME_SIZE = 4096       # bytes
+
+
+@pytest.fixture
+def adc_capture(tmp_path):
+    samples = (np.arange(10 * FRAME_SIZE // 2) % 4096 - 2048).astype(np.int16)
+    path = tmp_path / 'adc.raw'
+    samples.tofile(path)
+    return path, samples
+
+
+@pytest.fixture
+def iq_capture(tmp_path):
+    n = 4 * FRAME_SIZE // 8
+    samples = np.exp(2j * np.pi * 0.01 * np.arange(n)).astype(np.complex64)
+    path = tmp_path / 'iq.raw'
+    samples.tofile(path)
+    return path, samples
+
+
+def stream(source, nframes):
+    frames = []
+    source.set_async_params(frames.append, FRAME_SIZE)
+    source.start_streaming()
+    for _ in range(nframes):
+        source.handle_events()
+    source.stop_streaming()
+    return frames
+
+
+def test_file_source_streams_the_capture(adc_capture):
+    path, samples = adc_capture
+    with sddc.FileSource(str(path), 64e6) as source:
+        frames = stream(source, 10)
+        assert source.get_sample_rate() == 64e6
+    assert len(frames) == 10
+    for frame in frames:
+        assert frame.dtype == np.int16
+        assert len(frame) == FRAME_SIZE // 2
+    np.testing.assert_array_equal(np.concatenate(frames), samples)
+
+
+def test_file_source_frames_are_views(adc_capture):
+    path, _ = adc_capture
+    with sddc.FileSource(str(path), 64e6) as source:
+        frames = stream(source, 2)
+        assert not frames[0].flags.owndata
+
+
+def test_file_source_end_of_file(adc_capture):
+    path, _ = adc_capture
+    with sddc.FileSource(str(path), 64e6) as source:
+        stream(source, 10)
+        with pytest.raises(EOFError):
+            source.handle_events()
+        # a new start replays from the beginning
+        source.start_streaming()
+        source.handle_events()
+
+
+def test_file_source_read_frames(adc_capture):
+    path, samples = adc_capture
+    nsamples = FRAME_SIZE // 2
+    with sddc.FileSource(str(path), 64e6, frame_size=FRAME_SIZE) as source:
+        first = source.read_frames(4)
+        out = np.empty((6, nsamples), dtype=np.int16)
+        rest = source.read_frames(6, out)
+        with pytest.raises(EOFError):
+            source.read_frames(1)
+    assert first.shape == (4, nsamples)
+    assert rest is out
+    np.testing.assert_array_equal(first.ravel(), samples[:4 * nsamples])
+    np.testing.assert_array_equal(rest.ravel(), samples[4 * nsamples:])
+
+
+def test_file_source_iq_capture(iq_capture):
+    path, samples = iq_capture
+    with sddc.FileSource(str(path), 32e6, dtype=np.complex64) as source:
+        frames = stream(source, 4)
+    for frame in frames:
+        assert frame.dtype == np.complex64
+        assert len(frame) == FRAME_SIZE // 8
+    np.testing.assert_array_equal(np.concatenate(frames), samples)
+
+
+@pytest.mark.parametrize('rf_mode,baseband,iq_output,resampled,dtype', [
+    (sddc.HF_MODE, False, False, False, np.int16),
+    (sddc.HF_MODE, True, False, False, np.int16),
+    (sddc.HF_MODE, True, False, True, np.float32),
+    (sddc.HF_MODE, False, True, False, np.complex64),
+    (sddc.VHF_MODE, False, False, False, np.int16),
+    (sddc.VHF_MODE, True, False, False, np.complex64),
+    (sddc.VHF_MODE, True, False, True, np.complex64),
+])
+def test_sddc_dtype(monkeypatch, rf_mode, baseband, iq_output, resampled,
+                    dtype):
+    # no device: only the state dtype looks at
+    radio = sddc.Sddc.__new__(sddc.Sddc)
+    radio._handle = None
+    radio._baseband = baseband
+    radio._iq_output = iq_output
+    radio._resampled = resampled
+    monkeypatch.setattr(radio, 'get_rf_mode', lambda: rf_mode)
+    assert radio.dtype == dtype
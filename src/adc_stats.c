@@ -0,0 +1,177 @@
+/*
+ * adc_stats.c - ADC clipping and level statistics
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "adc_stats.h"
+
+
+typedef struct adc_stats adc_stats_t;
+
+/* the accumulated statistics are written by the thread handling the USB
+   events and read from any thread; a sequence counter lets the readers
+   detect a concurrent update and retry. A reset from another thread is
+   only requested, and applied by that single writer with the next frame */
+typedef struct adc_stats {
+  atomic_uint sequence;
+  atomic_int reset_requested;
+  struct sddc_adc_stats stats;
+} adc_stats_t;
+
+/* internal functions */
+static void adc_stats_clear(struct sddc_adc_stats *stats);
+
+
+static const int32_t FULL_SCALE = 32767;
+static const int32_t NEAR_FULL_SCALE = 29204;    /* -1dBFS */
+static const double NO_SIGNAL_DBFS = -200.0;
+
+
+void adc_stats_compute(const int16_t *samples, uint32_t nsamples,
+                       struct adc_frame_stats *frame_stats)
+{
+  /* branch free loop, so the compiler can vectorize it */
+  uint32_t full_scale = 0;
+  uint32_t near_full_scale = 0;
+  int32_t peak = 0;
+  uint64_t sum_squares = 0;
+  for (uint32_t i = 0; i < nsamples; ++i) {
+    int32_t value = samples[i];
+    int32_t magnitude = value < 0 ? -value : value;
+    full_scale += magnitude >= FULL_SCALE;
+    near_full_scale += magnitude >= NEAR_FULL_SCALE;
+    peak = magnitude > peak ? magnitude : peak;
+    sum_squares += (uint32_t) (value * value);
+  }
+  frame_stats->nsamples = nsamples;
+  frame_stats->full_scale = full_scale;
+  frame_stats->near_full_scale = near_full_scale;
+  frame_stats->peak = peak;
+  frame_stats->sum_squares = sum_squares;
+  return;
+}
+
+
+double adc_stats_peak_dbfs(const struct adc_frame_stats *frame_stats)
+{
+  if (frame_stats->peak == 0) {
+    return NO_SIGNAL_DBFS;
+  }
+  return 20.0 * log10(frame_stats->peak / 32768.0);
+}
+
+
+double adc_stats_rms_dbfs(const struct adc_frame_stats *frame_stats)
+{
+  if (frame_stats->sum_squares == 0 || frame_stats->nsamples == 0) {
+    return NO_SIGNAL_DBFS;
+  }
+  double mean_square = (double) frame_stats->sum_squares / frame_stats->nsamples;
+  return 10.0 * log10(mean_square / (32768.0 * 32768.0));
+}
+
+
+adc_stats_t *adc_stats_open()
+{
+  adc_stats_t *this = (adc_stats_t *) malloc(sizeof(adc_stats_t));
+  if (this == 0) {
+    return 0;
+  }
+  atomic_init(&this->sequence, 0);
+  atomic_init(&this->reset_requested, 0);
+  adc_stats_clear(&this->stats);
+  return this;
+}
+
+
+void adc_stats_close(adc_stats_t *this)
+{
+  free(this);
+  return;
+}
+
+
+void adc_stats_update(adc_stats_t *this,
+                      const struct adc_frame_stats *frame_stats)
+{
+  double peak = adc_stats_peak_dbfs(frame_stats);
+  double rms = adc_stats_rms_dbfs(frame_stats);
+
+  atomic_fetch_add_explicit(&this->sequence, 1, memory_order_relaxed);
+  /* the stores below must not be seen before the odd sequence */
+  atomic_thread_fence(memory_order_release);
+  if (atomic_exchange_explicit(&this->reset_requested, 0,
+                               memory_order_acquire)) {
+    adc_stats_clear(&this->stats);
+  }
+  this->stats.frames++;
+  this->stats.samples += frame_stats->nsamples;
+  this->stats.full_scale_samples += frame_stats->full_scale;
+  this->stats.near_full_scale_samples += frame_stats->near_full_scale;
+  this->stats.peak = peak;
+  this->stats.rms = rms;
+  if (peak > this->stats.max_peak) {
+    this->stats.max_peak = peak;
+  }
+  atomic_fetch_add_explicit(&this->sequence, 1, memory_order_release);
+  return;
+}
+
+
+void adc_stats_get(adc_stats_t *this, struct sddc_adc_stats *stats)
+{
+  unsigned int sequence;
+  int reset;
+  do {
+    sequence = atomic_load_explicit(&this->sequence, memory_order_acquire);
+    *stats = this->stats;
+    reset = atomic_load_explicit(&this->reset_requested, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+  } while ((sequence & 1) ||
+           sequence != atomic_load_explicit(&this->sequence, memory_order_relaxed));
+  /* a reset not applied yet (no frame since, or not streaming) */
+  if (reset) {
+    adc_stats_clear(stats);
+  }
+  return;
+}
+
+
+void adc_stats_reset(adc_stats_t *this)
+{
+  atomic_store_explicit(&this->reset_requested, 1, memory_order_release);
+  return;
+}
+
+
+/* internal functions */
+static void adc_stats_clear(struct sddc_adc_stats *stats)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->peak = NO_SIGNAL_DBFS;
+  stats->rms = NO_SIGNAL_DBFS;
+  stats->max_peak = NO_SIGNAL_DBFS;
+  return;
+}
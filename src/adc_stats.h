@@ -0,0 +1,67 @@
+/*
+ * adc_stats.h - ADC clipping and level statistics
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __ADC_STATS_H
+#define __ADC_STATS_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct adc_stats adc_stats_t;
+
+/* statistics for a single frame */
+struct adc_frame_stats {
+  uint32_t nsamples;
+  uint32_t full_scale;
+  uint32_t near_full_scale;
+  int32_t peak;
+  uint64_t sum_squares;
+};
+
+void adc_stats_compute(const int16_t *samples, uint32_t nsamples,
+                       struct adc_frame_stats *frame_stats);
+
+double adc_stats_peak_dbfs(const struct adc_frame_stats *frame_stats);
+
+double adc_stats_rms_dbfs(const struct adc_frame_stats *frame_stats);
+
+adc_stats_t *adc_stats_open();
+
+void adc_stats_close(adc_stats_t *this);
+
+void adc_stats_update(adc_stats_t *this,
+                      const struct adc_frame_stats *frame_stats);
+
+void adc_stats_get(adc_stats_t *this, struct sddc_adc_stats *stats);
+
+void adc_stats_reset(adc_stats_t *this);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __ADC_STATS_H */
@@ -0,0 +1,641 @@
+/*
+ * capture.c - memory mapped capture reader
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The whole file is mapped read only, with MADV_RANDOM so that a lookup
+ * does not drag in megabytes of readahead; the spans are prefetched with
+ * MADV_WILLNEED instead, and a playback advises a window ahead of the
+ * frames it hands over and drops the pages well behind them (so a long
+ * capture does not grow the resident set - the page cache keeps them).
+ *
+ * The sidecar index is a small header followed by the segments
+ * (capture.h).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "logging.h"
+#include "wavehdr.h"
+
+
+/* internal functions */
+static int capture_parse_wav(sddc_capture_t *this, const char *path);
+static int capture_chunk_follows(sddc_capture_t *this, uint64_t offset);
+static int capture_load_index(sddc_capture_t *this, const char *path);
+static const struct sddc_capture_segment *capture_segment(sddc_capture_t *this,
+                                                          uint64_t sample);
+static void capture_advise(sddc_capture_t *this, uint64_t offset,
+                           uint64_t length, int advice);
+static int64_t capture_play(sddc_capture_t *this, uint64_t sample,
+                            uint64_t count, uint32_t frame_size,
+                            uint32_t max_batch, double speed,
+                            sddc_read_async_cb_t callback,
+                            sddc_read_async_batch_cb_t batch_callback,
+                            void *context);
+
+
+typedef struct sddc_capture {
+  uint8_t *map;
+  uint64_t file_size;
+  double sample_rate;
+  double center_frequency;
+  uint32_t channels;
+  uint32_t bits_per_sample;
+  uint32_t sample_size;     /* bytes per sample, all channels */
+  uint64_t data_offset;
+  uint64_t samples;
+  int open_ended;           /* the data size in the header is not final */
+  struct sddc_capture_segment *segments;
+  uint32_t nsegments;
+  long page_size;
+  atomic_int stop;
+} sddc_capture_t;
+
+
+static const char CAPTURE_INDEX_MAGIC[8] = { 'S', 'D', 'D', 'C', 'C', 'I', 'D', 'X' };
+static const uint32_t CAPTURE_INDEX_VERSION = 1;
+static const char CAPTURE_INDEX_SUFFIX[] = ".sddcidx";
+static const uint64_t CAPTURE_PREFETCH_SIZE = 16 << 20;
+static const uint32_t DEFAULT_MAX_BATCH = 16;
+
+
+sddc_capture_t *sddc_capture_open(const char *path, double sample_rate)
+{
+  sddc_capture_t *ret_val = 0;
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    LOG_ERROR("open(%s) failed: %s", path, strerror(errno));
+    return ret_val;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    LOG_ERROR("fstat(%s) failed: %s", path, strerror(errno));
+    close(fd);
+    return ret_val;
+  }
+  if (st.st_size == 0 || (uint64_t) st.st_size > SIZE_MAX) {
+    LOG_ERROR("%s is empty or too large to map", path);
+    close(fd);
+    return ret_val;
+  }
+  void *map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    LOG_ERROR("mmap(%s) failed: %s", path, strerror(errno));
+    return ret_val;
+  }
+  madvise(map, st.st_size, MADV_RANDOM);
+
+  sddc_capture_t *this = (sddc_capture_t *) calloc(1, sizeof(sddc_capture_t));
+  if (this == 0) {
+    LOG_ERROR("calloc() failed");
+    munmap(map, st.st_size);
+    return ret_val;
+  }
+  this->map = (uint8_t *) map;
+  this->file_size = st.st_size;
+  this->page_size = sysconf(_SC_PAGESIZE);
+  atomic_init(&this->stop, 0);
+
+  /* raw ADC samples unless it is a WAV file */
+  this->sample_rate = sample_rate;
+  this->channels = 1;
+  this->bits_per_sample = 16;
+  this->data_offset = 0;
+  this->open_ended = 0;
+  int is_wav = this->file_size >= 12 && memcmp(this->map, "RIFF", 4) == 0 &&
+               memcmp(this->map + 8, "WAVE", 4) == 0;
+  if (is_wav && capture_parse_wav(this, path) < 0) {
+    goto FAIL;
+  }
+  this->sample_size = this->channels * this->bits_per_sample / 8;
+  if (!is_wav) {
+    this->samples = this->file_size / this->sample_size;
+  }
+
+  if (capture_load_index(this, path) < 0) {
+    goto FAIL;
+  }
+  if (this->sample_rate <= 0) {
+    LOG_ERROR("%s has no sample rate", path);
+    goto FAIL;
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL:
+  munmap(this->map, this->file_size);
+  free(this->segments);
+  free(this);
+  return ret_val;
+}
+
+void sddc_capture_close(sddc_capture_t *this)
+{
+  munmap(this->map, this->file_size);
+  free(this->segments);
+  free(this);
+  return;
+}
+
+int sddc_capture_get_info(sddc_capture_t *this,
+                          struct sddc_capture_info *info)
+{
+  info->sample_rate = this->sample_rate;
+  info->center_frequency = this->center_frequency;
+  info->channels = this->channels;
+  info->bits_per_sample = this->bits_per_sample;
+  info->samples = this->samples;
+  info->data_offset = this->data_offset;
+  info->start_time = sddc_capture_get_time(this, 0);
+  info->end_time = sddc_capture_get_time(this, this->samples);
+  info->segments = this->nsegments;
+  info->open_ended = this->open_ended;
+  return 0;
+}
+
+int64_t sddc_capture_get_time(sddc_capture_t *this, uint64_t sample)
+{
+  const struct sddc_capture_segment *segment = capture_segment(this, sample);
+  double offset = (double) sample - (double) segment->sample;
+  return segment->time + (int64_t) (offset * 1e9 / this->sample_rate);
+}
+
+uint64_t sddc_capture_find_time(sddc_capture_t *this, int64_t time)
+{
+  /* the last segment starting at or before the time (or the first) */
+  uint32_t lo = 0;
+  uint32_t hi = this->nsegments;
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+    if (this->segments[mid].time <= time) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  const struct sddc_capture_segment *segment = &this->segments[lo];
+  double offset = (double) (time - segment->time) * this->sample_rate / 1e9;
+  double sample = (double) segment->sample + ceil(offset);
+  /* in a gap: the start of the next segment */
+  uint64_t next = lo + 1 < this->nsegments ? this->segments[lo+1].sample :
+                  this->samples;
+  if (sample <= 0) {
+    return 0;
+  }
+  return sample < (double) next ? (uint64_t) sample : next;
+}
+
+const void *sddc_capture_span(sddc_capture_t *this, uint64_t sample,
+                              uint64_t count, uint64_t *available)
+{
+  if (sample >= this->samples) {
+    *available = 0;
+    return 0;
+  }
+  if (count > this->samples - sample) {
+    count = this->samples - sample;
+  }
+  *available = count;
+  uint64_t offset = this->data_offset + sample * this->sample_size;
+  capture_advise(this, offset, count * this->sample_size, MADV_WILLNEED);
+  return this->map + offset;
+}
+
+int64_t sddc_capture_play(sddc_capture_t *this, uint64_t sample,
+                          uint64_t count, uint32_t frame_size, double speed,
+                          sddc_read_async_cb_t callback, void *context)
+{
+  if (callback == 0) {
+    LOG_ERROR("no streaming callback");
+    return -1;
+  }
+  return capture_play(this, sample, count, frame_size, 1, speed, callback,
+                      0, context);
+}
+
+int64_t sddc_capture_play_batch(sddc_capture_t *this, uint64_t sample,
+                                uint64_t count, uint32_t frame_size,
+                                uint32_t max_batch, double speed,
+                                sddc_read_async_batch_cb_t callback,
+                                void *context)
+{
+  if (callback == 0) {
+    LOG_ERROR("no streaming callback");
+    return -1;
+  }
+  max_batch = max_batch > 0 ? max_batch : DEFAULT_MAX_BATCH;
+  return capture_play(this, sample, count, frame_size, max_batch, speed, 0,
+                      callback, context);
+}
+
+void sddc_capture_stop(sddc_capture_t *this)
+{
+  atomic_store(&this->stop, 1);
+  return;
+}
+
+int sddc_capture_write_index(const char *path, double sample_rate,
+                             const struct sddc_capture_segment *segments,
+                             uint32_t count)
+{
+  int ret_val = -1;
+
+  if (count == 0) {
+    LOG_ERROR("no segments");
+    return ret_val;
+  }
+  for (uint32_t i = 1; i < count; ++i) {
+    if (segments[i].sample <= segments[i-1].sample) {
+      LOG_ERROR("segments not in sample order");
+      return ret_val;
+    }
+  }
+  struct stat st;
+  if (stat(path, &st) < 0) {
+    LOG_ERROR("stat(%s) failed: %s", path, strerror(errno));
+    return ret_val;
+  }
+
+  /* written aside and renamed, so a reader never sees half an index */
+  size_t len = strlen(path);
+  char *index_path = (char *) malloc(len + sizeof(CAPTURE_INDEX_SUFFIX) + 4);
+  char *tmp_path = (char *) malloc(len + sizeof(CAPTURE_INDEX_SUFFIX) + 4);
+  if (index_path == 0 || tmp_path == 0) {
+    LOG_ERROR("malloc() failed");
+    goto DONE;
+  }
+  sprintf(index_path, "%s%s", path, CAPTURE_INDEX_SUFFIX);
+  sprintf(tmp_path, "%s%s.new", path, CAPTURE_INDEX_SUFFIX);
+  FILE *fp = fopen(tmp_path, "wb");
+  if (fp == 0) {
+    LOG_ERROR("fopen(%s) failed: %s", tmp_path, strerror(errno));
+    goto DONE;
+  }
+  struct capture_index_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CAPTURE_INDEX_MAGIC, sizeof(CAPTURE_INDEX_MAGIC));
+  header.version = CAPTURE_INDEX_VERSION;
+  header.count = count;
+  header.file_size = st.st_size;
+  header.sample_rate = sample_rate;
+  int ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+           fwrite(segments, sizeof(*segments), count, fp) == count;
+  ok = fclose(fp) == 0 && ok;
+  if (!ok || rename(tmp_path, index_path) < 0) {
+    LOG_ERROR("writing %s failed: %s", index_path, strerror(errno));
+    unlink(tmp_path);
+    goto DONE;
+  }
+
+  /* all good */
+  ret_val = 0;
+
+DONE:
+  free(index_path);
+  free(tmp_path);
+  return ret_val;
+}
+
+
+/* internal functions */
+/* walks the chunks of a WAV file (fmt, auxi, data); wavewrite keeps the
+   data size in 32 bits and writes it only at the end (0 until then), so
+   past 4GB or while still recording the data runs to the end of the file
+   instead - unless another chunk follows it */
+static int capture_parse_wav(sddc_capture_t *this, const char *path)
+{
+  const fmt_chunk *fmt = 0;
+  const auxi_chunk *auxi = 0;
+  uint64_t data_size = 0;
+  uint64_t offset = sizeof(riff_chunk);
+  while (offset + sizeof(chunk_hdr) <= this->file_size) {
+    const chunk_hdr *hdr = (const chunk_hdr *) (this->map + offset);
+    uint64_t size = hdr->size;
+    uint64_t body = offset + sizeof(chunk_hdr);
+    if (memcmp(hdr->ID, "data", 4) == 0) {
+      this->data_offset = body;
+      data_size = size;
+      break;
+    }
+    if (body + size > this->file_size) {
+      break;
+    }
+    if (memcmp(hdr->ID, "fmt ", 4) == 0 && size >= sizeof(fmt_chunk) - sizeof(chunk_hdr)) {
+      fmt = (const fmt_chunk *) hdr;
+    } else if (memcmp(hdr->ID, "auxi", 4) == 0 &&
+               size >= sizeof(auxi_chunk) - sizeof(chunk_hdr)) {
+      auxi = (const auxi_chunk *) hdr;
+    }
+    offset = body + size + (size & 1);
+  }
+  if (fmt == 0 || this->data_offset == 0) {
+    LOG_ERROR("%s is not a complete WAV file", path);
+    return -1;
+  }
+  if (fmt->wFormatTag != 1 || fmt->nChannels < 1 || fmt->nChannels > 2 ||
+      (fmt->nBitsPerSample != 8 && fmt->nBitsPerSample != 16)) {
+    LOG_ERROR("%s: unsupported WAV format %d (%d channels, %d bits)", path,
+              fmt->wFormatTag, fmt->nChannels, fmt->nBitsPerSample);
+    return -1;
+  }
+  this->channels = fmt->nChannels;
+  this->bits_per_sample = fmt->nBitsPerSample;
+  if (fmt->nSamplesPerSec > 0) {
+    this->sample_rate = fmt->nSamplesPerSec;
+  }
+
+  uint64_t available = this->file_size - this->data_offset;
+  if (data_size == 0 || data_size > available ||
+      (data_size < available &&
+       !capture_chunk_follows(this, this->data_offset + data_size))) {
+    this->open_ended = data_size != available;
+    data_size = available;
+  }
+  this->samples = data_size / (this->channels * this->bits_per_sample / 8);
+
+  if (auxi) {
+    const Wind_SystemTime *t = &auxi->StartTime;
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = t->wYear - 1900;
+    tm.tm_mon = t->wMonth - 1;
+    tm.tm_mday = t->wDay;
+    tm.tm_hour = t->wHour;
+    tm.tm_min = t->wMinute;
+    tm.tm_sec = t->wSecond;
+    int64_t start_time = (int64_t) timegm(&tm) * 1000000000 +
+                         (int64_t) t->wMilliseconds * 1000000;
+    this->center_frequency = auxi->centerFreq;
+    this->segments = (struct sddc_capture_segment *)
+                     malloc(sizeof(struct sddc_capture_segment));
+    if (this->segments == 0) {
+      LOG_ERROR("malloc() failed");
+      return -1;
+    }
+    this->segments[0].sample = 0;
+    this->segments[0].time = start_time;
+    this->nsegments = 1;
+  }
+  return 0;
+}
+
+/* a chunk header (printable ID) with its body within the file */
+static int capture_chunk_follows(sddc_capture_t *this, uint64_t offset)
+{
+  offset += offset & 1;
+  if (offset + sizeof(chunk_hdr) > this->file_size) {
+    return 0;
+  }
+  const chunk_hdr *hdr = (const chunk_hdr *) (this->map + offset);
+  for (int i = 0; i < 4; ++i) {
+    if (hdr->ID[i] < 0x20 || hdr->ID[i] > 0x7e) {
+      return 0;
+    }
+  }
+  return offset + sizeof(chunk_hdr) + hdr->size <= this->file_size;
+}
+
+/* the sidecar replaces the index from the header, unless it belongs to
+   a different version of the capture; if it cannot be read (damaged, or
+   out of memory) the index is the one from the header again */
+static int capture_load_index(sddc_capture_t *this, const char *path)
+{
+  size_t len = strlen(path);
+  char *index_path = (char *) malloc(len + sizeof(CAPTURE_INDEX_SUFFIX));
+  FILE *fp = 0;
+  struct capture_index_header header;
+  struct sddc_capture_segment *segments = 0;
+  struct stat st;
+  if (index_path == 0) {
+    LOG_ERROR("malloc() failed");
+    goto DONE;
+  }
+  sprintf(index_path, "%s%s", path, CAPTURE_INDEX_SUFFIX);
+  fp = fopen(index_path, "rb");
+  if (fp == 0) {
+    goto DONE;
+  }
+  if (fread(&header, sizeof(header), 1, fp) != 1 ||
+      memcmp(header.magic, CAPTURE_INDEX_MAGIC, sizeof(CAPTURE_INDEX_MAGIC)) != 0 ||
+      header.version != CAPTURE_INDEX_VERSION || header.count == 0) {
+    LOG_WARNING("%s is not a capture index - ignored", index_path);
+    goto DONE;
+  }
+  if (header.file_size != this->file_size) {
+    LOG_WARNING("%s is for a capture of %llu bytes - ignored", index_path,
+                (unsigned long long) header.file_size);
+    goto DONE;
+  }
+  if (fstat(fileno(fp), &st) < 0 ||
+      (uint64_t) st.st_size < sizeof(header) +
+                              (uint64_t) header.count * sizeof(*segments)) {
+    LOG_WARNING("%s is truncated - ignored", index_path);
+    goto DONE;
+  }
+  segments = (struct sddc_capture_segment *)
+             malloc(header.count * sizeof(struct sddc_capture_segment));
+  if (segments == 0) {
+    LOG_WARNING("%s does not fit in memory - ignored", index_path);
+    goto DONE;
+  }
+  if (fread(segments, sizeof(*segments), header.count, fp) != header.count) {
+    LOG_WARNING("%s is truncated - ignored", index_path);
+    goto DONE;
+  }
+  for (uint32_t i = 1; i < header.count; ++i) {
+    if (segments[i].sample <= segments[i-1].sample) {
+      LOG_WARNING("%s is damaged - ignored", index_path);
+      goto DONE;
+    }
+  }
+  free(this->segments);
+  this->segments = segments;
+  this->nsegments = header.count;
+  segments = 0;
+  if (header.sample_rate > 0) {
+    this->sample_rate = header.sample_rate;
+  }
+
+DONE:
+  if (fp) {
+    fclose(fp);
+  }
+  free(segments);
+  free(index_path);
+
+  /* no time information: the capture starts at 0 */
+  if (this->nsegments == 0) {
+    this->segments = (struct sddc_capture_segment *)
+                     calloc(1, sizeof(struct sddc_capture_segment));
+    if (this->segments == 0) {
+      LOG_ERROR("calloc() failed");
+      return -1;
+    }
+    this->nsegments = 1;
+  }
+  return 0;
+}
+
+/* the last segment starting at or before a sample (or the first) */
+static const struct sddc_capture_segment *capture_segment(sddc_capture_t *this,
+                                                          uint64_t sample)
+{
+  uint32_t lo = 0;
+  uint32_t hi = this->nsegments;
+  while (hi - lo > 1) {
+    uint32_t mid = (lo + hi) / 2;
+    if (this->segments[mid].sample <= sample) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return &this->segments[lo];
+}
+
+static void capture_advise(sddc_capture_t *this, uint64_t offset,
+                           uint64_t length, int advice)
+{
+  if (offset >= this->file_size) {
+    return;
+  }
+  if (length > this->file_size - offset) {
+    length = this->file_size - offset;
+  }
+  uint64_t start = offset & ~(uint64_t) (this->page_size - 1);
+  madvise(this->map + start, length + (offset - start), advice);
+  return;
+}
+
+static int64_t capture_play(sddc_capture_t *this, uint64_t sample,
+                            uint64_t count, uint32_t frame_size,
+                            uint32_t max_batch, double speed,
+                            sddc_read_async_cb_t callback,
+                            sddc_read_async_batch_cb_t batch_callback,
+                            void *context)
+{
+  if (sample > this->samples) {
+    sample = this->samples;
+  }
+  if (count > this->samples - sample) {
+    count = this->samples - sample;
+  }
+  uint32_t frame_samples = frame_size / this->sample_size;
+  if (frame_samples == 0) {
+    frame_samples = (uint32_t) (this->sample_rate / 1000);
+    frame_samples = frame_samples > 0 ? frame_samples : 1;
+  }
+  /* the frames are copies - a callback may write to them (e.g. to remove
+     the ADC randomization in place), and the mapping is read only */
+  uint32_t frame_bytes = frame_samples * this->sample_size;
+  uint8_t *frames = (uint8_t *) malloc((size_t) max_batch * frame_bytes);
+  if (frames == 0) {
+    LOG_ERROR("malloc() failed");
+    return -1;
+  }
+  struct sddc_frame_iov *batch = 0;
+  if (batch_callback) {
+    batch = (struct sddc_frame_iov *) malloc(max_batch * sizeof(struct sddc_frame_iov));
+    if (batch == 0) {
+      LOG_ERROR("malloc() failed");
+      free(frames);
+      return -1;
+    }
+  }
+  atomic_store(&this->stop, 0);
+
+  uint64_t start = this->data_offset + sample * this->sample_size;
+  uint64_t end = start + count * this->sample_size;
+  capture_advise(this, start, end - start, MADV_SEQUENTIAL);
+  uint64_t prefetched = start;
+  uint64_t released = start;
+
+  struct timespec clk_start;
+  clock_gettime(CLOCK_MONOTONIC, &clk_start);
+  uint64_t played = 0;
+  uint32_t nbatch = 0;
+  while (played < count && !atomic_load(&this->stop)) {
+    uint64_t n = count - played;
+    n = n < frame_samples ? n : frame_samples;
+    uint64_t offset = start + played * this->sample_size;
+
+    /* a window ahead is on its way in, and the pages two windows behind
+       are dropped from the mapping */
+    if (offset + CAPTURE_PREFETCH_SIZE / 2 >= prefetched && prefetched < end) {
+      capture_advise(this, prefetched, CAPTURE_PREFETCH_SIZE, MADV_WILLNEED);
+      prefetched += CAPTURE_PREFETCH_SIZE;
+    }
+    if (offset >= released + 2 * CAPTURE_PREFETCH_SIZE) {
+      capture_advise(this, released, CAPTURE_PREFETCH_SIZE, MADV_DONTNEED);
+      released += CAPTURE_PREFETCH_SIZE;
+    }
+
+    /* paced: a frame is due once its last sample would have arrived */
+    if (speed > 0) {
+      double due = (played + n) / (this->sample_rate * speed);
+      struct timespec deadline = clk_start;
+      deadline.tv_sec += (time_t) due;
+      deadline.tv_nsec += (long) ((due - (time_t) due) * 1e9);
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, 0) == EINTR) {
+      }
+    }
+
+    uint8_t *data = frames + (size_t) nbatch * frame_bytes;
+    uint32_t data_size = (uint32_t) (n * this->sample_size);
+    memcpy(data, this->map + offset, data_size);
+    if (callback) {
+      callback(data_size, data, context);
+    } else {
+      batch[nbatch].data = data;
+      batch[nbatch].size = data_size;
+      batch[nbatch].sample_index = sample + played;
+      if (++nbatch == max_batch) {
+        batch_callback(batch, nbatch, context);
+        nbatch = 0;
+      }
+    }
+    played += n;
+  }
+  if (nbatch > 0) {
+    batch_callback(batch, nbatch, context);
+  }
+  free(batch);
+  free(frames);
+  capture_advise(this, start, end - start, MADV_RANDOM);
+  return (int64_t) played;
+}
@@ -0,0 +1,51 @@
+/*
+ * capture.h - memory mapped capture reader
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __CAPTURE_H
+#define __CAPTURE_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the capture functions themselves are in libsddc.h; this is the layout
+   of the sidecar index */
+typedef struct sddc_capture sddc_capture_t;
+
+/* followed by 'count' struct sddc_capture_segment */
+struct capture_index_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t count;
+  uint64_t file_size;       /* of the capture, to spot a stale index */
+  double sample_rate;       /* 0: the one in the WAV header */
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CAPTURE_H */
@@ -0,0 +1,260 @@
+/*
+ * control.c - control command queue and control thread
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Control commands from any thread go through a bounded lock-free queue
+ * (the same Vyukov queue as the log records) and are run in order by a
+ * single control thread, which is then the only writer of the shadow
+ * state of the device (GPIO and firmware registers, tuner frequency,
+ * attenuations). The ticket of a command is its position in the queue;
+ * its status is kept in a ring next to the queue, packed with the ticket
+ * into a single atomic word, so waiting for it needs no allocation.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "control.h"
+#include "logging.h"
+
+
+typedef struct control control_t;
+
+/* internal functions */
+static void *control_thread(void *arg);
+static void control_run_ready(control_t *this);
+
+
+struct control_command {
+  atomic_uint_fast64_t sequence;
+  int type;
+  double value;
+};
+
+#define CONTROL_QUEUE_SIZE (256)   /* must be a power of 2 */
+
+typedef struct control {
+  struct control_command queue[CONTROL_QUEUE_SIZE];
+  atomic_uint_fast64_t head;
+  uint64_t tail;                   /* control thread only */
+  atomic_uint_fast64_t results[CONTROL_QUEUE_SIZE];  /* ticket << 16 | status */
+  atomic_uint_fast64_t completed;  /* the commands before are done */
+  control_execute_cb_t execute;
+  void *execute_context;
+  sem_t pending;
+  atomic_int running;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  atomic_int waiters;
+} control_t;
+
+static const int CONTROL_STATUS_BITS = 16;
+
+
+control_t *control_open(control_execute_cb_t execute, void *execute_context)
+{
+  control_t *this = (control_t *) malloc(sizeof(control_t));
+  if (this == 0) {
+    LOG_ERROR("malloc() failed");
+    return 0;
+  }
+  for (uint64_t i = 0; i < CONTROL_QUEUE_SIZE; ++i) {
+    atomic_init(&this->queue[i].sequence, i);
+    atomic_init(&this->results[i], UINT64_MAX);
+  }
+  atomic_init(&this->head, 0);
+  this->tail = 0;
+  atomic_init(&this->completed, 0);
+  this->execute = execute;
+  this->execute_context = execute_context;
+  atomic_init(&this->running, 1);
+  atomic_init(&this->waiters, 0);
+  pthread_mutex_init(&this->lock, 0);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&this->done, &attr);
+  pthread_condattr_destroy(&attr);
+
+  if (sem_init(&this->pending, 0, 0) < 0) {
+    LOG_ERROR("sem_init() failed");
+    goto FAIL;
+  }
+  if (pthread_create(&this->thread, 0, control_thread, this) != 0) {
+    LOG_ERROR("pthread_create() failed");
+    sem_destroy(&this->pending);
+    goto FAIL;
+  }
+  return this;
+
+FAIL:
+  pthread_cond_destroy(&this->done);
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+  return 0;
+}
+
+void control_close(control_t *this)
+{
+  atomic_store(&this->running, 0);
+  sem_post(&this->pending);
+  pthread_join(this->thread, 0);
+  sem_destroy(&this->pending);
+  pthread_cond_destroy(&this->done);
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+  return;
+}
+
+int64_t control_submit(control_t *this, int type, double value)
+{
+  struct control_command *command;
+  uint64_t pos = atomic_load_explicit(&this->head, memory_order_relaxed);
+  for (;;) {
+    command = &this->queue[pos & (CONTROL_QUEUE_SIZE - 1)];
+    uint64_t sequence = atomic_load_explicit(&command->sequence,
+                                             memory_order_acquire);
+    int64_t diff = (int64_t) (sequence - pos);
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&this->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      LOG_ERROR("control queue full");
+      return -1;
+    } else {
+      pos = atomic_load_explicit(&this->head, memory_order_relaxed);
+    }
+  }
+  command->type = type;
+  command->value = value;
+  atomic_store_explicit(&command->sequence, pos + 1, memory_order_release);
+  sem_post(&this->pending);
+  return (int64_t) pos;
+}
+
+int control_wait(control_t *this, int64_t ticket, int timeout)
+{
+  if (ticket < 0 || (uint64_t) ticket >= atomic_load(&this->head)) {
+    LOG_ERROR("invalid control ticket: %lld", (long long) ticket);
+    return -1;
+  }
+
+  if (atomic_load(&this->completed) <= (uint64_t) ticket && timeout != 0) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    atomic_fetch_add(&this->waiters, 1);
+    pthread_mutex_lock(&this->lock);
+    while (atomic_load(&this->completed) <= (uint64_t) ticket) {
+      if (timeout < 0) {
+        pthread_cond_wait(&this->done, &this->lock);
+      } else if (pthread_cond_timedwait(&this->done, &this->lock,
+                                        &deadline) == ETIMEDOUT) {
+        break;
+      }
+    }
+    pthread_mutex_unlock(&this->lock);
+    atomic_fetch_sub(&this->waiters, 1);
+  }
+  if (atomic_load(&this->completed) <= (uint64_t) ticket) {
+    return 1;
+  }
+
+  uint64_t result = atomic_load(&this->results[ticket & (CONTROL_QUEUE_SIZE - 1)]);
+  if (result >> CONTROL_STATUS_BITS != (uint64_t) ticket) {
+    LOG_ERROR("status of control command %lld no longer available",
+              (long long) ticket);
+    return -1;
+  }
+  return (int16_t) (result & 0xffff);
+}
+
+int64_t control_last_ticket(control_t *this)
+{
+  return (int64_t) atomic_load(&this->head) - 1;
+}
+
+int control_is_control_thread(control_t *this)
+{
+  return pthread_equal(pthread_self(), this->thread);
+}
+
+
+/* internal functions */
+static void *control_thread(void *arg)
+{
+  control_t *this = (control_t *) arg;
+  for (;;) {
+    if (sem_wait(&this->pending) < 0) {
+      continue;
+    }
+    /* a command may be published out of order with its wakeup, so run
+       all those that are ready */
+    control_run_ready(this);
+    if (!atomic_load(&this->running)) {
+      break;
+    }
+  }
+  return 0;
+}
+
+static void control_run_ready(control_t *this)
+{
+  for (;;) {
+    struct control_command *command = &this->queue[this->tail & (CONTROL_QUEUE_SIZE - 1)];
+    uint64_t sequence = atomic_load_explicit(&command->sequence,
+                                             memory_order_acquire);
+    if (sequence != this->tail + 1) {
+      break;
+    }
+    int type = command->type;
+    double value = command->value;
+    atomic_store_explicit(&command->sequence, this->tail + CONTROL_QUEUE_SIZE,
+                          memory_order_release);
+
+    int status = this->execute((int64_t) this->tail, type, value,
+                               this->execute_context);
+
+    uint64_t result = (this->tail << CONTROL_STATUS_BITS) |
+                      (uint16_t) (status < 0 ? -1 : status);
+    atomic_store(&this->results[this->tail & (CONTROL_QUEUE_SIZE - 1)], result);
+    this->tail++;
+    atomic_store(&this->completed, this->tail);
+    if (atomic_load(&this->waiters) > 0) {
+      pthread_mutex_lock(&this->lock);
+      pthread_cond_broadcast(&this->done);
+      pthread_mutex_unlock(&this->lock);
+    }
+  }
+  return;
+}
@@ -0,0 +1,61 @@
+/*
+ * control.h - control command queue and control thread
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __CONTROL_H
+#define __CONTROL_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct control control_t;
+
+/* runs a command on the control thread; returns its status (0 or -1) */
+typedef int (*control_execute_cb_t)(int64_t ticket, int type, double value,
+                                    void *context);
+
+control_t *control_open(control_execute_cb_t execute, void *execute_context);
+
+/* runs the commands still queued before returning */
+void control_close(control_t *this);
+
+/* queues a command without blocking (so also from the streaming thread);
+   returns its ticket, or -1 if the queue is full */
+int64_t control_submit(control_t *this, int type, double value);
+
+/* waits for a command for up to timeout ms (< 0 for no limit); returns
+   its status, or 1 if it is still pending. The statuses of the last
+   CONTROL_QUEUE_SIZE commands are kept */
+int control_wait(control_t *this, int64_t ticket, int timeout);
+
+/* the ticket of the last command queued (-1 if none) */
+int64_t control_last_ticket(control_t *this);
+
+int control_is_control_thread(control_t *this);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CONTROL_H */
@@ -0,0 +1,371 @@
+/*
+ * control_tags.c - sample index tags for the control changes
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Times are mapped to sample indexes with the sample rate and an offset
+ * taken from the frames as they are handed over: each frame gives the
+ * index of its last sample at that time, and the largest offset over the
+ * last frames is the least delayed one. The index of a time is then that
+ * of a sample delivered at that time, which was captured the USB latency
+ * earlier; the change shows up in the samples about that latency after
+ * the index of its completion, and this delay (plus the settling of the
+ * hardware) is measured from the step in the signal level after each
+ * change. Until a control has been measured, its settle time is taken
+ * as the latency measured from the frames: the spread of their offsets
+ * (how much later than the least delayed one a frame can be handed
+ * over) plus one frame, and as all the samples the USB transfers can
+ * hold until there are enough frames for that.
+ */
+
+#include <math.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "control_tags.h"
+#include "logging.h"
+
+
+typedef struct control_tags control_tags_t;
+
+/* internal functions */
+static uint64_t control_tags_index(control_tags_t *this,
+                                   const struct timespec *time);
+static void control_tags_measure(control_tags_t *this, const int16_t *samples,
+                                 uint32_t nsamples, uint64_t sample_index);
+static void control_tags_settle_done(control_tags_t *this);
+
+
+#define CONTROL_TAGS_QUEUE_SIZE (64)    /* must be a power of 2 */
+#define CONTROL_TAGS_ANCHORS (64)       /* frames for the time offset */
+#define CONTROL_TAGS_BLOCKS (2048)      /* level blocks after a change */
+#define CONTROL_TAGS_CONTROLS (SDDC_CONTROL_VHF_BIAS + 1)
+
+typedef struct control_tags {
+  double sample_rate;
+  struct timespec base;             /* stream start */
+  _Atomic double offset;            /* index - seconds since base * rate */
+  atomic_int active;
+  double anchors[CONTROL_TAGS_ANCHORS];
+  uint32_t nanchors;
+  uint32_t anchor_pos;
+  uint64_t in_flight;
+  uint64_t latency;                 /* measured from the frame offsets */
+  /* single producer (control thread), single consumer (streaming thread) */
+  struct sddc_control_tag queue[CONTROL_TAGS_QUEUE_SIZE];
+  atomic_uint_fast64_t head;
+  atomic_uint_fast64_t tail;
+  atomic_uint dropped;
+  struct sddc_control_tag ready[CONTROL_TAGS_QUEUE_SIZE];
+  /* settle measurement of the last change */
+  int measuring;
+  enum SDDCControl measured_control;
+  uint64_t measure_from;            /* complete index of the change */
+  uint64_t window_start;
+  uint32_t block_size;
+  double power[CONTROL_TAGS_BLOCKS];
+  /* written by the streaming thread, read from any thread */
+  atomic_uint sequence;
+  struct sddc_control_settle settle[CONTROL_TAGS_CONTROLS];
+} control_tags_t;
+
+static const double WINDOW_MARGIN = 5e-3;       /* s - after twice in_flight */
+static const uint32_t EDGE_BLOCKS = 16;         /* level before the change */
+static const uint32_t FINAL_BLOCKS = 64;        /* level after the change */
+static const double MIN_STEP = 3.0;             /* dB - smaller is not measured */
+static const double SETTLE_TOLERANCE = 1.0;     /* dB from the final level */
+
+
+control_tags_t *control_tags_open()
+{
+  control_tags_t *this = (control_tags_t *) malloc(sizeof(control_tags_t));
+  if (this == 0) {
+    return 0;
+  }
+  this->sample_rate = 0;
+  this->base.tv_sec = 0;
+  this->base.tv_nsec = 0;
+  atomic_init(&this->offset, 0.0);
+  atomic_init(&this->active, 0);
+  this->nanchors = 0;
+  this->anchor_pos = 0;
+  this->in_flight = 0;
+  this->latency = 0;
+  atomic_init(&this->head, 0);
+  atomic_init(&this->tail, 0);
+  atomic_init(&this->dropped, 0);
+  this->measuring = 0;
+  this->measured_control = SDDC_CONTROL_RF_MODE;
+  this->measure_from = 0;
+  this->window_start = 0;
+  this->block_size = 1;
+  atomic_init(&this->sequence, 0);
+  memset(this->settle, 0, sizeof(this->settle));
+  return this;
+}
+
+void control_tags_close(control_tags_t *this)
+{
+  free(this);
+  return;
+}
+
+void control_tags_start(control_tags_t *this, double sample_rate,
+                        uint64_t in_flight)
+{
+  this->sample_rate = sample_rate;
+  clock_gettime(CLOCK_MONOTONIC, &this->base);
+  this->nanchors = 0;
+  this->anchor_pos = 0;
+  this->in_flight = in_flight;
+  this->latency = in_flight;
+  this->measuring = 0;
+  double window = 2.0 * in_flight + WINDOW_MARGIN * sample_rate;
+  this->block_size = (uint32_t) ceil(window / CONTROL_TAGS_BLOCKS);
+  /* the tags of the previous stream are stale; until the first frame,
+     sample 0 is taken at the start */
+  atomic_store(&this->tail, atomic_load(&this->head));
+  atomic_store(&this->offset, 0.0);
+  atomic_store(&this->active, 1);
+  return;
+}
+
+void control_tags_stop(control_tags_t *this)
+{
+  atomic_store(&this->active, 0);
+  return;
+}
+
+int control_tags_is_tagged(enum SDDCControl control)
+{
+  switch (control) {
+    case SDDC_CONTROL_HF_ATTENUATION:
+    case SDDC_CONTROL_HF_VGA:
+    case SDDC_CONTROL_TUNER_FREQUENCY:
+    case SDDC_CONTROL_TUNER_RF_ATTENUATION:
+    case SDDC_CONTROL_TUNER_IF_ATTENUATION:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+void control_tags_add(control_tags_t *this, enum SDDCControl control,
+                      double value, int status, int64_t ticket,
+                      const struct timespec *submit_time,
+                      const struct timespec *complete_time)
+{
+  if (!control_tags_is_tagged(control) || !atomic_load(&this->active)) {
+    return;
+  }
+
+  uint64_t head = atomic_load_explicit(&this->head, memory_order_relaxed);
+  uint64_t tail = atomic_load_explicit(&this->tail, memory_order_acquire);
+  if (head - tail >= CONTROL_TAGS_QUEUE_SIZE) {
+    atomic_fetch_add(&this->dropped, 1);
+    return;
+  }
+  struct sddc_control_tag *tag = &this->queue[head & (CONTROL_TAGS_QUEUE_SIZE - 1)];
+  tag->control = control;
+  tag->value = value;
+  tag->status = status;
+  tag->ticket = ticket;
+  tag->sample_index = control_tags_index(this, submit_time);
+  tag->complete_index = control_tags_index(this, complete_time);
+  tag->settled_index = tag->complete_index;
+  tag->submit_time = *submit_time;
+  tag->complete_time = *complete_time;
+  atomic_store_explicit(&this->head, head + 1, memory_order_release);
+  return;
+}
+
+uint32_t control_tags_frame(control_tags_t *this, const int16_t *samples,
+                            uint32_t nsamples, uint64_t sample_index,
+                            const struct timespec *now,
+                            const struct sddc_control_tag **tags)
+{
+  uint64_t end = sample_index + nsamples;
+
+  /* the changes that may affect this frame; a new change also restarts
+     the settle measurement */
+  uint32_t ntags = 0;
+  uint64_t tail = atomic_load_explicit(&this->tail, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&this->head, memory_order_acquire);
+  while (tail != head) {
+    const struct sddc_control_tag *tag = &this->queue[tail & (CONTROL_TAGS_QUEUE_SIZE - 1)];
+    if (tag->sample_index >= end) {
+      break;
+    }
+    struct sddc_control_tag *ready = &this->ready[ntags++];
+    *ready = *tag;
+    ready->settled_index = ready->complete_index +
+                           control_tags_settle_samples(this, ready->control);
+    if (ready->status == 0) {
+      this->measuring = 1;
+      this->measured_control = ready->control;
+      this->measure_from = ready->complete_index;
+      this->window_start = ready->complete_index > sample_index ?
+                           ready->complete_index : sample_index;
+      memset(this->power, 0, sizeof(this->power));
+    }
+    tail++;
+  }
+  atomic_store_explicit(&this->tail, tail, memory_order_release);
+  unsigned int dropped = atomic_exchange(&this->dropped, 0);
+  if (dropped > 0) {
+    LOG_WARNING("control tag queue full - %u tags dropped", dropped);
+  }
+
+  if (this->measuring) {
+    control_tags_measure(this, samples, nsamples, sample_index);
+  }
+
+  /* time offset of the last sample of this frame */
+  double elapsed = (now->tv_sec - this->base.tv_sec) +
+                   1e-9 * (now->tv_nsec - this->base.tv_nsec);
+  this->anchors[this->anchor_pos] = end - elapsed * this->sample_rate;
+  this->anchor_pos = (this->anchor_pos + 1) % CONTROL_TAGS_ANCHORS;
+  if (this->nanchors < CONTROL_TAGS_ANCHORS) {
+    this->nanchors++;
+  }
+  double offset = this->anchors[0];
+  double min_offset = this->anchors[0];
+  for (uint32_t i = 1; i < this->nanchors; ++i) {
+    offset = this->anchors[i] > offset ? this->anchors[i] : offset;
+    min_offset = this->anchors[i] < min_offset ? this->anchors[i] : min_offset;
+  }
+  atomic_store(&this->offset, offset);
+  if (this->nanchors == CONTROL_TAGS_ANCHORS) {
+    uint64_t latency = (uint64_t) ceil(offset - min_offset) + nsamples;
+    this->latency = latency < this->in_flight ? latency : this->in_flight;
+  }
+
+  *tags = this->ready;
+  return ntags;
+}
+
+uint64_t control_tags_settle_samples(control_tags_t *this,
+                                     enum SDDCControl control)
+{
+  /* the settle measurements are written by this same thread */
+  const struct sddc_control_settle *settle = &this->settle[control];
+  return settle->measurements > 0 ? settle->max : this->latency;
+}
+
+int control_tags_get_settle(control_tags_t *this, enum SDDCControl control,
+                            struct sddc_control_settle *settle)
+{
+  if ((int) control < 0 || (int) control >= CONTROL_TAGS_CONTROLS) {
+    LOG_ERROR("invalid control: %d", control);
+    return -1;
+  }
+  unsigned int sequence;
+  do {
+    sequence = atomic_load_explicit(&this->sequence, memory_order_acquire);
+    *settle = this->settle[control];
+    atomic_thread_fence(memory_order_acquire);
+  } while ((sequence & 1) ||
+           sequence != atomic_load_explicit(&this->sequence, memory_order_relaxed));
+  return 0;
+}
+
+
+/* internal functions */
+static uint64_t control_tags_index(control_tags_t *this,
+                                   const struct timespec *time)
+{
+  double elapsed = (time->tv_sec - this->base.tv_sec) +
+                   1e-9 * (time->tv_nsec - this->base.tv_nsec);
+  double index = elapsed * this->sample_rate + atomic_load(&this->offset);
+  return index > 0 ? (uint64_t) index : 0;
+}
+
+/* accumulates the power of the blocks of the window after the change */
+static void control_tags_measure(control_tags_t *this, const int16_t *samples,
+                                 uint32_t nsamples, uint64_t sample_index)
+{
+  uint64_t window_end = this->window_start +
+                        (uint64_t) this->block_size * CONTROL_TAGS_BLOCKS;
+  uint64_t from = sample_index > this->window_start ? sample_index :
+                  this->window_start;
+  uint64_t to = sample_index + nsamples < window_end ?
+                sample_index + nsamples : window_end;
+  while (from < to) {
+    uint64_t block = (from - this->window_start) / this->block_size;
+    uint64_t block_end = this->window_start + (block + 1) * this->block_size;
+    block_end = block_end < to ? block_end : to;
+    const int16_t *x = samples + (from - sample_index);
+    uint32_t n = (uint32_t) (block_end - from);
+    double sum_squares = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+      sum_squares += (double) x[i] * x[i];
+    }
+    this->power[block] += sum_squares;
+    from = block_end;
+  }
+  if (sample_index + nsamples >= window_end) {
+    control_tags_settle_done(this);
+    this->measuring = 0;
+  }
+  return;
+}
+
+/* the change has settled after the last block away from the final level;
+   changes without a clear step in the level are not measured */
+static void control_tags_settle_done(control_tags_t *this)
+{
+  for (uint32_t b = 0; b < CONTROL_TAGS_BLOCKS; ++b) {
+    this->power[b] = 10.0 * log10(this->power[b] / this->block_size + 1.0);
+  }
+  double initial = 0;
+  for (uint32_t b = 0; b < EDGE_BLOCKS; ++b) {
+    initial += this->power[b];
+  }
+  initial /= EDGE_BLOCKS;
+  double final = 0;
+  for (uint32_t b = CONTROL_TAGS_BLOCKS - FINAL_BLOCKS; b < CONTROL_TAGS_BLOCKS; ++b) {
+    final += this->power[b];
+  }
+  final /= FINAL_BLOCKS;
+  if (fabs(final - initial) < MIN_STEP) {
+    return;
+  }
+
+  uint32_t settled = 0;
+  for (uint32_t b = 0; b < CONTROL_TAGS_BLOCKS; ++b) {
+    if (fabs(this->power[b] - final) > SETTLE_TOLERANCE) {
+      settled = b + 1;
+    }
+  }
+  uint64_t samples = this->window_start - this->measure_from +
+                     (uint64_t) settled * this->block_size;
+
+  struct sddc_control_settle *settle = &this->settle[this->measured_control];
+  atomic_fetch_add_explicit(&this->sequence, 1, memory_order_relaxed);
+  /* the stores below must not be seen before the odd sequence */
+  atomic_thread_fence(memory_order_release);
+  settle->measurements++;
+  settle->last = samples;
+  settle->max = samples > settle->max ? samples : settle->max;
+  settle->mean += (samples - settle->mean) / settle->measurements;
+  atomic_fetch_add_explicit(&this->sequence, 1, memory_order_release);
+  return;
+}
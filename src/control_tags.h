@@ -0,0 +1,79 @@
+/*
+ * control_tags.h - sample index tags for the control changes
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __CONTROL_TAGS_H
+#define __CONTROL_TAGS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct control_tags control_tags_t;
+
+control_tags_t *control_tags_open();
+
+void control_tags_close(control_tags_t *this);
+
+/* at the start of the stream: in_flight is the number of samples the USB
+   transfers can hold, the settle time assumed until the latency of the
+   frames has been measured */
+void control_tags_start(control_tags_t *this, double sample_rate,
+                        uint64_t in_flight);
+
+void control_tags_stop(control_tags_t *this);
+
+int control_tags_is_tagged(enum SDDCControl control);
+
+/* control thread - tags a change from the times (CLOCK_MONOTONIC) its
+   transfer was submitted and completed; ignored when not streaming */
+void control_tags_add(control_tags_t *this, enum SDDCControl control,
+                      double value, int status, int64_t ticket,
+                      const struct timespec *submit_time,
+                      const struct timespec *complete_time);
+
+/* streaming thread - for each frame, at the time it is handed over:
+   returns the tags for changes that may affect it, and measures the
+   settle time of the last change from the samples after it */
+uint32_t control_tags_frame(control_tags_t *this, const int16_t *samples,
+                            uint32_t nsamples, uint64_t sample_index,
+                            const struct timespec *now,
+                            const struct sddc_control_tag **tags);
+
+/* streaming thread - the samples from the completion of a (tagged)
+   change to when it shows up settled in the stream: the longest measured
+   so far, or else the latency measured from the frames */
+uint64_t control_tags_settle_samples(control_tags_t *this,
+                                     enum SDDCControl control);
+
+int control_tags_get_settle(control_tags_t *this, enum SDDCControl control,
+                            struct sddc_control_settle *settle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __CONTROL_TAGS_H */
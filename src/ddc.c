@@ -0,0 +1,244 @@
+/*
+ * ddc.c - digital down converter from real ADC samples to complex baseband
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The mixer is folded into the decimating filter: filtering the real input
+ * with the complex band pass taps h[k] * exp(j w k) and multiplying each
+ * output by exp(-j w n) is the same as mixing by exp(-j w n) and then low
+ * pass filtering with h[k], but the filter only runs at the output rate
+ * and the input stays real.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ddc.h"
+#include "dsp.h"
+#include "logging.h"
+
+
+typedef struct ddc ddc_t;
+
+typedef struct ddc {
+  double sample_rate;
+  double center_frequency;
+  uint32_t decimation;
+  int inverted;
+  uint32_t max_samples;
+  uint32_t ntaps;           /* padded to a multiple of DSP_LANES */
+  float *taps_re;           /* time reversed complex band pass taps */
+  float *taps_im;
+  float *input;             /* ntaps - 1 samples of history + new samples */
+  float *output;
+  uint32_t phase;           /* input samples to skip before the next output */
+  uint64_t input_count;
+  double rotator_re;        /* exp(-j w n) for the next output */
+  double rotator_im;
+  double step_re;           /* exp(-j w D) */
+  double step_im;
+} ddc_t;
+
+
+static const double DDC_ATTENUATION = 60.0;   /* stop band attenuation (dB) */
+static const double DDC_OVERSAMPLING = 1.25;  /* min output rate / bandwidth */
+
+
+uint32_t ddc_decimation(double sample_rate, double bandwidth)
+{
+  uint32_t decimation = (uint32_t) floor(sample_rate / (DDC_OVERSAMPLING * bandwidth));
+  return decimation > 0 ? decimation : 1;
+}
+
+
+ddc_t *ddc_open(double sample_rate, double center_frequency,
+                double bandwidth, int inverted, uint32_t max_samples)
+{
+  ddc_t *ret_val = 0;
+
+  if (sample_rate <= 0 || bandwidth <= 0 || max_samples == 0) {
+    LOG_ERROR("invalid DDC parameters");
+    return ret_val;
+  }
+  if (center_frequency - bandwidth / 2 < 0 ||
+      center_frequency + bandwidth / 2 > sample_rate / 2) {
+    LOG_ERROR("DDC band %lf+/-%lf outside of ADC Nyquist band",
+              center_frequency, bandwidth / 2);
+    return ret_val;
+  }
+
+  uint32_t decimation = ddc_decimation(sample_rate, bandwidth);
+
+  /* frequencies that alias into the transition band are fine, so the stop
+     band starts at output rate - bandwidth / 2 */
+  double pass = bandwidth / 2 / sample_rate;
+  double stop = (sample_rate / decimation - bandwidth / 2) / sample_rate;
+  stop = stop > 0.5 ? 0.5 : stop;
+  int ntaps = dsp_kaiser_ntaps(stop - pass, DDC_ATTENUATION);
+  float *taps = (float *) malloc(ntaps * sizeof(float));
+  if (taps == 0) {
+    LOG_ERROR("malloc() failed");
+    return ret_val;
+  }
+  dsp_kaiser_lowpass(taps, ntaps, (pass + stop) / 2, DDC_ATTENUATION);
+
+  ddc_t *this = (ddc_t *) calloc(1, sizeof(ddc_t));
+  if (this == 0) {
+    LOG_ERROR("calloc() failed");
+    free(taps);
+    return ret_val;
+  }
+  this->sample_rate = sample_rate;
+  this->center_frequency = center_frequency;
+  this->decimation = decimation;
+  this->inverted = inverted;
+  this->max_samples = max_samples;
+  this->ntaps = DSP_PAD(ntaps);
+  this->taps_re = (float *) calloc(this->ntaps, sizeof(float));
+  this->taps_im = (float *) calloc(this->ntaps, sizeof(float));
+  if (this->taps_re == 0 || this->taps_im == 0) {
+    LOG_ERROR("calloc() failed");
+    free(taps);
+    ddc_close(this);
+    return ret_val;
+  }
+  double w = 2.0 * M_PI * center_frequency / sample_rate;
+  for (int k = 0; k < ntaps; ++k) {
+    this->taps_re[this->ntaps-1-k] = (float) (taps[k] * cos(w * k));
+    this->taps_im[this->ntaps-1-k] = (float) (taps[k] * sin(w * k));
+  }
+  free(taps);
+  this->input = (float *) malloc((this->ntaps - 1 + max_samples) * sizeof(float));
+  this->output = (float *) malloc(2 * (max_samples / decimation + 1) * sizeof(float));
+  if (this->input == 0 || this->output == 0) {
+    LOG_ERROR("malloc() failed");
+    ddc_close(this);
+    return ret_val;
+  }
+  this->step_re = cos(w * decimation);
+  this->step_im = -sin(w * decimation);
+  ddc_reset(this);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void ddc_close(ddc_t *this)
+{
+  free(this->taps_re);
+  free(this->taps_im);
+  free(this->input);
+  free(this->output);
+  free(this);
+  return;
+}
+
+
+double ddc_get_output_sample_rate(ddc_t *this)
+{
+  return this->sample_rate / this->decimation;
+}
+
+
+uint32_t ddc_get_decimation(ddc_t *this)
+{
+  return this->decimation;
+}
+
+
+uint32_t ddc_get_ntaps(ddc_t *this)
+{
+  return this->ntaps;
+}
+
+
+void ddc_reset(ddc_t *this)
+{
+  memset(this->input, 0, (this->ntaps - 1) * sizeof(float));
+  this->phase = 0;
+  this->input_count = 0;
+  this->rotator_re = 1.0;
+  this->rotator_im = 0.0;
+  return;
+}
+
+
+void ddc_seek(ddc_t *this, uint64_t sample_index)
+{
+  ddc_reset(this);
+  uint32_t decimation = this->decimation;
+  this->phase = (decimation - sample_index % decimation) % decimation;
+  this->input_count = sample_index;
+
+  /* the rotator is exp(-j w n) at the last sample n of the next output;
+     w n is taken modulo 2 pi in two halves, to keep the precision */
+  uint64_t n = sample_index + this->phase;
+  double cycles = this->center_frequency / this->sample_rate;
+  double turns = fmod(fmod(cycles * 4294967296.0, 1.0) * (double) (n >> 32) +
+                      fmod(cycles * (double) (n & 0xffffffff), 1.0), 1.0);
+  this->rotator_re = cos(2.0 * M_PI * turns);
+  this->rotator_im = -sin(2.0 * M_PI * turns);
+  return;
+}
+
+
+uint32_t ddc_process(ddc_t *this, const int16_t *samples, uint32_t nsamples,
+                     float **output)
+{
+  if (nsamples > this->max_samples) {
+    LOG_ERROR("too many samples");
+    nsamples = this->max_samples;
+  }
+
+  uint32_t history = this->ntaps - 1;
+  dsp_int16_to_float(samples, this->input + history, nsamples);
+
+  /* this->input + i is the oldest sample in the filter window for the
+     output that ends at new sample i */
+  uint32_t nout = 0;
+  uint32_t i;
+  for (i = this->phase; i < nsamples; i += this->decimation) {
+    float re;
+    float im;
+    dsp_dot_complex(this->input + i, this->taps_re, this->taps_im,
+                    this->ntaps, &re, &im);
+    double out_re = re * this->rotator_re - im * this->rotator_im;
+    double out_im = re * this->rotator_im + im * this->rotator_re;
+    this->output[2*nout] = (float) out_re;
+    this->output[2*nout+1] = (float) (this->inverted ? -out_im : out_im);
+    nout++;
+
+    double rotator_re = this->rotator_re * this->step_re - this->rotator_im * this->step_im;
+    double rotator_im = this->rotator_re * this->step_im + this->rotator_im * this->step_re;
+    double norm = 1.0 / sqrt(rotator_re * rotator_re + rotator_im * rotator_im);
+    this->rotator_re = rotator_re * norm;
+    this->rotator_im = rotator_im * norm;
+  }
+  this->phase = i - nsamples;
+  this->input_count += nsamples;
+
+  memmove(this->input, this->input + nsamples, history * sizeof(float));
+
+  *output = this->output;
+  return nout;
+}
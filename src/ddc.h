@@ -0,0 +1,65 @@
+/*
+ * ddc.h - digital down converter from real ADC samples to complex baseband
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DDC_H
+#define __DDC_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ddc ddc_t;
+
+uint32_t ddc_decimation(double sample_rate, double bandwidth);
+
+ddc_t *ddc_open(double sample_rate, double center_frequency,
+                double bandwidth, int inverted, uint32_t max_samples);
+
+void ddc_close(ddc_t *this);
+
+double ddc_get_output_sample_rate(ddc_t *this);
+
+uint32_t ddc_get_decimation(ddc_t *this);
+
+/* filter length - the outputs after a reset or a seek are only exact
+   once ntaps - 1 samples went in */
+uint32_t ddc_get_ntaps(ddc_t *this);
+
+void ddc_reset(ddc_t *this);
+
+/* reset, then carry on as if the next sample were sample_index of the
+   stream: the outputs stay on the same grid (the window of each ends at a
+   multiple of the decimation) and get the same NCO phase */
+void ddc_seek(ddc_t *this, uint64_t sample_index);
+
+/* returns the number of complex output samples; *output points to an
+   internal buffer with interleaved I/Q floats, valid until the next call */
+uint32_t ddc_process(ddc_t *this, const int16_t *samples, uint32_t nsamples,
+                     float **output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DDC_H */
@@ -0,0 +1,382 @@
+/*
+ * detector.c - streaming energy detector with per-band activity events
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - Goertzel algorithm: https://en.wikipedia.org/wiki/Goertzel_algorithm
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "detector.h"
+#include "logging.h"
+
+
+typedef struct detector detector_t;
+
+/* internal functions */
+static int detector_setup_bins(detector_t *this);
+static void detector_evaluate(detector_t *this);
+static void goertzel_lanes(const float *restrict coeffs, float *restrict s1,
+                           float *restrict s2, const int16_t *restrict samples,
+                           uint32_t nsamples);
+
+
+/* the Goertzel bins are processed in groups of DETECTOR_LANES, so the inner
+   loop has a fixed trip count and the compiler can map it onto SIMD lanes */
+#define DETECTOR_LANES (8)
+
+typedef struct detector {
+  double sample_rate;
+  uint32_t block_size;
+  int nbands;
+  struct sddc_detector_band *bands;
+  int *band_bins;         /* first bin of each band (nbands + 1 entries) */
+  int nbins;              /* padded to a multiple of DETECTOR_LANES */
+  float *coeffs;
+  float *s1;
+  float *s2;
+  int *band_active;
+  double *power;          /* of the last block, per band */
+  detector_block_cb_t block_callback;
+  void *block_callback_context;
+  uint32_t block_pos;
+  uint64_t block_start;
+  double on_threshold;
+  double off_threshold;
+  sddc_activity_cb_t callback;
+  void *callback_context;
+} detector_t;
+
+
+detector_t *detector_open(double sample_rate, uint32_t block_size,
+                          const struct sddc_detector_band *bands, int nbands,
+                          double on_threshold, double off_threshold,
+                          sddc_activity_cb_t callback, void *callback_context)
+{
+  detector_t *ret_val = 0;
+
+  if (block_size == 0) {
+    LOG_ERROR("invalid block size");
+    return ret_val;
+  }
+  if (nbands <= 0 || bands == 0) {
+    LOG_ERROR("no bands to detect");
+    return ret_val;
+  }
+  if (off_threshold > on_threshold) {
+    LOG_ERROR("off threshold higher than on threshold");
+    return ret_val;
+  }
+
+  detector_t *this = (detector_t *) malloc(sizeof(detector_t));
+  if (this == 0) {
+    LOG_ERROR("malloc() failed");
+    return ret_val;
+  }
+  this->sample_rate = sample_rate;
+  this->block_size = block_size;
+  this->nbands = nbands;
+  this->bands = (struct sddc_detector_band *) malloc(nbands * sizeof(struct sddc_detector_band));
+  this->band_bins = 0;
+  this->nbins = 0;
+  this->coeffs = 0;
+  this->s1 = 0;
+  this->s2 = 0;
+  this->band_active = (int *) calloc(nbands, sizeof(int));
+  this->power = (double *) malloc(nbands * sizeof(double));
+  this->block_callback = 0;
+  this->block_callback_context = 0;
+  this->block_pos = 0;
+  this->block_start = 0;
+  this->on_threshold = on_threshold;
+  this->off_threshold = off_threshold;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  if (this->bands == 0 || this->band_active == 0 || this->power == 0) {
+    LOG_ERROR("malloc() failed");
+    detector_close(this);
+    return ret_val;
+  }
+  memcpy(this->bands, bands, nbands * sizeof(struct sddc_detector_band));
+
+  if (detector_setup_bins(this) < 0) {
+    detector_close(this);
+    return ret_val;
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void detector_close(detector_t *this)
+{
+  free(this->coeffs);
+  free(this->s1);
+  free(this->s2);
+  free(this->band_active);
+  free(this->power);
+  free(this->band_bins);
+  free(this->bands);
+  free(this);
+  return;
+}
+
+
+int detector_set_sample_rate(detector_t *this, double sample_rate)
+{
+  if (sample_rate == this->sample_rate) {
+    return 0;
+  }
+  double previous = this->sample_rate;
+  this->sample_rate = sample_rate;
+  if (detector_setup_bins(this) < 0) {
+    /* the bins are still those of the previous rate */
+    this->sample_rate = previous;
+    return -1;
+  }
+  return 0;
+}
+
+
+void detector_reset(detector_t *this)
+{
+  memset(this->s1, 0, this->nbins * sizeof(float));
+  memset(this->s2, 0, this->nbins * sizeof(float));
+  memset(this->band_active, 0, this->nbands * sizeof(int));
+  this->block_pos = 0;
+  return;
+}
+
+
+void detector_process(detector_t *this, const int16_t *samples,
+                      uint32_t nsamples, uint64_t sample_index)
+{
+  while (nsamples > 0) {
+    if (this->block_pos == 0) {
+      this->block_start = sample_index;
+    }
+    uint32_t n = this->block_size - this->block_pos;
+    if (n > nsamples) {
+      n = nsamples;
+    }
+    for (int k = 0; k < this->nbins; k += DETECTOR_LANES) {
+      goertzel_lanes(this->coeffs + k, this->s1 + k, this->s2 + k, samples, n);
+    }
+    samples += n;
+    nsamples -= n;
+    sample_index += n;
+    this->block_pos += n;
+    if (this->block_pos == this->block_size) {
+      detector_evaluate(this);
+      this->block_pos = 0;
+    }
+  }
+  return;
+}
+
+
+void detector_set_block_callback(detector_t *this,
+                                 detector_block_cb_t callback, void *context)
+{
+  this->block_callback = callback;
+  this->block_callback_context = context;
+  return;
+}
+
+
+void detector_decide(detector_t *this, const double *power,
+                     uint64_t block_start, const struct timespec *timestamp)
+{
+  struct timespec now;
+  for (int i = 0; i < this->nbands; ++i) {
+    enum SDDCActivityEventType type;
+    if (!this->band_active[i] && power[i] >= this->on_threshold) {
+      type = SDDC_ACTIVITY_START;
+    } else if (this->band_active[i] && power[i] < this->off_threshold) {
+      type = SDDC_ACTIVITY_STOP;
+    } else {
+      continue;
+    }
+    this->band_active[i] = type == SDDC_ACTIVITY_START;
+
+    if (timestamp == 0) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      timestamp = &now;
+    }
+    struct sddc_activity_event event = {
+      .type = type,
+      .band = i,
+      .power = power[i],
+      .sample_index = block_start,
+      .timestamp = *timestamp
+    };
+    if (this->callback) {
+      this->callback(&event, this->callback_context);
+    }
+  }
+  return;
+}
+
+
+/* internal functions */
+static int detector_setup_bins(detector_t *this)
+{
+  if (this->sample_rate <= 0) {
+    LOG_ERROR("invalid sample rate");
+    return -1;
+  }
+
+  /* the new bins are set up aside, so that on failure the current ones
+     stay in use */
+  int *first_bins = (int *) malloc(this->nbands * sizeof(int));
+  int *band_bins = (int *) malloc((this->nbands + 1) * sizeof(int));
+  if (first_bins == 0 || band_bins == 0) {
+    LOG_ERROR("malloc() failed");
+    free(first_bins);
+    free(band_bins);
+    return -1;
+  }
+
+  /* map each band onto the range of Goertzel bins it covers; bins are
+     1/block_size of the sample rate wide */
+  double bin_width = this->sample_rate / this->block_size;
+  int max_bin = this->block_size / 2;
+  int nbins = 0;
+  for (int i = 0; i < this->nbands; ++i) {
+    double frequency = this->bands[i].frequency;
+    double half_bandwidth = this->bands[i].bandwidth / 2;
+    if (frequency < 0 || frequency > this->sample_rate / 2) {
+      LOG_ERROR("detector band %d frequency out of range: %lf",
+                i, frequency);
+      free(first_bins);
+      free(band_bins);
+      return -1;
+    }
+    int first_bin = (int) ceil((frequency - half_bandwidth) / bin_width);
+    int last_bin = (int) floor((frequency + half_bandwidth) / bin_width);
+    if (first_bin > last_bin) {
+      first_bin = last_bin = (int) lround(frequency / bin_width);
+    }
+    first_bin = first_bin < 0 ? 0 : first_bin;
+    last_bin = last_bin > max_bin ? max_bin : last_bin;
+    first_bins[i] = first_bin;
+    band_bins[i] = nbins;
+    nbins += last_bin - first_bin + 1;
+  }
+  band_bins[this->nbands] = nbins;
+
+  /* padding bins have a zero coefficient and are never evaluated */
+  int nbins_padded = DETECTOR_LANES * ((nbins + DETECTOR_LANES - 1) / DETECTOR_LANES);
+  float *coeffs = (float *) calloc(nbins_padded, sizeof(float));
+  float *s1 = (float *) calloc(nbins_padded, sizeof(float));
+  float *s2 = (float *) calloc(nbins_padded, sizeof(float));
+  if (coeffs == 0 || s1 == 0 || s2 == 0) {
+    LOG_ERROR("calloc() failed");
+    free(coeffs);
+    free(s1);
+    free(s2);
+    free(first_bins);
+    free(band_bins);
+    return -1;
+  }
+  for (int i = 0; i < this->nbands; ++i) {
+    for (int k = band_bins[i]; k < band_bins[i+1]; ++k) {
+      int bin = first_bins[i] + k - band_bins[i];
+      coeffs[k] = (float) (2.0 * cos(2.0 * M_PI * bin / this->block_size));
+    }
+  }
+  free(first_bins);
+
+  free(this->band_bins);
+  free(this->coeffs);
+  free(this->s1);
+  free(this->s2);
+  this->band_bins = band_bins;
+  this->coeffs = coeffs;
+  this->s1 = s1;
+  this->s2 = s2;
+  this->nbins = nbins_padded;
+  this->block_pos = 0;
+  return 0;
+}
+
+
+static void detector_evaluate(detector_t *this)
+{
+  /* a full scale sine wave in a bin has |X|^2 = (N/2)^2 */
+  double norm = 4.0 / ((double) this->block_size * this->block_size);
+
+  for (int i = 0; i < this->nbands; ++i) {
+    double energy = 0.0;
+    for (int k = this->band_bins[i]; k < this->band_bins[i+1]; ++k) {
+      double s1 = this->s1[k];
+      double s2 = this->s2[k];
+      energy += s1 * s1 + s2 * s2 - this->coeffs[k] * s1 * s2;
+    }
+    this->power[i] = 10.0 * log10(energy * norm + 1e-20);
+  }
+  if (this->block_callback) {
+    this->block_callback(this->power, this->block_start,
+                         this->block_callback_context);
+  } else {
+    detector_decide(this, this->power, this->block_start, 0);
+  }
+
+  memset(this->s1, 0, this->nbins * sizeof(float));
+  memset(this->s2, 0, this->nbins * sizeof(float));
+  return;
+}
+
+
+static void goertzel_lanes(const float *restrict coeffs, float *restrict s1,
+                           float *restrict s2, const int16_t *restrict samples,
+                           uint32_t nsamples)
+{
+  /* keep the Goertzel state for one group of bins in locals, so it stays
+     in vector registers for the whole run of samples */
+  float c[DETECTOR_LANES];
+  float a[DETECTOR_LANES];
+  float b[DETECTOR_LANES];
+  for (int j = 0; j < DETECTOR_LANES; ++j) {
+    c[j] = coeffs[j];
+    a[j] = s1[j];
+    b[j] = s2[j];
+  }
+  for (uint32_t i = 0; i < nsamples; ++i) {
+    float x = samples[i] * (1.0f / 32768.0f);
+    for (int j = 0; j < DETECTOR_LANES; ++j) {
+      float s0 = x + c[j] * a[j] - b[j];
+      b[j] = a[j];
+      a[j] = s0;
+    }
+  }
+  for (int j = 0; j < DETECTOR_LANES; ++j) {
+    s1[j] = a[j];
+    s2[j] = b[j];
+  }
+  return;
+}
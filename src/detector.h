@@ -0,0 +1,67 @@
+/*
+ * detector.h - streaming energy detector with per-band activity events
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DETECTOR_H
+#define __DETECTOR_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct detector detector_t;
+
+detector_t *detector_open(double sample_rate, uint32_t block_size,
+                          const struct sddc_detector_band *bands, int nbands,
+                          double on_threshold, double off_threshold,
+                          sddc_activity_cb_t callback, void *callback_context);
+
+void detector_close(detector_t *this);
+
+int detector_set_sample_rate(detector_t *this, double sample_rate);
+
+void detector_reset(detector_t *this);
+
+void detector_process(detector_t *this, const int16_t *samples,
+                      uint32_t nsamples, uint64_t sample_index);
+
+/* with a block callback the band powers (dBFS) of each block go to it
+   instead of through the thresholds - e.g. to apply them later, in order,
+   with detector_decide() (the timestamp is the current time if 0) */
+typedef void (*detector_block_cb_t)(const double *power, uint64_t block_start,
+                                    void *context);
+
+void detector_set_block_callback(detector_t *this,
+                                 detector_block_cb_t callback, void *context);
+
+void detector_decide(detector_t *this, const double *power,
+                     uint64_t block_start, const struct timespec *timestamp);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DETECTOR_H */
@@ -0,0 +1,294 @@
+/*
+ * dsp.c - common DSP kernels and filter design functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - J. F. Kaiser, "Nonrecursive digital filter design using the I0-sinh
+ *    window function", Proc. IEEE ISCAS, 1974
+ */
+
+#include <math.h>
+#include <stdint.h>
+
+#include "dsp.h"
+
+
+/* outputs per block of the half-band filter */
+#define HALFBAND_BLOCK (8 * DSP_LANES)
+
+/* internal functions */
+static double bessel_i0(double x);
+
+
+void dsp_derandomize(uint16_t *samples, uint32_t n)
+{
+  /* branch free, so it vectorizes */
+  for (uint32_t i = 0; i < n; ++i) {
+    samples[i] ^= (uint16_t) (-(samples[i] & 1) & 0xfffe);
+  }
+  return;
+}
+
+
+void dsp_int16_to_float(const int16_t *in, float *out, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; ++i) {
+    out[i] = in[i] * (1.0f / 32768.0f);
+  }
+  return;
+}
+
+
+void dsp_fs4_mix(const int16_t *in, uint32_t npairs, int flip,
+                 float *i_out, float *q_out)
+{
+  /* mixer sequence 1, -j, -1, j: the real part of the product comes from
+     the even samples, the imaginary part from the odd ones */
+  float scale = flip ? -1.0f / 32768.0f : 1.0f / 32768.0f;
+  /* two pairs (a full mixer period) at a time; the offsets are 64 bit,
+     since with a 32 bit 4 * k that could wrap the compiler would not
+     vectorize the strided loads */
+  uint32_t nperiods = npairs / 2;
+  for (uint32_t k = 0; k < nperiods; ++k) {
+    const int16_t *x = in + 4 * (uint64_t) k;
+    float *i = i_out + 2 * (uint64_t) k;
+    float *q = q_out + 2 * (uint64_t) k;
+    i[0] = x[0] * scale;
+    q[0] = x[1] * -scale;
+    i[1] = x[2] * -scale;
+    q[1] = x[3] * scale;
+  }
+  if (npairs & 1) {
+    const int16_t *x = in + 2 * (uint64_t) (npairs - 1);
+    i_out[npairs-1] = x[0] * scale;
+    q_out[npairs-1] = x[1] * -scale;
+  }
+  return;
+}
+
+
+void dsp_halfband_iq(const float *i_in, const float *q_in, const float *taps,
+                     uint32_t ntaps, float center, uint32_t n, float *out)
+{
+  /* a block of outputs at a time, so the inner loop runs across outputs
+     and the accumulators stay in SIMD registers */
+  uint32_t last = 2 * ntaps - 1;
+  uint32_t m = 0;
+  for (; m + HALFBAND_BLOCK <= n; m += HALFBAND_BLOCK) {
+    const float *x = i_in + m;
+    const float *y = q_in + m;
+    float *o = out + 2 * (uint64_t) m;
+    float acc[HALFBAND_BLOCK] = { 0 };
+    for (uint32_t p = 0; p < ntaps; ++p) {
+      const float *x0 = x + p;
+      const float *x1 = x + last - p;
+      for (int j = 0; j < HALFBAND_BLOCK; ++j) {
+        acc[j] += taps[p] * (x0[j] + x1[j]);
+      }
+    }
+    for (int j = 0; j < HALFBAND_BLOCK; ++j) {
+      o[2*j] = acc[j];
+      o[2*j+1] = center * y[j];
+    }
+  }
+  for (; m < n; ++m) {
+    float acc = 0.0f;
+    for (uint32_t p = 0; p < ntaps; ++p) {
+      acc += taps[p] * (i_in[m+p] + i_in[m+last-p]);
+    }
+    out[2*m] = acc;
+    out[2*m+1] = center * q_in[m];
+  }
+  return;
+}
+
+
+void dsp_halfband_decimate(const float *in, const float *taps, uint32_t ntaps,
+                           float center, uint32_t n, float *out)
+{
+  /* the nonzero taps are the even offsets from the window start */
+  uint32_t last = 4 * ntaps - 2;
+  uint32_t m = 0;
+  for (; m + HALFBAND_BLOCK <= n; m += HALFBAND_BLOCK) {
+    const float *x = in + 2 * (uint64_t) m;
+    float acc[HALFBAND_BLOCK] = { 0 };
+    for (uint32_t p = 0; p < ntaps; ++p) {
+      const float *x0 = x + 2 * p;
+      const float *x1 = x + last - 2 * p;
+      for (int j = 0; j < HALFBAND_BLOCK; ++j) {
+        acc[j] += taps[p] * (x0[2*j] + x1[2*j]);
+      }
+    }
+    for (int j = 0; j < HALFBAND_BLOCK; ++j) {
+      out[m+j] = acc[j] + center * x[2*j+last/2];
+    }
+  }
+  for (; m < n; ++m) {
+    const float *x = in + 2 * (uint64_t) m;
+    float acc = 0.0f;
+    for (uint32_t p = 0; p < ntaps; ++p) {
+      acc += taps[p] * (x[2*p] + x[last-2*p]);
+    }
+    out[m] = acc + center * x[last/2];
+  }
+  return;
+}
+
+
+float dsp_dot(const float *x, const float *h, uint32_t n)
+{
+  float acc[DSP_LANES] = { 0 };
+  uint32_t i = 0;
+  for (; i + DSP_LANES <= n; i += DSP_LANES) {
+    for (int j = 0; j < DSP_LANES; ++j) {
+      acc[j] += x[i+j] * h[i+j];
+    }
+  }
+  for (; i < n; ++i) {
+    acc[0] += x[i] * h[i];
+  }
+  float sum = 0.0f;
+  for (int j = 0; j < DSP_LANES; ++j) {
+    sum += acc[j];
+  }
+  return sum;
+}
+
+
+void dsp_dot_complex(const float *x, const float *h_re, const float *h_im,
+                     uint32_t n, float *re, float *im)
+{
+  float acc_re[DSP_LANES] = { 0 };
+  float acc_im[DSP_LANES] = { 0 };
+  uint32_t i = 0;
+  for (; i + DSP_LANES <= n; i += DSP_LANES) {
+    for (int j = 0; j < DSP_LANES; ++j) {
+      acc_re[j] += x[i+j] * h_re[i+j];
+      acc_im[j] += x[i+j] * h_im[i+j];
+    }
+  }
+  for (; i < n; ++i) {
+    acc_re[0] += x[i] * h_re[i];
+    acc_im[0] += x[i] * h_im[i];
+  }
+  float sum_re = 0.0f;
+  float sum_im = 0.0f;
+  for (int j = 0; j < DSP_LANES; ++j) {
+    sum_re += acc_re[j];
+    sum_im += acc_im[j];
+  }
+  *re = sum_re;
+  *im = sum_im;
+  return;
+}
+
+
+void dsp_dot_pair(const float *x, const float *y, const float *h, uint32_t n,
+                  float *xh, float *yh)
+{
+  float acc_x[DSP_LANES] = { 0 };
+  float acc_y[DSP_LANES] = { 0 };
+  uint32_t i = 0;
+  for (; i + DSP_LANES <= n; i += DSP_LANES) {
+    for (int j = 0; j < DSP_LANES; ++j) {
+      acc_x[j] += x[i+j] * h[i+j];
+      acc_y[j] += y[i+j] * h[i+j];
+    }
+  }
+  for (; i < n; ++i) {
+    acc_x[0] += x[i] * h[i];
+    acc_y[0] += y[i] * h[i];
+  }
+  float sum_x = 0.0f;
+  float sum_y = 0.0f;
+  for (int j = 0; j < DSP_LANES; ++j) {
+    sum_x += acc_x[j];
+    sum_y += acc_y[j];
+  }
+  *xh = sum_x;
+  *yh = sum_y;
+  return;
+}
+
+
+void dsp_lerp(const float *a, const float *b, float mu, float *out, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; ++i) {
+    out[i] = a[i] + mu * (b[i] - a[i]);
+  }
+  return;
+}
+
+
+int dsp_kaiser_ntaps(double transition, double attenuation)
+{
+  int ntaps = (int) ceil((attenuation - 7.95) / (14.36 * transition)) + 1;
+  return ntaps | 1;   /* odd length, so the filter has an integer delay */
+}
+
+
+void dsp_kaiser_lowpass(float *taps, int ntaps, double cutoff,
+                        double attenuation)
+{
+  double beta;
+  if (attenuation > 50.0) {
+    beta = 0.1102 * (attenuation - 8.7);
+  } else if (attenuation >= 21.0) {
+    beta = 0.5842 * pow(attenuation - 21.0, 0.4) + 0.07886 * (attenuation - 21.0);
+  } else {
+    beta = 0.0;
+  }
+
+  double center = (ntaps - 1) / 2.0;
+  double i0_beta = bessel_i0(beta);
+  double sum = 0.0;
+  for (int i = 0; i < ntaps; ++i) {
+    double t = i - center;
+    double sinc = t == 0.0 ? 2.0 * cutoff :
+                  sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+    double r = center > 0.0 ? t / center : 0.0;
+    double window = bessel_i0(beta * sqrt(1.0 - r * r)) / i0_beta;
+    taps[i] = (float) (sinc * window);
+    sum += taps[i];
+  }
+
+  /* unity gain at DC */
+  for (int i = 0; i < ntaps; ++i) {
+    taps[i] = (float) (taps[i] / sum);
+  }
+  return;
+}
+
+
+/* internal functions */
+static double bessel_i0(double x)
+{
+  double sum = 1.0;
+  double term = 1.0;
+  double half_x = x / 2.0;
+  for (int k = 1; k < 50; ++k) {
+    term *= (half_x / k) * (half_x / k);
+    sum += term;
+    if (term < sum * 1e-16) {
+      break;
+    }
+  }
+  return sum;
+}
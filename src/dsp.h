@@ -0,0 +1,86 @@
+/*
+ * dsp.h - common DSP kernels and filter design functions
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __DSP_H
+#define __DSP_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the kernels keep DSP_LANES partial sums, so the compiler can map them
+   onto SIMD registers without reassociating floating point additions */
+#define DSP_LANES (8)
+
+/* round n up to a multiple of DSP_LANES */
+#define DSP_PAD(n) (DSP_LANES * (((n) + DSP_LANES - 1) / DSP_LANES))
+
+/* remove the ADC output randomization (in place): when the LSB is set,
+   the other bits are inverted */
+void dsp_derandomize(uint16_t *samples, uint32_t n);
+
+void dsp_int16_to_float(const int16_t *in, float *out, uint32_t n);
+
+/* fs/4 mixer for real samples: splits npairs sample pairs into the even
+   (I) and odd (Q) samples with the signs of the exp(-j pi n / 2) mixer,
+   scaled to float; flip is the mixer phase of the first pair */
+void dsp_fs4_mix(const int16_t *in, uint32_t npairs, int flip,
+                 float *i_out, float *q_out);
+
+/* half-band decimator with interleaved I/Q output: I is the symmetric
+   filter over the nonzero taps (ntaps per side, folded) starting at
+   i_in[m], Q is the center tap times q_in[m] */
+void dsp_halfband_iq(const float *i_in, const float *q_in, const float *taps,
+                     uint32_t ntaps, float center, uint32_t n, float *out);
+
+/* real half-band decimator by 2: out[m] is the filter over the window of
+   4 ntaps - 1 samples starting at in[2m], with the nonzero taps (ntaps per
+   side, folded) and the center tap */
+void dsp_halfband_decimate(const float *in, const float *taps, uint32_t ntaps,
+                           float center, uint32_t n, float *out);
+
+float dsp_dot(const float *x, const float *h, uint32_t n);
+
+void dsp_dot_complex(const float *x, const float *h_re, const float *h_im,
+                     uint32_t n, float *re, float *im);
+
+/* two dot products with the same coefficients (e.g. planar I and Q) */
+void dsp_dot_pair(const float *x, const float *y, const float *h, uint32_t n,
+                  float *xh, float *yh);
+
+/* out = a + mu * (b - a) */
+void dsp_lerp(const float *a, const float *b, float mu, float *out, uint32_t n);
+
+/* Kaiser window low pass filter design; frequencies are normalized to the
+   sample rate (i.e. 0 to 0.5) and the attenuation is in dB */
+int dsp_kaiser_ntaps(double transition, double attenuation);
+
+void dsp_kaiser_lowpass(float *taps, int ntaps, double cutoff,
+                        double attenuation);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __DSP_H */
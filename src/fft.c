@@ -0,0 +1,204 @@
+/*
+ * fft.c - radix-2 FFT for complex and real data
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* References:
+ *  - real FFT via a half size complex FFT: E. O. Brigham, "The Fast Fourier
+ *    Transform and Its Applications", chapter 9
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fft.h"
+#include "logging.h"
+
+
+typedef struct fft fft_t;
+
+typedef struct fft {
+  uint32_t size;            /* real transform size */
+  uint32_t npoints;         /* complex transform size (size / 2) */
+  uint32_t *bit_reverse;
+  float *twiddles;          /* exp(-j 2 pi k / npoints), k < npoints / 2 */
+  float *real_twiddles;     /* exp(-j 2 pi k / size), k <= npoints */
+  float *work;
+} fft_t;
+
+
+fft_t *fft_open(uint32_t size)
+{
+  fft_t *ret_val = 0;
+
+  if (size < 4 || (size & (size - 1)) != 0) {
+    LOG_ERROR("FFT size must be a power of two");
+    return ret_val;
+  }
+
+  fft_t *this = (fft_t *) malloc(sizeof(fft_t));
+  this->size = size;
+  this->npoints = size / 2;
+  uint32_t npoints = this->npoints;
+
+  int log2n = 0;
+  while ((1U << log2n) < npoints) {
+    log2n++;
+  }
+  this->bit_reverse = (uint32_t *) malloc(npoints * sizeof(uint32_t));
+  for (uint32_t i = 0; i < npoints; ++i) {
+    uint32_t r = 0;
+    for (int b = 0; b < log2n; ++b) {
+      r |= ((i >> b) & 1) << (log2n - 1 - b);
+    }
+    this->bit_reverse[i] = r;
+  }
+
+  this->twiddles = (float *) malloc(npoints * sizeof(float));
+  for (uint32_t k = 0; k < npoints / 2; ++k) {
+    this->twiddles[2*k] = (float) cos(2.0 * M_PI * k / npoints);
+    this->twiddles[2*k+1] = (float) -sin(2.0 * M_PI * k / npoints);
+  }
+  this->real_twiddles = (float *) malloc(2 * (npoints + 1) * sizeof(float));
+  for (uint32_t k = 0; k <= npoints; ++k) {
+    this->real_twiddles[2*k] = (float) cos(2.0 * M_PI * k / size);
+    this->real_twiddles[2*k+1] = (float) -sin(2.0 * M_PI * k / size);
+  }
+  this->work = (float *) malloc(size * sizeof(float));
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void fft_close(fft_t *this)
+{
+  free(this->bit_reverse);
+  free(this->twiddles);
+  free(this->real_twiddles);
+  free(this->work);
+  free(this);
+  return;
+}
+
+
+uint32_t fft_get_size(fft_t *this)
+{
+  return this->size;
+}
+
+
+void fft_complex(fft_t *this, float *data, int inverse)
+{
+  uint32_t n = this->npoints;
+
+  for (uint32_t i = 0; i < n; ++i) {
+    uint32_t j = this->bit_reverse[i];
+    if (j > i) {
+      float re = data[2*i];
+      float im = data[2*i+1];
+      data[2*i] = data[2*j];
+      data[2*i+1] = data[2*j+1];
+      data[2*j] = re;
+      data[2*j+1] = im;
+    }
+  }
+
+  /* the inverse uses the conjugate twiddles */
+  float sign = inverse ? -1.0f : 1.0f;
+  for (uint32_t half = 1; half < n; half *= 2) {
+    uint32_t stride = n / (2 * half);
+    for (uint32_t start = 0; start < n; start += 2 * half) {
+      float *a = data + 2 * start;
+      float *b = a + 2 * half;
+      for (uint32_t k = 0; k < half; ++k) {
+        float w_re = this->twiddles[2*k*stride];
+        float w_im = sign * this->twiddles[2*k*stride+1];
+        float t_re = b[2*k] * w_re - b[2*k+1] * w_im;
+        float t_im = b[2*k] * w_im + b[2*k+1] * w_re;
+        b[2*k] = a[2*k] - t_re;
+        b[2*k+1] = a[2*k+1] - t_im;
+        a[2*k] += t_re;
+        a[2*k+1] += t_im;
+      }
+    }
+  }
+  return;
+}
+
+
+void fft_real_forward(fft_t *this, const float *in, float *out)
+{
+  uint32_t m = this->npoints;
+
+  /* even samples in the real part, odd samples in the imaginary part */
+  float *z = this->work;
+  memcpy(z, in, this->size * sizeof(float));
+  fft_complex(this, z, 0);
+
+  for (uint32_t k = 0; k <= m; ++k) {
+    uint32_t k1 = k == m ? 0 : k;
+    uint32_t k2 = k == 0 ? 0 : m - k;
+    float zk_re = z[2*k1];
+    float zk_im = z[2*k1+1];
+    float zm_re = z[2*k2];
+    float zm_im = -z[2*k2+1];
+    float even_re = 0.5f * (zk_re + zm_re);
+    float even_im = 0.5f * (zk_im + zm_im);
+    /* odd = (Z[k] - conj(Z[m-k])) / 2j */
+    float odd_re = 0.5f * (zk_im - zm_im);
+    float odd_im = -0.5f * (zk_re - zm_re);
+    float w_re = this->real_twiddles[2*k];
+    float w_im = this->real_twiddles[2*k+1];
+    out[2*k] = even_re + w_re * odd_re - w_im * odd_im;
+    out[2*k+1] = even_im + w_re * odd_im + w_im * odd_re;
+  }
+  return;
+}
+
+
+void fft_real_inverse(fft_t *this, float *in, float *out)
+{
+  uint32_t m = this->npoints;
+
+  float *z = this->work;
+  for (uint32_t k = 0; k < m; ++k) {
+    float xk_re = in[2*k];
+    float xk_im = in[2*k+1];
+    float xm_re = in[2*(m-k)];
+    float xm_im = -in[2*(m-k)+1];
+    float even_re = xk_re + xm_re;
+    float even_im = xk_im + xm_im;
+    float diff_re = xk_re - xm_re;
+    float diff_im = xk_im - xm_im;
+    /* odd = (X[k] - conj(X[m-k])) / W^k, with |W^k| = 1 */
+    float w_re = this->real_twiddles[2*k];
+    float w_im = this->real_twiddles[2*k+1];
+    float odd_re = diff_re * w_re + diff_im * w_im;
+    float odd_im = diff_im * w_re - diff_re * w_im;
+    /* Z[k] = even + j odd */
+    z[2*k] = even_re - odd_im;
+    z[2*k+1] = even_im + odd_re;
+  }
+  fft_complex(this, z, 1);
+  memcpy(out, z, this->size * sizeof(float));
+  return;
+}
@@ -0,0 +1,59 @@
+/*
+ * fft.h - radix-2 FFT for complex and real data
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FFT_H
+#define __FFT_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fft fft_t;
+
+/* size is the number of real samples for the real transforms and twice
+   the number of points for the complex transforms; it must be a power of
+   two and at least 4 */
+fft_t *fft_open(uint32_t size);
+
+void fft_close(fft_t *this);
+
+uint32_t fft_get_size(fft_t *this);
+
+/* in place complex transform of size / 2 points (interleaved re/im);
+   the inverse is not normalized */
+void fft_complex(fft_t *this, float *data, int inverse);
+
+/* real input of size samples to size / 2 + 1 complex bins (interleaved
+   re/im, i.e. size + 2 floats) */
+void fft_real_forward(fft_t *this, const float *in, float *out);
+
+/* size / 2 + 1 complex bins to size real samples; not normalized (the
+   round trip scales by size); the input is overwritten */
+void fft_real_inverse(fft_t *this, float *in, float *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FFT_H */
@@ -0,0 +1,196 @@
+/*
+ * fs4.c - real ADC samples to complex I/Q at half the rate by fs/4 mixing
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Mixing by fs/4 multiplies the real input by 1, -j, -1, j, ..., so the
+ * real part of the mixer output is the even samples with alternating
+ * signs and the imaginary part the odd ones - no multiplies. The half-band
+ * low pass filter that follows has zero taps at every even offset from the
+ * center, so after decimation by 2 the I branch only sees the (symmetric)
+ * odd offset taps, and the Q branch only the center tap: a delay.
+ *
+ * The ADC randomization is not removed here, but in the streaming layer as
+ * each frame arrives: every other consumer of the frames needs the plain
+ * samples too, so removing it again in the mixer would undo it. The mixer
+ * and the filter still run in one pass over each L1 sized chunk.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs4.h"
+#include "dsp.h"
+#include "logging.h"
+
+
+typedef struct fs4 fs4_t;
+
+/* internal functions */
+static void fs4_filter(fs4_t *this, const int16_t *samples, uint32_t npairs,
+                       float *output);
+
+typedef struct fs4 {
+  uint32_t max_samples;
+  uint32_t max_pairs;
+  uint32_t ntaps;           /* nonzero taps on each side of the center */
+  float *taps;
+  float center;
+  float *i_input;           /* 2 * ntaps - 1 samples of history + chunk */
+  float *q_input;           /* ntaps samples of history + chunk */
+  float *output;
+  int flip;                 /* mixer phase of the next pair */
+  int has_pending;          /* odd input sample left from the last call */
+  int16_t pending;
+} fs4_t;
+
+
+static const double FS4_PASSBAND = 0.2;       /* flat band (fraction of fs) */
+static const double FS4_ATTENUATION = 60.0;   /* stop band attenuation (dB) */
+static const uint32_t FS4_CHUNK = 1024;       /* pairs per pass (L1 sized) */
+
+
+fs4_t *fs4_open(uint32_t max_samples)
+{
+  fs4_t *ret_val = 0;
+
+  if (max_samples == 0) {
+    LOG_ERROR("invalid fs/4 converter parameters");
+    return ret_val;
+  }
+
+  /* a half-band filter has 4 * ntaps - 1 taps, ntaps of them nonzero on
+     each side of the center */
+  int length = dsp_kaiser_ntaps(2 * (0.25 - FS4_PASSBAND), FS4_ATTENUATION);
+  uint32_t ntaps = (length + 1 + 3) / 4;
+  length = 4 * ntaps - 1;
+  float *taps = (float *) malloc(length * sizeof(float));
+  if (taps == 0) {
+    LOG_ERROR("malloc() failed");
+    return ret_val;
+  }
+  dsp_kaiser_lowpass(taps, length, 0.25, FS4_ATTENUATION);
+
+  fs4_t *this = (fs4_t *) calloc(1, sizeof(fs4_t));
+  if (this == 0) {
+    LOG_ERROR("calloc() failed");
+    free(taps);
+    return ret_val;
+  }
+  this->max_samples = max_samples;
+  this->max_pairs = max_samples / 2 + 1;
+  this->ntaps = ntaps;
+  this->taps = (float *) malloc(ntaps * sizeof(float));
+  if (this->taps == 0) {
+    LOG_ERROR("malloc() failed");
+    free(taps);
+    fs4_close(this);
+    return ret_val;
+  }
+  for (uint32_t p = 0; p < ntaps; ++p) {
+    this->taps[p] = taps[2*p];
+  }
+  this->center = taps[2*ntaps-1];
+  free(taps);
+  this->i_input = (float *) malloc((2 * ntaps - 1 + FS4_CHUNK) * sizeof(float));
+  this->q_input = (float *) malloc((ntaps + FS4_CHUNK) * sizeof(float));
+  this->output = (float *) malloc(2 * this->max_pairs * sizeof(float));
+  if (this->i_input == 0 || this->q_input == 0 || this->output == 0) {
+    LOG_ERROR("malloc() failed");
+    fs4_close(this);
+    return ret_val;
+  }
+  fs4_reset(this);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void fs4_close(fs4_t *this)
+{
+  free(this->taps);
+  free(this->i_input);
+  free(this->q_input);
+  free(this->output);
+  free(this);
+  return;
+}
+
+
+void fs4_reset(fs4_t *this)
+{
+  memset(this->i_input, 0, (2 * this->ntaps - 1) * sizeof(float));
+  memset(this->q_input, 0, this->ntaps * sizeof(float));
+  this->flip = 0;
+  this->has_pending = 0;
+  return;
+}
+
+
+uint32_t fs4_process(fs4_t *this, const int16_t *samples, uint32_t nsamples,
+                     float **output)
+{
+  if (nsamples > this->max_samples) {
+    LOG_ERROR("too many samples");
+    nsamples = this->max_samples;
+  }
+
+  /* complete the pair started by the last call */
+  uint32_t noutput = 0;
+  if (this->has_pending && nsamples > 0) {
+    int16_t pair[2] = { this->pending, samples[0] };
+    fs4_filter(this, pair, 1, this->output);
+    this->has_pending = 0;
+    samples++;
+    nsamples--;
+    noutput = 1;
+  }
+  uint32_t npairs = nsamples / 2;
+  for (uint32_t i = 0; i < npairs; i += FS4_CHUNK) {
+    uint32_t n = npairs - i < FS4_CHUNK ? npairs - i : FS4_CHUNK;
+    fs4_filter(this, samples + 2 * i, n, this->output + 2 * noutput);
+    noutput += n;
+  }
+  if (nsamples & 1) {
+    this->pending = samples[nsamples-1];
+    this->has_pending = 1;
+  }
+
+  *output = this->output;
+  return noutput;
+}
+
+
+/* internal functions */
+static void fs4_filter(fs4_t *this, const int16_t *samples, uint32_t npairs,
+                       float *output)
+{
+  uint32_t i_history = 2 * this->ntaps - 1;
+  uint32_t q_history = this->ntaps;
+  dsp_fs4_mix(samples, npairs, this->flip,
+              this->i_input + i_history, this->q_input + q_history);
+  this->flip ^= npairs & 1;
+  dsp_halfband_iq(this->i_input, this->q_input, this->taps, this->ntaps,
+                  this->center, npairs, output);
+  memmove(this->i_input, this->i_input + npairs, i_history * sizeof(float));
+  memmove(this->q_input, this->q_input + npairs, q_history * sizeof(float));
+  return;
+}
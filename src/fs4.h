@@ -0,0 +1,51 @@
+/*
+ * fs4.h - real ADC samples to complex I/Q at half the rate by fs/4 mixing
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __FS4_H
+#define __FS4_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct fs4 fs4_t;
+
+fs4_t *fs4_open(uint32_t max_samples);
+
+void fs4_close(fs4_t *this);
+
+void fs4_reset(fs4_t *this);
+
+/* returns the number of complex output samples, one per input sample
+   pair; *output points to an internal buffer with interleaved I/Q floats,
+   valid until the next call. Output frequency 0 is input frequency fs/4,
+   and the usable band is +/-0.2 fs */
+uint32_t fs4_process(fs4_t *this, const int16_t *samples, uint32_t nsamples,
+                     float **output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __FS4_H */
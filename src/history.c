@@ -0,0 +1,736 @@
+/*
+ * history.c - spectrum history store
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The file is a header page followed by chunks, each holding up to 64
+ * rows of one level (history.h); the chunks of a level are linked backwards from the
+ * header, so a query walks from the newest chunk back to its start time.
+ * A chunk has the row times, then an offset per column (plane and bin),
+ * then the columns: the values in 1/16 dB steps, as zigzag varints of the
+ * difference from the previous row - neighboring spectra differ little,
+ * so most take one byte.
+ *
+ * The whole file is mapped at once into a large reservation, and grown
+ * with ftruncate() ahead of the writes; the header 'end' is moved past a
+ * chunk only once it is complete, so concurrent readers (with their own
+ * mapping) never see a partial one.
+ *
+ * The minute and hour rows are written out as each period closes, one
+ * row per chunk, so readers see them at once and a crash does not lose
+ * them. A close writes the periods still open as well; the header keeps
+ * how many spectra went into them, and a reopen picks the sums back up
+ * from those rows, so that the next row of the level replaces the open
+ * one (its chunk is left unlinked) rather than repeating the period.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "logging.h"
+
+
+#define HISTORY_TILE_BINS (16)
+#define HISTORY_SKIP (64)
+
+struct history_level {
+  uint32_t nplanes;
+  uint32_t nrows;           /* rows not written yet */
+  int64_t *times;
+  float *values;            /* nplanes planes of HISTORY_CHUNK_ROWS rows */
+  int64_t period;           /* ns (the pyramid levels) */
+  int64_t period_start;
+  uint32_t count;           /* spectra in the current period */
+  double *sum;              /* linear power */
+  float *peak;
+  uint64_t recent[HISTORY_SKIP];    /* the last chunks, for the skips */
+  uint32_t nrecent;
+  uint32_t recent_pos;
+  uint64_t open_chunk;      /* holds the row of the resumed period (0: none) */
+};
+
+/* internal functions */
+static int history_map(sddc_history_t *this);
+static int history_grow(sddc_history_t *this, uint64_t size);
+static void history_push_row(sddc_history_t *this, int level, int64_t time,
+                             const float *mean, const float *peak);
+static void history_close_period(sddc_history_t *this, int level, int open);
+static int history_write_chunk(sddc_history_t *this, int level);
+static const struct history_chunk *history_chunk(sddc_history_t *this,
+                                                 uint64_t offset);
+static const struct history_chunk *history_find(sddc_history_t *this,
+                                                int level, int64_t time,
+                                                uint64_t row);
+static uint64_t history_rows_before(sddc_history_t *this, int level,
+                                    int64_t time);
+static void history_decode(sddc_history_t *this,
+                           const struct history_chunk *chunk, int stat,
+                           uint32_t r0, uint32_t r1, uint32_t bin0,
+                           uint32_t bin1, int64_t *times, float *power);
+
+typedef struct sddc_history {
+  int fd;
+  int writable;
+  uint8_t *map;
+  size_t map_size;          /* reserved address space */
+  uint64_t file_size;
+  struct history_header *header;
+  uint32_t nbins;
+  uint64_t max_chunk_size;
+  struct history_level levels[HISTORY_LEVELS];
+  double *linear;           /* nbins */
+  float *mean;
+  pthread_mutex_t lock;
+} sddc_history_t;
+
+
+static const char HISTORY_MAGIC[8] = { 'S', 'D', 'D', 'C', 'H', 'I', 'S', 'T' };
+static const uint32_t HISTORY_VERSION = 1;
+static const uint32_t HISTORY_CHUNK_MAGIC = 0x4b484353;   /* "SCHK" */
+static const float HISTORY_STEPS_PER_DB = 16.0f;
+static const uint64_t HISTORY_HEADER_SIZE = 4096;
+static const uint64_t HISTORY_GROW_SIZE = 4 << 20;
+static const int64_t HISTORY_PERIODS[HISTORY_LEVELS] = {
+  0, 60000000000LL, 3600000000000LL
+};
+#if UINTPTR_MAX > 0xffffffffu
+static const uint64_t HISTORY_MAP_SIZE = 1ULL << 38;     /* 256GB */
+#else
+static const uint64_t HISTORY_MAP_SIZE = 1ULL << 30;
+#endif
+
+
+sddc_history_t *sddc_history_open(const char *path, int writable,
+                                  uint32_t nbins, double frequency,
+                                  double bin_width)
+{
+  sddc_history_t *ret_val = 0;
+
+  int fd = open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if (fd < 0) {
+    LOG_ERROR("open(%s) failed: %s", path, strerror(errno));
+    return ret_val;
+  }
+  if (writable && flock(fd, LOCK_EX | LOCK_NB) < 0) {
+    LOG_ERROR("%s is already open for writing", path);
+    close(fd);
+    return ret_val;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    LOG_ERROR("fstat(%s) failed: %s", path, strerror(errno));
+    close(fd);
+    return ret_val;
+  }
+
+  sddc_history_t *this = (sddc_history_t *) calloc(1, sizeof(sddc_history_t));
+  if (this == 0) {
+    LOG_ERROR("calloc() failed");
+    close(fd);
+    return ret_val;
+  }
+  this->fd = fd;
+  this->writable = writable;
+  this->file_size = st.st_size;
+  this->map = MAP_FAILED;
+  pthread_mutex_init(&this->lock, 0);
+
+  int is_new = st.st_size == 0;
+  if (is_new) {
+    if (!writable || nbins == 0 || bin_width <= 0) {
+      LOG_ERROR("%s is empty - a new history needs the bins", path);
+      goto FAIL;
+    }
+    if (history_grow(this, HISTORY_HEADER_SIZE) < 0) {
+      goto FAIL;
+    }
+  } else if (st.st_size < (off_t) HISTORY_HEADER_SIZE) {
+    LOG_ERROR("%s is not a spectrum history", path);
+    goto FAIL;
+  }
+  if (history_map(this) < 0) {
+    goto FAIL;
+  }
+
+  struct history_header *header = this->header;
+  if (is_new) {
+    memcpy(header->magic, HISTORY_MAGIC, sizeof(HISTORY_MAGIC));
+    header->version = HISTORY_VERSION;
+    header->nbins = nbins;
+    header->frequency = frequency;
+    header->bin_width = bin_width;
+    for (int level = 0; level < HISTORY_LEVELS; ++level) {
+      header->first_time[level] = INT64_MIN;
+      header->last_time[level] = INT64_MIN;
+    }
+    atomic_thread_fence(memory_order_release);
+    header->end = HISTORY_HEADER_SIZE;
+  } else if (memcmp(header->magic, HISTORY_MAGIC, sizeof(HISTORY_MAGIC)) != 0 ||
+             header->version != HISTORY_VERSION) {
+    LOG_ERROR("%s is not a spectrum history (version %u)", path,
+              HISTORY_VERSION);
+    goto FAIL;
+  } else if (nbins != 0 && (header->nbins != nbins ||
+                            header->frequency != frequency ||
+                            header->bin_width != bin_width)) {
+    LOG_ERROR("%s has different bins (%u from %.0lfHz, %.3lfHz wide)", path,
+              header->nbins, header->frequency, header->bin_width);
+    goto FAIL;
+  } else if (header->end < HISTORY_HEADER_SIZE ||
+             header->end > this->file_size) {
+    LOG_ERROR("%s is damaged", path);
+    goto FAIL;
+  }
+  this->nbins = header->nbins;
+
+  if (writable) {
+    /* rows and columns of varints of up to 3 bytes, plus alignment */
+    this->max_chunk_size = sizeof(struct history_chunk) +
+                           HISTORY_CHUNK_ROWS * sizeof(int64_t) +
+                           (2 * this->nbins + 1) * sizeof(uint32_t) +
+                           2 * (uint64_t) this->nbins * HISTORY_CHUNK_ROWS * 3 + 8;
+    this->linear = (double *) malloc(this->nbins * sizeof(double));
+    this->mean = (float *) malloc(this->nbins * sizeof(float));
+    if (this->linear == 0 || this->mean == 0) {
+      LOG_ERROR("malloc() failed");
+      goto FAIL;
+    }
+    for (int level = 0; level < HISTORY_LEVELS; ++level) {
+      struct history_level *lvl = &this->levels[level];
+      lvl->nplanes = level == 0 ? 1 : 2;
+      lvl->times = (int64_t *) malloc(HISTORY_CHUNK_ROWS * sizeof(int64_t));
+      lvl->values = (float *) malloc(lvl->nplanes * HISTORY_CHUNK_ROWS *
+                                     this->nbins * sizeof(float));
+      lvl->period = HISTORY_PERIODS[level];
+      if (level > 0) {
+        lvl->sum = (double *) calloc(this->nbins, sizeof(double));
+        lvl->peak = (float *) malloc(this->nbins * sizeof(float));
+      }
+      if (lvl->times == 0 || lvl->values == 0 ||
+          (level > 0 && (lvl->sum == 0 || lvl->peak == 0))) {
+        LOG_ERROR("malloc() failed");
+        goto FAIL;
+      }
+      /* the last chunks already in the file, oldest first */
+      const struct history_chunk *chunk;
+      uint64_t offset = header->last_chunk[level];
+      for (chunk = history_chunk(this, offset);
+           chunk && lvl->nrecent < HISTORY_SKIP;
+           offset = chunk->prev, chunk = history_chunk(this, offset)) {
+        lvl->recent[HISTORY_SKIP-1-lvl->nrecent++] = offset;
+      }
+      memmove(lvl->recent, lvl->recent + HISTORY_SKIP - lvl->nrecent,
+              lvl->nrecent * sizeof(uint64_t));
+      lvl->recent_pos = lvl->nrecent % HISTORY_SKIP;
+
+      /* the period a close left open */
+      chunk = history_chunk(this, header->last_chunk[level]);
+      if (level > 0 && header->open_count[level] > 0 && chunk &&
+          chunk->nrows == 1) {
+        int64_t time;
+        history_decode(this, chunk, SDDC_HISTORY_MEAN, 0, 1, 0, this->nbins,
+                       &time, this->mean);
+        history_decode(this, chunk, SDDC_HISTORY_PEAK, 0, 1, 0, this->nbins,
+                       &time, lvl->peak);
+        lvl->count = header->open_count[level];
+        for (uint32_t k = 0; k < this->nbins; ++k) {
+          lvl->sum[k] = lvl->count * pow(10.0, this->mean[k] / 10.0);
+        }
+        lvl->period_start = time;
+        lvl->open_chunk = header->last_chunk[level];
+      }
+    }
+  }
+
+  ret_val = this;
+  return ret_val;
+
+FAIL:
+  for (int level = 0; level < HISTORY_LEVELS; ++level) {
+    free(this->levels[level].times);
+    free(this->levels[level].values);
+    free(this->levels[level].sum);
+    free(this->levels[level].peak);
+  }
+  free(this->linear);
+  free(this->mean);
+  if (this->map != MAP_FAILED) {
+    munmap(this->map, this->map_size);
+  }
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+  close(fd);
+  return ret_val;
+}
+
+
+int sddc_history_close(sddc_history_t *this)
+{
+  int ret_val = 0;
+  if (this->writable) {
+    /* the current minute and hour as they are, left open */
+    pthread_mutex_lock(&this->lock);
+    for (int level = 1; level < HISTORY_LEVELS; ++level) {
+      if (this->levels[level].count > 0) {
+        history_close_period(this, level, 1);
+      }
+    }
+    pthread_mutex_unlock(&this->lock);
+    ret_val = sddc_history_flush(this);
+    /* drop the room reserved for growth */
+    if (ftruncate(this->fd, this->header->end) < 0) {
+      LOG_ERROR("ftruncate() failed: %s", strerror(errno));
+      ret_val = -1;
+    }
+    for (int level = 0; level < HISTORY_LEVELS; ++level) {
+      free(this->levels[level].times);
+      free(this->levels[level].values);
+      free(this->levels[level].sum);
+      free(this->levels[level].peak);
+    }
+    free(this->linear);
+    free(this->mean);
+  }
+  munmap(this->map, this->map_size);
+  close(this->fd);
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+  return ret_val;
+}
+
+
+int sddc_history_append(sddc_history_t *this, int64_t time,
+                        const float *power)
+{
+  if (!this->writable) {
+    LOG_ERROR("history is read only");
+    return -1;
+  }
+  pthread_mutex_lock(&this->lock);
+  struct history_level *spectra = &this->levels[0];
+  int64_t last_time = spectra->nrows > 0 ?
+                      spectra->times[spectra->nrows-1] :
+                      this->header->last_time[0];
+  if (time < last_time) {
+    pthread_mutex_unlock(&this->lock);
+    LOG_ERROR("history time going backwards");
+    return -1;
+  }
+
+  history_push_row(this, 0, time, power, 0);
+  for (uint32_t k = 0; k < this->nbins; ++k) {
+    this->linear[k] = pow(10.0, power[k] / 10.0);
+  }
+  for (int level = 1; level < HISTORY_LEVELS; ++level) {
+    struct history_level *lvl = &this->levels[level];
+    /* floor, for times before the epoch too */
+    int64_t start = time / lvl->period * lvl->period;
+    start -= start > time ? lvl->period : 0;
+    if (lvl->count > 0 && start != lvl->period_start) {
+      history_close_period(this, level, 0);
+    }
+    lvl->period_start = start;
+    for (uint32_t k = 0; k < this->nbins; ++k) {
+      lvl->sum[k] += this->linear[k];
+    }
+    if (lvl->count == 0) {
+      memcpy(lvl->peak, power, this->nbins * sizeof(float));
+    } else {
+      for (uint32_t k = 0; k < this->nbins; ++k) {
+        lvl->peak[k] = power[k] > lvl->peak[k] ? power[k] : lvl->peak[k];
+      }
+    }
+    lvl->count++;
+  }
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+
+int sddc_history_flush(sddc_history_t *this)
+{
+  if (!this->writable) {
+    return 0;
+  }
+  int ret_val = 0;
+  pthread_mutex_lock(&this->lock);
+  for (int level = 0; level < HISTORY_LEVELS; ++level) {
+    if (history_write_chunk(this, level) < 0) {
+      ret_val = -1;
+    }
+  }
+  pthread_mutex_unlock(&this->lock);
+  return ret_val;
+}
+
+
+int sddc_history_get_info(sddc_history_t *this, struct sddc_history_info *info)
+{
+  const struct history_header *header = this->header;
+  uint64_t end = header->end;
+  atomic_thread_fence(memory_order_acquire);
+  info->nbins = this->nbins;
+  info->frequency = header->frequency;
+  info->bin_width = header->bin_width;
+  for (int level = 0; level < HISTORY_LEVELS; ++level) {
+    info->rows[level] = header->rows[level];
+  }
+  info->first_time = header->first_time[0];
+  info->last_time = header->last_time[0];
+  info->file_size = end;
+  return 0;
+}
+
+
+int sddc_history_query(sddc_history_t *this, int level, int stat,
+                       int64_t start_time, int64_t end_time,
+                       double start_frequency, double end_frequency,
+                       uint32_t max_rows, int64_t *times, float *power,
+                       uint32_t *first_bin, uint32_t *nbins)
+{
+  if (level < SDDC_HISTORY_AUTO || level >= HISTORY_LEVELS ||
+      (stat != SDDC_HISTORY_MEAN && stat != SDDC_HISTORY_PEAK)) {
+    LOG_ERROR("invalid history level or statistic");
+    return -1;
+  }
+
+  /* bins centered within the frequency range */
+  const struct history_header *header = this->header;
+  uint32_t bin0 = 0;
+  uint32_t bin1 = this->nbins;
+  if (end_frequency > start_frequency) {
+    double b0 = ceil((start_frequency - header->frequency) / header->bin_width);
+    double b1 = floor((end_frequency - header->frequency) / header->bin_width) + 1;
+    bin0 = b0 < 0 ? 0 : b0 > this->nbins ? this->nbins : (uint32_t) b0;
+    bin1 = b1 < bin0 ? bin0 : b1 > this->nbins ? this->nbins : (uint32_t) b1;
+  }
+  *first_bin = bin0;
+  *nbins = bin1 - bin0;
+
+  pthread_mutex_lock(&this->lock);
+  if (level == SDDC_HISTORY_AUTO) {
+    for (level = 0; level < HISTORY_LEVELS - 1; ++level) {
+      if (history_rows_before(this, level, end_time) -
+          history_rows_before(this, level, start_time) <= max_rows) {
+        break;
+      }
+    }
+  }
+
+  /* rows first_row to last_row (excluded) of the level, newest first */
+  uint64_t first_row = history_rows_before(this, level, start_time);
+  uint64_t end_row = history_rows_before(this, level, end_time);
+  uint64_t total = end_row > first_row ? end_row - first_row : 0;
+  uint64_t last_row = first_row + (total < max_rows ? total : max_rows);
+  const struct history_chunk *chunk;
+  for (chunk = last_row > first_row ?
+               history_find(this, level, INT64_MAX, last_row) : 0;
+       chunk && chunk->first_row + chunk->nrows > first_row;
+       chunk = history_chunk(this, chunk->prev)) {
+    uint64_t r0 = first_row > chunk->first_row ? first_row - chunk->first_row : 0;
+    uint64_t r1 = last_row - chunk->first_row < chunk->nrows ?
+                  last_row - chunk->first_row : chunk->nrows;
+    uint64_t row = chunk->first_row + r0 - first_row;
+    history_decode(this, chunk, stat, (uint32_t) r0, (uint32_t) r1, bin0,
+                   bin1, times + row, power + row * (bin1 - bin0));
+  }
+  pthread_mutex_unlock(&this->lock);
+  return total < INT32_MAX ? (int) total : INT32_MAX;
+}
+
+
+/* internal functions */
+static int history_map(sddc_history_t *this)
+{
+  int prot = PROT_READ | (this->writable ? PROT_WRITE : 0);
+  this->map_size = (size_t) HISTORY_MAP_SIZE;
+  this->map = (uint8_t *) mmap(0, this->map_size, prot, MAP_SHARED, this->fd, 0);
+  if (this->map == MAP_FAILED) {
+    LOG_ERROR("mmap() failed: %s", strerror(errno));
+    return -1;
+  }
+  this->header = (struct history_header *) this->map;
+  return 0;
+}
+
+static int history_grow(sddc_history_t *this, uint64_t size)
+{
+  if (size <= this->file_size) {
+    return 0;
+  }
+  if (size > HISTORY_MAP_SIZE) {
+    LOG_ERROR("history file is full");
+    return -1;
+  }
+  uint64_t file_size = (size + HISTORY_GROW_SIZE - 1) / HISTORY_GROW_SIZE *
+                       HISTORY_GROW_SIZE;
+  file_size = file_size > HISTORY_MAP_SIZE ? HISTORY_MAP_SIZE : file_size;
+  if (ftruncate(this->fd, file_size) < 0) {
+    LOG_ERROR("ftruncate() failed: %s", strerror(errno));
+    return -1;
+  }
+  this->file_size = file_size;
+  return 0;
+}
+
+static void history_push_row(sddc_history_t *this, int level, int64_t time,
+                             const float *mean, const float *peak)
+{
+  struct history_level *lvl = &this->levels[level];
+  uint32_t nbins = this->nbins;
+  lvl->times[lvl->nrows] = time;
+  memcpy(lvl->values + (uint64_t) lvl->nrows * nbins, mean,
+         nbins * sizeof(float));
+  if (peak) {
+    memcpy(lvl->values + (uint64_t) (HISTORY_CHUNK_ROWS + lvl->nrows) * nbins,
+           peak, nbins * sizeof(float));
+  }
+  lvl->nrows++;
+  if (lvl->nrows == HISTORY_CHUNK_ROWS) {
+    history_write_chunk(this, level);
+  }
+  return;
+}
+
+/* the row of a period, written out at once; an open one is resumed by
+   the next open */
+static void history_close_period(sddc_history_t *this, int level, int open)
+{
+  struct history_level *lvl = &this->levels[level];
+  for (uint32_t k = 0; k < this->nbins; ++k) {
+    this->mean[k] = (float) (10 * log10(lvl->sum[k] / lvl->count + 1e-20));
+    lvl->sum[k] = 0;
+  }
+  history_push_row(this, level, lvl->period_start, this->mean, lvl->peak);
+  if (history_write_chunk(this, level) == 0) {
+    this->header->open_count[level] = open ? lvl->count : 0;
+  }
+  lvl->count = 0;
+  return;
+}
+
+static int history_write_chunk(sddc_history_t *this, int level)
+{
+  struct history_level *lvl = &this->levels[level];
+  uint32_t nrows = lvl->nrows;
+  if (nrows == 0) {
+    return 0;
+  }
+  struct history_header *header = this->header;
+  uint64_t offset = header->end;
+  if (history_grow(this, offset + this->max_chunk_size) < 0) {
+    /* the rows are lost, but the file stays consistent (a resumed
+       period keeps the row it had) */
+    lvl->nrows = 0;
+    lvl->open_chunk = 0;
+    header->open_count[level] = 0;
+    return -1;
+  }
+
+  /* the row of a resumed period is replaced: the new chunk takes the
+     place of its chunk in the list */
+  uint64_t prev = header->last_chunk[level];
+  uint64_t skip = lvl->nrecent == HISTORY_SKIP ? lvl->recent[lvl->recent_pos] : 0;
+  uint64_t first_row = header->rows[level];
+  const struct history_chunk *open = history_chunk(this, lvl->open_chunk);
+  if (open) {
+    prev = open->prev;
+    skip = open->skip;
+    first_row = open->first_row;
+  }
+
+  /* written in place past 'end' - invisible until it moves */
+  struct history_chunk *chunk = (struct history_chunk *) (this->map + offset);
+  int64_t *times = (int64_t *) (chunk + 1);
+  uint32_t ncolumns = lvl->nplanes * this->nbins;
+  uint32_t *offsets = (uint32_t *) (times + nrows);
+  uint8_t *data = (uint8_t *) (offsets + ncolumns + 1);
+  memcpy(times, lvl->times, nrows * sizeof(int64_t));
+  uint8_t *p = data;
+  for (uint32_t plane = 0; plane < lvl->nplanes; ++plane) {
+    const float *values = lvl->values +
+                          (uint64_t) plane * HISTORY_CHUNK_ROWS * this->nbins;
+    for (uint32_t bin = 0; bin < this->nbins; ++bin) {
+      offsets[plane * this->nbins + bin] = (uint32_t) (p - data);
+      int32_t last = 0;
+      for (uint32_t r = 0; r < nrows; ++r) {
+        /* clamped to int16 (NaN too) */
+        float x = values[(uint64_t) r * this->nbins + bin] * HISTORY_STEPS_PER_DB;
+        x = x > -32768.0f ? x : -32768.0f;
+        x = x < 32767.0f ? x : 32767.0f;
+        int32_t value = (int32_t) lrintf(x);
+        int32_t delta = value - last;
+        uint32_t v = ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31);
+        while (v >= 0x80) {
+          *p++ = (uint8_t) (v | 0x80);
+          v >>= 7;
+        }
+        *p++ = (uint8_t) v;
+        last = value;
+      }
+    }
+  }
+  offsets[ncolumns] = (uint32_t) (p - data);
+  uint32_t size = (uint32_t) (((p - (uint8_t *) chunk) + 7) & ~7);
+  chunk->magic = HISTORY_CHUNK_MAGIC;
+  chunk->level = (uint16_t) level;
+  chunk->nplanes = (uint16_t) lvl->nplanes;
+  chunk->nrows = nrows;
+  chunk->size = size;
+  chunk->prev = prev;
+  chunk->skip = skip;
+  chunk->first_row = first_row;
+  chunk->first_time = times[0];
+  chunk->last_time = times[nrows-1];
+
+  /* publish: the chunk, then the end, then the level */
+  atomic_thread_fence(memory_order_release);
+  header->end = offset + size;
+  atomic_thread_fence(memory_order_release);
+  header->last_chunk[level] = offset;
+  header->rows[level] = first_row + nrows;
+  if (header->first_time[level] == INT64_MIN) {
+    header->first_time[level] = times[0];
+  }
+  header->last_time[level] = times[nrows-1];
+  lvl->nrows = 0;
+  if (open) {
+    uint32_t last = (lvl->recent_pos + HISTORY_SKIP - 1) % HISTORY_SKIP;
+    lvl->recent[last] = offset;
+    lvl->open_chunk = 0;
+  } else {
+    lvl->recent[lvl->recent_pos] = offset;
+    lvl->recent_pos = (lvl->recent_pos + 1) % HISTORY_SKIP;
+    lvl->nrecent += lvl->nrecent < HISTORY_SKIP;
+  }
+  return 0;
+}
+
+/* a chunk written out completely, or 0; the offset is from the header
+   or a newer chunk, so the chunk was published before it */
+static const struct history_chunk *history_chunk(sddc_history_t *this,
+                                                 uint64_t offset)
+{
+  atomic_thread_fence(memory_order_acquire);
+  uint64_t end = this->header->end;
+  if (offset == 0) {
+    return 0;
+  }
+  const struct history_chunk *chunk = (const struct history_chunk *)
+                                      (this->map + offset);
+  if (offset < HISTORY_HEADER_SIZE || offset + sizeof(*chunk) > end ||
+      chunk->magic != HISTORY_CHUNK_MAGIC || offset + chunk->size > end) {
+    LOG_ERROR("history chunk at %llu is damaged", (unsigned long long) offset);
+    return 0;
+  }
+  return chunk;
+}
+
+/* the newest chunk of a level with first_time < time and first_row < row
+   (both only decrease going back), or 0: the skips jump over 64 chunks
+   at a time while the chunk they land on is still too new */
+static const struct history_chunk *history_find(sddc_history_t *this,
+                                                int level, int64_t time,
+                                                uint64_t row)
+{
+  const struct history_chunk *chunk = history_chunk(this,
+                                          this->header->last_chunk[level]);
+  while (chunk && (chunk->first_time >= time || chunk->first_row >= row)) {
+    const struct history_chunk *skip = history_chunk(this, chunk->skip);
+    if (skip && (skip->first_time >= time || skip->first_row >= row)) {
+      chunk = skip;
+    } else {
+      chunk = history_chunk(this, chunk->prev);
+    }
+  }
+  return chunk;
+}
+
+/* number of rows of a level before a time */
+static uint64_t history_rows_before(sddc_history_t *this, int level,
+                                    int64_t time)
+{
+  const struct history_chunk *chunk = history_find(this, level, time,
+                                                   UINT64_MAX);
+  if (chunk == 0) {
+    return 0;
+  }
+  const int64_t *times = (const int64_t *) (chunk + 1);
+  uint32_t r = 0;
+  while (r < chunk->nrows && times[r] < time) {
+    r++;
+  }
+  return chunk->first_row + r;
+}
+
+/* rows r0 to r1 (excluded) of a chunk, for the bins bin0 to bin1 */
+static void history_decode(sddc_history_t *this,
+                           const struct history_chunk *chunk, int stat,
+                           uint32_t r0, uint32_t r1, uint32_t bin0,
+                           uint32_t bin1, int64_t *times, float *power)
+{
+  uint32_t nrows = chunk->nrows;
+  const int64_t *chunk_times = (const int64_t *) (chunk + 1);
+  const uint32_t *offsets = (const uint32_t *) (chunk_times + nrows);
+  const uint8_t *data = (const uint8_t *) (offsets +
+                                           chunk->nplanes * this->nbins + 1);
+  uint32_t plane = (uint32_t) stat < chunk->nplanes ? (uint32_t) stat : 0;
+  memcpy(times, chunk_times + r0, (r1 - r0) * sizeof(int64_t));
+
+  /* a tile of columns at a time, then out row by row - writing each
+     column straight into the rows would touch a cache line per value */
+  float tile[HISTORY_TILE_BINS * HISTORY_CHUNK_ROWS];
+  uint32_t row_size = bin1 - bin0;
+  for (uint32_t bin = bin0; bin < bin1; bin += HISTORY_TILE_BINS) {
+    uint32_t ncols = bin1 - bin < HISTORY_TILE_BINS ? bin1 - bin :
+                     HISTORY_TILE_BINS;
+    for (uint32_t c = 0; c < ncols; ++c) {
+      const uint8_t *p = data + offsets[plane * this->nbins + bin + c];
+      int32_t value = 0;
+      for (uint32_t r = 0; r < r1; ++r) {
+        uint32_t v = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+          byte = *p++;
+          v |= (uint32_t) (byte & 0x7f) << shift;
+          shift += 7;
+        } while (byte & 0x80);
+        value += (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+        tile[r * HISTORY_TILE_BINS + c] = value / HISTORY_STEPS_PER_DB;
+      }
+    }
+    for (uint32_t r = r0; r < r1; ++r) {
+      memcpy(power + (uint64_t) (r - r0) * row_size + (bin - bin0),
+             tile + r * HISTORY_TILE_BINS, ncols * sizeof(float));
+    }
+  }
+  return;
+}
@@ -0,0 +1,75 @@
+/*
+ * history.h - spectrum history store
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __HISTORY_H
+#define __HISTORY_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the history functions themselves are in libsddc.h; this is the file
+   layout */
+typedef struct sddc_history sddc_history_t;
+
+#define HISTORY_LEVELS (3)
+#define HISTORY_CHUNK_ROWS (64)
+
+/* the header page */
+struct history_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nbins;
+  double frequency;
+  double bin_width;
+  uint64_t end;                           /* bytes written */
+  uint64_t last_chunk[HISTORY_LEVELS];    /* 0: none */
+  uint64_t rows[HISTORY_LEVELS];
+  int64_t first_time[HISTORY_LEVELS];
+  int64_t last_time[HISTORY_LEVELS];
+  uint32_t open_count[HISTORY_LEVELS];    /* spectra in the last row, when
+                                             its period was still open */
+};
+
+struct history_chunk {
+  uint32_t magic;
+  uint16_t level;
+  uint16_t nplanes;         /* mean, then peak */
+  uint32_t nrows;
+  uint32_t size;            /* bytes, header included */
+  uint64_t prev;            /* previous chunk of the level (0: none) */
+  uint64_t skip;            /* HISTORY_SKIP chunks back (0: none) */
+  uint64_t first_row;       /* row number in the level */
+  int64_t first_time;
+  int64_t last_time;
+  /* int64_t times[nrows]; uint32_t offsets[nplanes * nbins + 1]; data */
+};
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HISTORY_H */
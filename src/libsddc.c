@@ -24,34 +24,132 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "libsddc.h"
 #include "logging.h"
+#include "trace.h"
 #include "usb_device.h"
 #include "streaming.h"
+#include "detector.h"
+#include "adc_stats.h"
+#include "ddc.h"
+#include "fs4.h"
+#include "ols.h"
+#include "resampler.h"
+#include "sweep.h"
+#include "pipeline.h"
+#include "control.h"
+#include "control_tags.h"
 
 typedef struct sddc sddc_t;
 
 
 /* internal functions */
 static int sddc_set_vhf_gpios(sddc_t *this);
+static int sddc_apply_hf_attenuation(sddc_t *this, double attenuation);
+static int sddc_queue_control(sddc_t *this);
+static int sddc_run_control(sddc_t *this, int control, double value);
+static int sddc_execute_control(int64_t ticket, int type, double value,
+                                void *context);
+static int sddc_apply_control(sddc_t *this, int control, double value);
+static int sddc_tuner_init(sddc_t *this);
+static int sddc_tuner_standby(sddc_t *this);
+static int sddc_adc_shutdown(sddc_t *this);
+static int sddc_open_dsp(sddc_t *this, int resample, double clock_scale);
+static void sddc_drain_controls(sddc_t *this);
+static void sddc_close_sweep(sddc_t *this);
+static void sddc_hf_agc_update(sddc_t *this,
+                               const struct adc_frame_stats *frame_stats,
+                               uint64_t sample_index);
+static void sddc_read_async_callback(uint32_t data_size, uint8_t *data,
+                                     void *context);
+static void sddc_deliver_batch(sddc_t *this, uint32_t data_size,
+                               uint8_t *data, uint64_t sample_index,
+                               void *lease);
+static void sddc_flush_batch(sddc_t *this);
+static int sddc_recover_streaming(sddc_t *this);
+static void sddc_pipeline_release(void *token, void *context);
+static void sddc_signal_stall(sddc_t *this);
+static void sddc_process_subbands(sddc_t *this, const int16_t *samples,
+                                  uint32_t nsamples);
 
 
 typedef struct sddc {
   enum SDDCStatus status;
   enum SDDCHWModel model;
   uint16_t firmware;
-  enum RFMode rf_mode;
+  _Atomic enum RFMode rf_mode;
   usb_device_t *usb_device;
+  control_t *control;
+  int handling_events;      /* in sddc_handle_events() */
+  control_tags_t *control_tags;
+  sddc_control_tag_cb_t tag_callback;
+  void *tag_callback_context;
   streaming_t *streaming;
+  enum SDDCStreamingBackend streaming_backend;
+  sddc_read_async_cb_t callback;
+  void *callback_context;
+  sddc_read_async_batch_cb_t batch_callback;
+  struct sddc_frame_iov *batch;
+  void **batch_leases;      /* frames also leased by the pipeline */
+  uint32_t max_batch;
+  uint32_t nbatch;
+  uint64_t sample_index;
+  struct sddc_stream_stats stream_stats;
+  detector_t *detector;
+  adc_stats_t *adc_stats;
+  int hf_agc;
+  double hf_agc_target;
+  double hf_agc_hysteresis;
+  uint32_t hf_agc_low_frames;
+  int64_t hf_agc_ticket;    /* the last change queued by the AGC */
+  int64_t recovery_ticket;  /* the producer stop queued by the recovery */
+  uint64_t hf_agc_settled;  /* sample index where that change has settled */
+  double vhf_bandwidth;
+  ddc_t *ddc;
+  int iq_output;
+  fs4_t *fs4;
+  double output_sample_rate;
+  resampler_t *resampler;
+  /* what the DSP objects were opened with - the next start keeps (and
+     resets) the ones whose parameters are the same */
+  double dsp_sample_rate;
+  uint32_t dsp_max_samples;
+  double ddc_if_frequency;
+  double ddc_bandwidth;
+  int ddc_inverted;
+  double resampler_input_rate;
+  double resampler_output_rate;
+  int resampler_channels;
+  sweep_t *_Atomic sweep;
+  _Atomic int sweep_stopping; /* the events thread closes the sweep */
+  struct sddc_subband *subbands;
+  uint32_t nsubbands;
+  uint32_t subband_fft_size;
+  uint32_t subband_ntaps;
+  int subband_threads;
+  sddc_subband_cb_t subband_callback;
+  void *subband_callback_context;
+  uint64_t subband_index;   /* ADC sample index of the filter bank input 0 */
+  ols_t *ols;
+  pipeline_t *pipeline;
+  int pipeline_running;
+  uint32_t spare_frames;
+  int lease_allowed;        /* in the callback with a raw ADC frame */
+  int stall_warned;
+  sddc_stall_cb_t stall_callback;
+  void *stall_callback_context;
   int has_clock_source;
   int has_vhf_tuner;
   int hf_attenuator_levels;
-  double hf_attenuation;
+  _Atomic double hf_attenuation;
   double sample_rate;
-  double tuner_frequency;
+  _Atomic double tuner_frequency;
   double tuner_attenuation;
   double tuner_clock;
+  double tuner_if_frequency;
   double freq_corr_ppm;
   double frequency_range[2];
 } sddc_t;
@@ -64,6 +162,15 @@ static const double DEFAULT_HF_ATTENUATION = 0;       /* no attenuation */
 static const double DEFAULT_TUNER_ATTENUATION = 0;    /* no gain */
 
 static const double TUNER_CLOCK = 32E6;               /* tuner expects 32MHz when running */
+static const double DEFAULT_TUNER_IF_FREQUENCY = 4.57e6; /* IF used by the firmware R82xx driver */
+
+static const double DEFAULT_HF_AGC_TARGET = -6.0;      /* AGC target peak level (dBFS) */
+static const double DEFAULT_HF_AGC_HYSTERESIS = 3.0;   /* AGC hysteresis (dB) */
+static const double HF_AGC_CLIP_STEP = 6.0;            /* attenuation added on clipping (dB) */
+static const double HF_AGC_MAX_DECAY_STEP = 6.0;       /* max attenuation removed at once (dB) */
+static const uint32_t HF_AGC_DECAY_FRAMES = 64;        /* frames below target before decaying */
+
+static const int SWEEP_STOP_TIMEOUT = 1000;            /* ms for the events thread to close the sweep */
 
 
 /******************************
@@ -121,25 +228,79 @@ sddc_t *sddc_open(int index, const char* imagefile)
 {
   sddc_t *ret_val = 0;
 
+  log_start();
+
   usb_device_t *usb_device = usb_device_open(index, imagefile, 0);
   if (usb_device == 0) {
-    fprintf(stderr, "ERROR - usb_device_open() failed\n");
+    LOG_ERROR("usb_device_open() failed");
     goto FAIL0;
   }
   uint8_t data[4];
   int ret = usb_device_control(usb_device, TESTFX3, 0, 0, data, sizeof(data));
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(TESTFX3) failed\n");
+    LOG_ERROR("usb_device_control(TESTFX3) failed");
     goto FAIL1;
   }
 
   sddc_t *this = (sddc_t *) malloc(sizeof(sddc_t));
+  if (this == 0) {
+    LOG_ERROR("malloc() failed");
+    goto FAIL1;
+  }
   this->status = SDDC_STATUS_READY;
   this->model = (enum SDDCHWModel) data[0];
   this->firmware = (data[1] << 8) | data[2];
   this->rf_mode = HF_MODE;
   this->usb_device = usb_device;
+  this->control = 0;
+  this->handling_events = 0;
+  this->control_tags = control_tags_open();
+  this->tag_callback = 0;
+  this->tag_callback_context = 0;
   this->streaming = 0;
+  this->callback = 0;
+  this->callback_context = 0;
+  this->batch_callback = 0;
+  this->batch = 0;
+  this->batch_leases = 0;
+  this->max_batch = 0;
+  this->nbatch = 0;
+  this->sample_index = 0;
+  memset(&this->stream_stats, 0, sizeof(this->stream_stats));
+  this->detector = 0;
+  this->adc_stats = adc_stats_open();
+  this->hf_agc = 0;
+  this->hf_agc_target = DEFAULT_HF_AGC_TARGET;
+  this->hf_agc_hysteresis = DEFAULT_HF_AGC_HYSTERESIS;
+  this->hf_agc_low_frames = 0;
+  this->hf_agc_ticket = -1;
+  this->hf_agc_settled = 0;
+  this->recovery_ticket = -1;
+  this->vhf_bandwidth = 0;
+  this->ddc = 0;
+  this->iq_output = 0;
+  this->fs4 = 0;
+  this->output_sample_rate = 0;
+  this->streaming_backend = SDDC_BACKEND_LIBUSB;
+  this->resampler = 0;
+  this->sweep = 0;
+  this->sweep_stopping = 0;
+  this->subbands = 0;
+  this->nsubbands = 0;
+  this->subband_fft_size = 0;
+  this->subband_ntaps = 0;
+  this->subband_threads = 0;
+  this->subband_callback = 0;
+  this->subband_callback_context = 0;
+  this->subband_index = 0;
+  this->ols = 0;
+  this->pipeline = pipeline_open();
+  this->pipeline_running = 0;
+  this->spare_frames = 0;
+  this->lease_allowed = 0;
+  this->stall_warned = 0;
+  this->stall_callback = 0;
+  this->stall_callback_context = 0;
   switch (this->model) {
     case HW_BBRF103:
     case HW_RX888:
@@ -169,11 +330,41 @@ sddc_t *sddc_open(int index, const char* imagefile)
   this->tuner_frequency = DEFAULT_TUNER_FREQUENCY;     /* default tuner frequency */
   this->tuner_attenuation = DEFAULT_TUNER_ATTENUATION; /* default gain */
   this->tuner_clock = 0;                               /* tuner off */
+  this->tuner_if_frequency = DEFAULT_TUNER_IF_FREQUENCY; /* R82xx IF */
   this->freq_corr_ppm = DEFAULT_FREQ_CORR_PPM;         /* default frequency correction PPM */
 
+  if (this->control_tags == 0) {
+    LOG_ERROR("control_tags_open() failed");
+    goto FAIL2;
+  }
+  if (this->adc_stats == 0) {
+    LOG_ERROR("adc_stats_open() failed");
+    goto FAIL2;
+  }
+  if (this->pipeline == 0) {
+    LOG_ERROR("pipeline_open() failed");
+    goto FAIL2;
+  }
+  this->control = control_open(sddc_execute_control, this);
+  if (this->control == 0) {
+    LOG_ERROR("control_open() failed");
+    goto FAIL2;
+  }
+
   ret_val = this;
   return ret_val;
 
+FAIL2:
+  if (this->pipeline) {
+    pipeline_close(this->pipeline);
+  }
+  if (this->adc_stats) {
+    adc_stats_close(this->adc_stats);
+  }
+  if (this->control_tags) {
+    control_tags_close(this->control_tags);
+  }
+  free(this);
 FAIL1:
   usb_device_close(usb_device);
 FAIL0:
@@ -182,6 +373,37 @@ FAIL0:
 
 void sddc_close(sddc_t *this)
 {
+  /* stop first, since the frames still in flight use the modules below */
+  if (this->streaming) {
+    if (this->status == SDDC_STATUS_STREAMING) {
+      sddc_stop_streaming(this);
+    }
+    streaming_close(this->streaming);
+  }
+  /* the changes still queued are applied before the device goes away */
+  control_close(this->control);
+  control_tags_close(this->control_tags);
+  sddc_close_sweep(this);
+  if (this->detector) {
+    detector_close(this->detector);
+  }
+  adc_stats_close(this->adc_stats);
+  if (this->ddc) {
+    ddc_close(this->ddc);
+  }
+  if (this->fs4) {
+    fs4_close(this->fs4);
+  }
+  if (this->resampler) {
+    resampler_close(this->resampler);
+  }
+  if (this->ols) {
+    ols_close(this->ols);
+  }
+  free(this->subbands);
+  pipeline_close(this->pipeline);
+  free(this->batch);
+  free(this->batch_leases);
   usb_device_close(this->usb_device);
   free(this);
   return;
@@ -214,29 +436,31 @@ enum RFMode sddc_get_rf_mode(sddc_t *this)
 
 int sddc_set_rf_mode(sddc_t *this, enum RFMode rf_mode)
 {
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_RF_MODE, rf_mode);
+  }
   int ret;
   switch (rf_mode) {
     case HF_MODE:
       this->rf_mode = HF_MODE;
 
       /* stop tuner */
-      ret = usb_device_control(this->usb_device, R82XXSTDBY, 0, 0, 0, 0);
+      ret = sddc_tuner_standby(this);
       if (ret < 0) {
-        fprintf(stderr, "ERROR - usb_device_control(R82XXSTDBY) failed\n");
         return -1;
       }
 
       /* switch to HF input and restore hf attenuation */
       ret = sddc_set_hf_attenuation(this, this->hf_attenuation);
       if (ret < 0) {
-        fprintf(stderr, "ERROR - sddc_set_hf_attenuation() failed\n");
+        LOG_ERROR("sddc_set_hf_attenuation() failed");
         return -1;
       }
 
       break;
     case VHF_MODE:
       if (!this->has_vhf_tuner) {
-        fprintf(stderr, "WARNING - no VHF/UHF tuner found\n");
+        LOG_WARNING("no VHF/UHF tuner found");
         return -1;
       }
       this->rf_mode = VHF_MODE;
@@ -244,7 +468,7 @@ int sddc_set_rf_mode(sddc_t *this, enum RFMode rf_mode)
       /* switch to VHF input */
       ret = sddc_set_vhf_gpios(this);
       if (ret < 0) {
-        fprintf(stderr, "ERROR - sddc_set_vhf_gpios() failed\n");
+        LOG_ERROR("sddc_set_vhf_gpios() failed");
         return -1;
       }
 
@@ -255,13 +479,13 @@ int sddc_set_rf_mode(sddc_t *this, enum RFMode rf_mode)
       ret = usb_device_control(this->usb_device, R82XXINIT, 0, 0,
                                (uint8_t *) &data, sizeof(data));
       if (ret < 0) {
-        fprintf(stderr, "ERROR - usb_device_control(R82XXINIT) failed\n");
+        LOG_ERROR("usb_device_control(R82XXINIT) failed");
         return -1;
       }
 
       break;
     default:
-      fprintf(stderr, "WARNING - invalid RF mode: %d\n", rf_mode);
+      LOG_WARNING("invalid RF mode: %d", rf_mode);
       return -1;
   }
   return 0;
@@ -285,6 +509,16 @@ enum GPIOBits {
 static const uint16_t GPIO_LED_SHIFT = 10;
 
 
+/* internal controls, queued after the public ones */
+enum InternalControls {
+  CONTROL_TUNER_INIT = SDDC_CONTROL_VHF_BIAS + 1,
+  CONTROL_TUNER_STANDBY,
+  CONTROL_ADC_SHUTDOWN,
+  CONTROL_PRODUCER_STOP,
+  CONTROL_PRODUCER_START
+};
+
+
 enum FWRegAddresses {
   FW_REG_R82XX_ATTENUATOR = 0x01,  /* R8xx lna/mixer gain - range: 0-29 */
   FW_REG_R82XX_VGA        = 0x02,  /* R8xx vga gain - range: 0-15 */
@@ -301,8 +535,11 @@ enum FWRegAddresses {
  *****************/
 int sddc_led_on(sddc_t *this, uint8_t led_pattern)
 {
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_LED_ON, led_pattern);
+  }
   if (led_pattern & ~(LED_YELLOW | LED_RED | LED_BLUE)) {
-    fprintf(stderr, "ERROR - invalid LED pattern: 0x%02x\n", led_pattern);
+    LOG_ERROR("invalid LED pattern: 0x%02x", led_pattern);
     return -1;
   }
   return usb_device_gpio_on(this->usb_device, (uint16_t) led_pattern << GPIO_LED_SHIFT);
@@ -310,8 +547,11 @@ int sddc_led_on(sddc_t *this, uint8_t led_pattern)
 
 int sddc_led_off(sddc_t *this, uint8_t led_pattern)
 {
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_LED_OFF, led_pattern);
+  }
   if (led_pattern & ~(LED_YELLOW | LED_RED | LED_BLUE)) {
-    fprintf(stderr, "ERROR - invalid LED pattern: 0x%02x\n", led_pattern);
+    LOG_ERROR("invalid LED pattern: 0x%02x", led_pattern);
     return -1;
   }
   return usb_device_gpio_off(this->usb_device, (uint16_t) led_pattern << GPIO_LED_SHIFT);
@@ -319,8 +559,11 @@ int sddc_led_off(sddc_t *this, uint8_t led_pattern)
 
 int sddc_led_toggle(sddc_t *this, uint8_t led_pattern)
 {
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_LED_TOGGLE, led_pattern);
+  }
   if (led_pattern & ~(LED_YELLOW | LED_RED | LED_BLUE)) {
-    fprintf(stderr, "ERROR - invalid LED pattern: 0x%02x\n", led_pattern);
+    LOG_ERROR("invalid LED pattern: 0x%02x", led_pattern);
     return -1;
   }
   return usb_device_gpio_toggle(this->usb_device, (uint16_t) led_pattern << GPIO_LED_SHIFT);
@@ -337,6 +580,9 @@ int sddc_get_adc_dither(sddc_t *this)
 
 int sddc_set_adc_dither(sddc_t *this, int dither)
 {
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_ADC_DITHER, dither);
+  }
   if (dither) {
     return usb_device_gpio_on(this->usb_device, GPIO_ADC_DITH);
   } else {
@@ -351,11 +597,19 @@ int sddc_get_adc_random(sddc_t *this)
 
 int sddc_set_adc_random(sddc_t *this, int random)
 {
-  if (random) {
-    return usb_device_gpio_on(this->usb_device, GPIO_ADC_RAND);
-  } else {
-    return usb_device_gpio_off(this->usb_device, GPIO_ADC_RAND);
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_ADC_RANDOM, random);
   }
+  int ret = random ? usb_device_gpio_on(this->usb_device, GPIO_ADC_RAND) :
+                     usb_device_gpio_off(this->usb_device, GPIO_ADC_RAND);
+  if (ret < 0) {
+    return ret;
+  }
+  /* the streaming layer removes it before the frames are shared */
+  if (this->streaming) {
+    streaming_set_random(this->streaming, random);
+  }
+  return ret;
 }
 
 
@@ -369,45 +623,10 @@ double sddc_get_hf_attenuation(sddc_t *this)
 
 int sddc_set_hf_attenuation(sddc_t *this, double attenuation)
 {
-  if (this->hf_attenuator_levels == 0) {
-    /* no attenuator */
-    return 0;
-  } else if (this->hf_attenuator_levels == 3) {
-    /* old style attenuator with just 0dB, 10dB, and 20Db */
-    uint16_t bit_pattern = 0;
-    switch ((int) attenuation) {
-      case 0:
-        bit_pattern = GPIO_ATT_SEL1;
-        break;
-      case 10:
-        bit_pattern = GPIO_ATT_SEL0 | GPIO_ATT_SEL1;
-        break;
-      case 20:
-        bit_pattern = GPIO_ATT_SEL0;
-        break;
-      default:
-        fprintf(stderr, "ERROR - invalid HF attenuation: %lf\n", attenuation);
-        return -1;
-    }
-    this->hf_attenuation = attenuation;
-    return usb_device_gpio_set(this->usb_device, bit_pattern,
-                               GPIO_ATT_SEL0 | GPIO_ATT_SEL1);
-  } else if (this->hf_attenuator_levels == 32) {
-    /* new style attenuator with 1dB increments */
-    if (attenuation < 0.0 || attenuation > this->hf_attenuator_levels - 1) {
-      fprintf(stderr, "ERROR - invalid HF attenuation: %lf\n", attenuation);
-      return -1;
-    }
-    this->hf_attenuation = attenuation;
-    uint16_t dat31_att = (this->hf_attenuator_levels - 1 - (int) attenuation);
-    return usb_device_set_fw_register(this->usb_device, FW_REG_DAT31_ATT,
-                                      dat31_att);
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_HF_ATTENUATION, attenuation);
   }
-
-  /* should never get here */
-  fprintf(stderr, "ERROR - invalid number of HF attenuator levels: %d\n",
-          this->hf_attenuator_levels);
-  return -1;
+  return sddc_apply_hf_attenuation(this, attenuation);
 }
 
 int sddc_get_hf_bias(sddc_t *this)
@@ -417,6 +636,9 @@ int sddc_get_hf_bias(sddc_t *this)
 
 int sddc_set_hf_bias(sddc_t *this, int bias)
 {
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_HF_BIAS, bias);
+  }
   if (bias) {
     return usb_device_gpio_on(this->usb_device, GPIO_BIAS_HF);
   } else {
@@ -424,6 +646,24 @@ int sddc_set_hf_bias(sddc_t *this, int bias)
   }
 }
 
+int sddc_get_hf_vga(sddc_t *this)
+{
+  return usb_device_get_fw_register(this->usb_device, FW_REG_AD8340_VGA);
+}
+
+int sddc_set_hf_vga(sddc_t *this, int vga)
+{
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_HF_VGA, vga);
+  }
+  if (vga < 0 || vga > 255) {
+    LOG_ERROR("invalid HF VGA value: %d", vga);
+    return -1;
+  }
+  return usb_device_set_fw_register(this->usb_device, FW_REG_AD8340_VGA,
+                                    (uint16_t) vga);
+}
+
 
 /*****************************************
  * VHF block and VHF/UHF tuner functions *
@@ -435,11 +675,18 @@ double sddc_get_tuner_frequency(sddc_t *this)
 
 int sddc_set_tuner_frequency(sddc_t *this, double frequency)
 {
+  if (sddc_queue_control(this)) {
+    if (this->sweep) {
+      LOG_ERROR("sddc_set_tuner_frequency() failed - sweep running");
+      return -1;
+    }
+    return sddc_run_control(this, SDDC_CONTROL_TUNER_FREQUENCY, frequency);
+  }
   uint64_t data = (uint64_t) frequency;
   int ret = usb_device_control(this->usb_device, R82XXTUNE, 0, 0,
                                (uint8_t *) &data, sizeof(data));
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(R82XXTUNE) failed\n");
+    LOG_ERROR("usb_device_control(R82XXTUNE) failed");
     return -1;
   }
   this->tuner_frequency = frequency;
@@ -470,6 +717,9 @@ double sddc_get_tuner_rf_attenuation(sddc_t *this)
 
 int sddc_set_tuner_rf_attenuation(sddc_t *this, double attenuation)
 {
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_TUNER_RF_ATTENUATION, attenuation);
+  }
   int rf_attenuation_table_size = sizeof(tuner_rf_attenuations_table) /
                                   sizeof(tuner_rf_attenuations_table[0]);
   uint16_t idx = 0;
@@ -485,12 +735,12 @@ int sddc_set_tuner_rf_attenuation(sddc_t *this, double attenuation)
   int ret = usb_device_set_fw_register(this->usb_device,
                                        FW_REG_R82XX_ATTENUATOR, idx);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_set_fw_register(FW_REG_R82XX_ATTENUATOR) failed\n");
+    LOG_ERROR("usb_device_set_fw_register(FW_REG_R82XX_ATTENUATOR) failed");
     return -1;
   }
 
-  fprintf(stderr, "INFO - RF tuner attenuation set to %.1f\n",
-          tuner_rf_attenuations_table[idx]);
+  LOG_INFO("RF tuner attenuation set to %.1f",
+           tuner_rf_attenuations_table[idx]);
   return 0;
 }
 
@@ -517,6 +767,9 @@ double sddc_get_tuner_if_attenuation(sddc_t *this)
 
 int sddc_set_tuner_if_attenuation(sddc_t *this, double attenuation)
 {
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_TUNER_IF_ATTENUATION, attenuation);
+  }
   int if_attenuation_table_size = sizeof(tuner_if_attenuations_table) /
                                   sizeof(tuner_if_attenuations_table[0]);
   uint16_t idx = 0;
@@ -531,12 +784,54 @@ int sddc_set_tuner_if_attenuation(sddc_t *this, double attenuation)
 
   int ret = usb_device_set_fw_register(this->usb_device, FW_REG_R82XX_VGA, idx);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_set_fw_register(FW_REG_R82XX_VGA) failed\n");
+    LOG_ERROR("usb_device_set_fw_register(FW_REG_R82XX_VGA) failed");
+    return -1;
+  }
+
+  LOG_INFO("IF tuner attenuation set to %.1f",
+           tuner_if_attenuations_table[idx]);
+  return 0;
+}
+
+double sddc_get_tuner_if_frequency(sddc_t *this)
+{
+  return this->tuner_if_frequency;
+}
+
+int sddc_set_tuner_if_frequency(sddc_t *this, double if_frequency)
+{
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_set_tuner_if_frequency() failed - device is streaming");
+    return -1;
+  }
+  if (if_frequency <= 0) {
+    LOG_ERROR("invalid tuner IF frequency: %lf", if_frequency);
     return -1;
   }
+  this->tuner_if_frequency = if_frequency;
+  return 0;
+}
+
+int sddc_get_tuner_sideband(sddc_t *this)
+{
+  return usb_device_get_fw_register(this->usb_device, FW_REG_R82XX_SIDEBAND);
+}
 
-  fprintf(stderr, "INFO - IF tuner attenuation set to %.1f\n",
-          tuner_if_attenuations_table[idx]);
+int sddc_set_tuner_sideband(sddc_t *this, int sideband)
+{
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_TUNER_SIDEBAND, sideband);
+  }
+  if (this->status == SDDC_STATUS_STREAMING && this->ddc) {
+    LOG_ERROR("sddc_set_tuner_sideband() failed - VHF baseband conversion is running");
+    return -1;
+  }
+  int ret = usb_device_set_fw_register(this->usb_device, FW_REG_R82XX_SIDEBAND,
+                                       sideband ? 1 : 0);
+  if (ret < 0) {
+    LOG_ERROR("usb_device_set_fw_register(FW_REG_R82XX_SIDEBAND) failed");
+    return -1;
+  }
   return 0;
 }
 
@@ -547,6 +842,9 @@ int sddc_get_vhf_bias(sddc_t *this)
 
 int sddc_set_vhf_bias(sddc_t *this, int bias)
 {
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, SDDC_CONTROL_VHF_BIAS, bias);
+  }
   if (bias) {
     return usb_device_gpio_on(this->usb_device, GPIO_BIAS_VHF);
   } else {
@@ -555,6 +853,77 @@ int sddc_set_vhf_bias(sddc_t *this, int bias)
 }
 
 
+/***************************
+ * control queue functions *
+ ***************************/
+int64_t sddc_submit_control(sddc_t *this, enum SDDCControl control,
+                            double value)
+{
+  if ((int) control < SDDC_CONTROL_RF_MODE ||
+      (int) control > SDDC_CONTROL_VHF_BIAS) {
+    LOG_ERROR("invalid control: %d", control);
+    return -1;
+  }
+  if (control == SDDC_CONTROL_TUNER_FREQUENCY && this->sweep) {
+    LOG_ERROR("sddc_submit_control() failed - sweep running");
+    return -1;
+  }
+  return control_submit(this->control, control, value);
+}
+
+int sddc_wait_control(sddc_t *this, int64_t ticket, int timeout)
+{
+  if (!usb_device_owns_events(this->usb_device)) {
+    return control_wait(this->control, ticket, timeout);
+  }
+
+  /* the streaming thread completes the transfers of the control thread,
+     so it handles the events while it waits - but not from within them */
+  if (this->handling_events) {
+    if (timeout != 0) {
+      LOG_WARNING("sddc_wait_control() cannot wait in a streaming callback");
+    }
+    return control_wait(this->control, ticket, 0);
+  }
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  double end = deadline.tv_sec + deadline.tv_nsec * 1e-9 + timeout * 1e-3;
+  for (;;) {
+    int ret = control_wait(this->control, ticket, 0);
+    if (ret != 1 || timeout == 0) {
+      return ret;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timeout > 0 && now.tv_sec + now.tv_nsec * 1e-9 >= end) {
+      return 1;
+    }
+    if (sddc_handle_events(this) < 0) {
+      LOG_ERROR("sddc_handle_events() failed");
+      return -1;
+    }
+  }
+}
+
+int sddc_set_control_tag_callback(sddc_t *this, sddc_control_tag_cb_t callback,
+                                  void *callback_context)
+{
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_set_control_tag_callback() failed - device is streaming");
+    return -1;
+  }
+  this->tag_callback = callback;
+  this->tag_callback_context = callback_context;
+  return 0;
+}
+
+int sddc_get_control_settle(sddc_t *this, enum SDDCControl control,
+                            struct sddc_control_settle *settle)
+{
+  return control_tags_get_settle(this->control_tags, control, settle);
+}
+
+
 /******************************
  * streaming related functions
  ******************************/
@@ -570,119 +939,323 @@ int sddc_set_async_params(sddc_t *this, uint32_t frame_size,
                            uint32_t num_frames, sddc_read_async_cb_t callback,
                            void *callback_context)
 {
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_set_async_params() failed - device is streaming");
+    return -1;
+  }
+
+  /* the user callback is invoked from sddc_read_async_callback(), after
+     any in-library processing of the frame; it can be 0 when the frames
+     are only consumed by the processing pipeline */
+  this->callback = callback;
+  this->callback_context = callback_context;
+  this->batch_callback = 0;
+
+  /* keep the existing buffers and transfers if the new geometry fits */
+  int usbfs = this->streaming_backend == SDDC_BACKEND_USBFS;
   if (this->streaming) {
-    fprintf(stderr, "ERROR - sddc_set_async_params() failed: streaming already configured\n");
+    if (streaming_is_usbfs(this->streaming) == usbfs &&
+        streaming_reconfigure(this->streaming, frame_size, num_frames,
+                              sddc_read_async_callback, this) == 0) {
+      goto SPARES;
+    }
+    streaming_close(this->streaming);
+    this->streaming = 0;
+  }
+
+  if (usbfs) {
+    this->streaming = streaming_open_usbfs(this->usb_device, frame_size,
+                                           num_frames,
+                                           sddc_read_async_callback,
+                                           this);
+    if (this->streaming == 0) {
+      LOG_ERROR("streaming_open_usbfs() failed");
+      return -1;
+    }
+  } else {
+    this->streaming = streaming_open_async(this->usb_device, frame_size,
+                                           num_frames,
+                                           sddc_read_async_callback,
+                                           this);
+    if (this->streaming == 0) {
+      LOG_ERROR("streaming_open_async() failed");
+      return -1;
+    }
+  }
+
+SPARES:
+  streaming_set_random(this->streaming, sddc_get_adc_random(this));
+  if (streaming_get_spare_frames(this->streaming) != this->spare_frames &&
+      streaming_set_spare_frames(this->streaming, this->spare_frames) < 0) {
+    LOG_ERROR("streaming_set_spare_frames() failed");
     return -1;
   }
+  return 0;
+}
 
-  this->streaming = streaming_open_async(this->usb_device, frame_size,
-                                         num_frames, callback,
-                                         callback_context);
-  if (this->streaming == 0) {
-    fprintf(stderr, "ERROR - streaming_open_async() failed\n");
+int sddc_set_async_batch_params(sddc_t *this, uint32_t frame_size,
+                                uint32_t num_frames, uint32_t max_batch,
+                                sddc_read_async_batch_cb_t callback,
+                                void *callback_context)
+{
+  if (callback == 0) {
+    LOG_ERROR("sddc_set_async_batch_params() failed - no callback");
+    return -1;
+  }
+  if (sddc_set_async_params(this, frame_size, num_frames, 0, 0) < 0) {
     return -1;
   }
 
+  /* the deferred transfers are out of the USB queue until the batch is
+     delivered - keep at least half of them in flight */
+  uint32_t limit = streaming_get_num_frames(this->streaming) / 2;
+  limit = limit > 0 ? limit : 1;
+  if (max_batch == 0 || max_batch > limit) {
+    max_batch = limit;
+  }
+  if (max_batch > this->max_batch) {
+    /* a buffer that did grow is kept - it is only larger than needed */
+    struct sddc_frame_iov *batch = (struct sddc_frame_iov *) realloc(this->batch, max_batch * sizeof(struct sddc_frame_iov));
+    if (batch == 0) {
+      LOG_ERROR("realloc() failed");
+      return -1;
+    }
+    this->batch = batch;
+    void **batch_leases = (void **) realloc(this->batch_leases, max_batch * sizeof(void *));
+    if (batch_leases == 0) {
+      LOG_ERROR("realloc() failed");
+      return -1;
+    }
+    this->batch_leases = batch_leases;
+  }
+  this->max_batch = max_batch;
+  this->nbatch = 0;
+  this->batch_callback = callback;
+  this->callback_context = callback_context;
+  return 0;
+}
+
+int sddc_set_streaming_backend(sddc_t *this, enum SDDCStreamingBackend backend)
+{
+  if (backend != SDDC_BACKEND_LIBUSB && backend != SDDC_BACKEND_USBFS) {
+    LOG_ERROR("invalid streaming backend: %d", backend);
+    return -1;
+  }
+#ifndef __linux__
+  if (backend == SDDC_BACKEND_USBFS) {
+    LOG_ERROR("the usbfs streaming backend is only available on Linux");
+    return -1;
+  }
+#endif
+  this->streaming_backend = backend;
   return 0;
 }
 
 int sddc_start_streaming(sddc_t *this)
 {
   if (this->status != SDDC_STATUS_READY) {
-    fprintf(stderr, "ERROR - sddc_start_streaming() called with SDR status not READY: %d\n", this->status);
+    LOG_ERROR("sddc_start_streaming() called with SDR status not READY: %d", this->status);
     return -1;
   }
 
-  /* ADC sampling frequency */
+  /* ADC sampling frequency - with the output resampler the ADC runs at
+     the nominal rate, and the frequency correction is applied digitally */
+  int resample = this->output_sample_rate > 0 && this->streaming &&
+                 (this->callback || this->batch_callback);
   double correction = 1e-6 * this->freq_corr_ppm * this->sample_rate;
-  uint32_t data = (uint32_t) (this->sample_rate + correction);
+  uint32_t data = (uint32_t) (this->sample_rate + (resample ? 0 : correction));
+  double clock_scale = resample ? 1.0 + 1e-6 * this->freq_corr_ppm : 1.0;
 
   int ret = usb_device_control(this->usb_device, STARTADC, 0, 0,
                                (uint8_t *) &data, sizeof(data));
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(STARTADC) failed\n");
+    LOG_ERROR("usb_device_control(STARTADC) failed");
     return -1;
   }
 
   /* initialize tuner */
   if (this->rf_mode == VHF_MODE) {
-    /* tuner reference frequency */
-    double correction = 1e-6 * this->freq_corr_ppm * TUNER_CLOCK;
-    uint32_t data = (uint32_t) (TUNER_CLOCK + correction);
+    ret = sddc_tuner_init(this);
+    if (ret < 0) {
+      goto FAIL0;
+    }
+  }
 
-    int ret = usb_device_control(this->usb_device, R82XXINIT, 0, 0,
-                                 (uint8_t *) &data, sizeof(data));
+  /* activity detector */
+  if (this->detector) {
+    ret = detector_set_sample_rate(this->detector, this->sample_rate);
     if (ret < 0) {
-      fprintf(stderr, "ERROR - usb_device_control(R82XXINIT) failed\n");
-      return -1;
+      LOG_ERROR("detector_set_sample_rate() failed");
+      goto FAIL0;
+    }
+    detector_reset(this->detector);
+  }
+  this->sample_index = 0;
+  memset(&this->stream_stats, 0, sizeof(this->stream_stats));
+  this->stall_warned = 0;
+  this->hf_agc_settled = 0;
+  this->recovery_ticket = -1;
+
+  /* VHF DDC, fs/4 converter, output resampler and sub-band filter bank */
+  if (sddc_open_dsp(this, resample, clock_scale) < 0) {
+    goto FAIL0;
+  }
+  this->subband_index = 0;
+
+  /* processing pipeline - the stages see the raw ADC frames */
+  if (this->streaming && pipeline_has_inputs(this->pipeline)) {
+    struct pipeline_format input = {
+      streaming_get_frame_size(this->streaming),
+      SDDC_FRAME_INT16,
+      this->sample_rate
+    };
+    ret = pipeline_start(this->pipeline, &input,
+                         streaming_get_num_frames(this->streaming) +
+                         streaming_get_spare_frames(this->streaming),
+                         sddc_pipeline_release, this);
+    if (ret < 0) {
+      LOG_ERROR("pipeline_start() failed");
+      goto FAIL0;
     }
+    this->pipeline_running = 1;
+  } else if (this->streaming && this->callback == 0 &&
+             this->batch_callback == 0 && this->ols == 0) {
+    LOG_ERROR("no streaming callback, pipeline or sub-band filter bank");
+    goto FAIL0;
   }
 
-  /* start async streaming */
+  /* start async streaming - from now on the control transfers complete
+     in the thread handling the events */
   if (this->streaming) {
+    usb_device_claim_events(this->usb_device);
+    control_tags_start(this->control_tags, this->sample_rate,
+                       (uint64_t) streaming_get_num_frames(this->streaming) *
+                       streaming_get_frame_size(this->streaming) / sizeof(int16_t));
     streaming_set_sample_rate(this->streaming, (uint32_t) this->sample_rate);
-    int ret = streaming_start(this->streaming);
+    ret = streaming_start(this->streaming);
     if (ret < 0) {
-      fprintf(stderr, "ERROR - streaming_start() failed\n");
-      return -1;
+      LOG_ERROR("streaming_start() failed");
+      goto FAIL1;
     }
   }
 
   /* start the producer */
   ret = usb_device_control(this->usb_device, STARTFX3, 0, 0, 0, 0);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(STARTFX3) failed\n");
-    return -1;
+    LOG_ERROR("usb_device_control(STARTFX3) failed");
+    goto FAIL1;
   }
 
   /* all good */
   this->status = SDDC_STATUS_STREAMING;
   return 0;
+
+FAIL1:
+  /* the transfers submitted so far are cancelled */
+  if (this->streaming) {
+    if (streaming_stop(this->streaming) < 0 ||
+        streaming_reset_status(this->streaming) < 0) {
+      LOG_ERROR("streaming_stop() failed");
+    }
+    control_tags_stop(this->control_tags);
+    usb_device_release_events(this->usb_device);
+  }
+  if (this->pipeline_running) {
+    pipeline_stop(this->pipeline);
+    this->pipeline_running = 0;
+  }
+FAIL0:
+  /* the ADC (and the tuner) are not left running */
+  if (this->rf_mode == VHF_MODE) {
+    sddc_tuner_standby(this);
+  }
+  sddc_adc_shutdown(this);
+  return -1;
 }
 
 int sddc_handle_events(sddc_t *this)
 {
-  return usb_device_handle_events(this->usb_device);
+  this->handling_events = 1;
+  int ret = usb_device_handle_events(this->usb_device);
+  /* the batch is the frames completed in this pass */
+  if (this->nbatch > 0) {
+    sddc_flush_batch(this);
+  }
+  if (this->streaming && streaming_needs_recovery(this->streaming)) {
+    if (sddc_recover_streaming(this) < 0) {
+      LOG_ERROR("sddc_recover_streaming() failed");
+      this->handling_events = 0;
+      return -1;
+    }
+  }
+  this->handling_events = 0;
+  /* out of the callbacks, so the sweep is not in use */
+  if (this->sweep_stopping) {
+    sddc_close_sweep(this);
+  }
+  return ret;
 }
 
 int sddc_stop_streaming(sddc_t *this)
 {
   if (this->status != SDDC_STATUS_STREAMING) {
-    fprintf(stderr, "ERROR - sddc_stop_streaming() called with SDR status not STREAMING: %d\n", this->status);
+    LOG_ERROR("sddc_stop_streaming() called with SDR status not STREAMING: %d", this->status);
     return -1;
   }
 
+  /* the changes queued so far are applied while still streaming */
+  sddc_drain_controls(this);
+
+  control_tags_stop(this->control_tags);
+
   /* stop the producer */
   int ret = usb_device_control(this->usb_device, STOPFX3, 0, 0, 0, 0);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(STOPFX3) failed\n");
+    LOG_ERROR("usb_device_control(STOPFX3) failed");
     return -1;
   }
 
+  /* hand over the last frames before their transfers are cancelled */
+  if (this->nbatch > 0) {
+    sddc_flush_batch(this);
+  }
+
+  /* the frames still queued in the pipeline are processed before it stops,
+     so that the transfers it holds are back before they are cancelled */
+  if (this->pipeline_running) {
+    pipeline_stop(this->pipeline);
+    this->pipeline_running = 0;
+  }
+
   /* stop async streaming */
   if (this->streaming) {
     int ret = streaming_stop(this->streaming);
     if (ret < 0) {
-      fprintf(stderr, "ERROR - streaming_stop() failed\n");
+      LOG_ERROR("streaming_stop() failed");
+      usb_device_release_events(this->usb_device);
       return -1;
     }
 
-    streaming_close(this->streaming);
+    /* the buffers and transfers are kept for the next start */
+    ret = streaming_reset_status(this->streaming);
+    usb_device_release_events(this->usb_device);
+    if (ret < 0) {
+      LOG_ERROR("streaming_reset_status() failed");
+      return -1;
+    }
   }
 
   /* stop tuner */
   if (this->rf_mode == VHF_MODE) {
-    int ret = usb_device_control(this->usb_device, R82XXSTDBY, 0, 0, 0, 0);
+    ret = sddc_tuner_standby(this);
     if (ret < 0) {
-      fprintf(stderr, "ERROR - usb_device_control(R82XXSTDBY) failed\n");
       return -1;
     }
   }
 
   /* stop ADC */
-  ret = usb_device_gpio_on(this->usb_device, GPIO_ADC_SHDN);
+  ret = sddc_adc_shutdown(this);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_gpio_on(ADC_SHDN) failed\n");
     return -1;
   }
 
@@ -693,9 +1266,12 @@ int sddc_stop_streaming(sddc_t *this)
 
 int sddc_reset_status(sddc_t *this)
 {
+  if (this->streaming == 0) {
+    return 0;
+  }
   int ret = streaming_reset_status(this->streaming);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - streaming_reset_status() failed\n");
+    LOG_ERROR("streaming_reset_status() failed");
     return -1;
   }
   return 0;
@@ -706,27 +1282,1106 @@ int sddc_read_sync(sddc_t *this, uint8_t *data, int length, int *transferred)
   return streaming_read_sync(this->streaming, data, length, transferred);
 }
 
+int sddc_get_stream_stats(sddc_t *this, struct sddc_stream_stats *stats)
+{
+  *stats = this->stream_stats;
+  stats->sample_index = this->sample_index;
+  stats->transfer_errors = this->streaming ?
+                           streaming_get_transfer_errors(this->streaming) : 0;
+  return 0;
+}
 
-/******************************
- * Misc functions
- ******************************/
-double sddc_get_frequency_correction(sddc_t *this)
+int sddc_set_spare_frames(sddc_t *this, uint32_t num_spare_frames)
 {
-  return this->freq_corr_ppm;
+  this->spare_frames = num_spare_frames;
+  if (this->streaming && this->status != SDDC_STATUS_STREAMING) {
+    return streaming_set_spare_frames(this->streaming, num_spare_frames);
+  }
+  return 0;
 }
 
-int sddc_set_frequency_correction(sddc_t *this, double correction)
+sddc_lease_t *sddc_lease_frame(sddc_t *this)
 {
-  if (this->status == SDDC_STATUS_STREAMING) {
-    fprintf(stderr, "ERROR - sddc_set_frequency_correction() failed - device is streaming\n");
-    return -1;
+  if (!this->lease_allowed) {
+    LOG_ERROR("sddc_lease_frame() called outside the callback of a raw ADC frame");
+    return 0;
   }
-  this->freq_corr_ppm = correction;
+  int stall;
+  void *lease = streaming_lease_frame(this->streaming, &stall);
+  if (stall) {
+    sddc_signal_stall(this);
+  }
+  return (sddc_lease_t *) lease;
+}
+
+void sddc_release_frame(sddc_t *this, sddc_lease_t *lease)
+{
+  streaming_release_frame(this->streaming, lease);
+  return;
+}
+
+int sddc_get_lease_stats(sddc_t *this, struct sddc_lease_stats *stats)
+{
+  if (this->streaming == 0) {
+    memset(stats, 0, sizeof(*stats));
+    return 0;
+  }
+  streaming_get_lease_stats(this->streaming, stats);
+  return 0;
+}
+
+int sddc_set_stall_callback(sddc_t *this, sddc_stall_cb_t callback,
+                            void *callback_context)
+{
+  this->stall_callback = callback;
+  this->stall_callback_context = callback_context;
   return 0;
 }
 
 
-/* internal functions */
+/******************************
+ * VHF baseband functions
+ ******************************/
+int sddc_set_vhf_baseband(sddc_t *this, double bandwidth)
+{
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_set_vhf_baseband() failed - device is streaming");
+    return -1;
+  }
+  if (bandwidth < 0 || bandwidth / 2 > this->tuner_if_frequency) {
+    LOG_ERROR("invalid VHF baseband bandwidth: %lf", bandwidth);
+    return -1;
+  }
+  this->vhf_bandwidth = bandwidth;
+  return 0;
+}
+
+double sddc_get_vhf_baseband_sample_rate(sddc_t *this)
+{
+  if (this->vhf_bandwidth == 0) {
+    return this->sample_rate;
+  }
+  return this->sample_rate / ddc_decimation(this->sample_rate, this->vhf_bandwidth);
+}
+
+
+/******************************
+ * I/Q output functions
+ ******************************/
+int sddc_set_iq_output(sddc_t *this, int enable)
+{
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_set_iq_output() failed - device is streaming");
+    return -1;
+  }
+  this->iq_output = enable != 0;
+  return 0;
+}
+
+int sddc_get_iq_output(sddc_t *this)
+{
+  return this->iq_output;
+}
+
+
+/******************************
+ * output resampler functions
+ ******************************/
+int sddc_set_output_sample_rate(sddc_t *this, double sample_rate)
+{
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_set_output_sample_rate() failed - device is streaming");
+    return -1;
+  }
+  if (sample_rate < 0) {
+    LOG_ERROR("invalid output sample rate: %lf", sample_rate);
+    return -1;
+  }
+  this->output_sample_rate = sample_rate;
+  return 0;
+}
+
+double sddc_get_output_sample_rate(sddc_t *this)
+{
+  return this->output_sample_rate;
+}
+
+
+/******************************
+ * frequency sweep functions
+ ******************************/
+int sddc_start_sweep(sddc_t *this, const double *frequencies, uint32_t nsteps,
+                     double span, double dwell, double settle,
+                     uint32_t fft_size, sddc_sweep_cb_t callback,
+                     void *callback_context)
+{
+  if (this->rf_mode != VHF_MODE) {
+    LOG_ERROR("sddc_start_sweep() failed - RF mode is not VHF");
+    return -1;
+  }
+  if (this->sweep) {
+    LOG_ERROR("sddc_start_sweep() failed - sweep already running");
+    return -1;
+  }
+
+  int inverted = sddc_get_tuner_sideband(this) == 0;
+  sweep_t *sweep = sweep_open(this->control, this->control_tags,
+                              this->sample_rate,
+                              this->tuner_if_frequency, inverted, frequencies,
+                              nsteps, span, dwell, settle, fft_size, callback,
+                              callback_context);
+  if (sweep == 0) {
+    LOG_ERROR("sweep_open() failed");
+    return -1;
+  }
+
+  int ret = sweep_start(sweep);
+  if (ret < 0) {
+    LOG_ERROR("sweep_start() failed");
+    sweep_close(sweep);
+    return -1;
+  }
+  this->sweep = sweep;
+  return 0;
+}
+
+/* the sweep is closed by the thread handling the events once it is out
+   of the callbacks, and the tuner stays on the last frequency it queued */
+int sddc_stop_sweep(sddc_t *this)
+{
+  if (this->sweep == 0) {
+    return 0;
+  }
+  this->sweep_stopping = 1;
+
+  if (usb_device_owns_events(this->usb_device)) {
+    /* from a callback the sweep may be on the stack */
+    if (!this->handling_events) {
+      sddc_close_sweep(this);
+    }
+    return 0;
+  }
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  double end = deadline.tv_sec + deadline.tv_nsec * 1e-9 +
+               SWEEP_STOP_TIMEOUT * 1e-3;
+  while (this->sweep && this->status == SDDC_STATUS_STREAMING) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec + now.tv_nsec * 1e-9 >= end) {
+      /* still stopping - the events thread closes it when it gets there */
+      LOG_ERROR("sddc_stop_sweep() timed out - no thread handling the events");
+      return -1;
+    }
+    struct timespec delay = { 0, 1000000L };
+    nanosleep(&delay, 0);
+  }
+  /* not streaming - nobody else is using it */
+  if (this->sweep) {
+    sddc_close_sweep(this);
+  }
+  return 0;
+}
+
+
+/******************************
+ * activity detector functions
+ ******************************/
+int sddc_set_activity_detector(sddc_t *this, uint32_t block_size,
+                               const struct sddc_detector_band *bands,
+                               int nbands, double on_threshold,
+                               double off_threshold,
+                               sddc_activity_cb_t callback,
+                               void *callback_context)
+{
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_set_activity_detector() failed - device is streaming");
+    return -1;
+  }
+
+  detector_t *detector = detector_open(this->sample_rate, block_size, bands,
+                                       nbands, on_threshold, off_threshold,
+                                       callback, callback_context);
+  if (detector == 0) {
+    LOG_ERROR("detector_open() failed");
+    return -1;
+  }
+
+  if (this->detector) {
+    detector_close(this->detector);
+  }
+  this->detector = detector;
+  return 0;
+}
+
+int sddc_clear_activity_detector(sddc_t *this)
+{
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_clear_activity_detector() failed - device is streaming");
+    return -1;
+  }
+
+  if (this->detector) {
+    detector_close(this->detector);
+    this->detector = 0;
+  }
+  return 0;
+}
+
+
+/*********************************
+ * sub-band filter bank functions
+ *********************************/
+int sddc_set_subbands(sddc_t *this, const struct sddc_subband *bands,
+                      uint32_t nbands, uint32_t fft_size, uint32_t ntaps,
+                      int num_threads, sddc_subband_cb_t callback,
+                      void *callback_context)
+{
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_set_subbands() failed - device is streaming");
+    return -1;
+  }
+
+  /* the filter bank is opened again at the next start */
+  if (this->ols) {
+    ols_close(this->ols);
+    this->ols = 0;
+  }
+  if (nbands == 0) {
+    free(this->subbands);
+    this->subbands = 0;
+    this->nsubbands = 0;
+    return 0;
+  }
+  if (ols_check_params(this->sample_rate, fft_size, ntaps, bands, nbands) < 0 ||
+      num_threads < 1 || callback == 0) {
+    LOG_ERROR("invalid sub-band filter bank parameters");
+    return -1;
+  }
+
+  struct sddc_subband *subbands = (struct sddc_subband *)
+                                  malloc(nbands * sizeof(struct sddc_subband));
+  if (subbands == 0) {
+    LOG_ERROR("malloc() failed");
+    return -1;
+  }
+  memcpy(subbands, bands, nbands * sizeof(struct sddc_subband));
+  free(this->subbands);
+  this->subbands = subbands;
+  this->nsubbands = nbands;
+  this->subband_fft_size = fft_size;
+  this->subband_ntaps = ntaps;
+  this->subband_threads = num_threads;
+  this->subband_callback = callback;
+  this->subband_callback_context = callback_context;
+  return 0;
+}
+
+double sddc_get_subband_sample_rate(sddc_t *this, uint32_t band)
+{
+  if (band >= this->nsubbands) {
+    LOG_ERROR("invalid sub-band: %u", band);
+    return 0.0;
+  }
+  return this->sample_rate /
+         ols_decimation(this->sample_rate, this->subband_fft_size,
+                        this->subband_ntaps, this->subbands[band].bandwidth);
+}
+
+double sddc_get_subband_frequency(sddc_t *this, uint32_t band)
+{
+  if (band >= this->nsubbands) {
+    LOG_ERROR("invalid sub-band: %u", band);
+    return 0.0;
+  }
+  return ols_center_frequency(this->sample_rate, this->subband_fft_size,
+                              this->subbands[band].frequency);
+}
+
+static void sddc_process_subbands(sddc_t *this, const int16_t *samples,
+                                  uint32_t nsamples)
+{
+  if (ols_process(this->ols, samples, nsamples) == 0) {
+    return;
+  }
+  for (uint32_t i = 0; i < this->nsubbands; ++i) {
+    float *output;
+    uint64_t index;
+    uint32_t noutput = ols_get_output(this->ols, i, &output, &index);
+    this->subband_callback(i, output, noutput, this->subband_index + index,
+                           this->subband_callback_context);
+  }
+  return;
+}
+
+
+/***************************************
+ * ADC statistics and HF AGC functions
+ ***************************************/
+int sddc_get_adc_stats(sddc_t *this, struct sddc_adc_stats *stats)
+{
+  adc_stats_get(this->adc_stats, stats);
+  return 0;
+}
+
+int sddc_reset_adc_stats(sddc_t *this)
+{
+  adc_stats_reset(this->adc_stats);
+  return 0;
+}
+
+int sddc_get_hf_agc(sddc_t *this)
+{
+  return this->hf_agc;
+}
+
+int sddc_set_hf_agc(sddc_t *this, int enable, double target_peak,
+                    double hysteresis)
+{
+  if (enable && this->hf_attenuator_levels == 0) {
+    LOG_WARNING("no HF attenuator found");
+    return -1;
+  }
+  if (target_peak > 0.0 || hysteresis < 0.0) {
+    LOG_ERROR("invalid HF AGC parameters: target_peak=%lf hysteresis=%lf",
+              target_peak, hysteresis);
+    return -1;
+  }
+  this->hf_agc_target = target_peak;
+  this->hf_agc_hysteresis = hysteresis;
+  this->hf_agc_low_frames = 0;
+  this->hf_agc = enable;
+  return 0;
+}
+
+
+/******************************
+ * processing pipeline functions
+ ******************************/
+int sddc_pipeline_set_threads(sddc_t *this, int num_threads)
+{
+  return pipeline_set_threads(this->pipeline, num_threads);
+}
+
+sddc_stage_t *sddc_pipeline_add_stage(sddc_t *this, const char *name,
+                                      sddc_stage_cb_t callback, void *context,
+                                      enum SDDCStageFlags flags,
+                                      uint32_t queue_size,
+                                      uint32_t output_size,
+                                      enum SDDCFrameFormat output_format)
+{
+  return pipeline_add_stage(this->pipeline, name, callback, context, 0, flags,
+                            queue_size, output_size, output_format);
+}
+
+int sddc_pipeline_connect(sddc_t *this, sddc_stage_t *from, sddc_stage_t *to)
+{
+  return pipeline_connect(this->pipeline, from, to);
+}
+
+int sddc_pipeline_clear(sddc_t *this)
+{
+  if (this->pipeline_running) {
+    LOG_ERROR("sddc_pipeline_clear() failed - device is streaming");
+    return -1;
+  }
+  pipeline_close(this->pipeline);
+  this->pipeline = pipeline_open();
+  return 0;
+}
+
+sddc_stage_t *sddc_pipeline_add_convert(sddc_t *this)
+{
+  return pipeline_add_convert(this->pipeline);
+}
+
+sddc_stage_t *sddc_pipeline_add_ddc(sddc_t *this, double center_frequency,
+                                    double bandwidth)
+{
+  return pipeline_add_ddc(this->pipeline, center_frequency, bandwidth);
+}
+
+sddc_stage_t *sddc_pipeline_add_fft(sddc_t *this, uint32_t fft_size)
+{
+  return pipeline_add_fft(this->pipeline, fft_size);
+}
+
+sddc_stage_t *sddc_pipeline_add_record(sddc_t *this, int fd)
+{
+  return pipeline_add_record(this->pipeline, fd);
+}
+
+sddc_stage_t *sddc_pipeline_add_history(sddc_t *this, sddc_history_t *history,
+                                        double interval)
+{
+  return pipeline_add_history(this->pipeline, history, interval);
+}
+
+
+/******************************
+ * Misc functions
+ ******************************/
+int sddc_set_log_level(enum SDDCLogLevel level)
+{
+  if (level < SDDC_LOG_ERROR || level > SDDC_LOG_DEBUG) {
+    LOG_ERROR("sddc_set_log_level() failed - invalid level %d", level);
+    return -1;
+  }
+  log_set_level(level);
+  return 0;
+}
+
+int sddc_set_log_sink(sddc_log_cb_t sink, void *context)
+{
+  log_set_sink(sink, context);
+  return 0;
+}
+
+void sddc_flush_log()
+{
+  log_flush();
+  return;
+}
+
+int sddc_trace_dump(const char *filename)
+{
+  return trace_dump(filename);
+}
+
+int sddc_trace_reset()
+{
+  trace_reset();
+  return 0;
+}
+
+double sddc_get_frequency_correction(sddc_t *this)
+{
+  return this->freq_corr_ppm;
+}
+
+int sddc_set_frequency_correction(sddc_t *this, double correction)
+{
+  if (this->status == SDDC_STATUS_STREAMING) {
+    LOG_ERROR("sddc_set_frequency_correction() failed - device is streaming");
+    return -1;
+  }
+  this->freq_corr_ppm = correction;
+  return 0;
+}
+
+
+/* internal functions */
+/* streaming callback - runs the in-library processing on each frame and
+   then hands it over to the user callback */
+static void sddc_read_async_callback(uint32_t data_size, uint8_t *data,
+                                     void *context)
+{
+  sddc_t *this = (sddc_t *) context;
+  const int16_t *samples = (const int16_t *) data;
+  uint32_t nsamples = data_size / sizeof(int16_t);
+  uint64_t sample_index = this->sample_index;
+
+  /* the pipeline leases the USB buffer until its stages are done */
+  void *lease = 0;
+  if (this->pipeline_running) {
+    int stall;
+    lease = streaming_lease_frame(this->streaming, &stall);
+    if (lease) {
+      /* plus a reference for the rest of this callback - the stages may
+         be done with the frame before it returns */
+      streaming_ref_frame(this->streaming, lease);
+      pipeline_push(this->pipeline, data, data_size, this->sample_index, lease);
+    } else {
+      pipeline_drop(this->pipeline);
+    }
+    if (stall) {
+      sddc_signal_stall(this);
+    }
+  }
+
+  /* the control changes that may affect this frame go first */
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  const struct sddc_control_tag *tags;
+  uint32_t ntags = control_tags_frame(this->control_tags, samples, nsamples,
+                                      sample_index, &now, &tags);
+  if (ntags > 0 && this->tag_callback) {
+    this->tag_callback(tags, ntags, this->tag_callback_context);
+  }
+
+  struct adc_frame_stats frame_stats;
+  adc_stats_compute(samples, nsamples, &frame_stats);
+  adc_stats_update(this->adc_stats, &frame_stats);
+  if (this->hf_agc) {
+    sddc_hf_agc_update(this, &frame_stats, sample_index);
+  }
+
+  if (this->detector) {
+    detector_process(this->detector, samples, nsamples, this->sample_index);
+  }
+
+  if (this->sweep && !this->sweep_stopping) {
+    sweep_process(this->sweep, samples, nsamples, this->sample_index);
+  }
+
+  if (this->ols) {
+    sddc_process_subbands(this, samples, nsamples);
+  }
+  this->sample_index += nsamples;
+
+  if (this->callback == 0 && this->batch_callback == 0) {
+    goto DONE;
+  }
+
+  if (this->ddc || this->fs4) {
+    float *output;
+    uint32_t noutput = this->ddc ?
+                       ddc_process(this->ddc, samples, nsamples, &output) :
+                       fs4_process(this->fs4, samples, nsamples, &output);
+    if (this->resampler) {
+      noutput = resampler_process(this->resampler, output, noutput, &output);
+    }
+    if (this->batch_callback) {
+      struct sddc_frame_iov frame = { (uint8_t *) output,
+                                      noutput * 2 * sizeof(float),
+                                      sample_index };
+      this->batch_callback(&frame, 1, this->callback_context);
+      goto DONE;
+    }
+    this->callback(noutput * 2 * sizeof(float), (uint8_t *) output,
+                   this->callback_context);
+    goto DONE;
+  }
+
+  if (this->resampler) {
+    float *output;
+    uint32_t noutput = resampler_process_int16(this->resampler, samples,
+                                               nsamples, &output);
+    if (this->batch_callback) {
+      struct sddc_frame_iov frame = { (uint8_t *) output,
+                                      noutput * sizeof(float),
+                                      sample_index };
+      this->batch_callback(&frame, 1, this->callback_context);
+      goto DONE;
+    }
+    this->callback(noutput * sizeof(float), (uint8_t *) output,
+                   this->callback_context);
+    goto DONE;
+  }
+
+  if (this->batch_callback) {
+    /* the batch takes over the reference */
+    sddc_deliver_batch(this, data_size, data, sample_index, lease);
+    return;
+  }
+
+  this->lease_allowed = 1;
+  this->callback(data_size, data, this->callback_context);
+  this->lease_allowed = 0;
+
+DONE:
+  if (lease) {
+    streaming_release_frame(this->streaming, lease);
+  }
+  return;
+}
+
+/* adds a raw ADC frame to the batch; its buffer must stay put until the
+   batch is delivered: if the pipeline leased it, by keeping a reference
+   to the lease, otherwise by deferring the resubmit of its transfer */
+static void sddc_deliver_batch(sddc_t *this, uint32_t data_size,
+                               uint8_t *data, uint64_t sample_index,
+                               void *lease)
+{
+  if (this->nbatch == this->max_batch) {
+    sddc_flush_batch(this);
+  }
+  if (lease == 0) {
+    streaming_defer_frame(this->streaming);
+  }
+  struct sddc_frame_iov *frame = &this->batch[this->nbatch];
+  frame->data = data;
+  frame->size = data_size;
+  frame->sample_index = sample_index;
+  this->batch_leases[this->nbatch] = lease;
+  this->nbatch++;
+  return;
+}
+
+static void sddc_flush_batch(sddc_t *this)
+{
+  this->batch_callback(this->batch, this->nbatch, this->callback_context);
+  for (uint32_t i = 0; i < this->nbatch; ++i) {
+    if (this->batch_leases[i]) {
+      streaming_release_frame(this->streaming, this->batch_leases[i]);
+    }
+  }
+  this->nbatch = 0;
+  streaming_flush_deferred(this->streaming);
+  return;
+}
+
+/* the last reference to a frame held by the pipeline is gone */
+static void sddc_pipeline_release(void *token, void *context)
+{
+  sddc_t *this = (sddc_t *) context;
+  streaming_release_frame(this->streaming, token);
+  return;
+}
+
+/* consumers hold too many frames - warn once per stream */
+static void sddc_signal_stall(sddc_t *this)
+{
+  struct sddc_lease_stats stats;
+  streaming_get_lease_stats(this->streaming, &stats);
+  if (!this->stall_warned) {
+    LOG_WARNING("frame leases are stalling the stream: %u frames leased, %u spare frames",
+                stats.leased, stats.spare_frames);
+    this->stall_warned = 1;
+  }
+  if (this->stall_callback) {
+    this->stall_callback(&stats, this->stall_callback_context);
+  }
+  return;
+}
+
+/* in place recovery after a transfer error, over two passes of the events
+   loop: the producer stop is queued to the control thread (waiting for it
+   here would block the events that complete it); once it is done, the
+   filter state and the sample index are moved past the gap before the
+   existing transfers are resubmitted, and the producer start is queued */
+static int sddc_recover_streaming(sddc_t *this)
+{
+  if (this->recovery_ticket < 0) {
+    this->recovery_ticket = control_submit(this->control,
+                                           CONTROL_PRODUCER_STOP, 0);
+    if (this->recovery_ticket < 0) {
+      LOG_ERROR("control_submit(PRODUCER_STOP) failed");
+      return -1;
+    }
+    return 0;
+  }
+  int ret = control_wait(this->control, this->recovery_ticket, 0);
+  if (ret == 1) {
+    return 0;
+  }
+  this->recovery_ticket = -1;
+  if (ret < 0) {
+    LOG_ERROR("usb_device_control(STOPFX3) failed");
+    return -1;
+  }
+
+  /* filter and detector state from before the gap is stale */
+  if (this->ddc) {
+    ddc_reset(this->ddc);
+  }
+  if (this->fs4) {
+    fs4_reset(this->fs4);
+  }
+  if (this->resampler) {
+    resampler_reset(this->resampler);
+  }
+  if (this->ols) {
+    ols_reset(this->ols);
+  }
+  if (this->detector) {
+    detector_reset(this->detector);
+  }
+
+  double outage = streaming_get_outage(this->streaming);
+  uint64_t gap = (uint64_t) (outage * this->sample_rate + 0.5);
+  struct sddc_stream_stats *stats = &this->stream_stats;
+  stats->recoveries++;
+  stats->gap_samples += gap;
+  stats->last_gap_sample_index = this->sample_index;
+  stats->last_gap_samples = gap;
+  stats->last_outage = outage;
+  this->sample_index += gap;
+  this->subband_index = this->sample_index;
+
+  ret = streaming_recover(this->streaming);
+  if (ret < 0) {
+    LOG_ERROR("streaming_recover() failed");
+    return -1;
+  }
+
+  if (control_submit(this->control, CONTROL_PRODUCER_START, 0) < 0) {
+    LOG_ERROR("control_submit(PRODUCER_START) failed");
+    return -1;
+  }
+
+  LOG_WARNING("streaming recovered after %.1f ms - about %llu samples lost",
+              outage * 1e3, (unsigned long long) gap);
+  return 0;
+}
+
+static int sddc_apply_hf_attenuation(sddc_t *this, double attenuation)
+{
+  if (this->hf_attenuator_levels == 0) {
+    /* no attenuator */
+    return 0;
+  } else if (this->hf_attenuator_levels == 3) {
+    /* old style attenuator with just 0dB, 10dB, and 20Db */
+    uint16_t bit_pattern = 0;
+    switch ((int) attenuation) {
+      case 0:
+        bit_pattern = GPIO_ATT_SEL1;
+        break;
+      case 10:
+        bit_pattern = GPIO_ATT_SEL0 | GPIO_ATT_SEL1;
+        break;
+      case 20:
+        bit_pattern = GPIO_ATT_SEL0;
+        break;
+      default:
+        LOG_ERROR("invalid HF attenuation: %lf", attenuation);
+        return -1;
+    }
+    this->hf_attenuation = attenuation;
+    return usb_device_gpio_set(this->usb_device, bit_pattern,
+                               GPIO_ATT_SEL0 | GPIO_ATT_SEL1);
+  } else if (this->hf_attenuator_levels == 32) {
+    /* new style attenuator with 1dB increments */
+    if (attenuation < 0.0 || attenuation > this->hf_attenuator_levels - 1) {
+      LOG_ERROR("invalid HF attenuation: %lf", attenuation);
+      return -1;
+    }
+    this->hf_attenuation = attenuation;
+    uint16_t dat31_att = (this->hf_attenuator_levels - 1 - (int) attenuation);
+    return usb_device_set_fw_register(this->usb_device, FW_REG_DAT31_ATT,
+                                      dat31_att);
+  }
+
+  /* should never get here */
+  LOG_ERROR("invalid number of HF attenuator levels: %d",
+            this->hf_attenuator_levels);
+  return -1;
+}
+
+/* HF AGC - fast attack when the ADC clips or the peak is above the target
+   window, slow decay once the peak has been below it for a while; the new
+   attenuation is queued to the control thread, since we are called from
+   within the streaming callback. sample_index is that of the frame */
+static void sddc_hf_agc_update(sddc_t *this,
+                               const struct adc_frame_stats *frame_stats,
+                               uint64_t sample_index)
+{
+  if (this->rf_mode != HF_MODE || this->hf_attenuator_levels == 0) {
+    return;
+  }
+
+  /* wait for the previous change to be applied, and then for the frames
+     captured before it (those still in the USB transfers) to go by */
+  if (this->hf_agc_ticket >= 0) {
+    if (control_wait(this->control, this->hf_agc_ticket, 0) == 1) {
+      return;
+    }
+    this->hf_agc_ticket = -1;
+    this->hf_agc_settled = sample_index + frame_stats->nsamples +
+                           control_tags_settle_samples(this->control_tags,
+                                                       SDDC_CONTROL_HF_ATTENUATION);
+  }
+  if (sample_index < this->hf_agc_settled) {
+    return;
+  }
+
+  double peak = adc_stats_peak_dbfs(frame_stats);
+  double delta;
+  if (frame_stats->full_scale > 0) {
+    delta = HF_AGC_CLIP_STEP;
+    this->hf_agc_low_frames = 0;
+  } else if (peak > this->hf_agc_target + this->hf_agc_hysteresis) {
+    delta = peak - this->hf_agc_target;
+    this->hf_agc_low_frames = 0;
+  } else if (peak < this->hf_agc_target - this->hf_agc_hysteresis) {
+    if (++this->hf_agc_low_frames < HF_AGC_DECAY_FRAMES) {
+      return;
+    }
+    this->hf_agc_low_frames = 0;
+    delta = peak - this->hf_agc_target;
+    delta = delta < -HF_AGC_MAX_DECAY_STEP ? -HF_AGC_MAX_DECAY_STEP : delta;
+  } else {
+    this->hf_agc_low_frames = 0;
+    return;
+  }
+
+  /* round up when attenuating, and only remove whole steps when decaying */
+  double step = this->hf_attenuator_levels == 3 ? 10.0 : 1.0;
+  double max_attenuation = this->hf_attenuator_levels == 3 ? 20.0 :
+                           this->hf_attenuator_levels - 1;
+  double steps = delta > 0 ? ceil(delta / step) : trunc(delta / step);
+  double attenuation = this->hf_attenuation + step * steps;
+  attenuation = attenuation < 0.0 ? 0.0 : attenuation;
+  attenuation = attenuation > max_attenuation ? max_attenuation : attenuation;
+  if (attenuation == this->hf_attenuation) {
+    return;
+  }
+
+  this->hf_agc_ticket = control_submit(this->control,
+                                       SDDC_CONTROL_HF_ATTENUATION,
+                                       attenuation);
+  return;
+}
+
+/* the setters queue their change unless called by the control thread */
+static int sddc_queue_control(sddc_t *this)
+{
+  return !control_is_control_thread(this->control);
+}
+
+static int sddc_run_control(sddc_t *this, int control, double value)
+{
+  int64_t ticket = control_submit(this->control, control, value);
+  if (ticket < 0) {
+    return -1;
+  }
+  /* waiting here would block the events the change needs to complete */
+  if (usb_device_owns_events(this->usb_device) && this->handling_events) {
+    return SDDC_CONTROL_QUEUED;
+  }
+  return sddc_wait_control(this, ticket, -1);
+}
+
+/* runs on the control thread; the transfer times of the changes are
+   kept for their tags */
+static int sddc_execute_control(int64_t ticket, int type, double value,
+                                void *context)
+{
+  sddc_t *this = (sddc_t *) context;
+  struct timespec submit_time;
+  struct timespec complete_time;
+  clock_gettime(CLOCK_MONOTONIC, &submit_time);
+  int ret = sddc_apply_control(this, type, value);
+  clock_gettime(CLOCK_MONOTONIC, &complete_time);
+  control_tags_add(this->control_tags, (enum SDDCControl) type, value, ret,
+                   ticket, &submit_time, &complete_time);
+  return ret;
+}
+
+/* on the control thread the setters apply the change */
+static int sddc_apply_control(sddc_t *this, int control, double value)
+{
+  switch (control) {
+    case SDDC_CONTROL_RF_MODE:
+      return sddc_set_rf_mode(this, (enum RFMode) value);
+    case SDDC_CONTROL_LED_ON:
+      return sddc_led_on(this, (uint8_t) value);
+    case SDDC_CONTROL_LED_OFF:
+      return sddc_led_off(this, (uint8_t) value);
+    case SDDC_CONTROL_LED_TOGGLE:
+      return sddc_led_toggle(this, (uint8_t) value);
+    case SDDC_CONTROL_ADC_DITHER:
+      return sddc_set_adc_dither(this, (int) value);
+    case SDDC_CONTROL_ADC_RANDOM:
+      return sddc_set_adc_random(this, (int) value);
+    case SDDC_CONTROL_HF_ATTENUATION:
+      return sddc_set_hf_attenuation(this, value);
+    case SDDC_CONTROL_HF_BIAS:
+      return sddc_set_hf_bias(this, (int) value);
+    case SDDC_CONTROL_HF_VGA:
+      return sddc_set_hf_vga(this, (int) value);
+    case SDDC_CONTROL_TUNER_FREQUENCY:
+      return sddc_set_tuner_frequency(this, value);
+    case SDDC_CONTROL_TUNER_RF_ATTENUATION:
+      return sddc_set_tuner_rf_attenuation(this, value);
+    case SDDC_CONTROL_TUNER_IF_ATTENUATION:
+      return sddc_set_tuner_if_attenuation(this, value);
+    case SDDC_CONTROL_TUNER_SIDEBAND:
+      return sddc_set_tuner_sideband(this, (int) value);
+    case SDDC_CONTROL_VHF_BIAS:
+      return sddc_set_vhf_bias(this, (int) value);
+    case CONTROL_TUNER_INIT:
+      return sddc_tuner_init(this);
+    case CONTROL_TUNER_STANDBY:
+      return sddc_tuner_standby(this);
+    case CONTROL_ADC_SHUTDOWN:
+      return sddc_adc_shutdown(this);
+    case CONTROL_PRODUCER_STOP:
+      return usb_device_control(this->usb_device, STOPFX3, 0, 0, 0, 0);
+    case CONTROL_PRODUCER_START:
+      return usb_device_control(this->usb_device, STARTFX3, 0, 0, 0, 0);
+  }
+  LOG_ERROR("invalid control: %d", control);
+  return -1;
+}
+
+static void sddc_drain_controls(sddc_t *this)
+{
+  int64_t ticket = control_last_ticket(this->control);
+  if (ticket >= 0) {
+    sddc_wait_control(this, ticket, -1);
+  }
+  return;
+}
+
+/* the tuner and GPIO writes of the stream start and stop also go
+   through the control thread */
+static int sddc_tuner_init(sddc_t *this)
+{
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, CONTROL_TUNER_INIT, 0);
+  }
+  /* tuner reference frequency */
+  double correction = 1e-6 * this->freq_corr_ppm * TUNER_CLOCK;
+  uint32_t data = (uint32_t) (TUNER_CLOCK + correction);
+  int ret = usb_device_control(this->usb_device, R82XXINIT, 0, 0,
+                               (uint8_t *) &data, sizeof(data));
+  if (ret < 0) {
+    LOG_ERROR("usb_device_control(R82XXINIT) failed");
+    return -1;
+  }
+  return 0;
+}
+
+static int sddc_tuner_standby(sddc_t *this)
+{
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, CONTROL_TUNER_STANDBY, 0);
+  }
+  int ret = usb_device_control(this->usb_device, R82XXSTDBY, 0, 0, 0, 0);
+  if (ret < 0) {
+    LOG_ERROR("usb_device_control(R82XXSTDBY) failed");
+    return -1;
+  }
+  return 0;
+}
+
+static int sddc_adc_shutdown(sddc_t *this)
+{
+  if (sddc_queue_control(this)) {
+    return sddc_run_control(this, CONTROL_ADC_SHUTDOWN, 0);
+  }
+  int ret = usb_device_gpio_on(this->usb_device, GPIO_ADC_SHDN);
+  if (ret < 0) {
+    LOG_ERROR("usb_device_gpio_on(ADC_SHDN) failed");
+    return -1;
+  }
+  return 0;
+}
+
+/* the VHF DDC, the fs/4 converter, the output resampler and the sub-band
+   filter bank for a start; the ones from the last start are reset instead
+   of opened again when they are the same (opening the filter bank starts
+   its threads) */
+static int sddc_open_dsp(sddc_t *this, int resample, double clock_scale)
+{
+  uint32_t max_samples = this->streaming ?
+                         streaming_get_frame_size(this->streaming) / sizeof(int16_t) : 0;
+  int same = this->dsp_sample_rate == this->sample_rate &&
+             this->dsp_max_samples == max_samples;
+  this->dsp_sample_rate = this->sample_rate;
+  this->dsp_max_samples = max_samples;
+
+  /* VHF baseband conversion - with the lower sideband (the default) the
+     LO is above the RF, so the IF spectrum is inverted; the IF from the
+     (corrected) tuner is scaled to the ADC clock */
+  int use_ddc = this->rf_mode == VHF_MODE && this->vhf_bandwidth > 0 &&
+                this->streaming;
+  int inverted = sddc_get_tuner_sideband(this) == 0;
+  double if_frequency = this->tuner_if_frequency * clock_scale;
+  if (this->ddc && !(use_ddc && same &&
+                     this->ddc_if_frequency == if_frequency &&
+                     this->ddc_bandwidth == this->vhf_bandwidth &&
+                     this->ddc_inverted == inverted)) {
+    ddc_close(this->ddc);
+    this->ddc = 0;
+  }
+  if (this->ddc) {
+    ddc_reset(this->ddc);
+  } else if (use_ddc) {
+    this->ddc = ddc_open(this->sample_rate, if_frequency, this->vhf_bandwidth,
+                         inverted, max_samples);
+    if (this->ddc == 0) {
+      LOG_ERROR("ddc_open() failed");
+      return -1;
+    }
+    this->ddc_if_frequency = if_frequency;
+    this->ddc_bandwidth = this->vhf_bandwidth;
+    this->ddc_inverted = inverted;
+  }
+
+  /* full band I/Q at half the ADC rate */
+  int use_fs4 = this->iq_output && this->ddc == 0 && this->streaming;
+  if (this->fs4 && !(use_fs4 && same)) {
+    fs4_close(this->fs4);
+    this->fs4 = 0;
+  }
+  if (this->fs4) {
+    fs4_reset(this->fs4);
+  } else if (use_fs4) {
+    this->fs4 = fs4_open(max_samples);
+    if (this->fs4 == 0) {
+      LOG_ERROR("fs4_open() failed");
+      return -1;
+    }
+  }
+
+  /* output resampler */
+  uint32_t resampler_samples = max_samples;
+  double input_rate = this->sample_rate;
+  int channels = 1;
+  if (this->ddc) {
+    resampler_samples = max_samples / ddc_get_decimation(this->ddc) + 1;
+    input_rate = ddc_get_output_sample_rate(this->ddc);
+    channels = 2;
+  } else if (this->fs4) {
+    resampler_samples = max_samples / 2 + 1;
+    input_rate = this->sample_rate / 2;
+    channels = 2;
+  }
+  input_rate /= clock_scale;
+  if (this->resampler && !(resample && same &&
+                           this->resampler_input_rate == input_rate &&
+                           this->resampler_output_rate == this->output_sample_rate &&
+                           this->resampler_channels == channels)) {
+    resampler_close(this->resampler);
+    this->resampler = 0;
+  }
+  if (this->resampler) {
+    resampler_reset(this->resampler);
+  } else if (resample) {
+    this->resampler = resampler_open(input_rate, this->output_sample_rate,
+                                     channels, resampler_samples);
+    if (this->resampler == 0) {
+      LOG_ERROR("resampler_open() failed");
+      return -1;
+    }
+    this->resampler_input_rate = input_rate;
+    this->resampler_output_rate = this->output_sample_rate;
+    this->resampler_channels = channels;
+  }
+
+  /* sub-band filter bank - sddc_set_subbands() closes it */
+  int use_ols = this->nsubbands > 0 && this->streaming;
+  if (this->ols && !(use_ols && same)) {
+    ols_close(this->ols);
+    this->ols = 0;
+  }
+  if (this->ols) {
+    ols_reset(this->ols);
+  } else if (use_ols) {
+    this->ols = ols_open(this->sample_rate, this->subband_fft_size,
+                         this->subband_ntaps, this->subbands, this->nsubbands,
+                         this->subband_threads, max_samples);
+    if (this->ols == 0) {
+      LOG_ERROR("ols_open() failed");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void sddc_close_sweep(sddc_t *this)
+{
+  sweep_t *sweep = this->sweep;
+  this->sweep = 0;
+  this->sweep_stopping = 0;
+  if (sweep) {
+    sweep_close(sweep);
+  }
+  return;
+}
+
 /* helper method to configure GPIOs for VHF */
 int sddc_set_vhf_gpios(sddc_t* this) {
     return usb_device_gpio_set(this->usb_device, 0, GPIO_ATT_SEL0 | GPIO_ATT_SEL1);
@@ -19,29 +19,323 @@
  * SPDX-License-Identifier: GPL-3.0-or-later
  */
 
+/* References:
+ *  - D. Vyukov, bounded MPMC queue: https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
 #include <libusb.h>
 
 #include "logging.h"
 
 
-void log_error(const char *error_message, const char *function,
-               const char *file, int line) {
-  fprintf(stderr, "ERROR - %s in %s at %s:%d\n", error_message, function,
-          file, line);
-  return;
-}
+/* internal functions */
+static void log_init();
+static int log_rate_limit(const char *file, int line, uint32_t *suppressed);
+static struct log_record *log_reserve(enum SDDCLogLevel level,
+                                      const char *file, int line);
+static void log_commit(struct log_record *record);
+static void log_drain();
+static void *log_thread(void *arg);
+static void log_default_sink(enum SDDCLogLevel level, const char *message,
+                             void *context);
+
+
+enum LogRecordType {
+  LOG_RECORD_TEXT,
+  LOG_RECORD_USB_ERROR,
+  LOG_RECORD_USB_WARNING
+};
+
+/* records only hold pointers to static strings, except for formatted
+   messages, so queueing them is just a few stores */
+struct log_record {
+  atomic_size_t sequence;
+  enum SDDCLogLevel level;
+  enum LogRecordType type;
+  const char *function;
+  const char *file;
+  int line;
+  int usb_error_code;
+  uint32_t suppressed;
+#define LOG_TEXT_SIZE (256)
+  char text[LOG_TEXT_SIZE];
+};
+
+/* per call site rate limiting; sites are hashed by file and line, so a
+   rare collision just shares a budget */
+struct log_rate {
+  atomic_llong second;
+  atomic_uint count;
+  atomic_uint suppressed;
+};
+
+#define LOG_QUEUE_SIZE (1024)   /* must be a power of 2 */
+#define LOG_RATE_SITES (256)    /* must be a power of 2 */
+
+static const unsigned int LOG_RATE_LIMIT = 10;  /* per site per second */
+
+static struct log_record log_queue[LOG_QUEUE_SIZE];
+static atomic_size_t log_head;
+static size_t log_tail;
+static atomic_uint log_dropped;
+static struct log_rate log_rates[LOG_RATE_SITES];
+static atomic_int log_level = SDDC_LOG_INFO;
+static sddc_log_cb_t log_sink = log_default_sink;
+static void *log_sink_context = 0;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t log_consumer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sem_t log_semaphore;
+static atomic_int log_wakeup;           /* the log thread has been posted */
+static int log_threaded = 0;
+
 
 void log_usb_error(int usb_error_code, const char *function, const char *file,
                    int line) {
-  fprintf(stderr, "ERROR - USB error %s in %s at %s:%d\n",
-          libusb_error_name(usb_error_code), function, file, line);
+  struct log_record *record = log_reserve(SDDC_LOG_ERROR, file, line);
+  if (record == 0) {
+    return;
+  }
+  record->type = LOG_RECORD_USB_ERROR;
+  record->usb_error_code = usb_error_code;
+  record->function = function;
+  record->file = file;
+  record->line = line;
+  log_commit(record);
   return;
 }
 
 void log_usb_warning(int usb_error_code, const char *function, const char *file,
                      int line) {
-  fprintf(stderr, "WARNING - USB warning %s in %s at %s:%d\n",
-          libusb_error_name(usb_error_code), function, file, line);
+  struct log_record *record = log_reserve(SDDC_LOG_WARNING, file, line);
+  if (record == 0) {
+    return;
+  }
+  record->type = LOG_RECORD_USB_WARNING;
+  record->usb_error_code = usb_error_code;
+  record->function = function;
+  record->file = file;
+  record->line = line;
+  log_commit(record);
+  return;
+}
+
+void log_message(enum SDDCLogLevel level, const char *function,
+                 const char *file, int line, const char *format, ...) {
+  struct log_record *record = log_reserve(level, file, line);
+  if (record == 0) {
+    return;
+  }
+  record->type = LOG_RECORD_TEXT;
+  record->function = function;
+  record->file = file;
+  record->line = line;
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(record->text, sizeof(record->text), format, ap);
+  va_end(ap);
+  log_commit(record);
+  return;
+}
+
+void log_start() {
+  pthread_once(&log_once, log_init);
+  return;
+}
+
+void log_set_level(enum SDDCLogLevel level) {
+  atomic_store(&log_level, level);
+  return;
+}
+
+void log_set_sink(sddc_log_cb_t sink, void *context) {
+  /* drain what is queued to the old sink first */
+  pthread_once(&log_once, log_init);
+  pthread_mutex_lock(&log_consumer_mutex);
+  log_drain();
+  log_sink = sink ? sink : log_default_sink;
+  log_sink_context = sink ? context : 0;
+  pthread_mutex_unlock(&log_consumer_mutex);
+  return;
+}
+
+void log_flush() {
+  pthread_once(&log_once, log_init);
+  pthread_mutex_lock(&log_consumer_mutex);
+  log_drain();
+  pthread_mutex_unlock(&log_consumer_mutex);
+  return;
+}
+
+
+/* internal functions */
+static void log_init() {
+  for (size_t i = 0; i < LOG_QUEUE_SIZE; ++i) {
+    atomic_init(&log_queue[i].sequence, i);
+  }
+  atomic_init(&log_head, 0);
+  log_tail = 0;
+  atomic_init(&log_dropped, 0);
+  atomic_init(&log_wakeup, 0);
+
+  /* without a background thread the records are written out synchronously */
+  if (sem_init(&log_semaphore, 0, 0) == 0) {
+    pthread_t thread;
+    if (pthread_create(&thread, 0, log_thread, 0) == 0) {
+      pthread_detach(thread);
+      log_threaded = 1;
+    }
+  }
+  atexit(log_flush);
+  return;
+}
+
+static int log_rate_limit(const char *file, int line, uint32_t *suppressed) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+
+  uintptr_t hash = ((uintptr_t) file >> 4) * 31 + (uintptr_t) line;
+  struct log_rate *rate = &log_rates[hash & (LOG_RATE_SITES - 1)];
+
+  long long second = atomic_load_explicit(&rate->second, memory_order_relaxed);
+  if (second != now.tv_sec &&
+      atomic_compare_exchange_strong(&rate->second, &second, now.tv_sec)) {
+    atomic_store_explicit(&rate->count, 0, memory_order_relaxed);
+  }
+  if (atomic_fetch_add_explicit(&rate->count, 1, memory_order_relaxed) >= LOG_RATE_LIMIT) {
+    atomic_fetch_add_explicit(&rate->suppressed, 1, memory_order_relaxed);
+    return -1;
+  }
+  *suppressed = atomic_exchange_explicit(&rate->suppressed, 0, memory_order_relaxed);
+  return 0;
+}
+
+static struct log_record *log_reserve(enum SDDCLogLevel level,
+                                      const char *file, int line) {
+  if ((int) level > atomic_load_explicit(&log_level, memory_order_relaxed)) {
+    return 0;
+  }
+  pthread_once(&log_once, log_init);
+
+  uint32_t suppressed;
+  if (log_rate_limit(file, line, &suppressed) < 0) {
+    return 0;
+  }
+
+  struct log_record *record;
+  size_t pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+  for (;;) {
+    record = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+    size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&log_head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      /* queue full */
+      atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+      return 0;
+    } else {
+      pos = atomic_load_explicit(&log_head, memory_order_relaxed);
+    }
+  }
+  record->level = level;
+  record->suppressed = suppressed;
+  return record;
+}
+
+static void log_commit(struct log_record *record) {
+  size_t pos = atomic_load_explicit(&record->sequence, memory_order_relaxed);
+  atomic_store_explicit(&record->sequence, pos + 1, memory_order_release);
+  if (log_threaded) {
+    /* one wakeup per batch: until the log thread takes it, the records
+       committed after it are drained with the first one */
+    if (atomic_exchange_explicit(&log_wakeup, 1, memory_order_acq_rel) == 0) {
+      sem_post(&log_semaphore);
+    }
+  } else {
+    log_flush();
+  }
+  return;
+}
+
+/* must be called with log_consumer_mutex held */
+static void log_drain() {
+  char message[LOG_TEXT_SIZE + 256];
+  for (;;) {
+    struct log_record *record = &log_queue[log_tail & (LOG_QUEUE_SIZE - 1)];
+    size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+    if (sequence != log_tail + 1) {
+      break;
+    }
+
+    int n = 0;
+    switch (record->type) {
+      case LOG_RECORD_TEXT:
+        n = snprintf(message, sizeof(message), "%s", record->text);
+        break;
+      case LOG_RECORD_USB_ERROR:
+        n = snprintf(message, sizeof(message), "USB error %s in %s at %s:%d",
+                     libusb_error_name(record->usb_error_code),
+                     record->function, record->file, record->line);
+        break;
+      case LOG_RECORD_USB_WARNING:
+        n = snprintf(message, sizeof(message), "USB warning %s in %s at %s:%d",
+                     libusb_error_name(record->usb_error_code),
+                     record->function, record->file, record->line);
+        break;
+    }
+    if (record->suppressed > 0 && n >= 0 && (size_t) n < sizeof(message)) {
+      snprintf(message + n, sizeof(message) - n,
+               " (%u similar messages suppressed)", record->suppressed);
+    }
+    enum SDDCLogLevel level = record->level;
+
+    atomic_store_explicit(&record->sequence, log_tail + LOG_QUEUE_SIZE,
+                          memory_order_release);
+    log_tail++;
+
+    log_sink(level, message, log_sink_context);
+  }
+
+  unsigned int dropped = atomic_exchange(&log_dropped, 0);
+  if (dropped > 0) {
+    snprintf(message, sizeof(message), "log queue full - %u messages dropped",
+             dropped);
+    log_sink(SDDC_LOG_WARNING, message, log_sink_context);
+  }
+  return;
+}
+
+static void *log_thread(void *arg __attribute__((unused))) {
+  for (;;) {
+    if (sem_wait(&log_semaphore) < 0) {
+      continue;
+    }
+    /* the records committed before this are drained below, and those
+       committed after it post again */
+    atomic_exchange_explicit(&log_wakeup, 0, memory_order_acq_rel);
+    pthread_mutex_lock(&log_consumer_mutex);
+    log_drain();
+    pthread_mutex_unlock(&log_consumer_mutex);
+  }
+  return 0;
+}
+
+static void log_default_sink(enum SDDCLogLevel level, const char *message,
+                             void *context __attribute__((unused))) {
+  static const char *prefixes[] = { "ERROR", "WARNING", "INFO", "DEBUG" };
+  fprintf(stderr, "%s - %s\n", prefixes[level], message);
   return;
 }
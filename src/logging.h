@@ -24,17 +24,38 @@
 
 #include <libusb.h>
 
+#include "libsddc.h"
+
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void log_error(const char *error_message, const char *function,
-               const char *file, int line);
+/* log records are queued without locks and written out by a background
+   thread, so these functions are safe to call from the USB event thread */
 void log_usb_error(int usb_error_code, const char *function, const char *file,
                    int line);
 void log_usb_warning(int usb_error_code, const char *function, const char *file,
                      int line);
+void log_message(enum SDDCLogLevel level, const char *function,
+                 const char *file, int line, const char *format, ...)
+                 __attribute__((format(printf, 5, 6)));
+
+/* starts the log thread up front, so that it is not started (and
+   allocated) by the first message, which may come while streaming */
+void log_start();
+void log_set_level(enum SDDCLogLevel level);
+void log_set_sink(sddc_log_cb_t sink, void *context);
+void log_flush();
+
+#define LOG_ERROR(...) \
+  log_message(SDDC_LOG_ERROR, __func__, __FILE__, __LINE__, __VA_ARGS__)
+#define LOG_WARNING(...) \
+  log_message(SDDC_LOG_WARNING, __func__, __FILE__, __LINE__, __VA_ARGS__)
+#define LOG_INFO(...) \
+  log_message(SDDC_LOG_INFO, __func__, __FILE__, __LINE__, __VA_ARGS__)
+#define LOG_DEBUG(...) \
+  log_message(SDDC_LOG_DEBUG, __func__, __FILE__, __LINE__, __VA_ARGS__)
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,804 @@
+/*
+ * offline.c - parallel offline processing of captures
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The chunks are taken in order by the workers, each into one of a ring
+ * of 2 x num_threads slots holding its outputs; the calling thread waits
+ * for the slots in chunk order, hands their outputs over and frees them
+ * for the chunks one ring further on. So the memory is bounded, and a
+ * slow chunk only holds up the workers once the ring is full.
+ *
+ * What makes a chunk independent of the ones before it:
+ * - DDC: the FIR filter only remembers its last ntaps - 1 inputs, so a
+ *   chunk starts ntaps - 1 samples early (the outputs from those are
+ *   dropped); ddc_seek() puts the outputs on the same grid, with the same
+ *   NCO phase, as in one pass
+ * - spectra and detection blocks: the chunks are whole numbers of them
+ * - the detector thresholds (with hysteresis, so they depend on all the
+ *   blocks before) are applied on the calling thread, to the band powers
+ *   the workers computed
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "offline.h"
+#include "ddc.h"
+#include "detector.h"
+#include "dsp.h"
+#include "fft.h"
+#include "logging.h"
+
+
+struct offline_worker;
+struct offline_slot;
+
+/* internal functions */
+static void *offline_worker_thread(void *arg);
+static struct offline_worker *offline_worker_open(sddc_offline_t *this);
+static void offline_worker_close(struct offline_worker *worker);
+static int offline_slot_init(sddc_offline_t *this, struct offline_slot *slot);
+static void offline_slot_free(sddc_offline_t *this, struct offline_slot *slot);
+static void offline_process_chunk(struct offline_worker *worker,
+                                  struct offline_slot *slot);
+static void offline_process_ddc(struct offline_worker *worker,
+                                struct offline_slot *slot, uint32_t band);
+static void offline_process_spectrum(struct offline_worker *worker,
+                                     struct offline_slot *slot, uint32_t index);
+static void offline_process_detector(struct offline_worker *worker,
+                                     struct offline_slot *slot, uint32_t index);
+static void offline_detector_block(const double *power, uint64_t block_start,
+                                   void *context);
+static void offline_deliver(sddc_offline_t *this, struct offline_slot *slot);
+static uint64_t offline_lcm(uint64_t a, uint64_t b);
+
+
+struct offline_ddc {
+  double center_frequency;
+  double bandwidth;
+  int inverted;
+  uint32_t decimation;
+  uint32_t warmup;          /* filter length - 1 */
+  double output_sample_rate;
+  sddc_subband_cb_t callback;
+  void *callback_context;
+};
+
+struct offline_spectrum {
+  uint32_t fft_size;
+  uint32_t navg;
+  uint32_t nbins;
+  float *window;
+  double scale;
+  sddc_offline_spectrum_cb_t callback;
+  void *callback_context;
+};
+
+struct offline_detector {
+  uint32_t block_size;
+  int nbands;
+  struct sddc_detector_band *bands;
+  double on_threshold;
+  double off_threshold;
+  detector_t *detector;     /* applies the thresholds, in order */
+};
+
+enum offline_slot_state {
+  OFFLINE_SLOT_FREE,
+  OFFLINE_SLOT_BUSY,
+  OFFLINE_SLOT_DONE
+};
+
+struct offline_slot {
+  enum offline_slot_state state;
+  uint64_t start;           /* samples of the chunk */
+  uint64_t end;
+  float **ddc_output;
+  uint32_t *ddc_count;
+  uint64_t *ddc_index;      /* sample index of the first output */
+  float **spectrum_output;
+  uint32_t *nspectra;
+  double **detector_power;
+  uint32_t *nblocks;
+};
+
+struct offline_worker {
+  sddc_offline_t *offline;
+  pthread_t thread;
+  ddc_t **ddcs;
+  fft_t **ffts;
+  detector_t **detectors;
+  float *block;
+  float *spectrum;
+  double *power;
+  struct offline_slot *slot;    /* the detector block callback target */
+  uint32_t detector_index;
+};
+
+typedef struct sddc_offline {
+  sddc_capture_t *capture;
+  struct sddc_capture_info info;
+  int num_threads;
+  uint64_t chunk_size;
+  struct offline_ddc *ddcs;
+  uint32_t nddcs;
+  struct offline_spectrum *spectra;
+  uint32_t nspectra;
+  struct offline_detector *detectors;
+  uint32_t ndetectors;
+  /* run state */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct offline_slot *slots;
+  uint32_t nslots;
+  uint64_t first_sample;
+  uint64_t end_sample;
+  uint64_t chunk;           /* chunk size of the run */
+  uint64_t nchunks;
+  uint64_t next_chunk;
+} sddc_offline_t;
+
+
+static const uint64_t DEFAULT_CHUNK_SIZE = 4 << 20;
+static const uint32_t OFFLINE_PIECE_SIZE = 65536;   /* samples per DSP call */
+static const uint64_t OFFLINE_MAX_UNIT = 1ULL << 32;
+
+
+sddc_offline_t *sddc_offline_open(sddc_capture_t *capture, int num_threads,
+                                  uint64_t chunk_size)
+{
+  sddc_offline_t *ret_val = 0;
+
+  struct sddc_capture_info info;
+  sddc_capture_get_info(capture, &info);
+  if (info.channels != 1 || info.bits_per_sample != 16) {
+    LOG_ERROR("offline processing needs real 16 bit ADC samples");
+    return ret_val;
+  }
+  if (num_threads <= 0) {
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = ncpus > 0 ? (int) ncpus : 1;
+  }
+
+  sddc_offline_t *this = (sddc_offline_t *) calloc(1, sizeof(sddc_offline_t));
+  if (this == 0) {
+    LOG_ERROR("calloc() failed");
+    return ret_val;
+  }
+  this->capture = capture;
+  this->info = info;
+  this->num_threads = num_threads;
+  this->chunk_size = chunk_size > 0 ? chunk_size : DEFAULT_CHUNK_SIZE;
+  pthread_mutex_init(&this->lock, 0);
+  pthread_cond_init(&this->cond, 0);
+
+  ret_val = this;
+  return ret_val;
+}
+
+void sddc_offline_close(sddc_offline_t *this)
+{
+  for (uint32_t i = 0; i < this->nspectra; ++i) {
+    free(this->spectra[i].window);
+  }
+  for (uint32_t i = 0; i < this->ndetectors; ++i) {
+    free(this->detectors[i].bands);
+    detector_close(this->detectors[i].detector);
+  }
+  free(this->ddcs);
+  free(this->spectra);
+  free(this->detectors);
+  pthread_cond_destroy(&this->cond);
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+  return;
+}
+
+int sddc_offline_add_ddc(sddc_offline_t *this, double center_frequency,
+                         double bandwidth, int inverted,
+                         sddc_subband_cb_t callback, void *callback_context)
+{
+  /* the workers open their own - this one checks the parameters */
+  ddc_t *ddc = ddc_open(this->info.sample_rate, center_frequency, bandwidth,
+                        inverted, OFFLINE_PIECE_SIZE);
+  if (ddc == 0) {
+    LOG_ERROR("ddc_open() failed");
+    return -1;
+  }
+  struct offline_ddc *ddcs = (struct offline_ddc *) realloc(this->ddcs,
+                                (this->nddcs + 1) * sizeof(struct offline_ddc));
+  if (ddcs == 0) {
+    LOG_ERROR("realloc() failed");
+    ddc_close(ddc);
+    return -1;
+  }
+  this->ddcs = ddcs;
+  struct offline_ddc *out = &this->ddcs[this->nddcs];
+  out->center_frequency = center_frequency;
+  out->bandwidth = bandwidth;
+  out->inverted = inverted;
+  out->decimation = ddc_get_decimation(ddc);
+  out->warmup = ddc_get_ntaps(ddc) - 1;
+  out->output_sample_rate = ddc_get_output_sample_rate(ddc);
+  out->callback = callback;
+  out->callback_context = callback_context;
+  ddc_close(ddc);
+  return (int) this->nddcs++;
+}
+
+double sddc_offline_get_ddc_sample_rate(sddc_offline_t *this, uint32_t band)
+{
+  if (band >= this->nddcs) {
+    LOG_ERROR("invalid DDC: %u", band);
+    return -1;
+  }
+  return this->ddcs[band].output_sample_rate;
+}
+
+int sddc_offline_add_spectrum(sddc_offline_t *this, uint32_t fft_size,
+                              uint32_t navg,
+                              sddc_offline_spectrum_cb_t callback,
+                              void *callback_context)
+{
+  if (fft_size < 4 || (fft_size & (fft_size - 1)) != 0 || navg == 0) {
+    LOG_ERROR("invalid FFT size or number of averages: %u %u", fft_size, navg);
+    return -1;
+  }
+  float *window = (float *) malloc(fft_size * sizeof(float));
+  if (window == 0) {
+    LOG_ERROR("malloc() failed");
+    return -1;
+  }
+  struct offline_spectrum *spectra = (struct offline_spectrum *) realloc(this->spectra,
+                                         (this->nspectra + 1) * sizeof(struct offline_spectrum));
+  if (spectra == 0) {
+    LOG_ERROR("realloc() failed");
+    free(window);
+    return -1;
+  }
+  this->spectra = spectra;
+  struct offline_spectrum *out = &this->spectra[this->nspectra];
+  out->fft_size = fft_size;
+  out->navg = navg;
+  out->nbins = fft_size / 2 + 1;
+  out->window = window;
+  double window_sum = 0;
+  for (uint32_t i = 0; i < fft_size; ++i) {
+    out->window[i] = (float) (0.5 - 0.5 * cos(2 * M_PI * i / fft_size));
+    window_sum += out->window[i];
+  }
+  out->scale = 1.0 / (window_sum * window_sum);
+  out->callback = callback;
+  out->callback_context = callback_context;
+  this->nspectra++;
+  return 0;
+}
+
+int sddc_offline_add_detector(sddc_offline_t *this, uint32_t block_size,
+                              const struct sddc_detector_band *bands,
+                              int nbands, double on_threshold,
+                              double off_threshold,
+                              sddc_activity_cb_t callback,
+                              void *callback_context)
+{
+  detector_t *detector = detector_open(this->info.sample_rate, block_size,
+                                       bands, nbands, on_threshold,
+                                       off_threshold, callback,
+                                       callback_context);
+  if (detector == 0) {
+    LOG_ERROR("detector_open() failed");
+    return -1;
+  }
+  struct sddc_detector_band *bands_copy = (struct sddc_detector_band *) malloc(nbands * sizeof(struct sddc_detector_band));
+  struct offline_detector *detectors = bands_copy == 0 ? 0 :
+      (struct offline_detector *) realloc(this->detectors,
+          (this->ndetectors + 1) * sizeof(struct offline_detector));
+  if (detectors == 0) {
+    LOG_ERROR("malloc() failed");
+    free(bands_copy);
+    detector_close(detector);
+    return -1;
+  }
+  this->detectors = detectors;
+  struct offline_detector *out = &this->detectors[this->ndetectors];
+  out->block_size = block_size;
+  out->nbands = nbands;
+  out->bands = bands_copy;
+  memcpy(out->bands, bands, nbands * sizeof(struct sddc_detector_band));
+  out->on_threshold = on_threshold;
+  out->off_threshold = off_threshold;
+  out->detector = detector;
+  this->ndetectors++;
+  return 0;
+}
+
+int64_t sddc_offline_run(sddc_offline_t *this, uint64_t sample, uint64_t count)
+{
+  if (this->nddcs == 0 && this->nspectra == 0 && this->ndetectors == 0) {
+    LOG_ERROR("nothing to process");
+    return -1;
+  }
+  if (sample > this->info.samples) {
+    sample = this->info.samples;
+  }
+  if (count > this->info.samples - sample) {
+    count = this->info.samples - sample;
+  }
+
+  /* the chunks are whole spectra and detection blocks */
+  uint64_t unit = 1;
+  for (uint32_t i = 0; i < this->nspectra; ++i) {
+    unit = offline_lcm(unit, (uint64_t) this->spectra[i].fft_size *
+                             this->spectra[i].navg);
+  }
+  for (uint32_t i = 0; i < this->ndetectors; ++i) {
+    unit = offline_lcm(unit, this->detectors[i].block_size);
+  }
+  if (unit > OFFLINE_MAX_UNIT) {
+    LOG_ERROR("the FFT and detection block sizes have no common chunk size");
+    return -1;
+  }
+  this->chunk = (this->chunk_size + unit - 1) / unit * unit;
+  this->first_sample = sample;
+  this->end_sample = sample + count;
+  this->nchunks = (count + this->chunk - 1) / this->chunk;
+  this->next_chunk = 0;
+  for (uint32_t i = 0; i < this->ndetectors; ++i) {
+    detector_reset(this->detectors[i].detector);
+  }
+
+  this->nslots = 2 * this->num_threads;
+  this->slots = (struct offline_slot *) calloc(this->nslots, sizeof(struct offline_slot));
+  struct offline_worker **workers = (struct offline_worker **)
+      calloc(this->num_threads, sizeof(struct offline_worker *));
+  int failed = this->slots == 0 || workers == 0;
+  if (failed) {
+    LOG_ERROR("calloc() failed");
+  }
+  for (uint32_t i = 0; !failed && i < this->nslots; ++i) {
+    failed = offline_slot_init(this, &this->slots[i]) < 0;
+  }
+  int nworkers = 0;
+  for (int i = 0; !failed && i < this->num_threads; ++i) {
+    workers[i] = offline_worker_open(this);
+    if (workers[i] == 0) {
+      failed = 1;
+      break;
+    }
+    if (pthread_create(&workers[i]->thread, 0, offline_worker_thread,
+                       workers[i]) != 0) {
+      LOG_ERROR("pthread_create() failed");
+      offline_worker_close(workers[i]);
+      failed = 1;
+      break;
+    }
+    nworkers++;
+  }
+  if (failed) {
+    /* no more chunks for the workers already started */
+    pthread_mutex_lock(&this->lock);
+    this->nchunks = this->next_chunk;
+    pthread_cond_broadcast(&this->cond);
+    pthread_mutex_unlock(&this->lock);
+  }
+
+  /* the outputs in chunk order */
+  uint64_t delivered = 0;
+  if (!failed) {
+    for (; delivered < this->nchunks; ++delivered) {
+      struct offline_slot *slot = &this->slots[delivered % this->nslots];
+      pthread_mutex_lock(&this->lock);
+      while (slot->state != OFFLINE_SLOT_DONE) {
+        pthread_cond_wait(&this->cond, &this->lock);
+      }
+      pthread_mutex_unlock(&this->lock);
+      offline_deliver(this, slot);
+      pthread_mutex_lock(&this->lock);
+      slot->state = OFFLINE_SLOT_FREE;
+      pthread_cond_broadcast(&this->cond);
+      pthread_mutex_unlock(&this->lock);
+    }
+  }
+
+  for (int i = 0; i < nworkers; ++i) {
+    pthread_join(workers[i]->thread, 0);
+    offline_worker_close(workers[i]);
+  }
+  free(workers);
+  for (uint32_t i = 0; this->slots && i < this->nslots; ++i) {
+    offline_slot_free(this, &this->slots[i]);
+  }
+  free(this->slots);
+  this->slots = 0;
+  if (failed) {
+    return -1;
+  }
+  return (int64_t) count;
+}
+
+
+/* internal functions */
+static void *offline_worker_thread(void *arg)
+{
+  struct offline_worker *worker = (struct offline_worker *) arg;
+  sddc_offline_t *this = worker->offline;
+  pthread_mutex_lock(&this->lock);
+  while (this->next_chunk < this->nchunks) {
+    /* the slot is free once the chunk one ring back was handed over */
+    uint64_t chunk = this->next_chunk;
+    struct offline_slot *slot = &this->slots[chunk % this->nslots];
+    if (slot->state != OFFLINE_SLOT_FREE) {
+      pthread_cond_wait(&this->cond, &this->lock);
+      continue;
+    }
+    this->next_chunk++;
+    slot->state = OFFLINE_SLOT_BUSY;
+    slot->start = this->first_sample + chunk * this->chunk;
+    slot->end = slot->start + this->chunk < this->end_sample ?
+                slot->start + this->chunk : this->end_sample;
+    pthread_mutex_unlock(&this->lock);
+
+    offline_process_chunk(worker, slot);
+
+    pthread_mutex_lock(&this->lock);
+    slot->state = OFFLINE_SLOT_DONE;
+    pthread_cond_broadcast(&this->cond);
+  }
+  pthread_mutex_unlock(&this->lock);
+  return 0;
+}
+
+static struct offline_worker *offline_worker_open(sddc_offline_t *this)
+{
+  struct offline_worker *worker = (struct offline_worker *) calloc(1, sizeof(struct offline_worker));
+  if (worker == 0) {
+    LOG_ERROR("calloc() failed");
+    return 0;
+  }
+  worker->offline = this;
+  /* (one extra element each, so that none of them is a zero size calloc) */
+  worker->ddcs = (ddc_t **) calloc(this->nddcs + 1, sizeof(ddc_t *));
+  worker->ffts = (fft_t **) calloc(this->nspectra + 1, sizeof(fft_t *));
+  worker->detectors = (detector_t **) calloc(this->ndetectors + 1, sizeof(detector_t *));
+  if (worker->ddcs == 0 || worker->ffts == 0 || worker->detectors == 0) {
+    LOG_ERROR("calloc() failed");
+    offline_worker_close(worker);
+    return 0;
+  }
+  for (uint32_t i = 0; i < this->nddcs; ++i) {
+    const struct offline_ddc *out = &this->ddcs[i];
+    worker->ddcs[i] = ddc_open(this->info.sample_rate, out->center_frequency,
+                               out->bandwidth, out->inverted,
+                               OFFLINE_PIECE_SIZE);
+    if (worker->ddcs[i] == 0) {
+      LOG_ERROR("ddc_open() failed");
+      offline_worker_close(worker);
+      return 0;
+    }
+  }
+  uint32_t max_fft_size = 0;
+  for (uint32_t i = 0; i < this->nspectra; ++i) {
+    uint32_t fft_size = this->spectra[i].fft_size;
+    worker->ffts[i] = fft_open(fft_size);
+    if (worker->ffts[i] == 0) {
+      LOG_ERROR("fft_open() failed");
+      offline_worker_close(worker);
+      return 0;
+    }
+    max_fft_size = fft_size > max_fft_size ? fft_size : max_fft_size;
+  }
+  worker->block = (float *) malloc(max_fft_size * sizeof(float));
+  worker->spectrum = (float *) malloc((max_fft_size + 2) * sizeof(float));
+  worker->power = (double *) malloc((max_fft_size / 2 + 1) * sizeof(double));
+  if (worker->block == 0 || worker->spectrum == 0 || worker->power == 0) {
+    LOG_ERROR("malloc() failed");
+    offline_worker_close(worker);
+    return 0;
+  }
+  for (uint32_t i = 0; i < this->ndetectors; ++i) {
+    const struct offline_detector *out = &this->detectors[i];
+    worker->detectors[i] = detector_open(this->info.sample_rate,
+                                         out->block_size, out->bands,
+                                         out->nbands, out->on_threshold,
+                                         out->off_threshold, 0, 0);
+    if (worker->detectors[i] == 0) {
+      LOG_ERROR("detector_open() failed");
+      offline_worker_close(worker);
+      return 0;
+    }
+    detector_set_block_callback(worker->detectors[i], offline_detector_block,
+                                worker);
+  }
+  return worker;
+}
+
+static void offline_worker_close(struct offline_worker *worker)
+{
+  sddc_offline_t *this = worker->offline;
+  for (uint32_t i = 0; worker->ddcs && i < this->nddcs && worker->ddcs[i]; ++i) {
+    ddc_close(worker->ddcs[i]);
+  }
+  for (uint32_t i = 0; worker->ffts && i < this->nspectra && worker->ffts[i]; ++i) {
+    fft_close(worker->ffts[i]);
+  }
+  for (uint32_t i = 0; worker->detectors && i < this->ndetectors &&
+                       worker->detectors[i]; ++i) {
+    detector_close(worker->detectors[i]);
+  }
+  free(worker->ddcs);
+  free(worker->ffts);
+  free(worker->detectors);
+  free(worker->block);
+  free(worker->spectrum);
+  free(worker->power);
+  free(worker);
+  return;
+}
+
+/* the slot is zeroed, so that offline_slot_free() can free a partial one */
+static int offline_slot_init(sddc_offline_t *this, struct offline_slot *slot)
+{
+  uint64_t chunk = this->chunk;
+  slot->state = OFFLINE_SLOT_FREE;
+  /* (one extra element each, so that none of them is a zero size calloc) */
+  slot->ddc_output = (float **) calloc(this->nddcs + 1, sizeof(float *));
+  slot->ddc_count = (uint32_t *) calloc(this->nddcs + 1, sizeof(uint32_t));
+  slot->ddc_index = (uint64_t *) calloc(this->nddcs + 1, sizeof(uint64_t));
+  slot->spectrum_output = (float **) calloc(this->nspectra + 1, sizeof(float *));
+  slot->nspectra = (uint32_t *) calloc(this->nspectra + 1, sizeof(uint32_t));
+  slot->detector_power = (double **) calloc(this->ndetectors + 1, sizeof(double *));
+  slot->nblocks = (uint32_t *) calloc(this->ndetectors + 1, sizeof(uint32_t));
+  if (slot->ddc_output == 0 || slot->ddc_count == 0 || slot->ddc_index == 0 ||
+      slot->spectrum_output == 0 || slot->nspectra == 0 ||
+      slot->detector_power == 0 || slot->nblocks == 0) {
+    LOG_ERROR("calloc() failed");
+    return -1;
+  }
+  for (uint32_t i = 0; i < this->nddcs; ++i) {
+    slot->ddc_output[i] = (float *) malloc(2 * (chunk / this->ddcs[i].decimation + 1) *
+                                           sizeof(float));
+    if (slot->ddc_output[i] == 0) {
+      LOG_ERROR("malloc() failed");
+      return -1;
+    }
+  }
+  for (uint32_t i = 0; i < this->nspectra; ++i) {
+    const struct offline_spectrum *out = &this->spectra[i];
+    uint64_t n = chunk / ((uint64_t) out->fft_size * out->navg) + 1;
+    slot->spectrum_output[i] = (float *) malloc(n * out->nbins * sizeof(float));
+    if (slot->spectrum_output[i] == 0) {
+      LOG_ERROR("malloc() failed");
+      return -1;
+    }
+  }
+  for (uint32_t i = 0; i < this->ndetectors; ++i) {
+    const struct offline_detector *out = &this->detectors[i];
+    uint64_t n = chunk / out->block_size + 1;
+    slot->detector_power[i] = (double *) malloc(n * out->nbands * sizeof(double));
+    if (slot->detector_power[i] == 0) {
+      LOG_ERROR("malloc() failed");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void offline_slot_free(sddc_offline_t *this, struct offline_slot *slot)
+{
+  for (uint32_t i = 0; slot->ddc_output && i < this->nddcs; ++i) {
+    free(slot->ddc_output[i]);
+  }
+  for (uint32_t i = 0; slot->spectrum_output && i < this->nspectra; ++i) {
+    free(slot->spectrum_output[i]);
+  }
+  for (uint32_t i = 0; slot->detector_power && i < this->ndetectors; ++i) {
+    free(slot->detector_power[i]);
+  }
+  free(slot->ddc_output);
+  free(slot->ddc_count);
+  free(slot->ddc_index);
+  free(slot->spectrum_output);
+  free(slot->nspectra);
+  free(slot->detector_power);
+  free(slot->nblocks);
+  return;
+}
+
+static void offline_process_chunk(struct offline_worker *worker,
+                                  struct offline_slot *slot)
+{
+  sddc_offline_t *this = worker->offline;
+  for (uint32_t i = 0; i < this->nddcs; ++i) {
+    offline_process_ddc(worker, slot, i);
+  }
+  for (uint32_t i = 0; i < this->nspectra; ++i) {
+    offline_process_spectrum(worker, slot, i);
+  }
+  for (uint32_t i = 0; i < this->ndetectors; ++i) {
+    offline_process_detector(worker, slot, i);
+  }
+  return;
+}
+
+/* from warmup samples before the chunk, dropping the outputs that end
+   before it */
+static void offline_process_ddc(struct offline_worker *worker,
+                                struct offline_slot *slot, uint32_t band)
+{
+  sddc_offline_t *this = worker->offline;
+  const struct offline_ddc *out = &this->ddcs[band];
+  ddc_t *ddc = worker->ddcs[band];
+  uint64_t decimation = out->decimation;
+  uint64_t start = slot->start > out->warmup ? slot->start - out->warmup : 0;
+  ddc_seek(ddc, start);
+
+  uint64_t next = (start + decimation - 1) / decimation * decimation;
+  float *output = slot->ddc_output[band];
+  uint32_t count = 0;
+  for (uint64_t pos = start; pos < slot->end; ) {
+    uint64_t n;
+    const int16_t *samples = (const int16_t *)
+        sddc_capture_span(this->capture, pos,
+                          slot->end - pos < OFFLINE_PIECE_SIZE ?
+                          slot->end - pos : OFFLINE_PIECE_SIZE, &n);
+    float *piece;
+    uint32_t nout = ddc_process(ddc, samples, (uint32_t) n, &piece);
+    uint32_t skip = 0;
+    while (skip < nout && next < slot->start) {
+      skip++;
+      next += decimation;
+    }
+    memcpy(output + 2 * count, piece + 2 * skip, 2 * (nout - skip) * sizeof(float));
+    count += nout - skip;
+    next += (nout - skip) * decimation;
+    pos += n;
+  }
+  slot->ddc_count[band] = count;
+  slot->ddc_index[band] = (slot->start + decimation - 1) / decimation * decimation;
+  return;
+}
+
+/* groups of navg blocks from the start of the chunk; only the last chunk
+   can end with a partial group (averaged over its blocks) */
+static void offline_process_spectrum(struct offline_worker *worker,
+                                     struct offline_slot *slot, uint32_t index)
+{
+  sddc_offline_t *this = worker->offline;
+  const struct offline_spectrum *out = &this->spectra[index];
+  uint32_t n = out->fft_size;
+  uint32_t nspectra = 0;
+  uint32_t navg = 0;
+  memset(worker->power, 0, out->nbins * sizeof(double));
+  for (uint64_t pos = slot->start; pos + n <= slot->end; pos += n) {
+    uint64_t available;
+    const int16_t *samples = (const int16_t *)
+        sddc_capture_span(this->capture, pos, n, &available);
+    dsp_int16_to_float(samples, worker->block, n);
+    for (uint32_t i = 0; i < n; ++i) {
+      worker->block[i] *= out->window[i];
+    }
+    fft_real_forward(worker->ffts[index], worker->block, worker->spectrum);
+    for (uint32_t k = 0; k < out->nbins; ++k) {
+      float re = worker->spectrum[2*k];
+      float im = worker->spectrum[2*k+1];
+      worker->power[k] += re * re + im * im;
+    }
+    navg++;
+    if (navg == out->navg || pos + 2 * n > slot->end) {
+      float *power = slot->spectrum_output[index] + (uint64_t) nspectra * out->nbins;
+      for (uint32_t k = 0; k < out->nbins; ++k) {
+        power[k] = (float) (10 * log10(worker->power[k] * out->scale / navg + 1e-20));
+        worker->power[k] = 0;
+      }
+      nspectra++;
+      navg = 0;
+    }
+  }
+  slot->nspectra[index] = nspectra;
+  return;
+}
+
+static void offline_process_detector(struct offline_worker *worker,
+                                     struct offline_slot *slot, uint32_t index)
+{
+  sddc_offline_t *this = worker->offline;
+  detector_t *detector = worker->detectors[index];
+  detector_reset(detector);
+  worker->slot = slot;
+  worker->detector_index = index;
+  slot->nblocks[index] = 0;
+  for (uint64_t pos = slot->start; pos < slot->end; ) {
+    uint64_t n;
+    const int16_t *samples = (const int16_t *)
+        sddc_capture_span(this->capture, pos,
+                          slot->end - pos < OFFLINE_PIECE_SIZE ?
+                          slot->end - pos : OFFLINE_PIECE_SIZE, &n);
+    detector_process(detector, samples, (uint32_t) n, pos);
+    pos += n;
+  }
+  return;
+}
+
+static void offline_detector_block(const double *power,
+                                   uint64_t block_start __attribute__((unused)),
+                                   void *context)
+{
+  struct offline_worker *worker = (struct offline_worker *) context;
+  struct offline_slot *slot = worker->slot;
+  uint32_t index = worker->detector_index;
+  int nbands = worker->offline->detectors[index].nbands;
+  memcpy(slot->detector_power[index] + (uint64_t) slot->nblocks[index] * nbands,
+         power, nbands * sizeof(double));
+  slot->nblocks[index]++;
+  return;
+}
+
+static void offline_deliver(sddc_offline_t *this, struct offline_slot *slot)
+{
+  for (uint32_t i = 0; i < this->nddcs; ++i) {
+    const struct offline_ddc *out = &this->ddcs[i];
+    if (slot->ddc_count[i] > 0 && out->callback) {
+      out->callback(i, slot->ddc_output[i], slot->ddc_count[i],
+                    slot->ddc_index[i], out->callback_context);
+    }
+  }
+  for (uint32_t i = 0; i < this->nspectra; ++i) {
+    const struct offline_spectrum *out = &this->spectra[i];
+    uint64_t group = (uint64_t) out->fft_size * out->navg;
+    for (uint32_t s = 0; s < slot->nspectra[i] && out->callback; ++s) {
+      out->callback(slot->spectrum_output[i] + (uint64_t) s * out->nbins,
+                    out->nbins, slot->start + s * group,
+                    out->callback_context);
+    }
+  }
+  for (uint32_t i = 0; i < this->ndetectors; ++i) {
+    const struct offline_detector *out = &this->detectors[i];
+    for (uint32_t b = 0; b < slot->nblocks[i]; ++b) {
+      uint64_t block_start = slot->start + (uint64_t) b * out->block_size;
+      int64_t time = sddc_capture_get_time(this->capture, block_start);
+      struct timespec timestamp = { (time_t) (time / 1000000000),
+                                    (long) (time % 1000000000) };
+      if (timestamp.tv_nsec < 0) {
+        timestamp.tv_sec--;
+        timestamp.tv_nsec += 1000000000;
+      }
+      detector_decide(out->detector,
+                      slot->detector_power[i] + (uint64_t) b * out->nbands,
+                      block_start, &timestamp);
+    }
+  }
+  return;
+}
+
+static uint64_t offline_lcm(uint64_t a, uint64_t b)
+{
+  uint64_t x = a;
+  uint64_t y = b;
+  while (y != 0) {
+    uint64_t t = x % y;
+    x = y;
+    y = t;
+  }
+  return a / x * b;
+}
@@ -0,0 +1,42 @@
+/*
+ * offline.h - parallel offline processing of captures
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __OFFLINE_H
+#define __OFFLINE_H
+
+#include "libsddc.h"
+#include "capture.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the offline processing functions themselves are in libsddc.h; a run
+   splits the capture into chunks processed in parallel, with the outputs
+   handed over in order on the calling thread */
+typedef struct sddc_offline sddc_offline_t;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __OFFLINE_H */
@@ -0,0 +1,539 @@
+/*
+ * ols.c - overlap-save fast convolution filter bank
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Each block of fft_size input samples overlaps the previous one by
+ * 'overlap' samples (at least ntaps - 1), so the circular convolution of
+ * the block with the filter is exact for the last fft_size - overlap
+ * outputs. One real FFT of the block is shared by all the sub-bands: each
+ * band takes the fft_size / D bins around its center, multiplies them by
+ * the filter response and goes back to the time domain with an inverse
+ * FFT D times smaller - the decimation happens in the frequency domain.
+ * The blocks of one call are independent, so they are spread across the
+ * threads; each thread has its own FFTs and buffers.
+ *
+ * The calling thread (the streaming callback) never takes a lock: it
+ * publishes the blocks of a call as one atomic word (count and next
+ * block), posts the semaphore the idle workers sleep on, and filters
+ * blocks itself, claiming them from the word like the workers do. A worker
+ * that wakes late finds no block left and goes back to sleep; the calling
+ * thread only spins, at the end, for the blocks other threads are still
+ * filtering.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ols.h"
+#include "dsp.h"
+#include "fft.h"
+#include "logging.h"
+
+
+typedef struct ols ols_t;
+typedef struct ols_band ols_band_t;
+typedef struct ols_worker ols_worker_t;
+
+/* internal functions */
+static uint32_t ols_overlap(uint32_t ntaps);
+static void *ols_worker_thread(void *arg);
+static uint32_t ols_run_blocks(ols_t *this, ols_worker_t *worker);
+static void ols_filter_block(ols_t *this, ols_worker_t *worker,
+                             uint32_t block);
+
+typedef struct ols_band {
+  int32_t bin;              /* center bin */
+  uint32_t decimation;
+  uint32_t npoints;         /* bins kept (inverse FFT size) */
+  uint32_t *source;         /* forward FFT bin of each kept bin */
+  float *sign;              /* -1 where the bin is the conjugate mirror */
+  float *response;          /* filter response / fft_size (re/im) */
+  float *output;            /* interleaved I/Q */
+} ols_band_t;
+
+typedef struct ols_worker {
+  ols_t *ols;
+  pthread_t thread;
+  fft_t *forward;
+  fft_t **inverse;          /* one per band */
+  float *spectrum;          /* fft_size + 2 */
+  float *scratch;           /* 2 * largest npoints */
+} ols_worker_t;
+
+typedef struct ols {
+  double sample_rate;
+  uint32_t fft_size;
+  uint32_t ntaps;
+  uint32_t overlap;
+  uint32_t step;            /* new input samples per block */
+  uint32_t max_samples;
+  uint32_t nbands;
+  ols_band_t *bands;
+  float *input;             /* overlap + pending samples + new samples */
+  uint32_t fill;
+  uint64_t block_index;     /* blocks filtered since open/reset */
+  uint64_t output_index;    /* input sample of the first output */
+  uint32_t nblocks;         /* blocks of the last call */
+  int num_threads;
+  int started;              /* worker threads running */
+  ols_worker_t *workers;    /* workers[0] is the calling thread */
+  sem_t wake;               /* posted for the idle workers */
+  atomic_int shutdown;
+  atomic_uint_fast64_t work;      /* blocks << 32 | next block to claim */
+  atomic_uint done_blocks;        /* filtered in the current call */
+} ols_t;
+
+
+static const double OLS_ATTENUATION = 80.0;   /* stop band attenuation (dB) */
+
+
+uint32_t ols_ntaps(uint32_t fft_size, uint32_t ntaps)
+{
+  /* odd, for an integer delay */
+  return ntaps == 0 ? fft_size / 4 + 1 : ntaps | 1;
+}
+
+
+uint32_t ols_decimation(double sample_rate, uint32_t fft_size, uint32_t ntaps,
+                        double bandwidth)
+{
+  ntaps = ols_ntaps(fft_size, ntaps);
+  double transition = (OLS_ATTENUATION - 7.95) / (14.36 * (ntaps - 1));
+  double max_decimation = sample_rate /
+                          (bandwidth + 2 * transition * sample_rate);
+  uint32_t overlap = ols_overlap(ntaps);
+  uint32_t decimation = 1;
+  while (2 * decimation <= max_decimation && 2 * decimation <= overlap) {
+    decimation *= 2;
+  }
+  return decimation;
+}
+
+
+double ols_center_frequency(double sample_rate, uint32_t fft_size,
+                            double frequency)
+{
+  return round(frequency * fft_size / sample_rate) * sample_rate /
+         fft_size;
+}
+
+
+int ols_check_params(double sample_rate, uint32_t fft_size, uint32_t ntaps,
+                     const struct sddc_subband *bands, uint32_t nbands)
+{
+  ntaps = ols_ntaps(fft_size, ntaps);
+  if (sample_rate <= 0.0 || fft_size < 16 || (fft_size & (fft_size - 1)) ||
+      ntaps < 3 || ntaps - 1 > fft_size / 2 || nbands == 0) {
+    LOG_ERROR("invalid FFT size or number of taps");
+    return -1;
+  }
+  for (uint32_t i = 0; i < nbands; ++i) {
+    double low = bands[i].frequency - bands[i].bandwidth / 2;
+    double high = bands[i].frequency + bands[i].bandwidth / 2;
+    if (bands[i].bandwidth <= 0.0 || low < 0.0 || high > sample_rate / 2) {
+      LOG_ERROR("invalid sub-band");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+ols_t *ols_open(double sample_rate, uint32_t fft_size, uint32_t ntaps,
+                const struct sddc_subband *bands, uint32_t nbands,
+                int num_threads, uint32_t max_samples)
+{
+  ols_t *ret_val = 0;
+
+  if (ols_check_params(sample_rate, fft_size, ntaps, bands, nbands) < 0 ||
+      num_threads < 1 || max_samples == 0) {
+    LOG_ERROR("invalid overlap-save filter parameters");
+    return ret_val;
+  }
+  ntaps = ols_ntaps(fft_size, ntaps);
+
+  /* zeroed, so that ols_close() can free a partial one */
+  ols_t *this = (ols_t *) calloc(1, sizeof(ols_t));
+  if (this == 0) {
+    LOG_ERROR("calloc() failed");
+    return ret_val;
+  }
+  sem_init(&this->wake, 0, 0);
+  atomic_init(&this->shutdown, 0);
+  atomic_init(&this->work, 0);
+  atomic_init(&this->done_blocks, 0);
+  this->sample_rate = sample_rate;
+  this->fft_size = fft_size;
+  this->ntaps = ntaps;
+  this->overlap = ols_overlap(ntaps);
+  this->step = fft_size - this->overlap;
+  this->max_samples = max_samples;
+  this->input = (float *) malloc((this->overlap + this->step + max_samples) *
+                                 sizeof(float));
+  this->nbands = nbands;
+  this->bands = (ols_band_t *) calloc(nbands, sizeof(ols_band_t));
+  this->num_threads = num_threads;
+  this->workers = (ols_worker_t *) calloc(num_threads, sizeof(ols_worker_t));
+  if (this->input == 0 || this->bands == 0 || this->workers == 0) {
+    LOG_ERROR("malloc() failed");
+    ols_close(this);
+    return ret_val;
+  }
+
+  /* filter response - the prototype low pass is the same for every band,
+     only the cutoff changes */
+  fft_t *forward = fft_open(fft_size);
+  float *taps = (float *) malloc(fft_size * sizeof(float));
+  float *response = (float *) malloc((fft_size + 2) * sizeof(float));
+  if (forward == 0 || taps == 0 || response == 0) {
+    LOG_ERROR("malloc() failed");
+    goto FAIL;
+  }
+  double transition = (OLS_ATTENUATION - 7.95) / (14.36 * (ntaps - 1));
+  uint32_t max_blocks = (max_samples + this->step - 1) / this->step + 1;
+  uint32_t max_npoints = 0;
+  for (uint32_t i = 0; i < nbands; ++i) {
+    ols_band_t *band = &this->bands[i];
+    band->bin = (int32_t) lround(bands[i].frequency * fft_size /
+                                 sample_rate);
+    band->decimation = ols_decimation(sample_rate, fft_size, ntaps,
+                                      bands[i].bandwidth);
+    band->npoints = fft_size / band->decimation;
+    if (band->npoints > max_npoints) {
+      max_npoints = band->npoints;
+    }
+
+    double cutoff = bands[i].bandwidth / 2 / sample_rate + transition / 2;
+    memset(taps, 0, fft_size * sizeof(float));
+    dsp_kaiser_lowpass(taps, ntaps, cutoff, OLS_ATTENUATION);
+    fft_real_forward(forward, taps, response);
+
+    /* kept bins in FFT order: offsets 0 .. npoints/2 - 1, then the
+       negative ones; bins past fft_size / 2 are conjugate mirrors */
+    band->source = (uint32_t *) malloc(band->npoints * sizeof(uint32_t));
+    band->sign = (float *) malloc(band->npoints * sizeof(float));
+    band->response = (float *) malloc(2 * band->npoints * sizeof(float));
+    band->output = (float *) malloc(2 * max_blocks *
+                                    (this->step / band->decimation) *
+                                    sizeof(float));
+    if (band->source == 0 || band->sign == 0 || band->response == 0 ||
+        band->output == 0) {
+      LOG_ERROR("malloc() failed");
+      goto FAIL;
+    }
+    for (uint32_t k = 0; k < band->npoints; ++k) {
+      int32_t offset = k < band->npoints / 2 ? (int32_t) k :
+                       (int32_t) k - (int32_t) band->npoints;
+      int32_t source = (band->bin + offset) % (int32_t) fft_size;
+      source = source < 0 ? source + (int32_t) fft_size : source;
+      int mirror = source > (int32_t) fft_size / 2;
+      band->source[k] = (uint32_t) (mirror ? (int32_t) fft_size - source : source);
+      band->sign[k] = mirror ? -1.0f : 1.0f;
+      uint32_t h = offset < 0 ? -offset : offset;
+      float h_sign = offset < 0 ? -1.0f : 1.0f;
+      band->response[2*k] = response[2*h] / fft_size;
+      band->response[2*k+1] = h_sign * response[2*h+1] / fft_size;
+    }
+  }
+  free(taps);
+  free(response);
+  fft_close(forward);
+
+  for (int t = 0; t < num_threads; ++t) {
+    ols_worker_t *worker = &this->workers[t];
+    worker->ols = this;
+    worker->forward = fft_open(fft_size);
+    worker->inverse = (fft_t **) calloc(nbands, sizeof(fft_t *));
+    worker->spectrum = (float *) malloc((fft_size + 2) * sizeof(float));
+    worker->scratch = (float *) malloc(2 * max_npoints * sizeof(float));
+    if (worker->forward == 0 || worker->inverse == 0 ||
+        worker->spectrum == 0 || worker->scratch == 0) {
+      LOG_ERROR("malloc() failed");
+      ols_close(this);
+      return ret_val;
+    }
+    for (uint32_t i = 0; i < nbands; ++i) {
+      worker->inverse[i] = fft_open(2 * this->bands[i].npoints);
+      if (worker->inverse[i] == 0) {
+        LOG_ERROR("fft_open() failed");
+        ols_close(this);
+        return ret_val;
+      }
+    }
+  }
+
+  this->nblocks = 0;
+  this->started = 0;
+  for (int t = 1; t < num_threads; ++t) {
+    int ret = pthread_create(&this->workers[t].thread, 0, ols_worker_thread,
+                             &this->workers[t]);
+    if (ret != 0) {
+      LOG_ERROR("pthread_create() failed: %s", strerror(ret));
+      ols_close(this);
+      return ret_val;
+    }
+    this->started++;
+  }
+  ols_reset(this);
+
+  ret_val = this;
+  return ret_val;
+
+FAIL:
+  free(taps);
+  free(response);
+  if (forward) {
+    fft_close(forward);
+  }
+  ols_close(this);
+  return ret_val;
+}
+
+
+void ols_close(ols_t *this)
+{
+  atomic_store(&this->shutdown, 1);
+  for (int t = 1; t <= this->started; ++t) {
+    sem_post(&this->wake);
+  }
+  for (int t = 1; t <= this->started; ++t) {
+    pthread_join(this->workers[t].thread, 0);
+  }
+  sem_destroy(&this->wake);
+
+  for (int t = 0; this->workers && t < this->num_threads; ++t) {
+    ols_worker_t *worker = &this->workers[t];
+    if (worker->forward) {
+      fft_close(worker->forward);
+    }
+    for (uint32_t i = 0; worker->inverse && i < this->nbands; ++i) {
+      if (worker->inverse[i]) {
+        fft_close(worker->inverse[i]);
+      }
+    }
+    free(worker->inverse);
+    free(worker->spectrum);
+    free(worker->scratch);
+  }
+  free(this->workers);
+  for (uint32_t i = 0; this->bands && i < this->nbands; ++i) {
+    free(this->bands[i].source);
+    free(this->bands[i].sign);
+    free(this->bands[i].response);
+    free(this->bands[i].output);
+  }
+  free(this->bands);
+  free(this->input);
+  free(this);
+  return;
+}
+
+
+void ols_reset(ols_t *this)
+{
+  /* the first block starts 'overlap' samples before the stream */
+  memset(this->input, 0, this->overlap * sizeof(float));
+  this->fill = this->overlap;
+  this->block_index = 0;
+  this->output_index = 0;
+  this->nblocks = 0;
+  return;
+}
+
+
+uint32_t ols_get_num_bands(ols_t *this)
+{
+  return this->nbands;
+}
+
+
+double ols_get_output_sample_rate(ols_t *this, uint32_t band)
+{
+  return band < this->nbands ?
+         this->sample_rate / this->bands[band].decimation : 0.0;
+}
+
+
+uint32_t ols_process(ols_t *this, const int16_t *samples, uint32_t nsamples)
+{
+  if (nsamples > this->max_samples) {
+    LOG_ERROR("too many samples");
+    nsamples = this->max_samples;
+  }
+
+  dsp_int16_to_float(samples, this->input + this->fill, nsamples);
+  this->fill += nsamples;
+  this->output_index = this->block_index * this->step;
+  this->nblocks = (this->fill - this->overlap) / this->step;
+  if (this->nblocks == 0) {
+    return 0;
+  }
+
+  /* the input and the block index are published with the work word */
+  atomic_store_explicit(&this->done_blocks, 0, memory_order_relaxed);
+  atomic_store_explicit(&this->work, (uint_fast64_t) this->nblocks << 32,
+                        memory_order_release);
+  if (this->started > 0) {
+    int pending = 0;
+    sem_getvalue(&this->wake, &pending);
+    for (int t = pending; t < this->started; ++t) {
+      sem_post(&this->wake);
+    }
+  }
+  uint32_t done = ols_run_blocks(this, &this->workers[0]);
+  if (done < this->nblocks) {
+    done += atomic_fetch_add_explicit(&this->done_blocks, done,
+                                      memory_order_acq_rel);
+    /* the last blocks claimed by the workers are short; the yield is for
+       a worker that was preempted in the middle of one */
+    while (done < this->nblocks) {
+      sched_yield();
+      done = atomic_load_explicit(&this->done_blocks, memory_order_acquire);
+    }
+  }
+
+  /* keep the overlap and the samples of the next partial block */
+  uint32_t consumed = this->nblocks * this->step;
+  this->fill -= consumed;
+  memmove(this->input, this->input + consumed, this->fill * sizeof(float));
+  this->block_index += this->nblocks;
+  return this->nblocks;
+}
+
+
+uint32_t ols_get_output(ols_t *this, uint32_t band, float **output,
+                        uint64_t *index)
+{
+  if (band >= this->nbands) {
+    LOG_ERROR("invalid sub-band");
+    return 0;
+  }
+  *output = this->bands[band].output;
+  *index = this->output_index;
+  return this->nblocks * (this->step / this->bands[band].decimation);
+}
+
+
+/* internal functions */
+static uint32_t ols_overlap(uint32_t ntaps)
+{
+  /* a power of two, so that it is a multiple of every decimation */
+  uint32_t overlap = 1;
+  while (overlap < ntaps - 1) {
+    overlap *= 2;
+  }
+  return overlap;
+}
+
+
+static void *ols_worker_thread(void *arg)
+{
+  ols_worker_t *worker = (ols_worker_t *) arg;
+  ols_t *this = worker->ols;
+
+  while (1) {
+    while (sem_wait(&this->wake) < 0) {
+    }
+    if (atomic_load(&this->shutdown)) {
+      break;
+    }
+    uint32_t done = ols_run_blocks(this, worker);
+    if (done > 0) {
+      atomic_fetch_add_explicit(&this->done_blocks, done, memory_order_release);
+    }
+  }
+  return 0;
+}
+
+
+/* claims the blocks of the current call one at a time; returns how many
+   this thread filtered */
+static uint32_t ols_run_blocks(ols_t *this, ols_worker_t *worker)
+{
+  uint32_t done = 0;
+  uint_fast64_t work = atomic_load_explicit(&this->work, memory_order_acquire);
+  while (1) {
+    uint32_t nblocks = (uint32_t) (work >> 32);
+    uint32_t block = (uint32_t) work;
+    if (block >= nblocks) {
+      break;
+    }
+    if (atomic_compare_exchange_weak_explicit(&this->work, &work, work + 1,
+                                              memory_order_acq_rel,
+                                              memory_order_acquire)) {
+      ols_filter_block(this, worker, block);
+      done++;
+      work = atomic_load_explicit(&this->work, memory_order_acquire);
+    }
+  }
+  return done;
+}
+
+
+static void ols_filter_block(ols_t *this, ols_worker_t *worker, uint32_t block)
+{
+  uint32_t fft_size = this->fft_size;
+  float *spectrum = worker->spectrum;
+  fft_real_forward(worker->forward, this->input + block * this->step,
+                   spectrum);
+
+  /* first input sample of the block (the stream starts at 0), modulo
+     fft_size, for the phase of the band shift */
+  uint64_t start = (this->block_index + block) * this->step;
+  uint32_t start_mod = (uint32_t) ((start + fft_size - this->overlap) %
+                                   fft_size);
+
+  for (uint32_t i = 0; i < this->nbands; ++i) {
+    ols_band_t *band = &this->bands[i];
+    uint32_t npoints = band->npoints;
+    float *scratch = worker->scratch;
+    for (uint32_t k = 0; k < npoints; ++k) {
+      uint32_t s = band->source[k];
+      float x_re = spectrum[2*s];
+      float x_im = band->sign[k] * spectrum[2*s+1];
+      float h_re = band->response[2*k];
+      float h_im = band->response[2*k+1];
+      scratch[2*k] = x_re * h_re - x_im * h_im;
+      scratch[2*k+1] = x_re * h_im + x_im * h_re;
+    }
+    fft_complex(worker->inverse[i], scratch, 1);
+
+    /* the block is shifted down by its own start; the rest of the shift
+       is a constant phase per block */
+    uint32_t phase = (uint32_t) (((uint64_t) band->bin * start_mod) % fft_size);
+    float p_re = (float) cos(-2.0 * M_PI * phase / fft_size);
+    float p_im = (float) sin(-2.0 * M_PI * phase / fft_size);
+    uint32_t first = this->overlap / band->decimation;
+    uint32_t noutput = npoints - first;
+    const float *y = scratch + 2 * first;
+    float *out = band->output + 2 * (uint64_t) block * noutput;
+    for (uint32_t m = 0; m < noutput; ++m) {
+      out[2*m] = y[2*m] * p_re - y[2*m+1] * p_im;
+      out[2*m+1] = y[2*m] * p_im + y[2*m+1] * p_re;
+    }
+  }
+  return;
+}
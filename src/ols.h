@@ -0,0 +1,83 @@
+/*
+ * ols.h - overlap-save fast convolution filter bank
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __OLS_H
+#define __OLS_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct ols ols_t;
+
+/* ntaps = 0 picks fft_size / 4 + 1 taps */
+uint32_t ols_ntaps(uint32_t fft_size, uint32_t ntaps);
+
+/* power of two decimation of a sub-band, for an output rate clear of the
+   filter transition band */
+uint32_t ols_decimation(double sample_rate, uint32_t fft_size, uint32_t ntaps,
+                        double bandwidth);
+
+/* the sub-band centers are rounded to an FFT bin */
+double ols_center_frequency(double sample_rate, uint32_t fft_size,
+                            double frequency);
+
+/* fft_size is a power of two (at least 16), with ntaps - 1 up to half of
+   it; the bands must lie within 0 to sample_rate / 2 */
+int ols_check_params(double sample_rate, uint32_t fft_size, uint32_t ntaps,
+                     const struct sddc_subband *bands, uint32_t nbands);
+
+/* the FFT blocks of each call are spread over num_threads threads, the
+   calling thread included */
+ols_t *ols_open(double sample_rate, uint32_t fft_size, uint32_t ntaps,
+                const struct sddc_subband *bands, uint32_t nbands,
+                int num_threads, uint32_t max_samples);
+
+void ols_close(ols_t *this);
+
+void ols_reset(ols_t *this);
+
+uint32_t ols_get_num_bands(ols_t *this);
+
+double ols_get_output_sample_rate(ols_t *this, uint32_t band);
+
+/* filters the FFT blocks completed by the new samples; returns the
+   number of blocks */
+uint32_t ols_process(ols_t *this, const int16_t *samples, uint32_t nsamples);
+
+/* output of a band from the last ols_process() call: returns the number
+   of complex samples; *output points to an internal buffer with
+   interleaved I/Q floats, valid until the next call, and *index is the
+   input sample (since open or reset) of the first one, before the
+   (ntaps - 1) / 2 samples of filter delay */
+uint32_t ols_get_output(ols_t *this, uint32_t band, float **output,
+                        uint64_t *index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __OLS_H */
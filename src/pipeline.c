@@ -0,0 +1,946 @@
+/*
+ * pipeline.c - processing graph on a work-stealing thread pool
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The frames are reference counted handles: an input frame points into
+ * the USB buffer it arrived in, and the buffer goes back to the USB queue
+ * when the last stage is done with it; the output frames of a stage come
+ * from a pool sized when the pipeline starts, so nothing is allocated
+ * while streaming.
+ *
+ * Every stage has a bounded input queue, and a task on the thread pool is
+ * a stage with frames to process: an ordered stage has at most one task
+ * (it drains its queue in order), a parallel stage has one task per
+ * queued frame. Each worker keeps its tasks in a deque - it works LIFO at
+ * the tail (the frame it just emitted is still in its cache), and the idle
+ * workers steal FIFO from the head of the others.
+ */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipeline.h"
+#include "logging.h"
+
+
+typedef struct frame_pool frame_pool_t;
+typedef struct worker worker_t;
+
+/* internal functions */
+static int frame_pool_init(frame_pool_t *pool, pipeline_t *pipeline,
+                           uint32_t nframes, uint32_t size);
+static void frame_pool_free(frame_pool_t *pool);
+static sddc_frame_t *frame_pool_get(frame_pool_t *pool);
+static int pipeline_setup_stages(pipeline_t *this,
+                                 const struct pipeline_format *input);
+static int pipeline_merge_input(sddc_stage_t *stage,
+                                const struct pipeline_format *format);
+static void pipeline_free_stages(pipeline_t *this);
+static int stage_reaches(const sddc_stage_t *from, const sddc_stage_t *to);
+static int stage_push(sddc_stage_t *stage, sddc_frame_t *frame);
+static void stage_run(sddc_stage_t *stage);
+static void schedule(pipeline_t *this, sddc_stage_t *stage);
+static sddc_stage_t *next_task(worker_t *worker);
+static void *worker_thread(void *arg);
+
+
+#define MAX_STAGES (64)
+#define MAX_STAGE_OUTPUTS (8)
+#define MAX_THREADS (64)
+#define STAGE_NAME_SIZE (32)
+
+static const int DEFAULT_NUM_THREADS = 2;
+static const uint32_t DEFAULT_QUEUE_SIZE = 16;
+static const int ORDERED_BATCH = 8;   /* frames before an ordered stage yields */
+static const uint32_t FRAME_ALIGNMENT = 64;
+
+struct sddc_frame {
+  const uint8_t *data;
+  uint8_t *buffer;            /* 0 for the input frames (read only) */
+  uint32_t size;
+  uint32_t capacity;
+  enum SDDCFrameFormat format;
+  uint64_t sample_index;
+  atomic_int refs;
+  frame_pool_t *pool;
+  void *token;                /* input frames: handed back on release */
+};
+
+typedef struct frame_pool {
+  pthread_mutex_t lock;
+  pipeline_t *pipeline;
+  uint32_t nframes;
+  uint32_t nfree;
+  sddc_frame_t *frames;
+  sddc_frame_t **free_frames;
+  uint8_t *buffers;           /* 0 for the input frames */
+} frame_pool_t;
+
+struct sddc_stage {
+  pipeline_t *pipeline;
+  char name[STAGE_NAME_SIZE];
+  sddc_stage_cb_t callback;
+  void *context;
+  const struct pipeline_stage_ops *ops;
+  enum SDDCStageFlags flags;
+  uint32_t output_size;
+  enum SDDCFrameFormat output_format;
+  int noutputs;
+  sddc_stage_t *outputs[MAX_STAGE_OUTPUTS];
+  /* set up when the pipeline starts */
+  int active;                 /* reachable from the input frames */
+  int setup_done;
+  int pending_inputs;
+  struct pipeline_format input;
+  struct pipeline_format output;
+  frame_pool_t pool;
+  /* input queue */
+  pthread_mutex_t lock;
+  sddc_frame_t **queue;
+  uint32_t queue_size;
+  uint32_t queue_head;
+  uint32_t queue_count;
+  int scheduled;              /* ordered stages: task queued or running */
+  atomic_uint_fast64_t frames;
+  atomic_uint_fast64_t dropped;
+  atomic_uint_fast64_t alloc_failures;
+};
+
+typedef struct worker {
+  pipeline_t *pipeline;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  sddc_stage_t **tasks;       /* deque of capacity ntasks */
+  uint32_t head;
+  uint32_t count;
+  uint32_t index;
+} worker_t;
+
+typedef struct pipeline {
+  int nstages;
+  sddc_stage_t *stages[MAX_STAGES];
+  int ninputs;
+  sddc_stage_t *inputs[MAX_STAGES];
+  int num_threads;
+  int running;
+  worker_t *workers;
+  uint32_t ntasks;            /* upper bound of the queued tasks */
+  pthread_mutex_t lock;
+  pthread_cond_t work_available;
+  pthread_cond_t drained;
+  atomic_int pending_tasks;
+  atomic_int sleepers;
+  atomic_int outstanding;     /* frames queued or being processed */
+  atomic_int draining;
+  atomic_uint next_worker;
+  frame_pool_t input_pool;
+  pipeline_release_cb_t release;
+  void *release_context;
+} pipeline_t;
+
+static __thread worker_t *current_worker = 0;
+
+
+pipeline_t *pipeline_open()
+{
+  pipeline_t *this = (pipeline_t *) malloc(sizeof(pipeline_t));
+  if (this == 0) {
+    return 0;
+  }
+  this->nstages = 0;
+  this->ninputs = 0;
+  this->num_threads = DEFAULT_NUM_THREADS;
+  this->running = 0;
+  this->workers = 0;
+  this->ntasks = 0;
+  pthread_mutex_init(&this->lock, 0);
+  pthread_cond_init(&this->work_available, 0);
+  pthread_cond_init(&this->drained, 0);
+  atomic_init(&this->pending_tasks, 0);
+  atomic_init(&this->sleepers, 0);
+  atomic_init(&this->outstanding, 0);
+  atomic_init(&this->draining, 0);
+  atomic_init(&this->next_worker, 0);
+  memset(&this->input_pool, 0, sizeof(this->input_pool));
+  this->release = 0;
+  this->release_context = 0;
+  return this;
+}
+
+
+void pipeline_close(pipeline_t *this)
+{
+  if (this->running) {
+    pipeline_stop(this);
+  }
+  for (int i = 0; i < this->nstages; ++i) {
+    sddc_stage_t *stage = this->stages[i];
+    if (stage->ops && stage->ops->close) {
+      stage->ops->close(stage->context);
+    }
+    pthread_mutex_destroy(&stage->lock);
+    free(stage);
+  }
+  pthread_cond_destroy(&this->drained);
+  pthread_cond_destroy(&this->work_available);
+  pthread_mutex_destroy(&this->lock);
+  free(this);
+  return;
+}
+
+
+int pipeline_set_threads(pipeline_t *this, int num_threads)
+{
+  if (this->running) {
+    LOG_ERROR("pipeline is running");
+    return -1;
+  }
+  if (num_threads < 1 || num_threads > MAX_THREADS) {
+    LOG_ERROR("invalid number of pipeline threads: %d", num_threads);
+    return -1;
+  }
+  this->num_threads = num_threads;
+  return 0;
+}
+
+
+sddc_stage_t *pipeline_add_stage(pipeline_t *this, const char *name,
+                                 sddc_stage_cb_t callback, void *context,
+                                 const struct pipeline_stage_ops *ops,
+                                 enum SDDCStageFlags flags,
+                                 uint32_t queue_size, uint32_t output_size,
+                                 enum SDDCFrameFormat output_format)
+{
+  sddc_stage_t *ret_val = 0;
+
+  if (this->running) {
+    LOG_ERROR("pipeline is running");
+    return ret_val;
+  }
+  if (this->nstages == MAX_STAGES) {
+    LOG_ERROR("too many pipeline stages");
+    return ret_val;
+  }
+  if (callback == 0) {
+    LOG_ERROR("no stage callback");
+    return ret_val;
+  }
+
+  sddc_stage_t *stage = (sddc_stage_t *) malloc(sizeof(sddc_stage_t));
+  if (stage == 0) {
+    LOG_ERROR("malloc() failed");
+    return ret_val;
+  }
+  stage->pipeline = this;
+  snprintf(stage->name, sizeof(stage->name), "%s", name ? name : "stage");
+  stage->callback = callback;
+  stage->context = context;
+  stage->ops = ops;
+  stage->flags = flags;
+  stage->output_size = output_size;
+  stage->output_format = output_format;
+  stage->noutputs = 0;
+  stage->active = 0;
+  stage->setup_done = 0;
+  stage->pending_inputs = 0;
+  memset(&stage->pool, 0, sizeof(stage->pool));
+  pthread_mutex_init(&stage->lock, 0);
+  stage->queue = 0;
+  stage->queue_size = queue_size > 0 ? queue_size : DEFAULT_QUEUE_SIZE;
+  stage->queue_head = 0;
+  stage->queue_count = 0;
+  stage->scheduled = 0;
+  atomic_init(&stage->frames, 0);
+  atomic_init(&stage->dropped, 0);
+  atomic_init(&stage->alloc_failures, 0);
+  this->stages[this->nstages++] = stage;
+
+  ret_val = stage;
+  return ret_val;
+}
+
+
+int pipeline_connect(pipeline_t *this, sddc_stage_t *from, sddc_stage_t *to)
+{
+  if (this->running) {
+    LOG_ERROR("pipeline is running");
+    return -1;
+  }
+  if (to == 0 || to->pipeline != this || (from && from->pipeline != this)) {
+    LOG_ERROR("invalid pipeline stage");
+    return -1;
+  }
+
+  if (from == 0) {
+    for (int i = 0; i < this->ninputs; ++i) {
+      if (this->inputs[i] == to) {
+        return 0;
+      }
+    }
+    this->inputs[this->ninputs++] = to;
+    return 0;
+  }
+
+  for (int i = 0; i < from->noutputs; ++i) {
+    if (from->outputs[i] == to) {
+      return 0;
+    }
+  }
+  if (from->noutputs == MAX_STAGE_OUTPUTS) {
+    LOG_ERROR("too many outputs for pipeline stage %s", from->name);
+    return -1;
+  }
+  if (stage_reaches(to, from)) {
+    LOG_ERROR("connecting %s to %s would make a cycle", from->name, to->name);
+    return -1;
+  }
+  from->outputs[from->noutputs++] = to;
+  return 0;
+}
+
+
+int pipeline_has_inputs(pipeline_t *this)
+{
+  return this->ninputs > 0;
+}
+
+
+int pipeline_start(pipeline_t *this, const struct pipeline_format *input,
+                   uint32_t max_inputs, pipeline_release_cb_t release,
+                   void *release_context)
+{
+  if (this->running) {
+    LOG_ERROR("pipeline is already running");
+    return -1;
+  }
+
+  if (pipeline_setup_stages(this, input) < 0) {
+    pipeline_free_stages(this);
+    return -1;
+  }
+
+  /* an ordered stage has at most one task queued, a parallel stage one
+     per queued frame - any deque can hold all of them */
+  this->ntasks = 1;
+  for (int i = 0; i < this->nstages; ++i) {
+    sddc_stage_t *stage = this->stages[i];
+    if (!stage->active) {
+      continue;
+    }
+    stage->queue = (sddc_frame_t **) malloc(stage->queue_size * sizeof(sddc_frame_t *));
+    if (stage->queue == 0) {
+      LOG_ERROR("malloc() failed");
+      pipeline_free_stages(this);
+      return -1;
+    }
+    stage->queue_head = 0;
+    stage->queue_count = 0;
+    stage->scheduled = 0;
+    this->ntasks += stage->flags & SDDC_STAGE_PARALLEL ? stage->queue_size : 1;
+
+    int owns_output = stage->ops && stage->ops->setup ?
+                      stage->output.size > 0 : stage->output_size > 0;
+    if (owns_output) {
+      uint32_t nframes = this->num_threads + 1;
+      for (int j = 0; j < stage->noutputs; ++j) {
+        nframes += stage->outputs[j]->queue_size;
+      }
+      if (frame_pool_init(&stage->pool, this, nframes, stage->output.size) < 0) {
+        pipeline_free_stages(this);
+        return -1;
+      }
+    }
+  }
+  if (frame_pool_init(&this->input_pool, this, max_inputs, 0) < 0) {
+    pipeline_free_stages(this);
+    return -1;
+  }
+  this->release = release;
+  this->release_context = release_context;
+
+  atomic_store(&this->pending_tasks, 0);
+  atomic_store(&this->outstanding, 0);
+  atomic_store(&this->draining, 0);
+  this->workers = (worker_t *) malloc(this->num_threads * sizeof(worker_t));
+  if (this->workers == 0) {
+    LOG_ERROR("malloc() failed");
+    pipeline_free_stages(this);
+    return -1;
+  }
+  for (int i = 0; i < this->num_threads; ++i) {
+    worker_t *worker = &this->workers[i];
+    worker->pipeline = this;
+    worker->tasks = (sddc_stage_t **) malloc(this->ntasks * sizeof(sddc_stage_t *));
+    if (worker->tasks == 0) {
+      LOG_ERROR("malloc() failed");
+      for (int j = 0; j < i; ++j) {
+        pthread_mutex_destroy(&this->workers[j].lock);
+        free(this->workers[j].tasks);
+      }
+      free(this->workers);
+      this->workers = 0;
+      pipeline_free_stages(this);
+      return -1;
+    }
+    pthread_mutex_init(&worker->lock, 0);
+    worker->head = 0;
+    worker->count = 0;
+    worker->index = i;
+  }
+  this->running = 1;
+  for (int i = 0; i < this->num_threads; ++i) {
+    int ret = pthread_create(&this->workers[i].thread, 0, worker_thread,
+                             &this->workers[i]);
+    if (ret != 0) {
+      LOG_ERROR("pthread_create() failed: %s", strerror(ret));
+      for (int j = i; j < this->num_threads; ++j) {
+        pthread_mutex_destroy(&this->workers[j].lock);
+        free(this->workers[j].tasks);
+      }
+      int num_threads = this->num_threads;
+      this->num_threads = i;
+      pipeline_stop(this);
+      this->num_threads = num_threads;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+void pipeline_stop(pipeline_t *this)
+{
+  if (!this->running) {
+    return;
+  }
+
+  /* let the workers drain the queues */
+  atomic_store(&this->draining, 1);
+  pthread_mutex_lock(&this->lock);
+  while (atomic_load(&this->outstanding) > 0) {
+    pthread_cond_wait(&this->drained, &this->lock);
+  }
+  this->running = 0;
+  pthread_cond_broadcast(&this->work_available);
+  pthread_mutex_unlock(&this->lock);
+
+  for (int i = 0; i < this->num_threads; ++i) {
+    pthread_join(this->workers[i].thread, 0);
+  }
+  for (int i = 0; i < this->num_threads; ++i) {
+    pthread_mutex_destroy(&this->workers[i].lock);
+    free(this->workers[i].tasks);
+  }
+  free(this->workers);
+  this->workers = 0;
+
+  pipeline_free_stages(this);
+  return;
+}
+
+
+int pipeline_push(pipeline_t *this, const uint8_t *data, uint32_t size,
+                  uint64_t sample_index, void *token)
+{
+  sddc_frame_t *frame = this->running ? frame_pool_get(&this->input_pool) : 0;
+  if (frame == 0) {
+    this->release(token, this->release_context);
+    pipeline_drop(this);
+    return -1;
+  }
+  frame->data = data;
+  frame->size = size;
+  frame->capacity = size;
+  frame->format = SDDC_FRAME_INT16;
+  frame->sample_index = sample_index;
+  frame->token = token;
+
+  for (int i = 0; i < this->ninputs; ++i) {
+    stage_push(this->inputs[i], frame);
+  }
+  sddc_frame_unref(frame);
+  return 0;
+}
+
+
+void pipeline_drop(pipeline_t *this)
+{
+  for (int i = 0; i < this->ninputs; ++i) {
+    atomic_fetch_add(&this->inputs[i]->dropped, 1);
+  }
+  return;
+}
+
+
+/* stage and frame functions (public) */
+int sddc_stage_get_stats(sddc_stage_t *stage, struct sddc_stage_stats *stats)
+{
+  stats->frames = atomic_load(&stage->frames);
+  stats->dropped = atomic_load(&stage->dropped);
+  stats->alloc_failures = atomic_load(&stage->alloc_failures);
+  pthread_mutex_lock(&stage->lock);
+  stats->queued = stage->queue_count;
+  pthread_mutex_unlock(&stage->lock);
+  return 0;
+}
+
+
+sddc_frame_t *sddc_stage_alloc_frame(sddc_stage_t *stage,
+                                     const sddc_frame_t *input)
+{
+  if (stage->pool.nframes == 0) {
+    LOG_ERROR("pipeline stage %s has no output frames", stage->name);
+    return 0;
+  }
+  sddc_frame_t *frame = frame_pool_get(&stage->pool);
+  if (frame == 0) {
+    atomic_fetch_add(&stage->alloc_failures, 1);
+    return 0;
+  }
+  frame->size = frame->capacity;
+  frame->format = stage->output.format;
+  frame->sample_index = input ? input->sample_index : 0;
+  return frame;
+}
+
+
+int sddc_stage_emit(sddc_stage_t *stage, sddc_frame_t *frame)
+{
+  int ret_val = 0;
+  for (int i = 0; i < stage->noutputs; ++i) {
+    if (stage_push(stage->outputs[i], frame) < 0) {
+      ret_val = -1;
+    }
+  }
+  return ret_val;
+}
+
+
+const void *sddc_frame_data(const sddc_frame_t *frame)
+{
+  return frame->data;
+}
+
+
+void *sddc_frame_writable_data(sddc_frame_t *frame)
+{
+  return frame->buffer;
+}
+
+
+uint32_t sddc_frame_size(const sddc_frame_t *frame)
+{
+  return frame->size;
+}
+
+
+int sddc_frame_set_size(sddc_frame_t *frame, uint32_t size)
+{
+  if (frame->buffer == 0 || size > frame->capacity) {
+    return -1;
+  }
+  frame->size = size;
+  return 0;
+}
+
+
+enum SDDCFrameFormat sddc_frame_format(const sddc_frame_t *frame)
+{
+  return frame->format;
+}
+
+
+uint64_t sddc_frame_sample_index(const sddc_frame_t *frame)
+{
+  return frame->sample_index;
+}
+
+
+void sddc_frame_ref(sddc_frame_t *frame)
+{
+  atomic_fetch_add(&frame->refs, 1);
+  return;
+}
+
+
+void sddc_frame_unref(sddc_frame_t *frame)
+{
+  if (atomic_fetch_sub(&frame->refs, 1) != 1) {
+    return;
+  }
+  frame_pool_t *pool = frame->pool;
+  if (pool->buffers == 0) {
+    pool->pipeline->release(frame->token, pool->pipeline->release_context);
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->free_frames[pool->nfree++] = frame;
+  pthread_mutex_unlock(&pool->lock);
+  return;
+}
+
+
+/* internal functions */
+static int frame_pool_init(frame_pool_t *pool, pipeline_t *pipeline,
+                           uint32_t nframes, uint32_t size)
+{
+  uint32_t stride = (size + FRAME_ALIGNMENT - 1) / FRAME_ALIGNMENT * FRAME_ALIGNMENT;
+  pthread_mutex_init(&pool->lock, 0);
+  pool->pipeline = pipeline;
+  pool->nframes = nframes;
+  pool->nfree = nframes;
+  pool->frames = (sddc_frame_t *) calloc(nframes, sizeof(sddc_frame_t));
+  pool->free_frames = (sddc_frame_t **) malloc(nframes * sizeof(sddc_frame_t *));
+  pool->buffers = 0;
+  if (pool->frames == 0 || pool->free_frames == 0) {
+    LOG_ERROR("malloc() failed");
+    free(pool->free_frames);
+    free(pool->frames);
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, 0, sizeof(*pool));
+    return -1;
+  }
+  if (size > 0) {
+    pool->buffers = (uint8_t *) aligned_alloc(FRAME_ALIGNMENT, (size_t) nframes * stride);
+    if (pool->buffers == 0) {
+      LOG_ERROR("aligned_alloc() failed");
+      frame_pool_free(pool);
+      return -1;
+    }
+  }
+  for (uint32_t i = 0; i < nframes; ++i) {
+    sddc_frame_t *frame = &pool->frames[i];
+    frame->buffer = pool->buffers ? pool->buffers + (size_t) i * stride : 0;
+    frame->data = frame->buffer;
+    frame->capacity = size;
+    frame->pool = pool;
+    atomic_init(&frame->refs, 0);
+    pool->free_frames[i] = frame;
+  }
+  return 0;
+}
+
+static void frame_pool_free(frame_pool_t *pool)
+{
+  if (pool->frames == 0) {
+    return;
+  }
+  if (pool->nfree != pool->nframes) {
+    LOG_WARNING("%u pipeline frames still referenced", pool->nframes - pool->nfree);
+  }
+  free(pool->buffers);
+  free(pool->free_frames);
+  free(pool->frames);
+  pthread_mutex_destroy(&pool->lock);
+  memset(pool, 0, sizeof(*pool));
+  return;
+}
+
+static sddc_frame_t *frame_pool_get(frame_pool_t *pool)
+{
+  sddc_frame_t *frame = 0;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->nfree > 0) {
+    frame = pool->free_frames[--pool->nfree];
+  }
+  pthread_mutex_unlock(&pool->lock);
+  if (frame) {
+    atomic_store(&frame->refs, 1);
+  }
+  return frame;
+}
+
+/* the formats flow from the input frames through the graph in
+   topological order; every stage is set up once all its inputs are */
+static int pipeline_setup_stages(pipeline_t *this,
+                                 const struct pipeline_format *input)
+{
+  sddc_stage_t *ready[MAX_STAGES];
+  int nready = 0;
+
+  /* the stages reachable from the input frames */
+  for (int i = 0; i < this->nstages; ++i) {
+    this->stages[i]->active = 0;
+    this->stages[i]->setup_done = 0;
+    this->stages[i]->pending_inputs = 0;
+  }
+  for (int i = 0; i < this->ninputs; ++i) {
+    ready[nready++] = this->inputs[i];
+    this->inputs[i]->active = 1;
+  }
+  for (int i = 0; i < nready; ++i) {
+    sddc_stage_t *stage = ready[i];
+    for (int j = 0; j < stage->noutputs; ++j) {
+      if (!stage->outputs[j]->active) {
+        stage->outputs[j]->active = 1;
+        ready[nready++] = stage->outputs[j];
+      }
+    }
+  }
+  for (int i = 0; i < this->nstages; ++i) {
+    sddc_stage_t *stage = this->stages[i];
+    for (int j = 0; stage->active && j < stage->noutputs; ++j) {
+      stage->outputs[j]->pending_inputs++;
+    }
+  }
+
+  nready = 0;
+  for (int i = 0; i < this->ninputs; ++i) {
+    sddc_stage_t *stage = this->inputs[i];
+    stage->input = *input;
+    stage->setup_done = -1;     /* input format set */
+    if (stage->pending_inputs == 0) {
+      ready[nready++] = stage;
+    }
+  }
+  for (int i = 0; i < nready; ++i) {
+    sddc_stage_t *stage = ready[i];
+    stage->output.size = stage->output_size;
+    stage->output.format = stage->output_format;
+    stage->output.sample_rate = stage->input.sample_rate;
+    if (stage->ops && stage->ops->setup) {
+      if (stage->ops->setup(&stage->input, &stage->output, stage->context) < 0) {
+        LOG_ERROR("setup of pipeline stage %s failed", stage->name);
+        stage->setup_done = 0;
+        return -1;
+      }
+    } else if (stage->output_size == 0) {
+      /* a stage without its own frames forwards the input ones */
+      stage->output = stage->input;
+    }
+    stage->setup_done = 1;
+
+    for (int j = 0; j < stage->noutputs; ++j) {
+      sddc_stage_t *output = stage->outputs[j];
+      if (pipeline_merge_input(output, &stage->output) < 0) {
+        LOG_ERROR("pipeline stage %s: inputs with different formats", output->name);
+        return -1;
+      }
+      if (--output->pending_inputs == 0) {
+        ready[nready++] = output;
+      }
+    }
+  }
+  return 0;
+}
+
+static int pipeline_merge_input(sddc_stage_t *stage,
+                                const struct pipeline_format *format)
+{
+  if (stage->setup_done == 0) {
+    stage->input = *format;
+    stage->setup_done = -1;
+    return 0;
+  }
+  if (stage->input.format != format->format ||
+      fabs(stage->input.sample_rate - format->sample_rate) > 1e-6 * format->sample_rate) {
+    return -1;
+  }
+  if (format->size > stage->input.size) {
+    stage->input.size = format->size;
+  }
+  return 0;
+}
+
+static void pipeline_free_stages(pipeline_t *this)
+{
+  for (int i = 0; i < this->nstages; ++i) {
+    sddc_stage_t *stage = this->stages[i];
+    if (stage->setup_done == 1 && stage->ops && stage->ops->stop) {
+      stage->ops->stop(stage->context);
+    }
+    stage->setup_done = 0;
+    stage->active = 0;
+    free(stage->queue);
+    stage->queue = 0;
+    frame_pool_free(&stage->pool);
+  }
+  frame_pool_free(&this->input_pool);
+  return;
+}
+
+static int stage_reaches(const sddc_stage_t *from, const sddc_stage_t *to)
+{
+  if (from == to) {
+    return 1;
+  }
+  for (int i = 0; i < from->noutputs; ++i) {
+    if (stage_reaches(from->outputs[i], to)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* a full queue drops the frame for this stage only - the USB thread and
+   the other consumers never wait on a slow stage */
+static int stage_push(sddc_stage_t *stage, sddc_frame_t *frame)
+{
+  pthread_mutex_lock(&stage->lock);
+  if (stage->queue_count == stage->queue_size) {
+    pthread_mutex_unlock(&stage->lock);
+    atomic_fetch_add(&stage->dropped, 1);
+    return -1;
+  }
+  sddc_frame_ref(frame);
+  uint32_t tail = (stage->queue_head + stage->queue_count) % stage->queue_size;
+  stage->queue[tail] = frame;
+  stage->queue_count++;
+  int run = (stage->flags & SDDC_STAGE_PARALLEL) || !stage->scheduled;
+  stage->scheduled = 1;
+  atomic_fetch_add(&stage->pipeline->outstanding, 1);
+  pthread_mutex_unlock(&stage->lock);
+
+  if (run) {
+    schedule(stage->pipeline, stage);
+  }
+  return 0;
+}
+
+static void stage_run(sddc_stage_t *stage)
+{
+  pipeline_t *this = stage->pipeline;
+  int parallel = stage->flags & SDDC_STAGE_PARALLEL;
+  int nframes = parallel ? 1 : ORDERED_BATCH;
+
+  for (int i = 0; i < nframes; ++i) {
+    pthread_mutex_lock(&stage->lock);
+    if (stage->queue_count == 0) {
+      stage->scheduled = 0;
+      pthread_mutex_unlock(&stage->lock);
+      return;
+    }
+    sddc_frame_t *frame = stage->queue[stage->queue_head];
+    stage->queue_head = (stage->queue_head + 1) % stage->queue_size;
+    stage->queue_count--;
+    pthread_mutex_unlock(&stage->lock);
+
+    stage->callback(stage, frame, stage->context);
+    atomic_fetch_add(&stage->frames, 1);
+    sddc_frame_unref(frame);
+
+    if (atomic_fetch_sub(&this->outstanding, 1) == 1 &&
+        atomic_load(&this->draining)) {
+      pthread_mutex_lock(&this->lock);
+      pthread_cond_broadcast(&this->drained);
+      pthread_mutex_unlock(&this->lock);
+    }
+  }
+  if (parallel) {
+    return;
+  }
+
+  /* yield the worker after a batch, so the other stages get their turn */
+  pthread_mutex_lock(&stage->lock);
+  int more = stage->queue_count > 0;
+  stage->scheduled = more;
+  pthread_mutex_unlock(&stage->lock);
+  if (more) {
+    schedule(this, stage);
+  }
+  return;
+}
+
+static void schedule(pipeline_t *this, sddc_stage_t *stage)
+{
+  worker_t *worker = current_worker;
+  if (worker == 0 || worker->pipeline != this) {
+    unsigned int index = atomic_fetch_add(&this->next_worker, 1);
+    worker = &this->workers[index % this->num_threads];
+  }
+  pthread_mutex_lock(&worker->lock);
+  worker->tasks[(worker->head + worker->count) % this->ntasks] = stage;
+  worker->count++;
+  pthread_mutex_unlock(&worker->lock);
+
+  atomic_fetch_add(&this->pending_tasks, 1);
+  if (atomic_load(&this->sleepers) > 0) {
+    pthread_mutex_lock(&this->lock);
+    pthread_cond_signal(&this->work_available);
+    pthread_mutex_unlock(&this->lock);
+  }
+  return;
+}
+
+static sddc_stage_t *next_task(worker_t *worker)
+{
+  pipeline_t *this = worker->pipeline;
+  sddc_stage_t *task = 0;
+
+  /* own tasks first, newest first */
+  pthread_mutex_lock(&worker->lock);
+  if (worker->count > 0) {
+    worker->count--;
+    task = worker->tasks[(worker->head + worker->count) % this->ntasks];
+  }
+  pthread_mutex_unlock(&worker->lock);
+
+  /* then steal the oldest task of another worker */
+  for (int i = 1; task == 0 && i < this->num_threads; ++i) {
+    worker_t *victim = &this->workers[(worker->index + i) % this->num_threads];
+    pthread_mutex_lock(&victim->lock);
+    if (victim->count > 0) {
+      task = victim->tasks[victim->head];
+      victim->head = (victim->head + 1) % this->ntasks;
+      victim->count--;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+
+  if (task) {
+    atomic_fetch_sub(&this->pending_tasks, 1);
+  }
+  return task;
+}
+
+static void *worker_thread(void *arg)
+{
+  worker_t *worker = (worker_t *) arg;
+  pipeline_t *this = worker->pipeline;
+  current_worker = worker;
+
+  for (;;) {
+    sddc_stage_t *task = next_task(worker);
+    if (task) {
+      stage_run(task);
+      continue;
+    }
+
+    pthread_mutex_lock(&this->lock);
+    atomic_fetch_add(&this->sleepers, 1);
+    while (atomic_load(&this->pending_tasks) == 0 && this->running) {
+      pthread_cond_wait(&this->work_available, &this->lock);
+    }
+    atomic_fetch_sub(&this->sleepers, 1);
+    int running = this->running;
+    pthread_mutex_unlock(&this->lock);
+    if (!running && atomic_load(&this->pending_tasks) == 0) {
+      break;
+    }
+  }
+
+  current_worker = 0;
+  return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * pipeline.h - processing graph on a work-stealing thread pool
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __PIPELINE_H
+#define __PIPELINE_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pipeline pipeline_t;
+
+/* what flows along an edge of the graph */
+struct pipeline_format {
+  uint32_t size;                /* max frame size (bytes) */
+  enum SDDCFrameFormat format;
+  double sample_rate;
+};
+
+/* the built in stages size their outputs (and allocate their state) when
+   the pipeline starts, from the format of their input */
+struct pipeline_stage_ops {
+  int (*setup)(const struct pipeline_format *input,
+               struct pipeline_format *output, void *context);
+  void (*stop)(void *context);
+  void (*close)(void *context);
+};
+
+/* called (from any thread) when the last reference to an input frame is
+   gone, with the token given to pipeline_push() */
+typedef void (*pipeline_release_cb_t)(void *token, void *context);
+
+pipeline_t *pipeline_open();
+
+void pipeline_close(pipeline_t *this);
+
+int pipeline_set_threads(pipeline_t *this, int num_threads);
+
+sddc_stage_t *pipeline_add_stage(pipeline_t *this, const char *name,
+                                 sddc_stage_cb_t callback, void *context,
+                                 const struct pipeline_stage_ops *ops,
+                                 enum SDDCStageFlags flags,
+                                 uint32_t queue_size, uint32_t output_size,
+                                 enum SDDCFrameFormat output_format);
+
+int pipeline_connect(pipeline_t *this, sddc_stage_t *from, sddc_stage_t *to);
+
+/* true if any stage is connected to the input frames */
+int pipeline_has_inputs(pipeline_t *this);
+
+int pipeline_start(pipeline_t *this, const struct pipeline_format *input,
+                   uint32_t max_inputs, pipeline_release_cb_t release,
+                   void *release_context);
+
+/* waits for all the queued frames to be processed */
+void pipeline_stop(pipeline_t *this);
+
+/* called from the USB thread: the frame is passed by reference to the
+   input stages, and released (see above) once they are all done with it */
+int pipeline_push(pipeline_t *this, const uint8_t *data, uint32_t size,
+                  uint64_t sample_index, void *token);
+
+/* the input frame could not be taken - counted as dropped on the input
+   stages */
+void pipeline_drop(pipeline_t *this);
+
+/* built in stages (pipeline_stages.c) */
+sddc_stage_t *pipeline_add_convert(pipeline_t *this);
+
+sddc_stage_t *pipeline_add_ddc(pipeline_t *this, double center_frequency,
+                               double bandwidth);
+
+sddc_stage_t *pipeline_add_fft(pipeline_t *this, uint32_t fft_size);
+
+sddc_stage_t *pipeline_add_record(pipeline_t *this, int fd);
+
+sddc_stage_t *pipeline_add_history(pipeline_t *this, sddc_history_t *history,
+                                   double interval);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __PIPELINE_H */
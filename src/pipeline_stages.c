@@ -0,0 +1,529 @@
+/*
+ * pipeline_stages.c - built in pipeline stages
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pipeline.h"
+#include "ddc.h"
+#include "dsp.h"
+#include "fft.h"
+#include "logging.h"
+
+
+struct fft_stage;
+struct history_stage;
+
+/* internal functions */
+static int convert_setup(const struct pipeline_format *input,
+                         struct pipeline_format *output, void *context);
+static void convert_process(sddc_stage_t *stage, sddc_frame_t *frame,
+                            void *context);
+static int ddc_stage_setup(const struct pipeline_format *input,
+                           struct pipeline_format *output, void *context);
+static void ddc_stage_stop(void *context);
+static void ddc_stage_process(sddc_stage_t *stage, sddc_frame_t *frame,
+                              void *context);
+static int fft_stage_setup(const struct pipeline_format *input,
+                           struct pipeline_format *output, void *context);
+static void fft_stage_stop(void *context);
+static void fft_stage_process(sddc_stage_t *stage, sddc_frame_t *frame,
+                              void *context);
+static void fft_stage_block(struct fft_stage *this);
+static void record_process(sddc_stage_t *stage, sddc_frame_t *frame,
+                           void *context);
+static int history_stage_setup(const struct pipeline_format *input,
+                               struct pipeline_format *output, void *context);
+static void history_stage_stop(void *context);
+static void history_stage_process(sddc_stage_t *stage, sddc_frame_t *frame,
+                                  void *context);
+static void history_stage_append(struct history_stage *this);
+
+
+static const uint32_t DEFAULT_QUEUE_SIZE = 16;
+
+
+/* int16 ADC samples to float (scaled to +/-1.0) - ordered, since the
+   stages after it are usually stateful filters */
+static const struct pipeline_stage_ops convert_ops = {
+  convert_setup, 0, 0
+};
+
+sddc_stage_t *pipeline_add_convert(pipeline_t *this)
+{
+  return pipeline_add_stage(this, "convert", convert_process, 0,
+                            &convert_ops, SDDC_STAGE_ORDERED,
+                            DEFAULT_QUEUE_SIZE, 0, SDDC_FRAME_FLOAT);
+}
+
+static int convert_setup(const struct pipeline_format *input,
+                         struct pipeline_format *output,
+                         void *context __attribute__((unused)))
+{
+  if (input->format != SDDC_FRAME_INT16) {
+    LOG_ERROR("convert stage input must be int16");
+    return -1;
+  }
+  output->size = input->size / sizeof(int16_t) * sizeof(float);
+  return 0;
+}
+
+static void convert_process(sddc_stage_t *stage, sddc_frame_t *frame,
+                            void *context __attribute__((unused)))
+{
+  sddc_frame_t *output = sddc_stage_alloc_frame(stage, frame);
+  if (output == 0) {
+    return;
+  }
+  uint32_t n = sddc_frame_size(frame) / sizeof(int16_t);
+  dsp_int16_to_float((const int16_t *) sddc_frame_data(frame),
+                     (float *) sddc_frame_writable_data(output), n);
+  sddc_frame_set_size(output, n * sizeof(float));
+  sddc_stage_emit(stage, output);
+  sddc_frame_unref(output);
+  return;
+}
+
+
+/* digital down conversion of the ADC samples (mix, filter, decimate) to
+   complex baseband */
+struct ddc_stage {
+  double center_frequency;
+  double bandwidth;
+  ddc_t *ddc;
+};
+
+static const struct pipeline_stage_ops ddc_stage_ops = {
+  ddc_stage_setup, ddc_stage_stop, free
+};
+
+sddc_stage_t *pipeline_add_ddc(pipeline_t *this, double center_frequency,
+                               double bandwidth)
+{
+  if (bandwidth <= 0) {
+    LOG_ERROR("invalid bandwidth");
+    return 0;
+  }
+  struct ddc_stage *context = (struct ddc_stage *) malloc(sizeof(struct ddc_stage));
+  context->center_frequency = center_frequency;
+  context->bandwidth = bandwidth;
+  context->ddc = 0;
+  sddc_stage_t *stage = pipeline_add_stage(this, "ddc", ddc_stage_process,
+                                           context, &ddc_stage_ops,
+                                           SDDC_STAGE_ORDERED,
+                                           DEFAULT_QUEUE_SIZE, 0,
+                                           SDDC_FRAME_COMPLEX_FLOAT);
+  if (stage == 0) {
+    free(context);
+  }
+  return stage;
+}
+
+static int ddc_stage_setup(const struct pipeline_format *input,
+                           struct pipeline_format *output, void *context)
+{
+  struct ddc_stage *this = (struct ddc_stage *) context;
+  if (input->format != SDDC_FRAME_INT16) {
+    LOG_ERROR("ddc stage input must be int16");
+    return -1;
+  }
+  uint32_t max_samples = input->size / sizeof(int16_t);
+  this->ddc = ddc_open(input->sample_rate, this->center_frequency,
+                       this->bandwidth, 0, max_samples);
+  if (this->ddc == 0) {
+    LOG_ERROR("ddc_open() failed");
+    return -1;
+  }
+  uint32_t max_output = max_samples / ddc_get_decimation(this->ddc) + 1;
+  output->size = max_output * 2 * sizeof(float);
+  output->sample_rate = ddc_get_output_sample_rate(this->ddc);
+  return 0;
+}
+
+static void ddc_stage_stop(void *context)
+{
+  struct ddc_stage *this = (struct ddc_stage *) context;
+  ddc_close(this->ddc);
+  this->ddc = 0;
+  return;
+}
+
+static void ddc_stage_process(sddc_stage_t *stage, sddc_frame_t *frame,
+                              void *context)
+{
+  struct ddc_stage *this = (struct ddc_stage *) context;
+  float *samples;
+  uint32_t n = ddc_process(this->ddc, (const int16_t *) sddc_frame_data(frame),
+                           sddc_frame_size(frame) / sizeof(int16_t), &samples);
+  if (n == 0) {
+    return;
+  }
+  sddc_frame_t *output = sddc_stage_alloc_frame(stage, frame);
+  if (output == 0) {
+    return;
+  }
+  memcpy(sddc_frame_writable_data(output), samples, n * 2 * sizeof(float));
+  sddc_frame_set_size(output, n * 2 * sizeof(float));
+  sddc_stage_emit(stage, output);
+  sddc_frame_unref(output);
+  return;
+}
+
+
+/* power spectrum (dB, Hann window) averaged over the FFT blocks of each
+   input frame; real inputs give fft_size / 2 + 1 bins, complex ones
+   fft_size bins in FFT order (DC first) */
+struct fft_stage {
+  uint32_t fft_size;
+  int complex_input;
+  uint32_t nbins;
+  fft_t *fft;
+  float *window;
+  float *block;               /* fft_size real or complex samples */
+  uint32_t block_pos;
+  float *spectrum;            /* FFT output */
+  double *power;
+  uint32_t navg;
+  double scale;
+};
+
+static const struct pipeline_stage_ops fft_stage_ops = {
+  fft_stage_setup, fft_stage_stop, free
+};
+
+sddc_stage_t *pipeline_add_fft(pipeline_t *this, uint32_t fft_size)
+{
+  if (fft_size < 4 || (fft_size & (fft_size - 1)) != 0) {
+    LOG_ERROR("invalid FFT size: %u", fft_size);
+    return 0;
+  }
+  struct fft_stage *context = (struct fft_stage *) calloc(1, sizeof(struct fft_stage));
+  context->fft_size = fft_size;
+  sddc_stage_t *stage = pipeline_add_stage(this, "fft", fft_stage_process,
+                                           context, &fft_stage_ops,
+                                           SDDC_STAGE_ORDERED,
+                                           DEFAULT_QUEUE_SIZE, 0,
+                                           SDDC_FRAME_FLOAT);
+  if (stage == 0) {
+    free(context);
+  }
+  return stage;
+}
+
+static int fft_stage_setup(const struct pipeline_format *input,
+                           struct pipeline_format *output, void *context)
+{
+  struct fft_stage *this = (struct fft_stage *) context;
+  uint32_t n = this->fft_size;
+  if (input->format == SDDC_FRAME_BYTES) {
+    LOG_ERROR("fft stage input must be samples");
+    return -1;
+  }
+  this->complex_input = input->format == SDDC_FRAME_COMPLEX_FLOAT;
+  this->nbins = this->complex_input ? n : n / 2 + 1;
+  this->fft = fft_open(n);
+  if (this->fft == 0) {
+    LOG_ERROR("fft_open() failed");
+    return -1;
+  }
+  this->window = (float *) malloc(n * sizeof(float));
+  double window_sum = 0;
+  for (uint32_t i = 0; i < n; ++i) {
+    this->window[i] = (float) (0.5 - 0.5 * cos(2 * M_PI * i / n));
+    window_sum += this->window[i];
+  }
+  this->block = (float *) malloc(2 * n * sizeof(float));
+  this->block_pos = 0;
+  this->spectrum = (float *) malloc((2 * n + 2) * sizeof(float));
+  this->power = (double *) calloc(this->nbins, sizeof(double));
+  this->navg = 0;
+  this->scale = 1.0 / (window_sum * window_sum);
+
+  output->size = this->nbins * sizeof(float);
+  output->sample_rate = input->sample_rate / n;
+  return 0;
+}
+
+static void fft_stage_stop(void *context)
+{
+  struct fft_stage *this = (struct fft_stage *) context;
+  fft_close(this->fft);
+  free(this->window);
+  free(this->block);
+  free(this->spectrum);
+  free(this->power);
+  this->fft = 0;
+  this->window = 0;
+  this->block = 0;
+  this->spectrum = 0;
+  this->power = 0;
+  return;
+}
+
+static void fft_stage_process(sddc_stage_t *stage, sddc_frame_t *frame,
+                              void *context)
+{
+  struct fft_stage *this = (struct fft_stage *) context;
+  enum SDDCFrameFormat format = sddc_frame_format(frame);
+  const void *data = sddc_frame_data(frame);
+  uint32_t n;
+  if (format == SDDC_FRAME_INT16) {
+    n = sddc_frame_size(frame) / sizeof(int16_t);
+  } else if (format == SDDC_FRAME_FLOAT) {
+    n = sddc_frame_size(frame) / sizeof(float);
+  } else {
+    n = sddc_frame_size(frame) / (2 * sizeof(float));
+  }
+
+  /* the blocks may straddle frames */
+  for (uint32_t i = 0; i < n; ) {
+    uint32_t count = this->fft_size - this->block_pos;
+    count = count < n - i ? count : n - i;
+    if (format == SDDC_FRAME_INT16) {
+      dsp_int16_to_float((const int16_t *) data + i,
+                         this->block + this->block_pos, count);
+    } else if (format == SDDC_FRAME_FLOAT) {
+      memcpy(this->block + this->block_pos, (const float *) data + i,
+             count * sizeof(float));
+    } else {
+      memcpy(this->block + 2 * this->block_pos, (const float *) data + 2 * i,
+             count * 2 * sizeof(float));
+    }
+    this->block_pos += count;
+    i += count;
+    if (this->block_pos == this->fft_size) {
+      fft_stage_block(this);
+      this->block_pos = 0;
+    }
+  }
+
+  if (this->navg == 0) {
+    return;
+  }
+  sddc_frame_t *output = sddc_stage_alloc_frame(stage, frame);
+  if (output == 0) {
+    return;
+  }
+  float *out = (float *) sddc_frame_writable_data(output);
+  for (uint32_t k = 0; k < this->nbins; ++k) {
+    out[k] = (float) (10 * log10(this->power[k] * this->scale / this->navg + 1e-20));
+    this->power[k] = 0;
+  }
+  this->navg = 0;
+  sddc_frame_set_size(output, this->nbins * sizeof(float));
+  sddc_stage_emit(stage, output);
+  sddc_frame_unref(output);
+  return;
+}
+
+static void fft_stage_block(struct fft_stage *this)
+{
+  uint32_t n = this->fft_size;
+  if (this->complex_input) {
+    for (uint32_t i = 0; i < n; ++i) {
+      this->spectrum[2*i] = this->block[2*i] * this->window[i];
+      this->spectrum[2*i+1] = this->block[2*i+1] * this->window[i];
+    }
+    fft_complex(this->fft, this->spectrum, 0);
+  } else {
+    for (uint32_t i = 0; i < n; ++i) {
+      this->block[i] *= this->window[i];
+    }
+    fft_real_forward(this->fft, this->block, this->spectrum);
+  }
+  for (uint32_t k = 0; k < this->nbins; ++k) {
+    float re = this->spectrum[2*k];
+    float im = this->spectrum[2*k+1];
+    this->power[k] += re * re + im * im;
+  }
+  this->navg++;
+  return;
+}
+
+
+/* writes the frames to a file descriptor (e.g. a file or a pipe) off the
+   USB thread */
+struct record_stage {
+  int fd;
+  int failed;
+};
+
+static const struct pipeline_stage_ops record_ops = {
+  0, 0, free
+};
+
+sddc_stage_t *pipeline_add_record(pipeline_t *this, int fd)
+{
+  if (fd < 0) {
+    LOG_ERROR("invalid file descriptor");
+    return 0;
+  }
+  struct record_stage *context = (struct record_stage *) malloc(sizeof(struct record_stage));
+  context->fd = fd;
+  context->failed = 0;
+  sddc_stage_t *stage = pipeline_add_stage(this, "record", record_process,
+                                           context, &record_ops,
+                                           SDDC_STAGE_ORDERED,
+                                           DEFAULT_QUEUE_SIZE, 0,
+                                           SDDC_FRAME_BYTES);
+  if (stage == 0) {
+    free(context);
+  }
+  return stage;
+}
+
+static void record_process(sddc_stage_t *stage __attribute__((unused)),
+                           sddc_frame_t *frame, void *context)
+{
+  struct record_stage *this = (struct record_stage *) context;
+  if (this->failed) {
+    return;
+  }
+  const uint8_t *data = (const uint8_t *) sddc_frame_data(frame);
+  uint32_t size = sddc_frame_size(frame);
+  while (size > 0) {
+    ssize_t ret = write(this->fd, data, size);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      LOG_ERROR("record stage write() failed: %s", strerror(errno));
+      this->failed = 1;
+      return;
+    }
+    data += ret;
+    size -= ret;
+  }
+  return;
+}
+
+
+/* averages the spectra (dB) of an fft stage in linear power over each
+   interval and appends them to a spectrum history, timestamped with the
+   wall clock at the start of the interval; the last partial interval is
+   appended when the pipeline stops */
+struct history_stage {
+  sddc_history_t *history;
+  int64_t interval;           /* ns */
+  uint32_t nbins;
+  double *power;
+  float *row;
+  uint32_t count;
+  int64_t start;
+};
+
+static const struct pipeline_stage_ops history_ops = {
+  history_stage_setup, history_stage_stop, free
+};
+
+sddc_stage_t *pipeline_add_history(pipeline_t *this, sddc_history_t *history,
+                                   double interval)
+{
+  struct sddc_history_info info;
+  if (history == 0 || interval <= 0 ||
+      sddc_history_get_info(history, &info) < 0) {
+    LOG_ERROR("invalid history stage parameters");
+    return 0;
+  }
+  struct history_stage *context = (struct history_stage *) calloc(1, sizeof(struct history_stage));
+  context->history = history;
+  context->interval = (int64_t) (interval * 1e9);
+  context->nbins = info.nbins;
+  sddc_stage_t *stage = pipeline_add_stage(this, "history",
+                                           history_stage_process, context,
+                                           &history_ops, SDDC_STAGE_ORDERED,
+                                           DEFAULT_QUEUE_SIZE, 0,
+                                           SDDC_FRAME_BYTES);
+  if (stage == 0) {
+    free(context);
+  }
+  return stage;
+}
+
+static int history_stage_setup(const struct pipeline_format *input,
+                               struct pipeline_format *output
+                               __attribute__((unused)),
+                               void *context)
+{
+  struct history_stage *this = (struct history_stage *) context;
+  if (input->format != SDDC_FRAME_FLOAT ||
+      input->size != this->nbins * sizeof(float)) {
+    LOG_ERROR("history stage input must be spectra of %u bins", this->nbins);
+    return -1;
+  }
+  this->power = (double *) calloc(this->nbins, sizeof(double));
+  this->row = (float *) malloc(this->nbins * sizeof(float));
+  this->count = 0;
+  return 0;
+}
+
+static void history_stage_stop(void *context)
+{
+  struct history_stage *this = (struct history_stage *) context;
+  if (this->count > 0) {
+    history_stage_append(this);
+  }
+  sddc_history_flush(this->history);
+  free(this->power);
+  free(this->row);
+  this->power = 0;
+  this->row = 0;
+  return;
+}
+
+static void history_stage_process(sddc_stage_t *stage __attribute__((unused)),
+                                  sddc_frame_t *frame, void *context)
+{
+  struct history_stage *this = (struct history_stage *) context;
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  int64_t now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  if (this->count > 0 && now - this->start >= this->interval) {
+    history_stage_append(this);
+  }
+  if (this->count == 0) {
+    this->start = now;
+  }
+
+  const float *spectrum = (const float *) sddc_frame_data(frame);
+  for (uint32_t k = 0; k < this->nbins; ++k) {
+    this->power[k] += pow(10.0, spectrum[k] / 10.0);
+  }
+  this->count++;
+  return;
+}
+
+static void history_stage_append(struct history_stage *this)
+{
+  for (uint32_t k = 0; k < this->nbins; ++k) {
+    this->row[k] = (float) (10 * log10(this->power[k] / this->count + 1e-20));
+    this->power[k] = 0;
+  }
+  sddc_history_append(this->history, this->start, this->row);
+  this->count = 0;
+  return;
+}
@@ -0,0 +1,438 @@
+/*
+ * resampler.c - arbitrary ratio resampler
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Polyphase resampler: the low pass prototype is designed at P times the
+ * input rate and split into P + 1 phases (phase P is phase 0 one input
+ * sample later). Each output sample sits at a position between two input
+ * samples; its fractional part selects the phase.
+ *  - when the ratio is an exact fraction L/M with a small L, P = L and the
+ *    position advances by exactly M/L, so every output uses one phase and
+ *    there is no drift
+ *  - otherwise (any other ratio, including one with the ppm correction
+ *    folded in) P = 128 and the position is kept in 32.32 fixed point; the
+ *    taps for the fractional phase are linearly interpolated between the
+ *    two nearest phases (a first order Farrow structure)
+ *
+ * For large decimations (e.g. from the ADC rate to an audio rate) the
+ * prototype would need tens of thousands of taps per phase, so a cascade
+ * of half-band decimators by 2 first brings the rate down to less than
+ * four times the output rate; each of them only has to keep the final
+ * pass band free of aliases, so the early (fast) stages are short.
+ *
+ * References:
+ *  - F. J. Harris, "Multirate Signal Processing for Communication Systems",
+ *    chapter 7 (arbitrary resampling with polyphase filters) and chapter 8
+ *    (half-band filters)
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resampler.h"
+#include "dsp.h"
+#include "logging.h"
+
+
+typedef struct resampler resampler_t;
+
+/* internal functions */
+static int find_fraction(double ratio, uint32_t *numerator,
+                         uint32_t *denominator);
+static int resampler_design_decimator(resampler_t *this, int stage,
+                                      double rate, double pass);
+static float *resampler_input(resampler_t *this, int channel);
+static uint32_t resampler_decimate(resampler_t *this, uint32_t ninput);
+static uint32_t resampler_run(resampler_t *this, uint32_t ninput);
+
+
+#define MAX_DECIMATORS (16)
+
+struct decimator {
+  uint32_t ntaps;           /* nonzero taps per side */
+  float *taps;
+  float center;
+  uint32_t history;         /* window length - 1 */
+  uint32_t phase;           /* window start of the next output (0 or 1) */
+  float *input[2];          /* per channel: history + new samples */
+};
+
+typedef struct resampler {
+  double input_rate;
+  double output_rate;
+  int channels;
+  uint32_t max_input;
+  int ndecimators;
+  struct decimator decimators[MAX_DECIMATORS];
+  int rational;
+  uint32_t nphases;
+  uint32_t ntaps;           /* per phase, padded to a multiple of DSP_LANES */
+  double delay;             /* input samples */
+  float *taps;              /* nphases + 1 time reversed phases */
+  float *taps_mu;           /* interpolated taps for the current output */
+  float *input[2];          /* per channel: ntaps - 1 samples of history + new samples */
+  float *output;
+  uint64_t unit;            /* position units per input sample */
+  uint64_t step;            /* position increment per output sample */
+  uint64_t position;        /* next output, relative to the oldest history sample */
+} resampler_t;
+
+
+static const double RESAMPLER_ATTENUATION = 80.0;   /* stop band attenuation (dB) */
+static const double RESAMPLER_PASSBAND = 0.4;       /* of the lower sample rate */
+static const uint32_t RESAMPLER_PHASES = 128;       /* for arbitrary ratios */
+static const uint32_t MAX_RATIONAL_PHASES = 256;
+static const double MAX_POLYPHASE_DECIMATION = 4.0; /* above, half-bands first */
+
+
+resampler_t *resampler_open(double input_rate, double output_rate,
+                            int channels, uint32_t max_input)
+{
+  resampler_t *ret_val = 0;
+
+  if (input_rate <= 0 || output_rate <= 0 || channels < 1 || channels > 2 ||
+      max_input == 0) {
+    LOG_ERROR("invalid resampler parameters");
+    return ret_val;
+  }
+
+  resampler_t *this = (resampler_t *) calloc(1, sizeof(resampler_t));
+  if (this == 0) {
+    LOG_ERROR("calloc() failed");
+    return ret_val;
+  }
+  this->input_rate = input_rate;
+  this->output_rate = output_rate;
+  this->channels = channels;
+  this->max_input = max_input;
+
+  /* half-band decimators while the rate is well above the output rate */
+  double pass_band = RESAMPLER_PASSBAND * output_rate;
+  double rate = input_rate;
+  uint32_t max_stage_input = max_input;
+  double delay = 0.0;
+  double scale = 1.0;
+  while (rate >= MAX_POLYPHASE_DECIMATION * output_rate &&
+         this->ndecimators < MAX_DECIMATORS) {
+    int stage = this->ndecimators;
+    if (resampler_design_decimator(this, stage, rate, pass_band) < 0) {
+      resampler_close(this);
+      return ret_val;
+    }
+    struct decimator *decimator = &this->decimators[stage];
+    this->ndecimators++;
+    for (int c = 0; c < channels; ++c) {
+      decimator->input[c] = (float *) malloc((decimator->history + max_stage_input) * sizeof(float));
+      if (decimator->input[c] == 0) {
+        LOG_ERROR("malloc() failed");
+        resampler_close(this);
+        return ret_val;
+      }
+    }
+    delay += scale * decimator->history / 2;
+    scale *= 2.0;
+    rate /= 2.0;
+    max_stage_input = max_stage_input / 2 + 1;
+  }
+
+  double ratio = output_rate / rate;
+  uint32_t numerator = 1;
+  uint32_t denominator = 1;
+  int rational = find_fraction(ratio, &numerator, &denominator);
+  uint32_t nphases = rational ? numerator : RESAMPLER_PHASES;
+
+  /* prototype low pass at nphases times the (decimated) input rate */
+  double min_rate = rate < output_rate ? rate : output_rate;
+  double pass = RESAMPLER_PASSBAND * min_rate / (nphases * rate);
+  double stop = 0.5 * min_rate / (nphases * rate);
+  int nproto = dsp_kaiser_ntaps(stop - pass, RESAMPLER_ATTENUATION);
+  float *proto = (float *) malloc(nproto * sizeof(float));
+  if (proto == 0) {
+    LOG_ERROR("malloc() failed");
+    resampler_close(this);
+    return ret_val;
+  }
+  dsp_kaiser_lowpass(proto, nproto, (pass + stop) / 2, RESAMPLER_ATTENUATION);
+
+  this->rational = rational;
+  this->nphases = nphases;
+  uint32_t ntaps = (nproto + nphases - 1) / nphases;
+  this->delay = delay + scale * (nproto - 1) / 2.0 / nphases;
+  this->ntaps = DSP_PAD(ntaps);
+  this->taps = (float *) calloc((nphases + 1) * this->ntaps, sizeof(float));
+  if (this->taps == 0) {
+    LOG_ERROR("calloc() failed");
+    free(proto);
+    resampler_close(this);
+    return ret_val;
+  }
+  for (uint32_t p = 0; p <= nphases; ++p) {
+    float *phase = this->taps + p * this->ntaps;
+    for (uint32_t k = 0; k < ntaps; ++k) {
+      uint32_t idx = k * nphases + p;
+      /* each phase has unity gain at DC */
+      phase[this->ntaps-1-k] = idx < (uint32_t) nproto ? proto[idx] * nphases : 0.0f;
+    }
+  }
+  free(proto);
+  this->taps_mu = (float *) malloc(this->ntaps * sizeof(float));
+  for (int c = 0; c < channels; ++c) {
+    this->input[c] = (float *) malloc((this->ntaps - 1 + max_stage_input) * sizeof(float));
+  }
+  uint32_t max_output = (uint32_t) ceil(max_stage_input * ratio) + 2;
+  this->output = (float *) malloc(channels * max_output * sizeof(float));
+  if (this->taps_mu == 0 || this->input[0] == 0 ||
+      (channels == 2 && this->input[1] == 0) || this->output == 0) {
+    LOG_ERROR("malloc() failed");
+    resampler_close(this);
+    return ret_val;
+  }
+  if (rational) {
+    this->unit = numerator;
+    this->step = denominator;
+  } else {
+    this->unit = (uint64_t) 1 << 32;
+    this->step = (uint64_t) llround(this->unit / ratio);
+  }
+  resampler_reset(this);
+
+  LOG_DEBUG("resampler %.3f -> %.3f: %d half-bands, %s, %u phases of %u taps",
+            input_rate, output_rate, this->ndecimators,
+            rational ? "rational" : "arbitrary", nphases, this->ntaps);
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+void resampler_close(resampler_t *this)
+{
+  for (int i = 0; i < MAX_DECIMATORS; ++i) {
+    struct decimator *decimator = &this->decimators[i];
+    free(decimator->input[0]);
+    free(decimator->input[1]);
+    free(decimator->taps);
+  }
+  free(this->output);
+  free(this->input[0]);
+  free(this->input[1]);
+  free(this->taps_mu);
+  free(this->taps);
+  free(this);
+  return;
+}
+
+
+int resampler_is_rational(resampler_t *this)
+{
+  return this->rational;
+}
+
+
+double resampler_get_delay(resampler_t *this)
+{
+  return this->delay;
+}
+
+
+void resampler_reset(resampler_t *this)
+{
+  for (int i = 0; i < this->ndecimators; ++i) {
+    struct decimator *decimator = &this->decimators[i];
+    for (int c = 0; c < this->channels; ++c) {
+      memset(decimator->input[c], 0, decimator->history * sizeof(float));
+    }
+    decimator->phase = 0;
+  }
+  for (int c = 0; c < this->channels; ++c) {
+    memset(this->input[c], 0, (this->ntaps - 1) * sizeof(float));
+  }
+  this->position = 0;
+  return;
+}
+
+
+uint32_t resampler_process(resampler_t *this, const float *input,
+                           uint32_t ninput, float **output)
+{
+  if (ninput > this->max_input) {
+    LOG_ERROR("too many samples");
+    ninput = this->max_input;
+  }
+
+  if (this->channels == 1) {
+    memcpy(resampler_input(this, 0), input, ninput * sizeof(float));
+  } else {
+    float *re = resampler_input(this, 0);
+    float *im = resampler_input(this, 1);
+    for (uint32_t i = 0; i < ninput; ++i) {
+      re[i] = input[2*i];
+      im[i] = input[2*i+1];
+    }
+  }
+
+  *output = this->output;
+  return resampler_run(this, resampler_decimate(this, ninput));
+}
+
+
+uint32_t resampler_process_int16(resampler_t *this, const int16_t *input,
+                                 uint32_t ninput, float **output)
+{
+  if (this->channels != 1) {
+    LOG_ERROR("int16 input requires one channel");
+    return 0;
+  }
+  if (ninput > this->max_input) {
+    LOG_ERROR("too many samples");
+    ninput = this->max_input;
+  }
+
+  dsp_int16_to_float(input, resampler_input(this, 0), ninput);
+
+  *output = this->output;
+  return resampler_run(this, resampler_decimate(this, ninput));
+}
+
+
+/* internal functions */
+/* half-band taps for a decimator by 2 at the given input rate; only the
+   band up to pass (Hz) has to be kept free of aliases */
+static int resampler_design_decimator(resampler_t *this, int stage,
+                                      double rate, double pass)
+{
+  struct decimator *decimator = &this->decimators[stage];
+  double transition = 0.5 - 2.0 * pass / rate;
+  int nfilter = dsp_kaiser_ntaps(transition, RESAMPLER_ATTENUATION);
+  /* 4 ntaps - 1 long, so that the first and last taps are not zero */
+  uint32_t ntaps = (nfilter + 1 + 3) / 4;
+  nfilter = 4 * ntaps - 1;
+  float *filter = (float *) malloc(nfilter * sizeof(float));
+  decimator->taps = (float *) malloc(ntaps * sizeof(float));
+  if (filter == 0 || decimator->taps == 0) {
+    LOG_ERROR("malloc() failed");
+    free(filter);
+    return -1;
+  }
+  dsp_kaiser_lowpass(filter, nfilter, 0.25, RESAMPLER_ATTENUATION);
+  for (uint32_t p = 0; p < ntaps; ++p) {
+    decimator->taps[p] = filter[2*p];
+  }
+  decimator->center = filter[2*ntaps-1];
+  decimator->ntaps = ntaps;
+  decimator->history = nfilter - 1;
+  decimator->phase = 0;
+  free(filter);
+  return 0;
+}
+
+/* where the new input samples go, after the history of the first stage */
+static float *resampler_input(resampler_t *this, int channel)
+{
+  if (this->ndecimators > 0) {
+    struct decimator *decimator = &this->decimators[0];
+    return decimator->input[channel] + decimator->history;
+  }
+  return this->input[channel] + this->ntaps - 1;
+}
+
+/* runs the new samples through the half-band stages, each writing after
+   the history of the next one; returns the number of samples for the
+   polyphase stage */
+static uint32_t resampler_decimate(resampler_t *this, uint32_t ninput)
+{
+  uint32_t n = ninput;
+  for (int i = 0; i < this->ndecimators; ++i) {
+    struct decimator *decimator = &this->decimators[i];
+    uint32_t nout = n > decimator->phase ? (n - decimator->phase + 1) / 2 : 0;
+    for (int c = 0; c < this->channels; ++c) {
+      float *out = i + 1 < this->ndecimators ?
+                   this->decimators[i+1].input[c] + this->decimators[i+1].history :
+                   this->input[c] + this->ntaps - 1;
+      dsp_halfband_decimate(decimator->input[c] + decimator->phase,
+                            decimator->taps, decimator->ntaps,
+                            decimator->center, nout, out);
+      memmove(decimator->input[c], decimator->input[c] + n,
+              decimator->history * sizeof(float));
+    }
+    decimator->phase = decimator->phase + 2 * nout - n;
+    n = nout;
+  }
+  return n;
+}
+
+/* the new samples are already in place after the history */
+static uint32_t resampler_run(resampler_t *this, uint32_t ninput)
+{
+
+  uint32_t history = this->ntaps - 1;
+  uint64_t end = (uint64_t) ninput * this->unit;
+  uint32_t nout = 0;
+  float *out = this->output;
+
+  /* the window for an output at position i + p / nphases starts at buffer
+     index i and ends at new sample i */
+  for (; this->position < end; this->position += this->step) {
+    uint32_t i = (uint32_t) (this->position / this->unit);
+    uint64_t fraction = (this->position % this->unit) * this->nphases;
+    uint32_t p = (uint32_t) (fraction / this->unit);
+    uint64_t remainder = fraction % this->unit;
+
+    const float *taps = this->taps + p * this->ntaps;
+    if (remainder != 0) {
+      const float *next = taps + this->ntaps;
+      dsp_lerp(taps, next, (float) ((double) remainder / this->unit),
+               this->taps_mu, this->ntaps);
+      taps = this->taps_mu;
+    }
+
+    if (this->channels == 1) {
+      out[nout] = dsp_dot(this->input[0] + i, taps, this->ntaps);
+    } else {
+      dsp_dot_pair(this->input[0] + i, this->input[1] + i, taps, this->ntaps,
+                   &out[2*nout], &out[2*nout+1]);
+    }
+    nout++;
+  }
+  this->position -= end;
+
+  for (int c = 0; c < this->channels; ++c) {
+    memmove(this->input[c], this->input[c] + ninput, history * sizeof(float));
+  }
+  return nout;
+}
+
+/* ratio = numerator / denominator exactly, with a small numerator */
+static int find_fraction(double ratio, uint32_t *numerator,
+                         uint32_t *denominator)
+{
+  for (uint32_t l = 1; l <= MAX_RATIONAL_PHASES; ++l) {
+    double m = round(l / ratio);
+    if (m >= 1 && m < 4294967296.0 && fabs(l / m - ratio) <= 1e-12 * ratio) {
+      *numerator = l;
+      *denominator = (uint32_t) m;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * resampler.h - arbitrary ratio resampler
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __RESAMPLER_H
+#define __RESAMPLER_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct resampler resampler_t;
+
+/* channels is 1 for real samples and 2 for interleaved I/Q; max_input is
+   the largest number of input frames passed to a single process call */
+resampler_t *resampler_open(double input_rate, double output_rate,
+                            int channels, uint32_t max_input);
+
+void resampler_close(resampler_t *this);
+
+/* 1 if the ratio is an exact small fraction L/M (no phase interpolation) */
+int resampler_is_rational(resampler_t *this);
+
+/* input samples of delay through the filter */
+double resampler_get_delay(resampler_t *this);
+
+void resampler_reset(resampler_t *this);
+
+/* return the number of output frames; *output points to an internal
+   buffer of interleaved floats, valid until the next call */
+uint32_t resampler_process(resampler_t *this, const float *input,
+                           uint32_t ninput, float **output);
+
+/* same for real int16 ADC samples (one channel only) */
+uint32_t resampler_process_int16(resampler_t *this, const int16_t *input,
+                                 uint32_t ninput, float **output);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RESAMPLER_H */
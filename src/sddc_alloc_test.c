@@ -0,0 +1,599 @@
+/*
+ * sddc_alloc_test - steady state allocation check for libsddc
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* interposes the C library allocator (and fopen()/open()) and streams in
+   each of the library modes (raw and batched callbacks, usbfs backend,
+   frame leases, setters queued from the callback, HF AGC and activity
+   detector, processing pipeline, VHF
+   baseband with the output resampler, I/Q output, frequency sweep,
+   sub-band filter bank); from the return of sddc_start_streaming() to the call to
+   sddc_stop_streaming() nothing may allocate, free or open a file, in
+   any thread. It exits with an error if anything did; with
+   SDDC_TEST_IMAGE set it is run by ctest (against sddc_fx3_emulator or
+   a real device) */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "libsddc.h"
+
+
+/* glibc entry points of the real allocator */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+#define MAX_CALLERS (16)
+
+static atomic_int armed = 0;
+static atomic_uint violations = 0;
+static void *callers[MAX_CALLERS];
+static const char *caller_kinds[MAX_CALLERS];
+static FILE *(*real_fopen)(const char *pathname, const char *mode) = 0;
+
+static void violation(const char *kind, void *caller)
+{
+  unsigned int n = atomic_fetch_add(&violations, 1);
+  if (n < MAX_CALLERS) {
+    callers[n] = caller;
+    caller_kinds[n] = kind;
+  }
+}
+
+void *malloc(size_t size)
+{
+  if (atomic_load_explicit(&armed, memory_order_relaxed)) {
+    violation("malloc", __builtin_return_address(0));
+  }
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  if (atomic_load_explicit(&armed, memory_order_relaxed)) {
+    violation("calloc", __builtin_return_address(0));
+  }
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  if (atomic_load_explicit(&armed, memory_order_relaxed)) {
+    violation("realloc", __builtin_return_address(0));
+  }
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+  if (atomic_load_explicit(&armed, memory_order_relaxed)) {
+    violation("memalign", __builtin_return_address(0));
+  }
+  return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  return memalign(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+  void *ptr = memalign(alignment, size);
+  if (ptr == 0) {
+    return ENOMEM;
+  }
+  *memptr = ptr;
+  return 0;
+}
+
+void free(void *ptr)
+{
+  if (ptr && atomic_load_explicit(&armed, memory_order_relaxed)) {
+    violation("free", __builtin_return_address(0));
+  }
+  __libc_free(ptr);
+}
+
+int open(const char *pathname, int flags, ...)
+{
+  mode_t mode = 0;
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_list ap;
+    va_start(ap, flags);
+    mode = va_arg(ap, mode_t);
+    va_end(ap);
+  }
+  if (atomic_load_explicit(&armed, memory_order_relaxed)) {
+    violation("open", __builtin_return_address(0));
+  }
+  return syscall(SYS_openat, AT_FDCWD, pathname, flags, mode);
+}
+
+FILE *fopen(const char *pathname, const char *mode)
+{
+  if (atomic_load_explicit(&armed, memory_order_relaxed)) {
+    violation("fopen", __builtin_return_address(0));
+  }
+  return real_fopen(pathname, mode);
+}
+
+
+/* the consumers only touch the data, as a real one would */
+static volatile uint8_t checksum = 0;
+static sddc_t *sddc_device = 0;
+static sddc_lease_t *held_lease = 0;
+static atomic_ullong frames = 0;
+
+static void raw_callback(uint32_t data_size, uint8_t *data, void *context);
+static void batch_callback(const struct sddc_frame_iov *iov, uint32_t count,
+                           void *context);
+static void lease_callback(uint32_t data_size, uint8_t *data, void *context);
+static void setter_callback(uint32_t data_size, uint8_t *data, void *context);
+static void activity_callback(const struct sddc_activity_event *event,
+                              void *context);
+static void sink_stage(sddc_stage_t *stage, sddc_frame_t *frame,
+                       void *context);
+static void sweep_callback(const struct sddc_sweep_spectrum *spectrum,
+                           void *context);
+static void subband_callback(uint32_t band, const float *samples,
+                             uint32_t count, uint64_t sample_index,
+                             void *context);
+
+static int setup_raw(sddc_t *sddc);
+static int setup_batch(sddc_t *sddc);
+static int setup_usbfs(sddc_t *sddc);
+static void teardown_usbfs(sddc_t *sddc);
+static int setup_lease(sddc_t *sddc);
+static void teardown_lease(sddc_t *sddc);
+static int setup_setter(sddc_t *sddc);
+static void teardown_setter(sddc_t *sddc);
+static int setup_agc_detector(sddc_t *sddc);
+static void teardown_agc_detector(sddc_t *sddc);
+static int setup_pipeline(sddc_t *sddc);
+static void teardown_pipeline(sddc_t *sddc);
+static int setup_vhf(sddc_t *sddc);
+static void teardown_vhf(sddc_t *sddc);
+static int setup_iq(sddc_t *sddc);
+static void teardown_iq(sddc_t *sddc);
+static int setup_sweep(sddc_t *sddc);
+static int start_sweep(sddc_t *sddc);
+static void stop_sweep(sddc_t *sddc);
+static int setup_subbands(sddc_t *sddc);
+static void teardown_subbands(sddc_t *sddc);
+
+/* started/stopping run while streaming, just outside the checked time */
+struct scenario {
+  const char *name;
+  int (*setup)(sddc_t *sddc);
+  int (*started)(sddc_t *sddc);
+  void (*stopping)(sddc_t *sddc);
+  void (*teardown)(sddc_t *sddc);
+};
+
+static const struct scenario scenarios[] = {
+  { "raw callback", setup_raw, 0, 0, 0 },
+  { "batched callback", setup_batch, 0, 0, 0 },
+  { "usbfs backend", setup_usbfs, 0, 0, teardown_usbfs },
+  { "frame leases", setup_lease, 0, 0, teardown_lease },
+  { "setter queued while streaming", setup_setter, 0, 0, teardown_setter },
+  { "HF AGC + detector", setup_agc_detector, 0, 0, teardown_agc_detector },
+  { "pipeline", setup_pipeline, 0, 0, teardown_pipeline },
+  { "VHF baseband + resampler", setup_vhf, 0, 0, teardown_vhf },
+  { "I/Q output", setup_iq, 0, 0, teardown_iq },
+  { "sweep", setup_sweep, start_sweep, stop_sweep, teardown_vhf },
+  { "sub-band filter bank", setup_subbands, 0, 0, teardown_subbands }
+};
+
+static const uint32_t FRAME_SIZE = 16384;   /* small frames - more calls */
+
+static double sample_rate = 0.0;
+
+
+static int run_scenario(sddc_t *sddc, const struct scenario *scenario,
+                        int runtime)
+{
+  atomic_store(&frames, 0);
+  if (scenario->setup(sddc) < 0) {
+    fprintf(stderr, "ERROR - %s setup failed\n", scenario->name);
+    return -1;
+  }
+  if (sddc_start_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_start_streaming() failed\n");
+    return -1;
+  }
+  if (scenario->started && scenario->started(sddc) < 0) {
+    fprintf(stderr, "ERROR - %s start failed\n", scenario->name);
+    sddc_stop_streaming(sddc);
+    return -1;
+  }
+
+  atomic_store(&violations, 0);
+  struct timespec clk_start, clk_now;
+  clock_gettime(CLOCK_MONOTONIC, &clk_start);
+  atomic_store(&armed, 1);
+  do {
+    if (sddc_handle_events(sddc) < 0) {
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &clk_now);
+  } while ((clk_now.tv_sec - clk_start.tv_sec) * 1000 +
+           (clk_now.tv_nsec - clk_start.tv_nsec) / 1000000 < runtime);
+  atomic_store(&armed, 0);
+  unsigned int count = atomic_load(&violations);
+
+  if (scenario->stopping) {
+    scenario->stopping(sddc);
+  }
+  if (sddc_stop_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_stop_streaming() failed\n");
+    return -1;
+  }
+  if (scenario->teardown) {
+    scenario->teardown(sddc);
+  }
+
+  printf("%-30s %10llu frames  %s\n", scenario->name,
+         (unsigned long long) atomic_load(&frames), count == 0 ? "ok" : "FAILED");
+  for (unsigned int i = 0; i < count && i < MAX_CALLERS; ++i) {
+    Dl_info info;
+    if (dladdr(callers[i], &info) && info.dli_sname) {
+      printf("    %s from %s+0x%lx (%s)\n", caller_kinds[i], info.dli_sname,
+             (unsigned long) ((char *) callers[i] - (char *) info.dli_saddr),
+             info.dli_fname);
+    } else {
+      printf("    %s from %p\n", caller_kinds[i], callers[i]);
+    }
+  }
+  if (atomic_load(&frames) == 0) {
+    fprintf(stderr, "ERROR - %s: no frames received\n", scenario->name);
+    return -1;
+  }
+  return count == 0 ? 0 : 1;
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <image file> <sample rate> [<runtime_in_ms per mode>]\n", argv[0]);
+    return -1;
+  }
+  char *imagefile = argv[1];
+  sscanf(argv[2], "%lf", &sample_rate);
+  int runtime = argc > 3 ? atoi(argv[3]) : 2000;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+    return -1;
+  }
+  /* (the POSIX way to get a function pointer out of dlsym()) */
+  *(void **) &real_fopen = dlsym(RTLD_NEXT, "fopen");
+
+  int ret_val = -1;
+
+  /* (quiet - and the first message must not start the log thread while
+     streaming) */
+  sddc_set_log_level(SDDC_LOG_WARNING);
+
+  sddc_t *sddc = sddc_open(0, imagefile);
+  if (sddc == 0) {
+    fprintf(stderr, "ERROR - sddc_open() failed\n");
+    return -1;
+  }
+  sddc_device = sddc;
+
+  if (sddc_set_sample_rate(sddc, sample_rate) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_sample_rate() failed\n");
+    goto DONE;
+  }
+
+  int failed = 0;
+  int nscenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+  for (int i = 0; i < nscenarios; ++i) {
+    int ret = run_scenario(sddc, &scenarios[i], runtime);
+    if (ret < 0) {
+      goto DONE;
+    }
+    failed |= ret;
+  }
+
+  /* done - all good, unless something allocated */
+  ret_val = failed ? 1 : 0;
+  if (failed) {
+    fprintf(stderr, "ERROR - the steady state allocates\n");
+  }
+
+DONE:
+  sddc_close(sddc);
+
+  return ret_val;
+}
+
+
+static int setup_raw(sddc_t *sddc)
+{
+  if (sddc_set_rf_mode(sddc, HF_MODE) < 0) {
+    return -1;
+  }
+  return sddc_set_async_params(sddc, FRAME_SIZE, 0, raw_callback, 0);
+}
+
+static int setup_batch(sddc_t *sddc)
+{
+  return sddc_set_async_batch_params(sddc, FRAME_SIZE, 0, 0, batch_callback,
+                                     0);
+}
+
+static int setup_usbfs(sddc_t *sddc)
+{
+  if (sddc_set_streaming_backend(sddc, SDDC_BACKEND_USBFS) < 0) {
+    return -1;
+  }
+  return sddc_set_async_params(sddc, FRAME_SIZE, 0, raw_callback, 0);
+}
+
+static void teardown_usbfs(sddc_t *sddc)
+{
+  sddc_set_streaming_backend(sddc, SDDC_BACKEND_LIBUSB);
+}
+
+static int setup_lease(sddc_t *sddc)
+{
+  if (sddc_set_spare_frames(sddc, 4) < 0) {
+    return -1;
+  }
+  return sddc_set_async_params(sddc, FRAME_SIZE, 0, lease_callback, 0);
+}
+
+static void teardown_lease(sddc_t *sddc)
+{
+  if (held_lease) {
+    sddc_release_frame(sddc, held_lease);
+    held_lease = 0;
+  }
+  sddc_set_spare_frames(sddc, 0);
+}
+
+static int setup_setter(sddc_t *sddc)
+{
+  if (sddc_set_rf_mode(sddc, HF_MODE) < 0) {
+    return -1;
+  }
+  return sddc_set_async_params(sddc, FRAME_SIZE, 0, setter_callback, 0);
+}
+
+static void teardown_setter(sddc_t *sddc)
+{
+  sddc_set_hf_attenuation(sddc, 0);
+}
+
+static int setup_agc_detector(sddc_t *sddc)
+{
+  static const struct sddc_detector_band bands[] = {
+    { 1e6, 100e3 },
+    { 10e6, 1e6 }
+  };
+  if (sddc_set_hf_agc(sddc, 1, -6.0, 3.0) < 0 ||
+      sddc_set_activity_detector(sddc, 4096, bands, 2, -30.0, -40.0,
+                                 activity_callback, 0) < 0) {
+    return -1;
+  }
+  return sddc_set_async_params(sddc, FRAME_SIZE, 0, raw_callback, 0);
+}
+
+static void teardown_agc_detector(sddc_t *sddc)
+{
+  sddc_set_hf_agc(sddc, 0, -6.0, 3.0);
+  sddc_clear_activity_detector(sddc);
+}
+
+static int setup_pipeline(sddc_t *sddc)
+{
+  if (sddc_set_async_params(sddc, FRAME_SIZE, 0, 0, 0) < 0 ||
+      sddc_pipeline_set_threads(sddc, 2) < 0) {
+    return -1;
+  }
+  sddc_stage_t *convert = sddc_pipeline_add_convert(sddc);
+  sddc_stage_t *fft = sddc_pipeline_add_fft(sddc, 1024);
+  sddc_stage_t *ddc = sddc_pipeline_add_ddc(sddc, sample_rate / 8,
+                                            sample_rate / 64);
+  sddc_stage_t *spectrum = sddc_pipeline_add_stage(sddc, "spectrum",
+                                                   sink_stage, 0,
+                                                   SDDC_STAGE_PARALLEL, 0, 0,
+                                                   SDDC_FRAME_BYTES);
+  sddc_stage_t *baseband = sddc_pipeline_add_stage(sddc, "baseband",
+                                                   sink_stage, 0,
+                                                   SDDC_STAGE_PARALLEL, 0, 0,
+                                                   SDDC_FRAME_BYTES);
+  if (convert == 0 || fft == 0 || ddc == 0 || spectrum == 0 ||
+      baseband == 0 ||
+      sddc_pipeline_connect(sddc, 0, convert) < 0 ||
+      sddc_pipeline_connect(sddc, convert, fft) < 0 ||
+      sddc_pipeline_connect(sddc, 0, ddc) < 0 ||
+      sddc_pipeline_connect(sddc, fft, spectrum) < 0 ||
+      sddc_pipeline_connect(sddc, ddc, baseband) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+static void teardown_pipeline(sddc_t *sddc)
+{
+  sddc_pipeline_clear(sddc);
+}
+
+static int setup_vhf(sddc_t *sddc)
+{
+  if (sddc_set_rf_mode(sddc, VHF_MODE) < 0 ||
+      sddc_set_tuner_frequency(sddc, 100e6) < 0 ||
+      sddc_set_vhf_baseband(sddc, 2e6) < 0 ||
+      sddc_set_output_sample_rate(sddc, 2e6) < 0) {
+    return -1;
+  }
+  return sddc_set_async_params(sddc, FRAME_SIZE, 0, raw_callback, 0);
+}
+
+static void teardown_vhf(sddc_t *sddc)
+{
+  sddc_set_output_sample_rate(sddc, 0);
+  sddc_set_vhf_baseband(sddc, 0);
+  sddc_set_rf_mode(sddc, HF_MODE);
+}
+
+static int setup_iq(sddc_t *sddc)
+{
+  /* with the ADC randomization, removed by the streaming layer */
+  if (sddc_set_adc_random(sddc, 1) < 0 ||
+      sddc_set_iq_output(sddc, 1) < 0) {
+    return -1;
+  }
+  return sddc_set_async_params(sddc, FRAME_SIZE, 0, raw_callback, 0);
+}
+
+static void teardown_iq(sddc_t *sddc)
+{
+  sddc_set_iq_output(sddc, 0);
+  sddc_set_adc_random(sddc, 0);
+}
+
+static int setup_sweep(sddc_t *sddc)
+{
+  if (sddc_set_rf_mode(sddc, VHF_MODE) < 0) {
+    return -1;
+  }
+  return sddc_set_async_params(sddc, FRAME_SIZE, 0, raw_callback, 0);
+}
+
+static int start_sweep(sddc_t *sddc)
+{
+  static const double frequencies[] = { 100e6, 102e6, 104e6, 106e6 };
+  return sddc_start_sweep(sddc, frequencies, 4, 2e6, 0.005, 0.001, 1024,
+                          sweep_callback, 0);
+}
+
+static void stop_sweep(sddc_t *sddc)
+{
+  sddc_stop_sweep(sddc);
+}
+
+static int setup_subbands(sddc_t *sddc)
+{
+  static const struct sddc_subband bands[] = {
+    { 1e6, 100e3 },
+    { 10e6, 1e6 }
+  };
+  if (sddc_set_async_params(sddc, FRAME_SIZE, 0, 0, 0) < 0) {
+    return -1;
+  }
+  return sddc_set_subbands(sddc, bands, 2, 4096, 0, 2, subband_callback, 0);
+}
+
+static void teardown_subbands(sddc_t *sddc)
+{
+  sddc_set_subbands(sddc, 0, 0, 0, 0, 0, 0, 0);
+}
+
+
+static void raw_callback(uint32_t data_size, uint8_t *data,
+                         void *context __attribute__((unused)))
+{
+  uint8_t sum = 0;
+  for (uint32_t i = 0; i < data_size; i += 64) {
+    sum += data[i];
+  }
+  checksum += sum;
+  atomic_fetch_add(&frames, 1);
+}
+
+static void batch_callback(const struct sddc_frame_iov *iov, uint32_t count,
+                           void *context)
+{
+  for (uint32_t i = 0; i < count; ++i) {
+    raw_callback(iov[i].size, iov[i].data, context);
+  }
+}
+
+/* keep every frame until the next one arrives */
+static void lease_callback(uint32_t data_size, uint8_t *data, void *context)
+{
+  sddc_lease_t *lease = sddc_lease_frame(sddc_device);
+  if (held_lease) {
+    sddc_release_frame(sddc_device, held_lease);
+  }
+  held_lease = lease;
+  raw_callback(data_size, data, context);
+}
+
+/* the change goes through the control queue and the control thread, and
+   completes in the events thread */
+static void setter_callback(uint32_t data_size, uint8_t *data, void *context)
+{
+  unsigned long long n = atomic_load(&frames);
+  if (n % 64 == 0) {
+    sddc_set_hf_attenuation(sddc_device, (n / 64) % 2 ? 10.0 : 0.0);
+  }
+  raw_callback(data_size, data, context);
+}
+
+static void activity_callback(const struct sddc_activity_event *event,
+                              void *context __attribute__((unused)))
+{
+  checksum += (uint8_t) event->band;
+}
+
+static void sink_stage(sddc_stage_t *stage __attribute__((unused)),
+                       sddc_frame_t *frame,
+                       void *context __attribute__((unused)))
+{
+  const uint8_t *data = (const uint8_t *) sddc_frame_data(frame);
+  checksum += data[0];
+  atomic_fetch_add(&frames, 1);
+}
+
+static void sweep_callback(const struct sddc_sweep_spectrum *spectrum,
+                           void *context __attribute__((unused)))
+{
+  checksum += (uint8_t) spectrum->sweep;
+}
+
+static void subband_callback(uint32_t band, const float *samples,
+                             uint32_t count,
+                             uint64_t sample_index __attribute__((unused)),
+                             void *context __attribute__((unused)))
+{
+  checksum += count > 0 ? (uint8_t) samples[0] : 0;
+  if (band == 0) {
+    atomic_fetch_add(&frames, 1);
+  }
+}
@@ -0,0 +1,197 @@
+/*
+ * sddc_backend_bench - compare the CPU cost of the streaming backends
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* streams for the given time with each backend (libusb and usbfs), with
+   a callback per frame and then with batched callbacks, that only touch
+   the data, and reports the CPU time (user + system) per GB received; it
+   works with the real hardware as well as with sddc_fx3_emulator */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "libsddc.h"
+
+
+static void touch_callback(uint32_t data_size, uint8_t *data, void *context);
+static void touch_batch_callback(const struct sddc_frame_iov *frames,
+                                 uint32_t count, void *context);
+
+static unsigned long long received_bytes = 0;
+static unsigned int num_callbacks = 0;
+static volatile uint8_t checksum = 0;
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+  return (b->tv_sec - a->tv_sec) + 1e-9 * (b->tv_nsec - a->tv_nsec);
+}
+
+static double cpu_seconds()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + 1e-6 * usage.ru_utime.tv_usec +
+         usage.ru_stime.tv_sec + 1e-6 * usage.ru_stime.tv_usec;
+}
+
+static int run_backend(sddc_t *sddc, enum SDDCStreamingBackend backend,
+                       const char *name, uint32_t frame_size,
+                       uint32_t num_frames, int batched, int runtime)
+{
+  if (sddc_set_streaming_backend(sddc, backend) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_streaming_backend(%s) failed\n", name);
+    return -1;
+  }
+  int ret = batched ?
+            sddc_set_async_batch_params(sddc, frame_size, num_frames, 0,
+                                        touch_batch_callback, 0) :
+            sddc_set_async_params(sddc, frame_size, num_frames,
+                                  touch_callback, 0);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - sddc_set_async_params(%s) failed\n", name);
+    return -1;
+  }
+
+  received_bytes = 0;
+  num_callbacks = 0;
+  if (sddc_start_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_start_streaming(%s) failed\n", name);
+    return -1;
+  }
+
+  struct timespec clk_start, clk_now;
+  double cpu_start = cpu_seconds();
+  clock_gettime(CLOCK_MONOTONIC, &clk_start);
+  do {
+    if (sddc_handle_events(sddc) < 0) {
+      fprintf(stderr, "ERROR - sddc_handle_events(%s) failed\n", name);
+      sddc_stop_streaming(sddc);
+      return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &clk_now);
+  } while (timespec_diff(&clk_start, &clk_now) * 1000 < runtime);
+  double cpu = cpu_seconds() - cpu_start;
+  double elapsed = timespec_diff(&clk_start, &clk_now);
+
+  if (sddc_stop_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_stop_streaming(%s) failed\n", name);
+    return -1;
+  }
+
+  double gbytes = received_bytes * 1e-9;
+  struct sddc_stream_stats stats;
+  sddc_get_stream_stats(sddc, &stats);
+  printf("%-13s %10.3f GB %8.1f MB/s %10u callbacks %8.3f CPU s %8.3f CPU s/GB %6llu errors\n",
+         name, gbytes, gbytes * 1e3 / elapsed, num_callbacks, cpu,
+         gbytes > 0 ? cpu / gbytes : 0.0,
+         (unsigned long long) stats.transfer_errors);
+  return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <image file> <sample rate> [<runtime_in_ms> [<frame size> [<num frames>]]]\n", argv[0]);
+    return -1;
+  }
+  char *imagefile = argv[1];
+  double sample_rate = 0.0;
+  sscanf(argv[2], "%lf", &sample_rate);
+  int runtime = argc > 3 ? atoi(argv[3]) : 10000;
+  uint32_t frame_size = argc > 4 ? strtoul(argv[4], 0, 0) : 0;
+  uint32_t num_frames = argc > 5 ? strtoul(argv[5], 0, 0) : 0;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+    return -1;
+  }
+
+  int ret_val = -1;
+
+  sddc_t *sddc = sddc_open(0, imagefile);
+  if (sddc == 0) {
+    fprintf(stderr, "ERROR - sddc_open() failed\n");
+    return -1;
+  }
+
+  if (sddc_set_sample_rate(sddc, sample_rate) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_sample_rate() failed\n");
+    goto DONE;
+  }
+
+  if (sddc_set_rf_mode(sddc, HF_MODE) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_rf_mode failed\n");
+    goto DONE;
+  }
+
+  if (run_backend(sddc, SDDC_BACKEND_LIBUSB, "libusb", frame_size, num_frames,
+                  0, runtime) < 0 ||
+      run_backend(sddc, SDDC_BACKEND_LIBUSB, "libusb/batch", frame_size,
+                  num_frames, 1, runtime) < 0) {
+    goto DONE;
+  }
+  if (run_backend(sddc, SDDC_BACKEND_USBFS, "usbfs", frame_size, num_frames,
+                  0, runtime) < 0 ||
+      run_backend(sddc, SDDC_BACKEND_USBFS, "usbfs/batch", frame_size,
+                  num_frames, 1, runtime) < 0) {
+    goto DONE;
+  }
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  sddc_close(sddc);
+
+  return ret_val;
+}
+
+static void touch_callback(uint32_t data_size, uint8_t *data,
+                           void *context __attribute__((unused)))
+{
+  ++num_callbacks;
+  received_bytes += data_size;
+  /* read one byte per cache line, so the data is actually fetched */
+  uint8_t sum = 0;
+  for (uint32_t i = 0; i < data_size; i += 64) {
+    sum += data[i];
+  }
+  checksum += sum;
+}
+
+static void touch_batch_callback(const struct sddc_frame_iov *frames,
+                                 uint32_t count,
+                                 void *context __attribute__((unused)))
+{
+  ++num_callbacks;
+  uint8_t sum = 0;
+  for (uint32_t k = 0; k < count; ++k) {
+    received_bytes += frames[k].size;
+    for (uint32_t i = 0; i < frames[k].size; i += 64) {
+      sum += frames[k].data[i];
+    }
+  }
+  checksum += sum;
+}
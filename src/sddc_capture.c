@@ -0,0 +1,231 @@
+/*
+ * sddc_capture - look up, extract and play back recordings with libsddc
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* info: the format and time range of a capture (also while it is still
+   being recorded); extract: the samples
+   from a time on, straight from the mapping; play: the capture through a
+   streaming callback (peak level per second), timing the playback;
+   index: writes a sidecar index from sample/time pairs */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libsddc.h"
+
+
+static int info(int argc, char **argv);
+static int extract(int argc, char **argv);
+static int play(int argc, char **argv);
+static int index_capture(int argc, char **argv);
+static void play_callback(uint32_t data_size, uint8_t *data, void *context);
+static double now();
+
+static const char *USAGE =
+  "usage: %s info <capture file> [<sample rate>]\n"
+  "       %s extract <capture file> <start time> <duration_in_s> <output file> [<sample rate>]\n"
+  "       %s play <capture file> [<speed> [<frame size> [<sample rate>]]]\n"
+  "       %s index <capture file> <sample rate> <sample> <time> [<sample> <time> ...]\n"
+  "(times in seconds since the epoch, or < 0 for seconds after the start; speed 0 for as fast as possible)\n";
+
+struct play_state {
+  double sample_rate;
+  uint64_t samples;
+  uint64_t next_report;
+  int peak;
+};
+
+
+int main(int argc, char **argv)
+{
+  if (argc >= 3 && argc <= 4 && strcmp(argv[1], "info") == 0) {
+    return info(argc, argv);
+  }
+  if (argc >= 6 && strcmp(argv[1], "extract") == 0) {
+    return extract(argc, argv);
+  }
+  if (argc >= 3 && strcmp(argv[1], "play") == 0) {
+    return play(argc, argv);
+  }
+  if (argc >= 6 && argc % 2 == 0 && strcmp(argv[1], "index") == 0) {
+    return index_capture(argc, argv);
+  }
+  fprintf(stderr, USAGE, argv[0], argv[0], argv[0], argv[0]);
+  return -1;
+}
+
+static int info(int argc, char **argv)
+{
+  double sample_rate = argc > 3 ? atof(argv[3]) : 0.0;
+  sddc_capture_t *capture = sddc_capture_open(argv[2], sample_rate);
+  if (capture == 0) {
+    fprintf(stderr, "ERROR - sddc_capture_open(%s) failed\n", argv[2]);
+    return -1;
+  }
+  struct sddc_capture_info info;
+  sddc_capture_get_info(capture, &info);
+  printf("format:   %u channel(s), %u bits, %.0lf Hz, center %.0lf Hz\n",
+         info.channels, info.bits_per_sample, info.sample_rate,
+         info.center_frequency);
+  printf("samples:  %llu (%.3lf s) from offset %llu%s\n",
+         (unsigned long long) info.samples, info.samples / info.sample_rate,
+         (unsigned long long) info.data_offset,
+         info.open_ended ? " - to the end of the file (still recording?)" : "");
+  printf("time:     %.3lf to %.3lf (%u segment(s))\n", info.start_time * 1e-9,
+         info.end_time * 1e-9, info.segments);
+  sddc_capture_close(capture);
+  return 0;
+}
+
+static int extract(int argc, char **argv)
+{
+  double sample_rate = argc > 6 ? atof(argv[6]) : 0.0;
+  sddc_capture_t *capture = sddc_capture_open(argv[2], sample_rate);
+  if (capture == 0) {
+    fprintf(stderr, "ERROR - sddc_capture_open(%s) failed\n", argv[2]);
+    return -1;
+  }
+  struct sddc_capture_info info;
+  sddc_capture_get_info(capture, &info);
+  double t = atof(argv[3]);
+  int64_t start_time = t < 0 ? info.start_time - (int64_t) (t * 1e9) :
+                       (int64_t) (t * 1e9);
+  double duration = atof(argv[4]);
+
+  int ret_val = -1;
+  FILE *fp = 0;
+  double t0 = now();
+  uint64_t sample = sddc_capture_find_time(capture, start_time);
+  uint64_t count = (uint64_t) (duration * info.sample_rate);
+  const void *data = sddc_capture_span(capture, sample, count, &count);
+  double elapsed = now() - t0;
+  if (data == 0) {
+    fprintf(stderr, "ERROR - no samples at that time\n");
+    goto DONE;
+  }
+  fprintf(stderr, "%llu samples from sample %llu (%.6lf) found in %.3lf ms\n",
+          (unsigned long long) count, (unsigned long long) sample,
+          sddc_capture_get_time(capture, sample) * 1e-9, elapsed * 1e3);
+
+  fp = fopen(argv[5], "wb");
+  if (fp == 0) {
+    fprintf(stderr, "ERROR - cannot open %s\n", argv[5]);
+    goto DONE;
+  }
+  size_t size = count * info.channels * info.bits_per_sample / 8;
+  if (fwrite(data, 1, size, fp) != size) {
+    fprintf(stderr, "ERROR - write to %s failed\n", argv[5]);
+    goto DONE;
+  }
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  if (fp) {
+    fclose(fp);
+  }
+  sddc_capture_close(capture);
+  return ret_val;
+}
+
+static int play(int argc, char **argv)
+{
+  double speed = argc > 3 ? atof(argv[3]) : 0.0;
+  uint32_t frame_size = argc > 4 ? (uint32_t) atoi(argv[4]) : 0;
+  double sample_rate = argc > 5 ? atof(argv[5]) : 0.0;
+  sddc_capture_t *capture = sddc_capture_open(argv[2], sample_rate);
+  if (capture == 0) {
+    fprintf(stderr, "ERROR - sddc_capture_open(%s) failed\n", argv[2]);
+    return -1;
+  }
+  struct sddc_capture_info info;
+  sddc_capture_get_info(capture, &info);
+  if (info.bits_per_sample != 16) {
+    fprintf(stderr, "ERROR - only 16 bit captures can be played\n");
+    sddc_capture_close(capture);
+    return -1;
+  }
+
+  struct play_state state = { info.sample_rate * info.channels, 0, 0, 0 };
+  double t0 = now();
+  int64_t played = sddc_capture_play(capture, 0, info.samples, frame_size,
+                                     speed, play_callback, &state);
+  double elapsed = now() - t0;
+  if (played < 0) {
+    fprintf(stderr, "ERROR - sddc_capture_play() failed\n");
+    sddc_capture_close(capture);
+    return -1;
+  }
+  double duration = played / info.sample_rate;
+  fprintf(stderr, "played %.3lf s of samples in %.3lf s (%.1lfx real time, %.1lf MB/s)\n",
+          duration, elapsed, duration / elapsed,
+          played * info.channels * 2 / elapsed * 1e-6);
+  sddc_capture_close(capture);
+  return 0;
+}
+
+static int index_capture(int argc, char **argv)
+{
+  double sample_rate = atof(argv[3]);
+  uint32_t count = (uint32_t) (argc - 4) / 2;
+  struct sddc_capture_segment *segments = (struct sddc_capture_segment *)
+                                          malloc(count * sizeof(struct sddc_capture_segment));
+  for (uint32_t i = 0; i < count; ++i) {
+    segments[i].sample = strtoull(argv[4+2*i], 0, 10);
+    segments[i].time = (int64_t) (atof(argv[5+2*i]) * 1e9);
+  }
+  int ret = sddc_capture_write_index(argv[2], sample_rate, segments, count);
+  free(segments);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - sddc_capture_write_index() failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+/* print the peak level about once a second of samples */
+static void play_callback(uint32_t data_size, uint8_t *data, void *context)
+{
+  struct play_state *state = (struct play_state *) context;
+  const int16_t *samples = (const int16_t *) data;
+  uint32_t nsamples = data_size / sizeof(int16_t);
+  for (uint32_t i = 0; i < nsamples; ++i) {
+    int value = abs(samples[i]);
+    state->peak = value > state->peak ? value : state->peak;
+  }
+  state->samples += nsamples;
+  if (state->samples >= state->next_report) {
+    printf("%8.3fs  peak %6d\n", state->samples / state->sample_rate,
+           state->peak);
+    state->next_report += (uint64_t) state->sample_rate;
+    state->peak = 0;
+  }
+  return;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,109 @@
+/*
+ * sddc_cpp_test - stream test program for the C++20 interface (libsddc.hpp)
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Runs a callback stream and then an awaitable stream consumed by a
+ * coroutine, each for the given number of samples */
+
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+
+#include "libsddc.hpp"
+
+
+static libsddc::task count_frames(libsddc::async_stream &stream,
+                                  unsigned long long total_samples,
+                                  unsigned long long &received_samples,
+                                  int &num_frames)
+{
+  while (received_samples < total_samples) {
+    auto frame = co_await stream.next();
+    if (frame.empty()) {
+      break;
+    }
+    ++num_frames;
+    received_samples += frame.size();
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    std::fprintf(stderr, "usage: %s <image file> <sample rate> [<runtime_in_ms>]\n", argv[0]);
+    return -1;
+  }
+  const char *imagefile = argv[1];
+  double sample_rate = std::atof(argv[2]);
+  int runtime = 3 < argc ? std::atoi(argv[3]) : 1000;
+
+  if (sample_rate <= 0) {
+    std::fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+    return -1;
+  }
+  auto total_samples = static_cast<unsigned long long>(runtime * sample_rate / 1000.0);
+
+  try {
+    libsddc::device sddc(0, imagefile);
+    sddc.set_sample_rate(sample_rate);
+    sddc.set_rf_mode(HF_MODE);
+
+    /* callback stream */
+    unsigned long long received_samples = 0;
+    int num_frames = 0;
+    {
+      libsddc::stream stream(sddc, [&](std::span<const int16_t> frame) {
+        ++num_frames;
+        received_samples += frame.size();
+      });
+      stream.start();
+      while (received_samples < total_samples) {
+        stream.handle_events();
+      }
+      stream.stop();
+    }
+    std::fprintf(stderr, "stream: received=%llu 16-Bit samples in %d frames\n",
+                 received_samples, num_frames);
+
+    /* awaitable stream */
+    received_samples = 0;
+    num_frames = 0;
+    {
+      libsddc::async_stream stream(sddc);
+      stream.start();
+      auto consumer = count_frames(stream, total_samples, received_samples,
+                                   num_frames);
+      while (!consumer.done()) {
+        stream.handle_events();
+      }
+      stream.stop();
+      consumer.get();
+      std::fprintf(stderr, "async_stream: received=%llu 16-Bit samples in %d frames (%llu dropped)\n",
+                   received_samples, num_frames,
+                   static_cast<unsigned long long>(stream.dropped_frames()));
+    }
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "ERROR - %s\n", e.what());
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,705 @@
+/*
+ * sddc_fx3_emulator - SDDC FX3 device emulator on a Linux USB gadget
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Emulates the FX3 of an SDDC receiver (with the streamer firmware
+ * already loaded) through the Linux raw-gadget interface, so the library
+ * can be tested end to end - enumeration, endpoint and SuperSpeed
+ * companion descriptors, libusb_dev_mem_alloc() and bulk transfers -
+ * on a machine without the hardware:
+ *
+ *   modprobe dummy_hcd is_super_speed=1
+ *   modprobe raw_gadget
+ *   sddc_fx3_emulator -v &
+ *   sddc_stream_test <image file> 64000000 10000
+ *
+ * It answers the vendor requests of usb_device_control() (GPIO, I2C
+ * and firmware registers are kept, and I2C reads return what was
+ * written), and while the stream is started (STARTFX3) it writes frames
+ * of a synthetic pattern to the bulk IN endpoint, at the sample rate
+ * set with STARTADC or the one given with -r (0 for as fast as the host
+ * reads). The 'ramp' pattern is a 16 bit counter, so a consumer can
+ * check every sample for gaps; 'tone' is a full scale sine at fs/16.
+ * When the ADC randomizer GPIO is on, the samples are randomized the way
+ * the ADC does it, and the library undoes it.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usb/ch9.h>
+#include <linux/usb/raw_gadget.h>
+
+#include "libsddc.h"
+#include "usb_device.h"
+
+
+#define FX3_VID (0x04b4)
+#define FX3_PID (0x00f1)              /* Cypress / FX3 Streamer Example */
+#define FX3_FIRMWARE (0x0104)
+#define EP0_MAX_DATA (4096)
+#define BULK_MAX_PACKET_SIZE (1024)
+#define BULK_MAX_BURST (15)
+#define I2C_ADDRESSES (128)
+#define GPIO_ADC_RAND (0x0080)        /* same as in libsddc.c */
+
+enum Pattern {
+  PATTERN_RAMP,
+  PATTERN_TONE
+};
+
+typedef struct fx3 {
+  int fd;
+  const char *driver;
+  const char *device;
+  enum SDDCHWModel model;
+  enum Pattern pattern;
+  double rate;                        /* < 0: follow STARTADC */
+  uint32_t chunk_size;
+  int verbose;
+  int configured;
+  int bulk_in;                        /* raw-gadget endpoint handle */
+  uint8_t bulk_in_address;
+  pthread_t streamer;
+  atomic_int streaming;
+  atomic_uint adc_rate;
+  atomic_uint gpio;
+  uint16_t fw_registers[256];
+  uint8_t i2c[I2C_ADDRESSES][256];
+} fx3_t;
+
+static volatile sig_atomic_t stop = 0;
+
+
+static void handle_signal(int signum);
+static int fx3_run(fx3_t *this);
+static int fx3_control(fx3_t *this, const struct usb_ctrlrequest *ctrl);
+static int fx3_get_descriptor(fx3_t *this, const struct usb_ctrlrequest *ctrl);
+static int fx3_set_configuration(fx3_t *this, uint16_t value);
+static int fx3_vendor(fx3_t *this, const struct usb_ctrlrequest *ctrl);
+static int fx3_ep0_write(fx3_t *this, const void *data, uint32_t length);
+static int fx3_ep0_read(fx3_t *this, void *data, uint32_t length);
+static int fx3_ep0_stall(fx3_t *this);
+static void *fx3_streamer(void *arg);
+static void fill_pattern(fx3_t *this, int16_t *samples, uint32_t nsamples,
+                         uint64_t sample_index);
+static double now();
+
+
+int main(int argc, char **argv)
+{
+  fx3_t fx3;
+  memset(&fx3, 0, sizeof(fx3));
+  fx3.driver = "dummy_udc";
+  fx3.device = "dummy_udc.0";
+  fx3.model = HW_RX888;
+  fx3.pattern = PATTERN_RAMP;
+  fx3.rate = -1;
+  fx3.chunk_size = 32768;
+  atomic_init(&fx3.streaming, 0);
+  atomic_init(&fx3.adc_rate, 0);
+  atomic_init(&fx3.gpio, 0);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "d:D:m:p:r:c:v")) != -1) {
+    switch (opt) {
+      case 'd':
+        fx3.driver = optarg;
+        break;
+      case 'D':
+        fx3.device = optarg;
+        break;
+      case 'm':
+        fx3.model = (enum SDDCHWModel) atoi(optarg);
+        break;
+      case 'p':
+        fx3.pattern = strcmp(optarg, "tone") == 0 ? PATTERN_TONE : PATTERN_RAMP;
+        break;
+      case 'r':
+        fx3.rate = atof(optarg);
+        break;
+      case 'c':
+        fx3.chunk_size = (uint32_t) atol(optarg);
+        break;
+      case 'v':
+        fx3.verbose = 1;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-d <UDC driver>] [-D <UDC device>] [-m <hw model>] [-p ramp|tone] [-r <sample rate>] [-c <chunk size>] [-v]\n", argv[0]);
+        return -1;
+    }
+  }
+  if (fx3.chunk_size == 0 || fx3.chunk_size % BULK_MAX_PACKET_SIZE != 0) {
+    fprintf(stderr, "ERROR - the chunk size must be a multiple of %d\n", BULK_MAX_PACKET_SIZE);
+    return -1;
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_signal;
+  sigaction(SIGINT, &action, 0);
+  sigaction(SIGTERM, &action, 0);
+
+  fx3.fd = open("/dev/raw-gadget", O_RDWR);
+  if (fx3.fd < 0) {
+    fprintf(stderr, "ERROR - open(/dev/raw-gadget) failed: %s (is the raw_gadget module loaded?)\n", strerror(errno));
+    return -1;
+  }
+
+  int ret = fx3_run(&fx3);
+
+  /* the streamer may be blocked in a bulk write; closing the gadget
+     releases it */
+  atomic_store(&fx3.streaming, 0);
+  close(fx3.fd);
+  return ret;
+}
+
+
+/* internal functions */
+static void handle_signal(int signum __attribute__((unused)))
+{
+  stop = 1;
+}
+
+static int fx3_run(fx3_t *this)
+{
+  struct usb_raw_init init;
+  memset(&init, 0, sizeof(init));
+  strncpy((char *) init.driver_name, this->driver, UDC_NAME_LENGTH_MAX - 1);
+  strncpy((char *) init.device_name, this->device, UDC_NAME_LENGTH_MAX - 1);
+  init.speed = USB_SPEED_SUPER;
+  if (ioctl(this->fd, USB_RAW_IOCTL_INIT, &init) < 0) {
+    fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_INIT) failed: %s\n", strerror(errno));
+    return -1;
+  }
+  if (ioctl(this->fd, USB_RAW_IOCTL_RUN, 0) < 0) {
+    fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_RUN) failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  struct usb_raw_event *event = (struct usb_raw_event *) malloc(sizeof(struct usb_raw_event) + sizeof(struct usb_ctrlrequest));
+  while (!stop) {
+    event->type = 0;
+    event->length = sizeof(struct usb_ctrlrequest);
+    if (ioctl(this->fd, USB_RAW_IOCTL_EVENT_FETCH, event) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_EVENT_FETCH) failed: %s\n", strerror(errno));
+      free(event);
+      return -1;
+    }
+    switch (event->type) {
+      case USB_RAW_EVENT_CONNECT:
+        if (this->verbose) {
+          fprintf(stderr, "INFO - connected to %s\n", this->device);
+        }
+        break;
+      case USB_RAW_EVENT_CONTROL:
+        if (fx3_control(this, (struct usb_ctrlrequest *) event->data) < 0) {
+          fx3_ep0_stall(this);
+        }
+        break;
+      default:
+        /* reset, disconnect, suspend and resume (newer kernels) */
+        if (this->verbose) {
+          fprintf(stderr, "INFO - event %u\n", event->type);
+        }
+        atomic_store(&this->streaming, 0);
+        break;
+    }
+  }
+  free(event);
+  return 0;
+}
+
+static int fx3_control(fx3_t *this, const struct usb_ctrlrequest *ctrl)
+{
+  uint8_t data[EP0_MAX_DATA];
+
+  if ((ctrl->bRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR) {
+    return fx3_vendor(this, ctrl);
+  }
+  if ((ctrl->bRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD) {
+    return -1;
+  }
+
+  switch (ctrl->bRequest) {
+    case USB_REQ_GET_DESCRIPTOR:
+      return fx3_get_descriptor(this, ctrl);
+    case USB_REQ_SET_CONFIGURATION:
+      if (fx3_set_configuration(this, le16toh(ctrl->wValue)) < 0) {
+        return -1;
+      }
+      return fx3_ep0_read(this, data, 0);
+    case USB_REQ_GET_CONFIGURATION:
+      data[0] = this->configured;
+      return fx3_ep0_write(this, data, 1);
+    case USB_REQ_GET_STATUS:
+      memset(data, 0, 2);
+      return fx3_ep0_write(this, data, 2);
+    case USB_REQ_SET_INTERFACE:
+    case USB_REQ_SET_ISOCH_DELAY:
+      return fx3_ep0_read(this, data, 0);
+    case USB_REQ_SET_SEL:
+      return fx3_ep0_read(this, data, le16toh(ctrl->wLength));
+    default:
+      return -1;
+  }
+}
+
+static int fx3_get_descriptor(fx3_t *this, const struct usb_ctrlrequest *ctrl)
+{
+  uint8_t data[EP0_MAX_DATA];
+  uint32_t length = 0;
+  uint8_t type = le16toh(ctrl->wValue) >> 8;
+  uint8_t index = le16toh(ctrl->wValue) & 0xff;
+
+  switch (type) {
+    case USB_DT_DEVICE: {
+      struct usb_device_descriptor desc = {
+        .bLength = USB_DT_DEVICE_SIZE,
+        .bDescriptorType = USB_DT_DEVICE,
+        .bcdUSB = htole16(0x0320),
+        .bDeviceClass = 0,
+        .bDeviceSubClass = 0,
+        .bDeviceProtocol = 0,
+        .bMaxPacketSize0 = 9,           /* 512 bytes at SuperSpeed */
+        .idVendor = htole16(FX3_VID),
+        .idProduct = htole16(FX3_PID),
+        .bcdDevice = htole16(0x0000),
+        .iManufacturer = 1,
+        .iProduct = 2,
+        .iSerialNumber = 3,
+        .bNumConfigurations = 1
+      };
+      memcpy(data, &desc, USB_DT_DEVICE_SIZE);
+      length = USB_DT_DEVICE_SIZE;
+      break;
+    }
+    case USB_DT_CONFIG: {
+      struct usb_config_descriptor config = {
+        .bLength = USB_DT_CONFIG_SIZE,
+        .bDescriptorType = USB_DT_CONFIG,
+        .wTotalLength = 0,
+        .bNumInterfaces = 1,
+        .bConfigurationValue = 1,
+        .iConfiguration = 0,
+        .bmAttributes = USB_CONFIG_ATT_ONE | USB_CONFIG_ATT_SELFPOWER,
+        .bMaxPower = 0x32
+      };
+      struct usb_interface_descriptor interface = {
+        .bLength = USB_DT_INTERFACE_SIZE,
+        .bDescriptorType = USB_DT_INTERFACE,
+        .bInterfaceNumber = 0,
+        .bAlternateSetting = 0,
+        .bNumEndpoints = 1,
+        .bInterfaceClass = USB_CLASS_VENDOR_SPEC,
+        .bInterfaceSubClass = 0,
+        .bInterfaceProtocol = 0,
+        .iInterface = 0
+      };
+      struct usb_endpoint_descriptor endpoint = {
+        .bLength = USB_DT_ENDPOINT_SIZE,
+        .bDescriptorType = USB_DT_ENDPOINT,
+        .bEndpointAddress = this->bulk_in_address ? this->bulk_in_address : USB_DIR_IN | 1,
+        .bmAttributes = USB_ENDPOINT_XFER_BULK,
+        .wMaxPacketSize = htole16(BULK_MAX_PACKET_SIZE),
+        .bInterval = 0
+      };
+      struct usb_ss_ep_comp_descriptor companion = {
+        .bLength = USB_DT_SS_EP_COMP_SIZE,
+        .bDescriptorType = USB_DT_SS_ENDPOINT_COMP,
+        .bMaxBurst = BULK_MAX_BURST,
+        .bmAttributes = 0,
+        .wBytesPerInterval = 0
+      };
+      length = USB_DT_CONFIG_SIZE + USB_DT_INTERFACE_SIZE +
+               USB_DT_ENDPOINT_SIZE + USB_DT_SS_EP_COMP_SIZE;
+      config.wTotalLength = htole16(length);
+      uint8_t *p = data;
+      memcpy(p, &config, USB_DT_CONFIG_SIZE);
+      p += USB_DT_CONFIG_SIZE;
+      memcpy(p, &interface, USB_DT_INTERFACE_SIZE);
+      p += USB_DT_INTERFACE_SIZE;
+      memcpy(p, &endpoint, USB_DT_ENDPOINT_SIZE);
+      p += USB_DT_ENDPOINT_SIZE;
+      memcpy(p, &companion, USB_DT_SS_EP_COMP_SIZE);
+      break;
+    }
+    case USB_DT_BOS: {
+      struct usb_bos_descriptor bos = {
+        .bLength = USB_DT_BOS_SIZE,
+        .bDescriptorType = USB_DT_BOS,
+        .wTotalLength = 0,
+        .bNumDeviceCaps = 2
+      };
+      struct usb_ext_cap_descriptor ext_cap = {
+        .bLength = USB_DT_USB_EXT_CAP_SIZE,
+        .bDescriptorType = USB_DT_DEVICE_CAPABILITY,
+        .bDevCapabilityType = USB_CAP_TYPE_EXT,
+        .bmAttributes = htole32(USB_LPM_SUPPORT)
+      };
+      struct usb_ss_cap_descriptor ss_cap = {
+        .bLength = USB_DT_USB_SS_CAP_SIZE,
+        .bDescriptorType = USB_DT_DEVICE_CAPABILITY,
+        .bDevCapabilityType = USB_SS_CAP_TYPE,
+        .bmAttributes = 0,
+        .wSpeedSupported = htole16(USB_FULL_SPEED_OPERATION |
+                                   USB_HIGH_SPEED_OPERATION |
+                                   USB_5GBPS_OPERATION),
+        .bFunctionalitySupport = 1,
+        .bU1devExitLat = 0x0a,
+        .bU2DevExitLat = htole16(0x07ff)
+      };
+      length = USB_DT_BOS_SIZE + USB_DT_USB_EXT_CAP_SIZE +
+               USB_DT_USB_SS_CAP_SIZE;
+      bos.wTotalLength = htole16(length);
+      memcpy(data, &bos, USB_DT_BOS_SIZE);
+      memcpy(data + USB_DT_BOS_SIZE, &ext_cap, USB_DT_USB_EXT_CAP_SIZE);
+      memcpy(data + USB_DT_BOS_SIZE + USB_DT_USB_EXT_CAP_SIZE, &ss_cap,
+             USB_DT_USB_SS_CAP_SIZE);
+      break;
+    }
+    case USB_DT_STRING: {
+      static const char *strings[] = { 0, "Cypress", "SDDC FX3 emulator",
+                                       "000000000001" };
+      if (index == 0) {
+        data[0] = 4;
+        data[1] = USB_DT_STRING;
+        data[2] = 0x09;     /* English (US) */
+        data[3] = 0x04;
+        length = 4;
+      } else if (index < sizeof(strings) / sizeof(strings[0])) {
+        const char *s = strings[index];
+        length = 2 + 2 * strlen(s);
+        data[0] = length;
+        data[1] = USB_DT_STRING;
+        for (size_t i = 0; i < strlen(s); ++i) {
+          data[2+2*i] = s[i];
+          data[2+2*i+1] = 0;
+        }
+      } else {
+        return -1;
+      }
+      break;
+    }
+    default:
+      /* no device qualifier - SuperSpeed only */
+      return -1;
+  }
+
+  uint16_t requested = le16toh(ctrl->wLength);
+  return fx3_ep0_write(this, data, length < requested ? length : requested);
+}
+
+static int fx3_set_configuration(fx3_t *this, uint16_t value)
+{
+  if (value != 1) {
+    return -1;
+  }
+  if (this->configured) {
+    return 0;
+  }
+
+  /* first bulk IN endpoint of the UDC */
+  struct usb_raw_eps_info info;
+  memset(&info, 0, sizeof(info));
+  int neps = ioctl(this->fd, USB_RAW_IOCTL_EPS_INFO, &info);
+  if (neps < 0) {
+    fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_EPS_INFO) failed: %s\n", strerror(errno));
+    return -1;
+  }
+  uint8_t address = 0;
+  for (int i = 0; i < neps; ++i) {
+    if (info.eps[i].caps.type_bulk && info.eps[i].caps.dir_in) {
+      address = info.eps[i].addr == USB_RAW_EP_ADDR_ANY ? 1 : info.eps[i].addr;
+      break;
+    }
+  }
+  if (address == 0) {
+    fprintf(stderr, "ERROR - no bulk IN endpoint on %s\n", this->device);
+    return -1;
+  }
+  this->bulk_in_address = USB_DIR_IN | address;
+
+  struct usb_endpoint_descriptor endpoint = {
+    .bLength = USB_DT_ENDPOINT_SIZE,
+    .bDescriptorType = USB_DT_ENDPOINT,
+    .bEndpointAddress = this->bulk_in_address,
+    .bmAttributes = USB_ENDPOINT_XFER_BULK,
+    .wMaxPacketSize = htole16(BULK_MAX_PACKET_SIZE),
+    .bInterval = 0
+  };
+  this->bulk_in = ioctl(this->fd, USB_RAW_IOCTL_EP_ENABLE, &endpoint);
+  if (this->bulk_in < 0) {
+    fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_EP_ENABLE) failed: %s\n", strerror(errno));
+    return -1;
+  }
+  if (ioctl(this->fd, USB_RAW_IOCTL_VBUS_DRAW, 0x32) < 0 ||
+      ioctl(this->fd, USB_RAW_IOCTL_CONFIGURE, 0) < 0) {
+    fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_CONFIGURE) failed: %s\n", strerror(errno));
+    return -1;
+  }
+
+  if (pthread_create(&this->streamer, 0, fx3_streamer, this) != 0) {
+    fprintf(stderr, "ERROR - pthread_create() failed\n");
+    return -1;
+  }
+  pthread_detach(this->streamer);
+  this->configured = 1;
+  if (this->verbose) {
+    fprintf(stderr, "INFO - configured - bulk IN endpoint 0x%02x\n", this->bulk_in_address);
+  }
+  return 0;
+}
+
+static int fx3_vendor(fx3_t *this, const struct usb_ctrlrequest *ctrl)
+{
+  uint8_t data[EP0_MAX_DATA];
+  uint16_t value = le16toh(ctrl->wValue);
+  uint16_t index = le16toh(ctrl->wIndex);
+  uint16_t length = le16toh(ctrl->wLength);
+  if (length > EP0_MAX_DATA) {
+    return -1;
+  }
+
+  /* device to host */
+  if (ctrl->bRequestType & USB_DIR_IN) {
+    switch (ctrl->bRequest) {
+      case TESTFX3:
+        memset(data, 0, length);
+        if (length >= 3) {
+          data[0] = this->model;
+          data[1] = FX3_FIRMWARE >> 8;
+          data[2] = FX3_FIRMWARE & 0xff;
+        }
+        break;
+      case I2CRFX3:
+        if (value >= I2C_ADDRESSES || index + length > 256) {
+          return -1;
+        }
+        memcpy(data, this->i2c[value] + index, length);
+        break;
+      default:
+        return -1;
+    }
+    return fx3_ep0_write(this, data, length);
+  }
+
+  /* host to device */
+  if (fx3_ep0_read(this, data, length) < 0) {
+    return -1;
+  }
+  switch (ctrl->bRequest) {
+    case STARTFX3:
+      atomic_store(&this->streaming, 1);
+      break;
+    case STOPFX3:
+    case RESETFX3:
+      atomic_store(&this->streaming, 0);
+      break;
+    case STARTADC:
+      if (length >= 4) {
+        atomic_store(&this->adc_rate, data[0] | data[1] << 8 | data[2] << 16 |
+                                      (uint32_t) data[3] << 24);
+      }
+      break;
+    case GPIOFX3:
+      if (length >= 2) {
+        atomic_store(&this->gpio, data[0] | data[1] << 8);
+      }
+      break;
+    case I2CWFX3:
+      if (value >= I2C_ADDRESSES || index + length > 256) {
+        return -1;
+      }
+      memcpy(this->i2c[value] + index, data, length);
+      break;
+    case SETARGFX3:
+      this->fw_registers[value & 0xff] = index;
+      break;
+    case R82XXINIT:
+    case R82XXTUNE:
+    case R82XXSTDBY:
+      break;
+    default:
+      fprintf(stderr, "WARNING - unknown vendor request 0x%02x\n", ctrl->bRequest);
+      break;
+  }
+  if (this->verbose) {
+    fprintf(stderr, "INFO - request 0x%02x value=0x%04x index=0x%04x length=%u\n",
+            ctrl->bRequest, value, index, length);
+  }
+  return 0;
+}
+
+static int fx3_ep0_write(fx3_t *this, const void *data, uint32_t length)
+{
+  struct usb_raw_ep_io *io = (struct usb_raw_ep_io *) malloc(sizeof(struct usb_raw_ep_io) + length);
+  io->ep = 0;
+  io->flags = 0;
+  io->length = length;
+  memcpy(io->data, data, length);
+  int ret = ioctl(this->fd, USB_RAW_IOCTL_EP0_WRITE, io);
+  free(io);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_EP0_WRITE) failed: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* also used with length 0 to acknowledge a request without data */
+static int fx3_ep0_read(fx3_t *this, void *data, uint32_t length)
+{
+  struct usb_raw_ep_io *io = (struct usb_raw_ep_io *) malloc(sizeof(struct usb_raw_ep_io) + length);
+  io->ep = 0;
+  io->flags = 0;
+  io->length = length;
+  int ret = ioctl(this->fd, USB_RAW_IOCTL_EP0_READ, io);
+  if (ret >= 0) {
+    memcpy(data, io->data, ret);
+  }
+  free(io);
+  if (ret < 0) {
+    fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_EP0_READ) failed: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+static int fx3_ep0_stall(fx3_t *this)
+{
+  if (ioctl(this->fd, USB_RAW_IOCTL_EP0_STALL, 0) < 0) {
+    fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_EP0_STALL) failed: %s\n", strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+/* writes the pattern to the bulk endpoint while streaming, paced to the
+   sample rate; a write blocks until the host reads it */
+static void *fx3_streamer(void *arg)
+{
+  fx3_t *this = (fx3_t *) arg;
+  struct usb_raw_ep_io *io = (struct usb_raw_ep_io *) malloc(sizeof(struct usb_raw_ep_io) + this->chunk_size);
+  uint32_t nsamples = this->chunk_size / sizeof(int16_t);
+  uint64_t sample_index = 0;
+  uint64_t total_bytes = 0;
+  double deadline = 0;
+  double report_time = now();
+  uint64_t report_bytes = 0;
+
+  while (!stop) {
+    if (!atomic_load(&this->streaming)) {
+      usleep(1000);
+      deadline = 0;
+      continue;
+    }
+
+    fill_pattern(this, (int16_t *) io->data, nsamples, sample_index);
+    io->ep = this->bulk_in;
+    io->flags = 0;
+    io->length = this->chunk_size;
+    int ret = ioctl(this->fd, USB_RAW_IOCTL_EP_WRITE, io);
+    if (ret < 0) {
+      if (errno != EINTR && errno != ESHUTDOWN) {
+        fprintf(stderr, "ERROR - ioctl(USB_RAW_IOCTL_EP_WRITE) failed: %s\n", strerror(errno));
+      }
+      usleep(1000);
+      continue;
+    }
+    sample_index += nsamples;
+    total_bytes += ret;
+
+    /* pacing - a late chunk is sent right away, but the schedule is not
+       allowed to build up a burst of more than 100ms */
+    double rate = this->rate >= 0 ? this->rate : atomic_load(&this->adc_rate);
+    if (rate > 0) {
+      double t = now();
+      deadline = deadline == 0 || deadline < t - 0.1 ? t : deadline;
+      deadline += nsamples / rate;
+      if (deadline > t) {
+        struct timespec ts;
+        ts.tv_sec = (time_t) deadline;
+        ts.tv_nsec = (long) ((deadline - ts.tv_sec) * 1e9);
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+      }
+    }
+
+    if (this->verbose) {
+      double t = now();
+      if (t - report_time >= 1.0) {
+        fprintf(stderr, "INFO - %.1f MB/s - %.2f Msps - total %llu MB\n",
+                (total_bytes - report_bytes) / (t - report_time) / 1e6,
+                (total_bytes - report_bytes) / sizeof(int16_t) / (t - report_time) / 1e6,
+                (unsigned long long) (total_bytes / 1000000));
+        report_time = t;
+        report_bytes = total_bytes;
+      }
+    }
+  }
+
+  free(io);
+  return 0;
+}
+
+static void fill_pattern(fx3_t *this, int16_t *samples, uint32_t nsamples,
+                         uint64_t sample_index)
+{
+  if (this->pattern == PATTERN_TONE) {
+    for (uint32_t i = 0; i < nsamples; ++i) {
+      samples[i] = (int16_t) (32767.0 * sin(2.0 * M_PI * ((sample_index + i) % 16) / 16.0));
+    }
+  } else {
+    for (uint32_t i = 0; i < nsamples; ++i) {
+      samples[i] = (int16_t) (uint16_t) (sample_index + i);
+    }
+  }
+
+  /* ADC randomizer: when the LSB is set, the other bits are inverted */
+  if (atomic_load(&this->gpio) & GPIO_ADC_RAND) {
+    uint16_t *raw = (uint16_t *) samples;
+    for (uint32_t i = 0; i < nsamples; ++i) {
+      raw[i] ^= (uint16_t) (-(raw[i] & 1) & 0xfffe);
+    }
+  }
+  return;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
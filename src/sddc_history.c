@@ -0,0 +1,260 @@
+/*
+ * sddc_history - record and query a spectrum history with libsddc
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* record: the ADC frames go through an fft stage into a spectrum history
+   (a new file or an existing one, appended to); info and query read a
+   history - also while another process is recording into it */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libsddc.h"
+
+
+static int record(int argc, char **argv);
+static int info(int argc, char **argv);
+static int query(int argc, char **argv);
+static int64_t parse_time(const char *arg, int64_t last_time);
+static double now();
+
+static const char *USAGE =
+  "usage: %s record <image file> <sample rate> <history file> [<runtime_in_ms> [<fft size> [<interval_in_s>]]]\n"
+  "       %s info <history file>\n"
+  "       %s query <history file> <level> <start time> <end time> [<start frequency> <end frequency> [<max rows> [mean|peak]]]\n"
+  "(level: auto, spectra, minutes or hours; times in seconds since the epoch, or <= 0 for seconds before the last spectrum)\n";
+
+
+int main(int argc, char **argv)
+{
+  if (argc >= 6 && strcmp(argv[1], "record") == 0) {
+    return record(argc, argv);
+  }
+  if (argc == 3 && strcmp(argv[1], "info") == 0) {
+    return info(argc, argv);
+  }
+  if (argc >= 6 && strcmp(argv[1], "query") == 0) {
+    return query(argc, argv);
+  }
+  fprintf(stderr, USAGE, argv[0], argv[0], argv[0]);
+  return -1;
+}
+
+static int record(int argc, char **argv)
+{
+  char *imagefile = argv[2];
+  double sample_rate = 0.0;
+  sscanf(argv[3], "%lf", &sample_rate);
+  const char *historyfile = argv[4];
+  int runtime = argc > 5 ? atoi(argv[5]) : 10000;
+  uint32_t fft_size = argc > 6 ? (uint32_t) atoi(argv[6]) : 4096;
+  double interval = argc > 7 ? atof(argv[7]) : 1.0;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+    return -1;
+  }
+
+  int ret_val = -1;
+  sddc_history_t *history = 0;
+
+  sddc_t *sddc = sddc_open(0, imagefile);
+  if (sddc == 0) {
+    fprintf(stderr, "ERROR - sddc_open() failed\n");
+    return -1;
+  }
+
+  if (sddc_set_sample_rate(sddc, sample_rate) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_sample_rate() failed\n");
+    goto DONE;
+  }
+
+  /* real input: fft_size / 2 + 1 bins from 0 Hz */
+  history = sddc_history_open(historyfile, 1, fft_size / 2 + 1, 0.0,
+                              sample_rate / fft_size);
+  if (history == 0) {
+    fprintf(stderr, "ERROR - sddc_history_open(%s) failed\n", historyfile);
+    goto DONE;
+  }
+
+  if (sddc_set_async_params(sddc, 0, 0, 0, 0) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_async_params() failed\n");
+    goto DONE;
+  }
+
+  if (sddc_set_rf_mode(sddc, HF_MODE) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_rf_mode failed\n");
+    goto DONE;
+  }
+
+  sddc_stage_t *fft = sddc_pipeline_add_fft(sddc, fft_size);
+  sddc_stage_t *store = sddc_pipeline_add_history(sddc, history, interval);
+  if (fft == 0 || store == 0 ||
+      sddc_pipeline_connect(sddc, 0, fft) < 0 ||
+      sddc_pipeline_connect(sddc, fft, store) < 0) {
+    fprintf(stderr, "ERROR - history pipeline setup failed\n");
+    goto DONE;
+  }
+
+  if (sddc_start_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_start_streaming() failed\n");
+    goto DONE;
+  }
+
+  fprintf(stderr, "started streaming .. for %d ms ..\n", runtime);
+  double start = now();
+  do {
+    sddc_handle_events(sddc);
+  } while ((now() - start) * 1000 < runtime);
+
+  fprintf(stderr, "finished. now stop streaming ..\n");
+  if (sddc_stop_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_stop_streaming() failed\n");
+    goto DONE;
+  }
+
+  struct sddc_stage_stats stats;
+  if (sddc_stage_get_stats(store, &stats) == 0) {
+    fprintf(stderr, "spectra=%llu dropped=%llu\n",
+            (unsigned long long) stats.frames,
+            (unsigned long long) stats.dropped);
+  }
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  sddc_close(sddc);
+  if (history && sddc_history_close(history) < 0) {
+    fprintf(stderr, "ERROR - sddc_history_close() failed\n");
+    ret_val = -1;
+  }
+
+  return ret_val;
+}
+
+static int info(int argc __attribute__((unused)), char **argv)
+{
+  sddc_history_t *history = sddc_history_open(argv[2], 0, 0, 0, 0);
+  if (history == 0) {
+    fprintf(stderr, "ERROR - sddc_history_open(%s) failed\n", argv[2]);
+    return -1;
+  }
+  struct sddc_history_info info;
+  sddc_history_get_info(history, &info);
+  printf("bins:     %u from %.1lf Hz, %.3lf Hz wide\n", info.nbins,
+         info.frequency, info.bin_width);
+  printf("rows:     %llu spectra, %llu minutes, %llu hours\n",
+         (unsigned long long) info.rows[SDDC_HISTORY_SPECTRA],
+         (unsigned long long) info.rows[SDDC_HISTORY_MINUTES],
+         (unsigned long long) info.rows[SDDC_HISTORY_HOURS]);
+  if (info.rows[SDDC_HISTORY_SPECTRA] > 0) {
+    printf("time:     %.3lf to %.3lf\n", info.first_time * 1e-9,
+           info.last_time * 1e-9);
+    printf("size:     %llu bytes (%.2lf bytes per value)\n",
+           (unsigned long long) info.file_size,
+           (double) info.file_size / (info.nbins * (info.rows[0] +
+                                                    2 * info.rows[1] +
+                                                    2 * info.rows[2])));
+  }
+  sddc_history_close(history);
+  return 0;
+}
+
+static int query(int argc, char **argv)
+{
+  static const char *levels[] = { "spectra", "minutes", "hours" };
+  int level = SDDC_HISTORY_AUTO;
+  for (int i = 0; i < 3; ++i) {
+    if (strcmp(argv[3], levels[i]) == 0) {
+      level = i;
+    }
+  }
+  if (level == SDDC_HISTORY_AUTO && strcmp(argv[3], "auto") != 0) {
+    fprintf(stderr, "ERROR - invalid level: %s\n", argv[3]);
+    return -1;
+  }
+  double start_frequency = argc > 7 ? atof(argv[6]) : 0.0;
+  double end_frequency = argc > 7 ? atof(argv[7]) : 0.0;
+  uint32_t max_rows = argc > 8 ? (uint32_t) atoi(argv[8]) : 1000;
+  int stat = argc > 9 && strcmp(argv[9], "peak") == 0 ? SDDC_HISTORY_PEAK :
+             SDDC_HISTORY_MEAN;
+
+  sddc_history_t *history = sddc_history_open(argv[2], 0, 0, 0, 0);
+  if (history == 0) {
+    fprintf(stderr, "ERROR - sddc_history_open(%s) failed\n", argv[2]);
+    return -1;
+  }
+  struct sddc_history_info info;
+  sddc_history_get_info(history, &info);
+  int64_t start_time = parse_time(argv[4], info.last_time);
+  int64_t end_time = parse_time(argv[5], info.last_time + 1);
+
+  int ret_val = -1;
+  int64_t *times = (int64_t *) malloc(max_rows * sizeof(int64_t));
+  float *power = (float *) malloc((size_t) max_rows * info.nbins * sizeof(float));
+  uint32_t first_bin;
+  uint32_t nbins;
+  double t0 = now();
+  int rows = sddc_history_query(history, level, stat, start_time, end_time,
+                                start_frequency, end_frequency, max_rows,
+                                times, power, &first_bin, &nbins);
+  double elapsed = now() - t0;
+  if (rows < 0) {
+    fprintf(stderr, "ERROR - sddc_history_query() failed\n");
+    goto DONE;
+  }
+  fprintf(stderr, "%d rows (%d shown) of %u bins from %.1lf Hz in %.3lf ms\n",
+          rows, rows < (int) max_rows ? rows : (int) max_rows, nbins,
+          info.frequency + first_bin * info.bin_width, elapsed * 1e3);
+
+  /* one line per row: time, then the bins */
+  for (int r = 0; r < rows && r < (int) max_rows; ++r) {
+    printf("%.3lf", times[r] * 1e-9);
+    for (uint32_t k = 0; k < nbins; ++k) {
+      printf(" %.2f", power[(size_t) r * nbins + k]);
+    }
+    printf("\n");
+  }
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  free(times);
+  free(power);
+  sddc_history_close(history);
+  return ret_val;
+}
+
+static int64_t parse_time(const char *arg, int64_t last_time)
+{
+  double t = atof(arg);
+  return t <= 0 ? last_time + (int64_t) (t * 1e9) : (int64_t) (t * 1e9);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
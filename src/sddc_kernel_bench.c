@@ -0,0 +1,528 @@
+/*
+ * sddc_kernel_bench - micro-benchmark for the per-sample kernels
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Runs each per-sample kernel of the library over a cache resident buffer
+ * and a streaming sized one, and prints one line per kernel and buffer:
+ *
+ *   <isa> <kernel> <buffer> <samples> <ns/sample> <GB/s>
+ *
+ * where the time is the best of repeated runs, and GB/s is the input data
+ * rate. Lines starting with '#' are comments. The kernels are built into
+ * this program with the compiler flags of the library; to compare ISA
+ * levels, configure with e.g. -DKERNEL_BENCH_ISA="x86-64-v2;x86-64-v3",
+ * which also builds sddc_kernel_bench_<level> for each of them (a level
+ * the CPU does not support is reported and skipped).
+ *
+ * With -c <baseline file> (the saved output of a previous run) each
+ * result is compared with the baseline, and the exit status is 1 if any
+ * kernel got slower by more than the threshold (-r, default 10%).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "adc_stats.h"
+#include "ddc.h"
+#include "detector.h"
+#include "dsp.h"
+#include "fft.h"
+#include "fs4.h"
+#include "resampler.h"
+
+
+#if defined(__AVX512F__)
+static const char *ISA = "avx512";
+#elif defined(__AVX2__)
+static const char *ISA = "avx2";
+#elif defined(__AVX__)
+static const char *ISA = "avx";
+#elif defined(__SSE4_2__)
+static const char *ISA = "sse4.2";
+#elif defined(__ARM_NEON)
+static const char *ISA = "neon";
+#else
+static const char *ISA = "baseline";
+#endif
+
+#define FIR_TAPS (64)
+#define FFT_SIZE (4096)
+#define PADDING (1024)
+
+struct bench_context {
+  uint32_t nsamples;
+  int16_t *adc;
+  float *real;
+  float *real2;
+  float *iq;
+  float *out;
+  float *taps;
+  float *taps_im;
+  ddc_t *ddc;
+  fs4_t *fs4;
+  resampler_t *resampler_rational;
+  resampler_t *resampler_arbitrary;
+  resampler_t *resampler_int16;
+  fft_t *fft;
+  detector_t *detector;
+};
+
+struct kernel {
+  const char *name;
+  uint32_t input_bytes;     /* per sample */
+  void (*run)(struct bench_context *ctx);
+};
+
+struct baseline {
+  char isa[32];
+  char kernel[32];
+  char buffer[32];
+  double ns_per_sample;
+};
+
+/* the compiler must not drop the work of the kernels without output */
+static volatile float sink;
+
+
+static void run_derandomize(struct bench_context *ctx)
+{
+  dsp_derandomize((uint16_t *) ctx->adc, ctx->nsamples);
+}
+
+static void run_int16_to_float(struct bench_context *ctx)
+{
+  dsp_int16_to_float(ctx->adc, ctx->out, ctx->nsamples);
+}
+
+static void run_adc_stats(struct bench_context *ctx)
+{
+  struct adc_frame_stats frame_stats;
+  adc_stats_compute(ctx->adc, ctx->nsamples, &frame_stats);
+  sink = frame_stats.peak;
+}
+
+static void run_fir_real(struct bench_context *ctx)
+{
+  for (uint32_t i = 0; i < ctx->nsamples; ++i) {
+    ctx->out[i] = dsp_dot(ctx->real + i, ctx->taps, FIR_TAPS);
+  }
+}
+
+static void run_fir_complex(struct bench_context *ctx)
+{
+  for (uint32_t i = 0; i < ctx->nsamples; ++i) {
+    dsp_dot_complex(ctx->real + i, ctx->taps, ctx->taps_im, FIR_TAPS,
+                    &ctx->out[2*i], &ctx->out[2*i+1]);
+  }
+}
+
+static void run_fir_pair(struct bench_context *ctx)
+{
+  for (uint32_t i = 0; i < ctx->nsamples; ++i) {
+    dsp_dot_pair(ctx->real + i, ctx->real2 + i, ctx->taps, FIR_TAPS,
+                 &ctx->out[2*i], &ctx->out[2*i+1]);
+  }
+}
+
+static void run_lerp(struct bench_context *ctx)
+{
+  dsp_lerp(ctx->real, ctx->real2, 0.25f, ctx->out, ctx->nsamples);
+}
+
+static void run_ddc(struct bench_context *ctx)
+{
+  float *output;
+  uint32_t n = ddc_process(ctx->ddc, ctx->adc, ctx->nsamples, &output);
+  sink = n > 0 ? output[0] : 0;
+}
+
+static void run_fs4(struct bench_context *ctx)
+{
+  float *output;
+  uint32_t n = fs4_process(ctx->fs4, ctx->adc, ctx->nsamples, &output);
+  sink = n > 0 ? output[0] : 0;
+}
+
+static void run_resample_rational(struct bench_context *ctx)
+{
+  float *output;
+  uint32_t n = resampler_process(ctx->resampler_rational, ctx->iq,
+                                 ctx->nsamples, &output);
+  sink = n > 0 ? output[0] : 0;
+}
+
+static void run_resample_arbitrary(struct bench_context *ctx)
+{
+  float *output;
+  uint32_t n = resampler_process(ctx->resampler_arbitrary, ctx->iq,
+                                 ctx->nsamples, &output);
+  sink = n > 0 ? output[0] : 0;
+}
+
+static void run_resample_int16(struct bench_context *ctx)
+{
+  float *output;
+  uint32_t n = resampler_process_int16(ctx->resampler_int16, ctx->adc,
+                                       ctx->nsamples, &output);
+  sink = n > 0 ? output[0] : 0;
+}
+
+static void run_fft_real(struct bench_context *ctx)
+{
+  for (uint32_t i = 0; i + FFT_SIZE <= ctx->nsamples; i += FFT_SIZE) {
+    fft_real_forward(ctx->fft, ctx->real + i, ctx->out);
+  }
+}
+
+static void run_detector(struct bench_context *ctx)
+{
+  detector_process(ctx->detector, ctx->adc, ctx->nsamples, 0);
+}
+
+static const struct kernel kernels[] = {
+  { "derandomize",        2, run_derandomize },
+  { "int16_to_float",     2, run_int16_to_float },
+  { "adc_stats",          2, run_adc_stats },
+  { "fir_real_64",        4, run_fir_real },
+  { "fir_complex_64",     4, run_fir_complex },
+  { "fir_pair_64",        8, run_fir_pair },
+  { "lerp",               8, run_lerp },
+  { "ddc_64M_2M",         2, run_ddc },
+  { "fs4_iq",             2, run_fs4 },
+  { "resample_4_5",       8, run_resample_rational },
+  { "resample_arbitrary", 8, run_resample_arbitrary },
+  { "resample_int16",     2, run_resample_int16 },
+  { "fft_real_4096",      4, run_fft_real },
+  { "detector_4096",      2, run_detector },
+};
+
+#define NUM_KERNELS ((int) (sizeof(kernels) / sizeof(kernels[0])))
+
+
+static int isa_supported();
+static int context_open(struct bench_context *ctx, uint32_t nsamples);
+static void context_close(struct bench_context *ctx);
+static double bench(const struct kernel *kernel, struct bench_context *ctx,
+                    double min_time);
+static double now();
+static int read_baseline(const char *filename, struct baseline **baseline);
+static const struct baseline *find_baseline(const struct baseline *baseline,
+                                            int count, const char *kernel,
+                                            const char *buffer);
+
+
+int main(int argc, char **argv)
+{
+  const char *baseline_file = 0;
+  double threshold = 10.0;
+  double min_time = 0.2;
+  uint32_t stream_samples = 1 << 22;
+  uint32_t cache_samples = 4096;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:r:t:s:")) != -1) {
+    switch (opt) {
+      case 'c':
+        baseline_file = optarg;
+        break;
+      case 'r':
+        threshold = atof(optarg);
+        break;
+      case 't':
+        min_time = atof(optarg);
+        break;
+      case 's':
+        stream_samples = (uint32_t) atol(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-c <baseline file> [-r <threshold %%>]] [-t <seconds per kernel>] [-s <streaming samples>] [<kernel>...]\n", argv[0]);
+        return -1;
+    }
+  }
+  if (stream_samples < FFT_SIZE) {
+    fprintf(stderr, "ERROR - streaming buffer must have at least %d samples\n", FFT_SIZE);
+    return -1;
+  }
+
+  struct baseline *baseline = 0;
+  int nbaseline = 0;
+  if (baseline_file) {
+    nbaseline = read_baseline(baseline_file, &baseline);
+    if (nbaseline < 0) {
+      fprintf(stderr, "ERROR - read_baseline(%s) failed\n", baseline_file);
+      return -1;
+    }
+  }
+
+  printf("# sddc_kernel_bench isa=%s\n", ISA);
+  if (!isa_supported()) {
+    printf("# skipped - %s is not supported by this CPU\n", ISA);
+    free(baseline);
+    return 0;
+  }
+  if (baseline_file) {
+    printf("# isa kernel buffer samples ns/sample GB/s baseline_ns/sample change%%\n");
+  } else {
+    printf("# isa kernel buffer samples ns/sample GB/s\n");
+  }
+
+  struct {
+    const char *name;
+    uint32_t nsamples;
+  } buffers[] = {
+    { "cache", cache_samples },
+    { "stream", stream_samples },
+  };
+
+  int regressions = 0;
+  for (int b = 0; b < 2; ++b) {
+    struct bench_context ctx;
+    if (context_open(&ctx, buffers[b].nsamples) < 0) {
+      fprintf(stderr, "ERROR - context_open(%u) failed\n", buffers[b].nsamples);
+      free(baseline);
+      return -1;
+    }
+    for (int k = 0; k < NUM_KERNELS; ++k) {
+      const struct kernel *kernel = &kernels[k];
+      if (optind < argc) {
+        int selected = 0;
+        for (int i = optind; i < argc; ++i) {
+          selected |= strcmp(argv[i], kernel->name) == 0;
+        }
+        if (!selected) {
+          continue;
+        }
+      }
+
+      double ns = bench(kernel, &ctx, min_time) * 1e9 / ctx.nsamples;
+      double gbps = kernel->input_bytes / ns;
+      printf("%s %s %s %u %.4f %.3f", ISA, kernel->name, buffers[b].name,
+             ctx.nsamples, ns, gbps);
+      if (baseline_file) {
+        const struct baseline *base = find_baseline(baseline, nbaseline,
+                                                    kernel->name,
+                                                    buffers[b].name);
+        if (base) {
+          double change = 100.0 * (ns - base->ns_per_sample) / base->ns_per_sample;
+          int regression = change > threshold;
+          printf(" %.4f %+.1f%s", base->ns_per_sample, change,
+                 regression ? " REGRESSION" : "");
+          regressions += regression;
+        } else {
+          printf(" - -");
+        }
+      }
+      printf("\n");
+      fflush(stdout);
+    }
+    context_close(&ctx);
+  }
+
+  free(baseline);
+  if (regressions > 0) {
+    printf("# %d regression(s) above %.1f%%\n", regressions, threshold);
+    return 1;
+  }
+  return 0;
+}
+
+
+/* internal functions */
+static int isa_supported()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+#if defined(__AVX512F__)
+  return __builtin_cpu_supports("avx512f");
+#elif defined(__AVX2__)
+  return __builtin_cpu_supports("avx2");
+#elif defined(__AVX__)
+  return __builtin_cpu_supports("avx");
+#elif defined(__SSE4_2__)
+  return __builtin_cpu_supports("sse4.2");
+#endif
+#endif
+  return 1;
+}
+
+static int context_open(struct bench_context *ctx, uint32_t nsamples)
+{
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->nsamples = nsamples;
+
+  /* a tone plus some noise, well within full scale */
+  uint32_t n = nsamples + PADDING;
+  ctx->adc = (int16_t *) malloc(n * sizeof(int16_t));
+  ctx->real = (float *) malloc(n * sizeof(float));
+  ctx->real2 = (float *) malloc(n * sizeof(float));
+  ctx->iq = (float *) malloc(2 * n * sizeof(float));
+  ctx->out = (float *) malloc(2 * n * sizeof(float));
+  ctx->taps = (float *) malloc(FIR_TAPS * sizeof(float));
+  ctx->taps_im = (float *) malloc(FIR_TAPS * sizeof(float));
+  if (!ctx->adc || !ctx->real || !ctx->real2 || !ctx->iq || !ctx->out ||
+      !ctx->taps || !ctx->taps_im) {
+    context_close(ctx);
+    return -1;
+  }
+  uint32_t seed = 1;
+  for (uint32_t i = 0; i < n; ++i) {
+    seed = seed * 1664525 + 1013904223;
+    ctx->adc[i] = (int16_t) ((i * 2654435761u) >> 20) + (int16_t) (seed >> 24);
+    ctx->real[i] = ctx->adc[i] * (1.0f / 32768.0f);
+    ctx->real2[i] = -ctx->real[i];
+    ctx->iq[2*i] = ctx->real[i];
+    ctx->iq[2*i+1] = ctx->real2[i];
+  }
+  dsp_kaiser_lowpass(ctx->taps, FIR_TAPS, 0.2, 60.0);
+  for (int i = 0; i < FIR_TAPS; ++i) {
+    ctx->taps_im[i] = ctx->taps[FIR_TAPS-1-i];
+  }
+
+  ctx->ddc = ddc_open(64e6, 16e6, 2e6, 0, nsamples);
+  ctx->fs4 = fs4_open(nsamples);
+  ctx->resampler_rational = resampler_open(10e6, 8e6, 2, nsamples);
+  ctx->resampler_arbitrary = resampler_open(10e6, 8e6 * (1 + 1e-5), 2, nsamples);
+  ctx->resampler_int16 = resampler_open(64e6, 50e6, 1, nsamples);
+  ctx->fft = fft_open(FFT_SIZE);
+  struct sddc_detector_band band = { 10e6, 1e6 };
+  ctx->detector = detector_open(64e6, FFT_SIZE, &band, 1, 100.0, 90.0, 0, 0);
+  if (!ctx->ddc || !ctx->fs4 || !ctx->resampler_rational ||
+      !ctx->resampler_arbitrary ||
+      !ctx->resampler_int16 || !ctx->fft || !ctx->detector) {
+    context_close(ctx);
+    return -1;
+  }
+  return 0;
+}
+
+static void context_close(struct bench_context *ctx)
+{
+  if (ctx->detector) {
+    detector_close(ctx->detector);
+  }
+  if (ctx->fft) {
+    fft_close(ctx->fft);
+  }
+  if (ctx->resampler_int16) {
+    resampler_close(ctx->resampler_int16);
+  }
+  if (ctx->resampler_arbitrary) {
+    resampler_close(ctx->resampler_arbitrary);
+  }
+  if (ctx->resampler_rational) {
+    resampler_close(ctx->resampler_rational);
+  }
+  if (ctx->fs4) {
+    fs4_close(ctx->fs4);
+  }
+  if (ctx->ddc) {
+    ddc_close(ctx->ddc);
+  }
+  free(ctx->taps_im);
+  free(ctx->taps);
+  free(ctx->out);
+  free(ctx->iq);
+  free(ctx->real2);
+  free(ctx->real);
+  free(ctx->adc);
+  return;
+}
+
+/* best time of a single run, repeating for at least min_time seconds */
+static double bench(const struct kernel *kernel, struct bench_context *ctx,
+                    double min_time)
+{
+  kernel->run(ctx);   /* warm up */
+  double best = 1e30;
+  double start = now();
+  int runs = 0;
+  do {
+    double t0 = now();
+    kernel->run(ctx);
+    double elapsed = now() - t0;
+    best = elapsed < best ? elapsed : best;
+    runs++;
+  } while (runs < 3 || now() - start < min_time);
+  return best;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int read_baseline(const char *filename, struct baseline **baseline)
+{
+  FILE *fp = fopen(filename, "r");
+  if (fp == 0) {
+    return -1;
+  }
+
+  int count = 0;
+  int size = 0;
+  struct baseline *entries = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    struct baseline entry;
+    if (line[0] == '#' ||
+        sscanf(line, "%31s %31s %31s %*u %lf", entry.isa, entry.kernel,
+               entry.buffer, &entry.ns_per_sample) != 4) {
+      continue;
+    }
+    /* results for other ISA levels are ignored */
+    if (strcmp(entry.isa, ISA) != 0) {
+      continue;
+    }
+    if (count == size) {
+      size = size ? 2 * size : 32;
+      struct baseline *resized = (struct baseline *) realloc(entries, size * sizeof(struct baseline));
+      if (resized == 0) {
+        free(entries);
+        fclose(fp);
+        return -1;
+      }
+      entries = resized;
+    }
+    entries[count++] = entry;
+  }
+  fclose(fp);
+
+  *baseline = entries;
+  return count;
+}
+
+static const struct baseline *find_baseline(const struct baseline *baseline,
+                                            int count, const char *kernel,
+                                            const char *buffer)
+{
+  for (int i = 0; i < count; ++i) {
+    if (strcmp(baseline[i].kernel, kernel) == 0 &&
+        strcmp(baseline[i].buffer, buffer) == 0) {
+      return &baseline[i];
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,190 @@
+/*
+ * sddc_offline - parallel offline processing of a recording with libsddc
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* runs a DDC (its I/Q optionally written to a file), a spectrum and an
+   activity detector on the DDC band over a whole capture, and reports
+   the throughput; the I/Q files of runs with different threads or chunk
+   sizes should only differ by rounding */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "libsddc.h"
+
+
+static void ddc_callback(uint32_t band, const float *samples, uint32_t count,
+                         uint64_t sample_index, void *context);
+static void spectrum_callback(const float *power, uint32_t nbins,
+                              uint64_t sample_index, void *context);
+static void activity_callback(const struct sddc_activity_event *event,
+                              void *context);
+static double now();
+
+static const uint32_t FFT_SIZE = 4096;
+static const uint32_t FFT_AVERAGES = 16;
+static const uint32_t DETECTOR_BLOCK_SIZE = 8192;
+
+static uint64_t ddc_decimation = 1;
+static uint64_t ddc_samples = 0;
+static uint64_t next_ddc_index = 0;
+static uint64_t ddc_discontinuities = 0;
+static double ddc_energy = 0;
+static uint64_t spectra = 0;
+static double max_power = -1000;
+static uint64_t events = 0;
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 4) {
+    fprintf(stderr, "usage: %s <capture file> <ddc frequency> <ddc bandwidth> [<threads> [<chunk size> [<output file> [<sample rate>]]]]\n", argv[0]);
+    return -1;
+  }
+  double frequency = atof(argv[2]);
+  double bandwidth = atof(argv[3]);
+  int threads = argc > 4 ? atoi(argv[4]) : 0;
+  uint64_t chunk_size = argc > 5 ? strtoull(argv[5], 0, 10) : 0;
+  const char *outfilename = argc > 6 ? argv[6] : 0;
+  double sample_rate = argc > 7 ? atof(argv[7]) : 0.0;
+
+  int ret_val = -1;
+  FILE *fp = 0;
+  sddc_offline_t *offline = 0;
+
+  sddc_capture_t *capture = sddc_capture_open(argv[1], sample_rate);
+  if (capture == 0) {
+    fprintf(stderr, "ERROR - sddc_capture_open(%s) failed\n", argv[1]);
+    return -1;
+  }
+  struct sddc_capture_info info;
+  sddc_capture_get_info(capture, &info);
+
+  if (outfilename) {
+    fp = fopen(outfilename, "wb");
+    if (fp == 0) {
+      fprintf(stderr, "ERROR - cannot open %s\n", outfilename);
+      goto DONE;
+    }
+  }
+
+  offline = sddc_offline_open(capture, threads, chunk_size);
+  if (offline == 0) {
+    fprintf(stderr, "ERROR - sddc_offline_open() failed\n");
+    goto DONE;
+  }
+  struct sddc_detector_band band = { frequency, bandwidth };
+  if (sddc_offline_add_ddc(offline, frequency, bandwidth, 0, ddc_callback, fp) < 0 ||
+      sddc_offline_add_spectrum(offline, FFT_SIZE, FFT_AVERAGES,
+                                spectrum_callback, 0) < 0 ||
+      sddc_offline_add_detector(offline, DETECTOR_BLOCK_SIZE, &band, 1,
+                                -60.0, -66.0, activity_callback, 0) < 0) {
+    fprintf(stderr, "ERROR - offline processing setup failed\n");
+    goto DONE;
+  }
+
+  ddc_decimation = (uint64_t) llround(info.sample_rate /
+                                      sddc_offline_get_ddc_sample_rate(offline, 0));
+
+  double t0 = now();
+  int64_t processed = sddc_offline_run(offline, 0, info.samples);
+  double elapsed = now() - t0;
+  if (processed < 0) {
+    fprintf(stderr, "ERROR - sddc_offline_run() failed\n");
+    goto DONE;
+  }
+
+  double duration = processed / info.sample_rate;
+  fprintf(stderr, "processed %.3lf s of samples in %.3lf s (%.2lfx real time)\n",
+          duration, elapsed, duration / elapsed);
+  printf("ddc: %llu samples at %.0lf Hz, rms %.3lf dBFS, %llu discontinuities\n",
+         (unsigned long long) ddc_samples,
+         sddc_offline_get_ddc_sample_rate(offline, 0),
+         10 * log10(ddc_energy / (ddc_samples ? ddc_samples : 1) + 1e-20),
+         (unsigned long long) ddc_discontinuities);
+  printf("spectrum: %llu spectra, max bin %.2lf dB\n",
+         (unsigned long long) spectra, max_power);
+  printf("detector: %llu events\n", (unsigned long long) events);
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  if (offline) {
+    sddc_offline_close(offline);
+  }
+  if (fp) {
+    fclose(fp);
+  }
+  sddc_capture_close(capture);
+  return ret_val;
+}
+
+static void ddc_callback(uint32_t band __attribute__((unused)),
+                         const float *samples, uint32_t count,
+                         uint64_t sample_index, void *context)
+{
+  /* the sample indexes follow on from call to call */
+  if (ddc_samples > 0 && sample_index != next_ddc_index) {
+    ddc_discontinuities++;
+  }
+  for (uint32_t i = 0; i < 2 * count; ++i) {
+    ddc_energy += samples[i] * samples[i];
+  }
+  ddc_samples += count;
+  FILE *fp = (FILE *) context;
+  if (fp) {
+    fwrite(samples, 2 * sizeof(float), count, fp);
+  }
+  next_ddc_index = sample_index + count * ddc_decimation;
+  return;
+}
+
+static void spectrum_callback(const float *power, uint32_t nbins,
+                              uint64_t sample_index __attribute__((unused)),
+                              void *context __attribute__((unused)))
+{
+  for (uint32_t k = 1; k < nbins; ++k) {
+    max_power = power[k] > max_power ? power[k] : max_power;
+  }
+  spectra++;
+  return;
+}
+
+static void activity_callback(const struct sddc_activity_event *event,
+                              void *context __attribute__((unused)))
+{
+  printf("%s at sample %llu (%.6lf): %.1lf dBFS\n",
+         event->type == SDDC_ACTIVITY_START ? "start" : "stop ",
+         (unsigned long long) event->sample_index,
+         event->timestamp.tv_sec + event->timestamp.tv_nsec * 1e-9,
+         event->power);
+  events++;
+  return;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
@@ -0,0 +1,374 @@
+/*
+ * sddc_ols_bench - overlap-save filter bank vs direct FIR benchmark
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Filters the same buffer of ADC samples into nbands sub-bands with a
+ * direct (polyphase style, one dot product per output) complex FIR and
+ * with the overlap-save filter bank, for each number of taps, and prints:
+ *
+ *   <ntaps> <fft_size> <method> <threads> <ns/sample> <Msps> <speedup>
+ *
+ * where the time is per ADC sample (best of repeated runs), and the
+ * speedup is relative to the direct FIR. The overlap-save output is also
+ * checked against the direct one (the error is relative to its RMS).
+ * The samples are fed in frames of the given size, as from the USB
+ * callback; the overlap-save blocks of a frame are spread over the
+ * threads.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dsp.h"
+#include "ols.h"
+
+
+struct bench_context {
+  uint32_t nsamples;
+  uint32_t frame_size;
+  int16_t *adc;
+  float *real;              /* ntaps - 1 zeros, then the samples */
+  uint32_t ntaps;
+  uint32_t fft_size;
+  uint32_t nbands;
+  struct sddc_subband *bands;
+  /* direct FIR */
+  float **taps_re;          /* band pass taps, reversed */
+  float **taps_im;
+  uint32_t *bin;            /* center bin in fft_size */
+  uint32_t *decimation;
+  float *rotator;           /* exp(-j 2 pi k / fft_size) */
+  float **direct;
+  uint32_t *ndirect;
+  /* overlap-save */
+  ols_t *ols;
+  float **output;
+  uint32_t *noutput;
+};
+
+static const double SAMPLE_RATE = 64e6;
+
+
+static int context_open(struct bench_context *ctx, uint32_t nsamples,
+                        uint32_t frame_size, uint32_t ntaps,
+                        uint32_t fft_size, uint32_t nbands);
+static void context_close(struct bench_context *ctx);
+static void run_direct(struct bench_context *ctx);
+static void run_ols(struct bench_context *ctx);
+static double bench(void (*run)(struct bench_context *ctx),
+                    struct bench_context *ctx, double min_time);
+static double max_error(struct bench_context *ctx);
+static double now();
+
+
+int main(int argc, char **argv)
+{
+  double min_time = 0.5;
+  uint32_t nsamples = 1 << 22;
+  uint32_t frame_size = 1 << 17;
+  uint32_t fft_size = 0;
+  uint32_t nbands = 4;
+  int max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:s:F:f:b:T:")) != -1) {
+    switch (opt) {
+      case 't':
+        min_time = atof(optarg);
+        break;
+      case 's':
+        nsamples = (uint32_t) atol(optarg);
+        break;
+      case 'F':
+        frame_size = (uint32_t) atol(optarg);
+        break;
+      case 'f':
+        fft_size = (uint32_t) atol(optarg);
+        break;
+      case 'b':
+        nbands = (uint32_t) atol(optarg);
+        break;
+      case 'T':
+        max_threads = atoi(optarg);
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-t <seconds per run>] [-s <samples>] [-F <frame samples>] [-f <fft size>] [-b <bands>] [-T <max threads>] [<ntaps>...]\n", argv[0]);
+        return -1;
+    }
+  }
+  if (nsamples == 0 || frame_size == 0 || nbands == 0 || max_threads < 1) {
+    fprintf(stderr, "ERROR - invalid parameters\n");
+    return -1;
+  }
+
+  uint32_t default_ntaps[] = { 63, 255, 1023, 4095 };
+  int nntaps = argc > optind ? argc - optind : 4;
+
+  printf("# sddc_ols_bench samples=%u frame=%u bands=%u\n", nsamples,
+         frame_size, nbands);
+  printf("# ntaps fft_size method threads ns/sample Msps speedup\n");
+  for (int n = 0; n < nntaps; ++n) {
+    uint32_t ntaps = argc > optind ? (uint32_t) atol(argv[optind+n]) :
+                     default_ntaps[n];
+    /* the FFT size defaults to 4 times the overlap, i.e. 3/4 of each
+       block is new samples */
+    uint32_t size = fft_size;
+    if (size == 0) {
+      for (size = 16; size < 4 * (ntaps - 1); size *= 2)
+        ;
+    }
+
+    struct bench_context ctx;
+    if (context_open(&ctx, nsamples, frame_size, ntaps, size, nbands) < 0) {
+      fprintf(stderr, "ERROR - context_open(ntaps=%u) failed\n", ntaps);
+      return -1;
+    }
+    double direct = bench(run_direct, &ctx, min_time) * 1e9 / nsamples;
+    printf("%u %u direct 1 %.4f %.1f 1.00\n", ctx.ntaps, size, direct,
+           1e3 / direct);
+    fflush(stdout);
+    context_close(&ctx);
+
+    double error = 0.0;
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+      if (context_open(&ctx, nsamples, frame_size, ntaps, size, nbands) < 0) {
+        fprintf(stderr, "ERROR - context_open(ntaps=%u) failed\n", ntaps);
+        return -1;
+      }
+      ols_close(ctx.ols);
+      ctx.ols = ols_open(SAMPLE_RATE, size, ntaps, ctx.bands, nbands, threads,
+                         frame_size);
+      if (ctx.ols == 0) {
+        fprintf(stderr, "ERROR - ols_open(threads=%d) failed\n", threads);
+        context_close(&ctx);
+        return -1;
+      }
+      double ns = bench(run_ols, &ctx, min_time) * 1e9 / nsamples;
+      printf("%u %u ols %d %.4f %.1f %.2f\n", ctx.ntaps, size, threads, ns,
+             1e3 / ns, direct / ns);
+      fflush(stdout);
+      if (threads == 1) {
+        run_direct(&ctx);
+        error = max_error(&ctx);
+      }
+      context_close(&ctx);
+    }
+    printf("# ntaps=%u max error vs direct: %.2e of RMS\n", ntaps, error);
+  }
+  return 0;
+}
+
+
+/* internal functions */
+static int context_open(struct bench_context *ctx, uint32_t nsamples,
+                        uint32_t frame_size, uint32_t ntaps,
+                        uint32_t fft_size, uint32_t nbands)
+{
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->nsamples = nsamples;
+  ctx->frame_size = frame_size;
+  ctx->ntaps = ols_ntaps(fft_size, ntaps);
+  ctx->fft_size = fft_size;
+  ctx->nbands = nbands;
+
+  /* narrow bands spread over the spectrum */
+  ctx->bands = (struct sddc_subband *) malloc(nbands * sizeof(struct sddc_subband));
+  for (uint32_t i = 0; i < nbands; ++i) {
+    ctx->bands[i].frequency = SAMPLE_RATE * (i + 1) / (2 * (nbands + 1)) + 12345;
+    ctx->bands[i].bandwidth = SAMPLE_RATE / 64;
+  }
+  ctx->ols = ols_open(SAMPLE_RATE, fft_size, ntaps, ctx->bands, nbands, 1,
+                      frame_size);
+  if (ctx->ols == 0) {
+    free(ctx->bands);
+    return -1;
+  }
+
+  /* a tone plus some noise, well within full scale */
+  uint32_t history = ctx->ntaps - 1;
+  ctx->adc = (int16_t *) malloc(nsamples * sizeof(int16_t));
+  ctx->real = (float *) calloc(history + nsamples, sizeof(float));
+  uint32_t seed = 1;
+  for (uint32_t i = 0; i < nsamples; ++i) {
+    seed = seed * 1664525 + 1013904223;
+    ctx->adc[i] = (int16_t) ((i * 2654435761u) >> 20) + (int16_t) (seed >> 24);
+    ctx->real[history+i] = ctx->adc[i] * (1.0f / 32768.0f);
+  }
+
+  /* the same low pass as the filter bank, shifted to each band center */
+  float *taps = (float *) malloc(ctx->ntaps * sizeof(float));
+  double transition = (80.0 - 7.95) / (14.36 * (ctx->ntaps - 1));
+  ctx->taps_re = (float **) malloc(nbands * sizeof(float *));
+  ctx->taps_im = (float **) malloc(nbands * sizeof(float *));
+  ctx->bin = (uint32_t *) malloc(nbands * sizeof(uint32_t));
+  ctx->decimation = (uint32_t *) malloc(nbands * sizeof(uint32_t));
+  ctx->direct = (float **) malloc(nbands * sizeof(float *));
+  ctx->ndirect = (uint32_t *) malloc(nbands * sizeof(uint32_t));
+  ctx->output = (float **) malloc(nbands * sizeof(float *));
+  ctx->noutput = (uint32_t *) malloc(nbands * sizeof(uint32_t));
+  for (uint32_t i = 0; i < nbands; ++i) {
+    double cutoff = ctx->bands[i].bandwidth / 2 / SAMPLE_RATE + transition / 2;
+    dsp_kaiser_lowpass(taps, ctx->ntaps, cutoff, 80.0);
+    ctx->bin[i] = (uint32_t) lround(ctx->bands[i].frequency * fft_size /
+                                    SAMPLE_RATE);
+    ctx->decimation[i] = ols_decimation(SAMPLE_RATE, fft_size, ntaps,
+                                        ctx->bands[i].bandwidth);
+    ctx->taps_re[i] = (float *) malloc(ctx->ntaps * sizeof(float));
+    ctx->taps_im[i] = (float *) malloc(ctx->ntaps * sizeof(float));
+    for (uint32_t k = 0; k < ctx->ntaps; ++k) {
+      double phase = 2.0 * M_PI * (((uint64_t) ctx->bin[i] * k) % fft_size) /
+                     fft_size;
+      ctx->taps_re[i][ctx->ntaps-1-k] = (float) (taps[k] * cos(phase));
+      ctx->taps_im[i][ctx->ntaps-1-k] = (float) (taps[k] * sin(phase));
+    }
+    uint32_t max_output = nsamples / ctx->decimation[i] + 1;
+    ctx->direct[i] = (float *) malloc(2 * max_output * sizeof(float));
+    ctx->output[i] = (float *) malloc(2 * max_output * sizeof(float));
+    ctx->ndirect[i] = 0;
+    ctx->noutput[i] = 0;
+  }
+  free(taps);
+  ctx->rotator = (float *) malloc(2 * fft_size * sizeof(float));
+  for (uint32_t k = 0; k < fft_size; ++k) {
+    ctx->rotator[2*k] = (float) cos(2.0 * M_PI * k / fft_size);
+    ctx->rotator[2*k+1] = (float) -sin(2.0 * M_PI * k / fft_size);
+  }
+  return 0;
+}
+
+static void context_close(struct bench_context *ctx)
+{
+  for (uint32_t i = 0; i < ctx->nbands; ++i) {
+    free(ctx->taps_re[i]);
+    free(ctx->taps_im[i]);
+    free(ctx->direct[i]);
+    free(ctx->output[i]);
+  }
+  free(ctx->taps_re);
+  free(ctx->taps_im);
+  free(ctx->bin);
+  free(ctx->decimation);
+  free(ctx->direct);
+  free(ctx->ndirect);
+  free(ctx->output);
+  free(ctx->noutput);
+  free(ctx->rotator);
+  free(ctx->real);
+  free(ctx->adc);
+  if (ctx->ols) {
+    ols_close(ctx->ols);
+  }
+  free(ctx->bands);
+  return;
+}
+
+/* one dot product per output sample, then the shift to baseband */
+static void run_direct(struct bench_context *ctx)
+{
+  for (uint32_t i = 0; i < ctx->nbands; ++i) {
+    uint32_t decimation = ctx->decimation[i];
+    float *out = ctx->direct[i];
+    uint32_t m = 0;
+    for (uint32_t n = 0; n < ctx->nsamples; n += decimation, ++m) {
+      float re, im;
+      dsp_dot_complex(ctx->real + n, ctx->taps_re[i], ctx->taps_im[i],
+                      ctx->ntaps, &re, &im);
+      uint32_t k = (uint32_t) (((uint64_t) ctx->bin[i] * n) % ctx->fft_size);
+      float r_re = ctx->rotator[2*k];
+      float r_im = ctx->rotator[2*k+1];
+      out[2*m] = re * r_re - im * r_im;
+      out[2*m+1] = re * r_im + im * r_re;
+    }
+    ctx->ndirect[i] = m;
+  }
+}
+
+static void run_ols(struct bench_context *ctx)
+{
+  ols_reset(ctx->ols);
+  memset(ctx->noutput, 0, ctx->nbands * sizeof(uint32_t));
+  for (uint32_t n = 0; n < ctx->nsamples; n += ctx->frame_size) {
+    uint32_t size = ctx->nsamples - n < ctx->frame_size ?
+                    ctx->nsamples - n : ctx->frame_size;
+    if (ols_process(ctx->ols, ctx->adc + n, size) == 0) {
+      continue;
+    }
+    for (uint32_t i = 0; i < ctx->nbands; ++i) {
+      float *output;
+      uint64_t index;
+      uint32_t noutput = ols_get_output(ctx->ols, i, &output, &index);
+      memcpy(ctx->output[i] + 2 * ctx->noutput[i], output,
+             2 * noutput * sizeof(float));
+      ctx->noutput[i] += noutput;
+    }
+  }
+}
+
+/* best time of a single run, repeating for at least min_time seconds */
+static double bench(void (*run)(struct bench_context *ctx),
+                    struct bench_context *ctx, double min_time)
+{
+  run(ctx);   /* warm up */
+  double best = 1e30;
+  double start = now();
+  int runs = 0;
+  do {
+    double t0 = now();
+    run(ctx);
+    double elapsed = now() - t0;
+    best = elapsed < best ? elapsed : best;
+    runs++;
+  } while (runs < 3 || now() - start < min_time);
+  return best;
+}
+
+static double max_error(struct bench_context *ctx)
+{
+  double error = 0.0;
+  for (uint32_t i = 0; i < ctx->nbands; ++i) {
+    uint32_t n = ctx->noutput[i] < ctx->ndirect[i] ? ctx->noutput[i] :
+                 ctx->ndirect[i];
+    double power = 0.0;
+    double max_diff = 0.0;
+    for (uint32_t m = 0; m < n; ++m) {
+      double d_re = ctx->output[i][2*m] - ctx->direct[i][2*m];
+      double d_im = ctx->output[i][2*m+1] - ctx->direct[i][2*m+1];
+      double diff = d_re * d_re + d_im * d_im;
+      max_diff = diff > max_diff ? diff : max_diff;
+      power += ctx->direct[i][2*m] * ctx->direct[i][2*m] +
+               ctx->direct[i][2*m+1] * ctx->direct[i][2*m+1];
+    }
+    double band_error = n > 0 ? sqrt(max_diff / (power / n)) : 0.0;
+    error = band_error > error ? band_error : error;
+  }
+  return error;
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
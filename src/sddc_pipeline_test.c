@@ -0,0 +1,183 @@
+/*
+ * sddc_pipeline_test - simple processing pipeline test program for libsddc
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* the ADC frames feed two branches off the USB thread: a spectrum (fft ->
+   peak) and, optionally, a raw recording - both read the same USB buffers */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsddc.h"
+
+
+static void peak_callback(sddc_stage_t *stage, sddc_frame_t *frame,
+                          void *context);
+
+static const uint32_t FFT_SIZE = 4096;
+
+static double sample_rate = 0.0;
+static uint64_t spectra = 0;
+static uint64_t next_report = 0;
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s <image file> <sample rate> [<runtime_in_ms> [<output_filename> [<threads>]]]\n", argv[0]);
+    return -1;
+  }
+  char *imagefile = argv[1];
+  sscanf(argv[2], "%lf", &sample_rate);
+  int runtime = argc > 3 ? atoi(argv[3]) : 3000;
+  const char *outfilename = argc > 4 ? argv[4] : 0;
+  int threads = argc > 5 ? atoi(argv[5]) : 2;
+
+  if (sample_rate <= 0) {
+    fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
+    return -1;
+  }
+
+  int ret_val = -1;
+  int fd = -1;
+
+  sddc_t *sddc = sddc_open(0, imagefile);
+  if (sddc == 0) {
+    fprintf(stderr, "ERROR - sddc_open() failed\n");
+    return -1;
+  }
+
+  if (sddc_set_sample_rate(sddc, sample_rate) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_sample_rate() failed\n");
+    goto DONE;
+  }
+
+  /* no streaming callback - the frames only go to the pipeline */
+  if (sddc_set_async_params(sddc, 0, 0, 0, 0) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_async_params() failed\n");
+    goto DONE;
+  }
+
+  if (sddc_set_rf_mode(sddc, HF_MODE) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_rf_mode failed\n");
+    goto DONE;
+  }
+
+  if (sddc_pipeline_set_threads(sddc, threads) < 0) {
+    fprintf(stderr, "ERROR - sddc_pipeline_set_threads() failed\n");
+    goto DONE;
+  }
+  sddc_stage_t *fft = sddc_pipeline_add_fft(sddc, FFT_SIZE);
+  sddc_stage_t *peak = sddc_pipeline_add_stage(sddc, "peak", peak_callback, 0,
+                                               SDDC_STAGE_ORDERED, 0, 0,
+                                               SDDC_FRAME_BYTES);
+  if (fft == 0 || peak == 0 ||
+      sddc_pipeline_connect(sddc, 0, fft) < 0 ||
+      sddc_pipeline_connect(sddc, fft, peak) < 0) {
+    fprintf(stderr, "ERROR - spectrum pipeline setup failed\n");
+    goto DONE;
+  }
+  sddc_stage_t *record = 0;
+  if (outfilename) {
+    fd = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      fprintf(stderr, "ERROR - cannot open %s\n", outfilename);
+      goto DONE;
+    }
+    record = sddc_pipeline_add_record(sddc, fd);
+    if (record == 0 || sddc_pipeline_connect(sddc, 0, record) < 0) {
+      fprintf(stderr, "ERROR - record pipeline setup failed\n");
+      goto DONE;
+    }
+  }
+
+  if (sddc_start_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_start_streaming() failed\n");
+    goto DONE;
+  }
+
+  fprintf(stderr, "started streaming .. for %d ms ..\n", runtime);
+  struct timespec clk_start, clk_now;
+  clock_gettime(CLOCK_MONOTONIC, &clk_start);
+  do {
+    sddc_handle_events(sddc);
+    clock_gettime(CLOCK_MONOTONIC, &clk_now);
+  } while ((clk_now.tv_sec - clk_start.tv_sec) * 1000 +
+           (clk_now.tv_nsec - clk_start.tv_nsec) / 1000000 < runtime);
+
+  fprintf(stderr, "finished. now stop streaming ..\n");
+  if (sddc_stop_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_stop_streaming() failed\n");
+    goto DONE;
+  }
+
+  sddc_stage_t *stages[] = { fft, peak, record };
+  const char *names[] = { "fft", "peak", "record" };
+  for (int i = 0; i < 3; ++i) {
+    struct sddc_stage_stats stats;
+    if (stages[i] && sddc_stage_get_stats(stages[i], &stats) == 0) {
+      fprintf(stderr, "%-6s frames=%llu dropped=%llu alloc_failures=%llu\n",
+              names[i], (unsigned long long) stats.frames,
+              (unsigned long long) stats.dropped,
+              (unsigned long long) stats.alloc_failures);
+    }
+  }
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  sddc_close(sddc);
+  if (fd >= 0) {
+    close(fd);
+  }
+
+  return ret_val;
+}
+
+/* print the strongest bin about once a second */
+static void peak_callback(sddc_stage_t *stage __attribute__((unused)),
+                          sddc_frame_t *frame,
+                          void *context __attribute__((unused)))
+{
+  const float *power = (const float *) sddc_frame_data(frame);
+  uint32_t nbins = sddc_frame_size(frame) / sizeof(float);
+  uint64_t sample_index = sddc_frame_sample_index(frame);
+  spectra++;
+  if (sample_index < next_report) {
+    return;
+  }
+  next_report = sample_index + (uint64_t) sample_rate;
+
+  uint32_t peak = 1;
+  for (uint32_t i = 2; i < nbins; ++i) {
+    if (power[i] > power[peak]) {
+      peak = i;
+    }
+  }
+  printf("%8.3fs  peak %10.1f Hz  %7.1f dB  (%llu spectra)\n",
+         sample_index / sample_rate, peak * sample_rate / FFT_SIZE,
+         power[peak], (unsigned long long) spectra);
+  return;
+}
@@ -120,6 +120,12 @@ int main(int argc, char **argv)
     return -1;
   }
 
+  /* libsddc built with -DENABLE_TRACE=ON records a transfer trace */
+  const char *tracefilename = getenv("SDDC_TRACE_FILE");
+  if (tracefilename && sddc_trace_dump(tracefilename) < 0) {
+    fprintf(stderr, "ERROR - sddc_trace_dump() failed\n");
+  }
+
   double dur = clk_diff();
   fprintf(stderr, "received=%llu 16-Bit samples in %d callbacks\n", received_samples, num_callbacks);
   fprintf(stderr, "run for %f sec\n", dur);
@@ -130,6 +136,8 @@ int main(int argc, char **argv)
     if (f) {
       fprintf(stderr, "saving received real samples to file ..\n");
       waveWriteHeader( (unsigned)(0.5 + sample_rate), 0U /*frequency*/, 16 /*bitsPerSample*/, 1 /*numChannels*/, f);
+      /* the time of the first sample (rewritten by waveFinalizeHeader()) */
+      waveSetStartTime(clk_start.tv_sec, clk_start.tv_nsec * 1e-9);
       for ( unsigned long long off = 0; off + 65536 < received_samples; off += 65536 )
         waveWriteSamples(f,  sampleData + off, 65536, 0 /*needCleanData*/);
       waveFinalizeHeader(f);
@@ -0,0 +1,149 @@
+/*
+ * sddc_sweep_test - simple frequency sweep test program for libsddc
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libsddc.h"
+
+
+static void ignore_samples_callback(uint32_t data_size, uint8_t *data,
+                                    void *context);
+static void print_spectrum_callback(const struct sddc_sweep_spectrum *spectrum,
+                                    void *context);
+
+static int num_sweeps = 1;
+static int stop_reception = 0;
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 6) {
+    fprintf(stderr, "usage: %s <image file> <sample rate> <start frequency> <stop frequency> <span> [<dwell_in_ms> [<settle_in_ms> [<num_sweeps>]]]\n", argv[0]);
+    return -1;
+  }
+  char *imagefile = argv[1];
+  double sample_rate = 0.0;
+  double start_frequency = 0.0;
+  double stop_frequency = 0.0;
+  double span = 0.0;
+  double dwell = 1.0;
+  double settle = 5.0;
+  sscanf(argv[2], "%lf", &sample_rate);
+  sscanf(argv[3], "%lf", &start_frequency);
+  sscanf(argv[4], "%lf", &stop_frequency);
+  sscanf(argv[5], "%lf", &span);
+  if (6 < argc)
+    sscanf(argv[6], "%lf", &dwell);
+  if (7 < argc)
+    sscanf(argv[7], "%lf", &settle);
+  if (8 < argc)
+    num_sweeps = atoi(argv[8]);
+
+  if (sample_rate <= 0 || span <= 0 || stop_frequency < start_frequency) {
+    fprintf(stderr, "ERROR - invalid sample rate, span or frequency range\n");
+    return -1;
+  }
+
+  /* contiguous steps, so the step spectra stitch into one */
+  uint32_t nsteps = (uint32_t) ((stop_frequency - start_frequency) / span) + 1;
+  double *frequencies = (double *) malloc(nsteps * sizeof(double));
+  for (uint32_t i = 0; i < nsteps; ++i)
+    frequencies[i] = start_frequency + span / 2 + i * span;
+
+  int ret_val = -1;
+
+  sddc_t *sddc = sddc_open(0, imagefile);
+  if (sddc == 0) {
+    fprintf(stderr, "ERROR - sddc_open() failed\n");
+    free(frequencies);
+    return -1;
+  }
+
+  if (sddc_set_sample_rate(sddc, sample_rate) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_sample_rate() failed\n");
+    goto DONE;
+  }
+
+  if (sddc_set_async_params(sddc, 0, 0, ignore_samples_callback, 0) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_async_params() failed\n");
+    goto DONE;
+  }
+
+  if (sddc_set_rf_mode(sddc, VHF_MODE) < 0) {
+    fprintf(stderr, "ERROR - sddc_set_rf_mode() failed\n");
+    goto DONE;
+  }
+
+  if (sddc_start_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_start_streaming() failed\n");
+    goto DONE;
+  }
+
+  if (sddc_start_sweep(sddc, frequencies, nsteps, span, dwell / 1000.0,
+                       settle / 1000.0, 4096, print_spectrum_callback, 0) < 0) {
+    fprintf(stderr, "ERROR - sddc_start_sweep() failed\n");
+    sddc_stop_streaming(sddc);
+    goto DONE;
+  }
+
+  /* todo: move this into a thread */
+  stop_reception = 0;
+  while (!stop_reception)
+    sddc_handle_events(sddc);
+
+  sddc_stop_sweep(sddc);
+  if (sddc_stop_streaming(sddc) < 0) {
+    fprintf(stderr, "ERROR - sddc_stop_streaming() failed\n");
+    goto DONE;
+  }
+
+  /* done - all good */
+  ret_val = 0;
+
+DONE:
+  sddc_close(sddc);
+  free(frequencies);
+
+  return ret_val;
+}
+
+/* the sweep runs on the samples before they reach this callback */
+static void ignore_samples_callback(uint32_t data_size __attribute__((unused)),
+                                    uint8_t *data __attribute__((unused)),
+                                    void *context __attribute__((unused)) )
+{
+}
+
+static void print_spectrum_callback(const struct sddc_sweep_spectrum *spectrum,
+                                    void *context __attribute__((unused)) )
+{
+  for (uint32_t s = 0; s < spectrum->nsteps; ++s) {
+    for (uint32_t i = 0; i < spectrum->bins_per_step; ++i) {
+      double frequency = spectrum->frequencies[s] +
+          ((int) i - (int) spectrum->bins_per_step / 2) * spectrum->bin_width;
+      printf("%llu,%.0f,%.1f\n", (unsigned long long) spectrum->sweep,
+             frequency, spectrum->power[s * spectrum->bins_per_step + i]);
+    }
+  }
+  if ((int) spectrum->sweep + 1 >= num_sweeps)
+    stop_reception = 1;
+}
@@ -0,0 +1,244 @@
+/*
+ * sddc_trace_timeline - per-transfer latency timeline from a libsddc trace
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* The input is either a file written by sddc_trace_dump() or the output
+ * of misc/sddc_trace.bt (same format: 'timestamp_ns event id arg').
+ * For each completed transfer it prints where the time went:
+ *  - usb:       submit -> completion (host controller and device)
+ *  - dispatch:  completion -> start of the user callback (event thread)
+ *  - callback:  time spent in the user callback
+ *  - resubmit:  end of the user callback -> transfer resubmitted
+ * together with the number of transfers in flight at completion and the
+ * gap since the previous completion. When samples are lost, a long usb
+ * time with many transfers in flight points at the host controller, a
+ * long dispatch time at the event thread, and a long callback time at
+ * the application.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+struct transfer_state {
+  unsigned long long id;
+  unsigned long long submit;
+  unsigned long long complete;
+  unsigned long long enter;
+  unsigned long long exit;
+  int status;
+};
+
+struct phase_stats {
+  const char *name;
+  unsigned long count;
+  double min;
+  double max;
+  double sum;
+};
+
+#define MAX_TRANSFERS (1024)
+
+static struct transfer_state transfers[MAX_TRANSFERS];
+static int num_transfers = 0;
+
+static struct transfer_state *find_transfer(unsigned long long id);
+static void update_stats(struct phase_stats *stats, double value);
+static void print_stats(const struct phase_stats *stats);
+
+
+int main(int argc, char **argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <trace file>|-\n", argv[0]);
+    return -1;
+  }
+
+  FILE *fp = stdin;
+  if (strcmp(argv[1], "-") != 0) {
+    fp = fopen(argv[1], "r");
+    if (fp == 0) {
+      fprintf(stderr, "ERROR - fopen(%s) failed\n", argv[1]);
+      return -1;
+    }
+  }
+
+  struct phase_stats usb = { "usb", 0, 0, 0, 0 };
+  struct phase_stats dispatch = { "dispatch", 0, 0, 0, 0 };
+  struct phase_stats callback = { "callback", 0, 0, 0, 0 };
+  struct phase_stats resubmit = { "resubmit", 0, 0, 0, 0 };
+  struct phase_stats gap = { "gap", 0, 0, 0, 0 };
+  struct phase_stats control = { "control", 0, 0, 0, 0 };
+  unsigned long long start = 0;
+  unsigned long long last_complete = 0;
+  unsigned long long control_submit = 0;
+  int in_flight = 0;
+  int min_in_flight = -1;
+  unsigned long failures = 0;
+
+  char line[256];
+  while (fgets(line, sizeof(line), fp)) {
+    unsigned long long timestamp;
+    char event[64];
+    unsigned long long id;
+    long long arg;
+    if (line[0] == '#' ||
+        sscanf(line, "%llu %63s %llx %lld", &timestamp, event, &id, &arg) != 4) {
+      continue;
+    }
+    if (start == 0) {
+      start = timestamp;
+    }
+    double t = (timestamp - start) / 1e6;
+
+    if (strcmp(event, "control_submit") == 0) {
+      control_submit = timestamp;
+      continue;
+    }
+    if (strcmp(event, "control_complete") == 0) {
+      double latency = control_submit ? (timestamp - control_submit) / 1e3 : 0;
+      printf("%12.3f ms  control 0x%02llx  %8.1f us  status %lld\n", t, id,
+             latency, arg);
+      if (control_submit) {
+        update_stats(&control, latency);
+      }
+      control_submit = 0;
+      continue;
+    }
+
+    struct transfer_state *transfer = find_transfer(id);
+    if (transfer == 0) {
+      fprintf(stderr, "ERROR - too many transfers in trace\n");
+      return -1;
+    }
+    if (strcmp(event, "transfer_submit") == 0) {
+      transfer->submit = timestamp;
+      in_flight++;
+    } else if (strcmp(event, "transfer_complete") == 0) {
+      transfer->complete = timestamp;
+      transfer->status = (int) arg;
+      transfer->enter = 0;
+      transfer->exit = 0;
+      if (in_flight > 0) {
+        in_flight--;
+      }
+      if (arg != 0) {
+        failures++;
+        printf("%12.3f ms  xfer %3d  completed with status %lld\n", t,
+               (int) (transfer - transfers), arg);
+      }
+    } else if (strcmp(event, "callback_enter") == 0) {
+      transfer->enter = timestamp;
+    } else if (strcmp(event, "callback_exit") == 0) {
+      transfer->exit = timestamp;
+    } else if (strcmp(event, "transfer_resubmit") == 0) {
+      if (transfer->submit && transfer->complete && transfer->enter &&
+          transfer->exit) {
+        double usb_us = (transfer->complete - transfer->submit) / 1e3;
+        double dispatch_us = (transfer->enter - transfer->complete) / 1e3;
+        double callback_us = (transfer->exit - transfer->enter) / 1e3;
+        double resubmit_us = (timestamp - transfer->exit) / 1e3;
+        double gap_us = last_complete ? (transfer->complete - last_complete) / 1e3 : 0;
+        printf("%12.3f ms  xfer %3d  inflight %3d  usb %9.1f us  dispatch %7.1f us  callback %8.1f us  resubmit %6.1f us  gap %8.1f us\n",
+               (transfer->complete - start) / 1e6, (int) (transfer - transfers),
+               in_flight, usb_us, dispatch_us, callback_us, resubmit_us,
+               gap_us);
+        update_stats(&usb, usb_us);
+        update_stats(&dispatch, dispatch_us);
+        update_stats(&callback, callback_us);
+        update_stats(&resubmit, resubmit_us);
+        if (last_complete) {
+          update_stats(&gap, gap_us);
+        }
+        if (min_in_flight < 0 || in_flight < min_in_flight) {
+          min_in_flight = in_flight;
+        }
+        last_complete = transfer->complete;
+      }
+      if (arg == 0) {
+        transfer->submit = timestamp;
+        in_flight++;
+      } else {
+        failures++;
+        printf("%12.3f ms  xfer %3d  resubmit failed with %lld\n", t,
+               (int) (transfer - transfers), arg);
+      }
+    } else if (strcmp(event, "transfer_cancel") == 0) {
+      if (arg == 0) {
+        printf("%12.3f ms  xfer %3d  cancelled\n", t,
+               (int) (transfer - transfers));
+      }
+    }
+  }
+  if (fp != stdin) {
+    fclose(fp);
+  }
+
+  printf("# transfers: %d - failures: %lu - min in flight: %d\n",
+         num_transfers, failures, min_in_flight);
+  printf("# %-10s %10s %12s %12s %12s\n", "phase", "count", "min (us)",
+         "avg (us)", "max (us)");
+  print_stats(&usb);
+  print_stats(&dispatch);
+  print_stats(&callback);
+  print_stats(&resubmit);
+  print_stats(&gap);
+  print_stats(&control);
+
+  return 0;
+}
+
+static struct transfer_state *find_transfer(unsigned long long id)
+{
+  for (int i = 0; i < num_transfers; ++i) {
+    if (transfers[i].id == id) {
+      return &transfers[i];
+    }
+  }
+  if (num_transfers == MAX_TRANSFERS) {
+    return 0;
+  }
+  struct transfer_state *transfer = &transfers[num_transfers++];
+  memset(transfer, 0, sizeof(*transfer));
+  transfer->id = id;
+  return transfer;
+}
+
+static void update_stats(struct phase_stats *stats, double value)
+{
+  if (stats->count == 0 || value < stats->min) {
+    stats->min = value;
+  }
+  if (stats->count == 0 || value > stats->max) {
+    stats->max = value;
+  }
+  stats->sum += value;
+  stats->count++;
+}
+
+static void print_stats(const struct phase_stats *stats)
+{
+  if (stats->count == 0) {
+    return;
+  }
+  printf("# %-10s %10lu %12.1f %12.1f %12.1f\n", stats->name, stats->count,
+         stats->min, stats->sum / stats->count, stats->max);
+}
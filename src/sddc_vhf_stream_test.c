@@ -39,6 +39,7 @@ static int16_t *sampleData = 0;
 static int runtime = 3000;
 static struct timespec clk_start, clk_end;
 static int stop_reception = 0;
+static int num_channels = 1;
 
 static double clk_diff() {
   return ((double)clk_end.tv_sec + 1.0e-9*clk_end.tv_nsec) - 
@@ -49,7 +50,7 @@ static double clk_diff() {
 int main(int argc, char **argv)
 {
   if (argc < 3) {
-    fprintf(stderr, "usage: %s <image file> <sample rate> [<runtime_in_ms> [<output_filename>]\n", argv[0]);
+    fprintf(stderr, "usage: %s <image file> <sample rate> [<runtime_in_ms> [<output_filename> [<baseband_bandwidth>]]]\n", argv[0]);
     return -1;
   }
   char *imagefile = argv[1];
@@ -58,12 +59,15 @@ int main(int argc, char **argv)
 
   double vhf_frequency = 100e6;
   double vhf_attenuation = 20;  /* 20dB attenuation */
+  double baseband_bandwidth = 0;
 
   sscanf(argv[2], "%lf", &sample_rate);
   if (3 < argc)
     runtime = atoi(argv[3]);
   if (4 < argc)
     outfilename = argv[4];
+  if (5 < argc)
+    sscanf(argv[5], "%lf", &baseband_bandwidth);
 
   if (sample_rate <= 0) {
     fprintf(stderr, "ERROR - given samplerate '%f' should be > 0\n", sample_rate);
@@ -103,6 +107,17 @@ int main(int argc, char **argv)
     goto DONE;
   }
 
+  /* complex baseband output */
+  double output_sample_rate = sample_rate;
+  if (baseband_bandwidth > 0) {
+    if (sddc_set_vhf_baseband(sddc, baseband_bandwidth) < 0) {
+      fprintf(stderr, "ERROR - sddc_set_vhf_baseband() failed\n");
+      goto DONE;
+    }
+    output_sample_rate = sddc_get_vhf_baseband_sample_rate(sddc);
+    num_channels = 2;
+  }
+
   received_samples = 0;
   num_callbacks = 0;
   if (sddc_start_streaming(sddc) < 0) {
@@ -111,7 +126,7 @@ int main(int argc, char **argv)
   }
 
   fprintf(stderr, "started streaming .. for %d ms ..\n", runtime);
-  total_samples = (unsigned long long)(runtime * sample_rate / 1000.0);
+  total_samples = (unsigned long long)(runtime * output_sample_rate / 1000.0) * num_channels;
 
   if (outfilename)
     sampleData = (int16_t*)malloc(total_samples * sizeof(int16_t));
@@ -131,13 +146,15 @@ int main(int argc, char **argv)
   double dur = clk_diff();
   fprintf(stderr, "received=%llu 16-Bit samples in %d callbacks\n", received_samples, num_callbacks);
   fprintf(stderr, "run for %f sec\n", dur);
-  fprintf(stderr, "approx. samplerate is %f kSamples/sec\n", received_samples / (1000.0*dur) );
+  fprintf(stderr, "approx. samplerate is %f kSamples/sec\n", received_samples / num_channels / (1000.0*dur) );
 
   if (outfilename && sampleData && received_samples) {
     FILE * f = fopen(outfilename, "wb");
     if (f) {
-      fprintf(stderr, "saving received real samples to file ..\n");
-      waveWriteHeader( (unsigned)(0.5 + sample_rate), 0U /*frequency*/, 16 /*bitsPerSample*/, 1 /*numChannels*/, f);
+      fprintf(stderr, "saving received %s samples to file ..\n", num_channels == 2 ? "I/Q" : "real");
+      waveWriteHeader( (unsigned)(0.5 + output_sample_rate), num_channels == 2 ? (unsigned) vhf_frequency : 0U /*frequency*/, 16 /*bitsPerSample*/, num_channels /*numChannels*/, f);
+      /* the time of the first sample (rewritten by waveFinalizeHeader()) */
+      waveSetStartTime(clk_start.tv_sec, clk_start.tv_nsec * 1e-9);
       for ( unsigned long long off = 0; off + 65536 < received_samples; off += 65536 )
         waveWriteSamples(f,  sampleData + off, 65536, 0 /*needCleanData*/);
       waveFinalizeHeader(f);
@@ -161,6 +178,21 @@ static void count_bytes_callback(uint32_t data_size,
   if (stop_reception)
     return;
   ++num_callbacks;
+  if (num_channels == 2) {
+    /* complex baseband: interleaved float I/Q */
+    const float *iq = (const float *) data;
+    unsigned N = data_size / sizeof(float);
+    if ( received_samples + N < total_samples ) {
+      if (sampleData)
+        for (unsigned i = 0; i < N; ++i)
+          sampleData[received_samples + i] = (int16_t) (iq[i] * 32767.0f);
+      received_samples += N;
+      return;
+    }
+    clock_gettime(CLOCK_REALTIME, &clk_end);
+    stop_reception = 1;
+    return;
+  }
   unsigned N = data_size / sizeof(int16_t);
   if ( received_samples + N < total_samples ) {
     if (sampleData)
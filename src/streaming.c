@@ -33,18 +33,42 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <time.h>
 #include <stdatomic.h>
+#include <pthread.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/usbdevice_fs.h>
+#endif
 
 #include "streaming.h"
 #include "usb_device.h"
 #include "usb_device_internals.h"
 #include "logging.h"
+#include "trace.h"
+#include "dsp.h"
 
 
 typedef struct streaming streaming_t;
 
 /* internal functions */
 static void streaming_read_async_callback(struct libusb_transfer *transfer);
+static void streaming_fail(streaming_t *this, int fatal);
+static int streaming_cancel_all(streaming_t *this);
+static uint32_t streaming_round_frame_size(usb_device_t *usb_device,
+                                           uint32_t frame_size);
+static uint8_t *streaming_alloc_buffer(streaming_t *this);
+static void streaming_free_buffer(streaming_t *this, uint8_t *buffer);
+static int streaming_init_leases(streaming_t *this, uint32_t nleases);
+#ifdef __linux__
+static int usbfs_open(usb_device_t *usb_device);
+static void usbfs_close(usb_device_t *usb_device, int fd);
+static int usbfs_submit(streaming_t *this, struct usbdevfs_urb *urb);
+static void usbfs_discard_all(streaming_t *this);
+static void usbfs_events(short revents, void *context);
+#endif
 
 
 enum StreamingStatus {
@@ -52,23 +76,58 @@ enum StreamingStatus {
   STREAMING_STATUS_READY,
   STREAMING_STATUS_STREAMING,
   STREAMING_STATUS_CANCELLED,
+  STREAMING_STATUS_RECOVERING,
   STREAMING_STATUS_FAILED = 0xff
 };
 
 typedef struct streaming {
-  enum StreamingStatus status;
-  int random;
+  _Atomic enum StreamingStatus status;
+  atomic_int random;        /* set by the control thread */
   usb_device_t *usb_device;
   uint32_t sample_rate;
   uint32_t frame_size;
   uint32_t num_frames;
+  uint32_t buffer_size;     /* allocated size of each frame buffer */
+  uint32_t num_buffers;     /* allocated frame buffers and transfers */
   sddc_read_async_cb_t callback;
   void *callback_context;
   uint8_t **frames;
   struct libusb_transfer **transfers;
-  atomic_int active_transfers;
+  atomic_int active_transfers;  /* in flight (the held back ones are not) */
+  uint64_t transfer_errors;
+  struct timespec failure_time;
+  int usbfs_fd;             /* usbfs backend (-1 with libusb) */
+  int usbfs_mapped;         /* frames mapped from usbfs (zerocopy) */
+  struct usbdevfs_urb *urbs;
+  struct usbdevfs_urb **reaped;
+  struct timespec last_completion;
+  void *current_frame;      /* transfer (or URB) in the callback */
+  int current_held;
+  int current_deferred;
+  struct streaming_lease *current_lease;
+  void **deferred;          /* transfers (or URBs) waiting for a flush */
+  uint32_t ndeferred;
+  /* frame leases - frames[] owns all the buffers (num_buffers +
+     num_spares); a transfer uses whichever buffer it was last given */
+  pthread_mutex_t lease_lock;  /* also orders the resubmits with the stop */
+  uint32_t num_spares;
+  uint8_t **free_spares;
+  uint32_t nfree_spares;
+  struct streaming_lease *leases;
+  struct streaming_lease **free_leases;
+  uint32_t nfree_leases;
+  uint32_t held_frames;     /* transfers held back (no spare) */
+  struct sddc_lease_stats lease_stats;
 } streaming_t;
 
+/* a leased buffer: either swapped out of its transfer for a spare, or
+   (with no spare left) still in its transfer, which is then held back */
+struct streaming_lease {
+  uint8_t *buffer;
+  void *transfer;
+  uint32_t refs;            /* the same frame can be leased more than once */
+};
+
 
 static const uint32_t DEFAULT_SAMPLE_RATE = 64000000;   /* 64Msps */
 static uint32_t DEFAULT_FRAME_SIZE = (2 * DEFAULT_SAMPLE_RATE / 1000);  /* ~ 1 ms */
@@ -82,7 +141,7 @@ streaming_t *streaming_open_sync(usb_device_t *usb_device)
 
   /* we must have a bulk in device to transfer data from */
   if (usb_device->bulk_in_endpoint_address == 0) {
-    log_error("no USB bulk in endpoint found", __func__, __FILE__, __LINE__);
+    LOG_ERROR("no USB bulk in endpoint found");
     return ret_val;
   }
 
@@ -94,11 +153,30 @@ streaming_t *streaming_open_sync(usb_device_t *usb_device)
   this->sample_rate = DEFAULT_SAMPLE_RATE;
   this->frame_size = 0;
   this->num_frames = 0;
+  this->buffer_size = 0;
+  this->num_buffers = 0;
   this->callback = 0;
   this->callback_context = 0;
   this->frames = 0;
   this->transfers = 0;
   atomic_init(&this->active_transfers, 0);
+  this->transfer_errors = 0;
+  this->usbfs_fd = -1;
+  this->usbfs_mapped = 0;
+  this->urbs = 0;
+  this->reaped = 0;
+  this->deferred = 0;
+  this->ndeferred = 0;
+  pthread_mutex_init(&this->lease_lock, 0);
+  this->num_spares = 0;
+  this->free_spares = 0;
+  this->nfree_spares = 0;
+  this->leases = 0;
+  this->free_leases = 0;
+  if (streaming_init_leases(this, this->num_buffers) < 0) {
+    streaming_close(this);
+    return ret_val;
+  }
 
   ret_val = this;
   return ret_val;
@@ -113,82 +191,253 @@ streaming_t *streaming_open_async(usb_device_t *usb_device, uint32_t frame_size,
 
   /* we must have a bulk in device to transfer data from */
   if (usb_device->bulk_in_endpoint_address == 0) {
-    log_error("no USB bulk in endpoint found", __func__, __FILE__, __LINE__);
+    LOG_ERROR("no USB bulk in endpoint found");
     return ret_val;
   }
 
-  /* frame size must be a multiple of max_packet_size * max_burst */
-  uint32_t max_xfer_size = usb_device->bulk_in_max_packet_size *
-                           usb_device->bulk_in_max_burst;
-  if ( !max_xfer_size ) {
-    fprintf(stderr, "ERROR: maximum transfer size is 0. probably not connected at USB 3 port?!\n");
+  num_frames = num_frames > 0 ? num_frames : DEFAULT_NUM_FRAMES;
+  frame_size = streaming_round_frame_size(usb_device, frame_size);
+  if (frame_size == 0) {
     return ret_val;
   }
 
-  num_frames = num_frames > 0 ? num_frames : DEFAULT_NUM_FRAMES;
-  frame_size = frame_size > 0 ? frame_size : DEFAULT_FRAME_SIZE;
-  frame_size = max_xfer_size * ((frame_size +max_xfer_size -1) / max_xfer_size);  // round up
-  int iso_packets_per_frame = frame_size / usb_device->bulk_in_max_packet_size;
-  fprintf(stderr, "frame_size = %u, iso_packets_per_frame = %d\n", (unsigned)frame_size, iso_packets_per_frame);
+  /* zeroed, so that streaming_close() can free a partial one */
+  streaming_t *this = (streaming_t *) calloc(1, sizeof(streaming_t));
+  if (this == 0) {
+    LOG_ERROR("calloc() failed");
+    return ret_val;
+  }
+  this->status = STREAMING_STATUS_READY;
+  this->random = 0;
+  this->usb_device = usb_device;
+  this->sample_rate = DEFAULT_SAMPLE_RATE;
+  this->frame_size = frame_size;
+  this->num_frames = num_frames;
+  this->buffer_size = frame_size;
+  this->num_buffers = num_frames;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  atomic_init(&this->active_transfers, 0);
+  this->transfer_errors = 0;
+  this->usbfs_fd = -1;
+  this->usbfs_mapped = 0;
+  this->urbs = 0;
+  this->reaped = 0;
+  this->ndeferred = 0;
+  pthread_mutex_init(&this->lease_lock, 0);
+  this->num_spares = 0;
+  this->free_spares = 0;
+  this->nfree_spares = 0;
+  this->leases = 0;
+  this->free_leases = 0;
 
-  if (frame_size % max_xfer_size != 0) {
-    fprintf(stderr, "frame size must be a multiple of %d\n", max_xfer_size);
+  /* allocate frames for zerocopy USB bulk transfers */
+  this->frames = (uint8_t **) calloc(num_frames, sizeof(uint8_t *));
+  this->transfers = (struct libusb_transfer **) calloc(num_frames, sizeof(struct libusb_transfer *));
+  this->deferred = (void **) malloc(num_frames * sizeof(void *));
+  if (this->frames == 0 || this->transfers == 0 || this->deferred == 0) {
+    LOG_ERROR("malloc() failed");
+    streaming_close(this);
     return ret_val;
   }
+  for (uint32_t i = 0; i < num_frames; ++i) {
+    this->frames[i] = streaming_alloc_buffer(this);
+    if (this->frames[i] == 0) {
+      LOG_ERROR("frame allocation failed");
+      streaming_close(this);
+      return ret_val;
+    }
+  }
 
-   /* allocate frames for zerocopy USB bulk transfers */
-  uint8_t **frames = (uint8_t **) malloc(num_frames * sizeof(uint8_t *));
-#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+  /* populate the required libusb_transfer fields */
   for (uint32_t i = 0; i < num_frames; ++i) {
-    frames[i] = libusb_dev_mem_alloc(usb_device->dev_handle, frame_size);
-    if (frames[i] == 0) {
-      log_error("libusb_dev_mem_alloc() failed", __func__, __FILE__, __LINE__);
-      for (uint32_t j = 0; j < i; j++) {
-        libusb_dev_mem_free(usb_device->dev_handle, frames[j], frame_size);
-      }
+    this->transfers[i] = libusb_alloc_transfer(0);	// iso_packets_per_frame ?
+    if (this->transfers[i] == 0) {
+      LOG_ERROR("libusb_alloc_transfer() failed");
+      streaming_close(this);
       return ret_val;
     }
+    libusb_fill_bulk_transfer(this->transfers[i], usb_device->dev_handle,
+                              usb_device->bulk_in_endpoint_address,
+                              this->frames[i], frame_size,
+                              streaming_read_async_callback,
+                              this, BULK_XFER_TIMEOUT);
   }
-#else
+  if (streaming_init_leases(this, this->num_buffers) < 0) {
+    streaming_close(this);
+    return ret_val;
+  }
+
+  ret_val = this;
+  return ret_val;
+}
+
+
+streaming_t *streaming_open_usbfs(usb_device_t *usb_device, uint32_t frame_size,
+                                  uint32_t num_frames,
+                                  sddc_read_async_cb_t callback,
+                                  void *callback_context)
+{
+  streaming_t *ret_val = 0;
+
+#ifdef __linux__
+  /* we must have a bulk in device to transfer data from */
+  if (usb_device->bulk_in_endpoint_address == 0) {
+    LOG_ERROR("no USB bulk in endpoint found");
+    return ret_val;
+  }
+
+  num_frames = num_frames > 0 ? num_frames : DEFAULT_NUM_FRAMES;
+  frame_size = streaming_round_frame_size(usb_device, frame_size);
+  if (frame_size == 0) {
+    return ret_val;
+  }
+
+  int fd = usbfs_open(usb_device);
+  if (fd < 0) {
+    return ret_val;
+  }
+
+  /* map the frames from usbfs for zerocopy transfers (like
+     libusb_dev_mem_alloc() does); older kernels copy from user memory */
+  uint8_t **frames = (uint8_t **) calloc(num_frames, sizeof(uint8_t *));
+  if (frames == 0) {
+    LOG_ERROR("calloc() failed");
+    goto FAIL1;
+  }
+  int mapped = 1;
   for (uint32_t i = 0; i < num_frames; ++i) {
-    frames[i] = malloc(num_frames);
-    if (!frames[i])
-      log_error("Memory allocation failed", __func__, __FILE__, __LINE__);
+    void *frame = mapped ? mmap(0, frame_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (frame == MAP_FAILED) {
+      if (mapped && i > 0) {
+        LOG_WARNING("usbfs mmap() failed after %u frames: %s", i, strerror(errno));
+      }
+      for (uint32_t j = 0; mapped && j < i; ++j) {
+        munmap(frames[j], frame_size);
+        frames[j] = 0;
+      }
+      if (mapped) {
+        i = 0;
+      }
+      mapped = 0;
+      frame = malloc(frame_size);
+      if (frame == 0) {
+        LOG_ERROR("malloc() failed");
+        goto FAIL2;
+      }
+    }
+    frames[i] = (uint8_t *) frame;
   }
-#endif
+
   /* we are good here - create and initialize the streaming */
   streaming_t *this = (streaming_t *) malloc(sizeof(streaming_t));
+  if (this == 0) {
+    LOG_ERROR("malloc() failed");
+    goto FAIL2;
+  }
   this->status = STREAMING_STATUS_READY;
   this->random = 0;
   this->usb_device = usb_device;
   this->sample_rate = DEFAULT_SAMPLE_RATE;
-  this->frame_size = frame_size > 0 ? frame_size : DEFAULT_FRAME_SIZE;
-  this->num_frames = num_frames > 0 ? num_frames : DEFAULT_NUM_FRAMES;
+  this->frame_size = frame_size;
+  this->num_frames = num_frames;
+  this->buffer_size = frame_size;
+  this->num_buffers = num_frames;
   this->callback = callback;
   this->callback_context = callback_context;
   this->frames = frames;
-
-  /* populate the required libusb_transfer fields */
-  struct libusb_transfer **transfers = (struct libusb_transfer **) malloc(num_frames * sizeof(struct libusb_transfer *));
+  this->transfers = 0;
+  atomic_init(&this->active_transfers, 0);
+  this->transfer_errors = 0;
+  this->usbfs_fd = fd;
+  this->usbfs_mapped = mapped;
+  memset(&this->lease_stats, 0, sizeof(this->lease_stats));
+  this->urbs = (struct usbdevfs_urb *) calloc(num_frames, sizeof(struct usbdevfs_urb));
+  this->reaped = (struct usbdevfs_urb **) malloc(num_frames * sizeof(struct usbdevfs_urb *));
+  this->deferred = (void **) malloc(num_frames * sizeof(void *));
+  this->ndeferred = 0;
+  pthread_mutex_init(&this->lease_lock, 0);
+  this->num_spares = 0;
+  this->free_spares = 0;
+  this->nfree_spares = 0;
+  this->leases = 0;
+  this->free_leases = 0;
+  if (this->urbs == 0 || this->reaped == 0 || this->deferred == 0 ||
+      streaming_init_leases(this, this->num_buffers) < 0) {
+    LOG_ERROR("malloc() failed");
+    streaming_close(this);
+    return ret_val;
+  }
   for (uint32_t i = 0; i < num_frames; ++i) {
-    transfers[i] = libusb_alloc_transfer(0);	// iso_packets_per_frame ?
-    libusb_fill_bulk_transfer(transfers[i], usb_device->dev_handle,
-                              usb_device->bulk_in_endpoint_address,
-                              frames[i], frame_size, streaming_read_async_callback,
-                              this, BULK_XFER_TIMEOUT);
+    this->urbs[i].type = USBDEVFS_URB_TYPE_BULK;
+    this->urbs[i].endpoint = usb_device->bulk_in_endpoint_address;
+    this->urbs[i].buffer = frames[i];
+    this->urbs[i].usercontext = this;
   }
-  this->transfers = transfers;
-  atomic_init(&this->active_transfers, 0);
+  usb_device_set_event_source(usb_device, fd, usbfs_events, this);
 
   ret_val = this;
   return ret_val;
+
+FAIL2:
+  for (uint32_t i = 0; i < num_frames && frames[i]; ++i) {
+    if (mapped) {
+      munmap(frames[i], frame_size);
+    } else {
+      free(frames[i]);
+    }
+  }
+  free(frames);
+FAIL1:
+  usbfs_close(usb_device, fd);
+#else
+  (void) usb_device;
+  (void) frame_size;
+  (void) num_frames;
+  (void) callback;
+  (void) callback_context;
+  LOG_ERROR("the usbfs streaming backend is only available on Linux");
+#endif
+  return ret_val;
+}
+
+
+int streaming_is_usbfs(streaming_t *this)
+{
+  return this->usbfs_fd >= 0;
 }
 
 
 void streaming_close(streaming_t *this)
 {
+  if (this->lease_stats.leased > 0) {
+    LOG_WARNING("streaming closed with %u frames still leased",
+                this->lease_stats.leased);
+  }
+  free(this->free_spares);
+  free(this->free_leases);
+  free(this->leases);
+  free(this->deferred);
+  pthread_mutex_destroy(&this->lease_lock);
+
+#ifdef __linux__
+  if (this->usbfs_fd >= 0) {
+    for (uint32_t i = 0; i < this->num_buffers + this->num_spares; ++i) {
+      streaming_free_buffer(this, this->frames[i]);
+    }
+    free(this->frames);
+    free(this->urbs);
+    free(this->reaped);
+    usbfs_close(this->usb_device, this->usbfs_fd);
+    this->usbfs_fd = -1;
+    free(this);
+    return;
+  }
+#endif
+
   if (this->transfers) {
-    for (uint32_t i = 0; i < this->num_frames; ++i) {
+    for (uint32_t i = 0; i < this->num_buffers; ++i) {
       if (this->transfers[i]) {
         libusb_free_transfer(this->transfers[i]);
       }
@@ -198,25 +447,59 @@ void streaming_close(streaming_t *this)
   }
 
   if (this->frames) {
-    for (uint32_t i = 0; i < this->num_frames; ++i) {
+    for (uint32_t i = 0; i < this->num_buffers + this->num_spares; ++i) {
       if (this->frames[i]) {
-#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
-        libusb_dev_mem_free(this->usb_device->dev_handle, this->frames[i],
-                          this->frame_size);
-#else
-        free(this->frames[i]);
-#endif
+        streaming_free_buffer(this, this->frames[i]);
       }
     }
 
     free(this->frames);
-    this->frames = NULL;  
-    free(this);
-  } 
+    this->frames = NULL;
+  }
+  free(this);
   return;
 }
 
 
+/* reuse the allocated buffers and transfers for a new configuration, as
+   long as it fits in them; returns -1 if the streaming must be reopened */
+int streaming_reconfigure(streaming_t *this, uint32_t frame_size,
+                          uint32_t num_frames, sddc_read_async_cb_t callback,
+                          void *callback_context)
+{
+  if (this->status != STREAMING_STATUS_READY ||
+      (this->transfers == 0 && this->urbs == 0)) {
+    return -1;
+  }
+  num_frames = num_frames > 0 ? num_frames : DEFAULT_NUM_FRAMES;
+  frame_size = streaming_round_frame_size(this->usb_device, frame_size);
+  if (frame_size == 0 || frame_size > this->buffer_size ||
+      num_frames > this->num_buffers) {
+    return -1;
+  }
+
+  for (uint32_t i = 0; this->transfers && i < this->num_buffers; ++i) {
+    this->transfers[i]->length = frame_size;
+  }
+  this->frame_size = frame_size;
+  this->num_frames = num_frames;
+  this->callback = callback;
+  this->callback_context = callback_context;
+  return 0;
+}
+
+
+uint32_t streaming_get_frame_size(streaming_t *this)
+{
+  return this->frame_size;
+}
+
+
+uint32_t streaming_get_num_frames(streaming_t *this)
+{
+  return this->num_frames;
+}
+
 
 int streaming_set_sample_rate(streaming_t *this, uint32_t sample_rate)
 {
@@ -236,7 +519,7 @@ int streaming_set_random(streaming_t *this, int random)
 int streaming_start(streaming_t *this)
 {
   if (this->status != STREAMING_STATUS_READY) {
-    fprintf(stderr, "ERROR - streaming_start() called with streaming status not READY: %d\n", this->status);
+    LOG_ERROR("streaming_start() called with streaming status not READY: %d", this->status);
     return -1;
   }
 
@@ -246,9 +529,35 @@ int streaming_start(streaming_t *this)
     return 0;
   }
 
+  /* a transfer still held back by a lease can not be submitted */
+  pthread_mutex_lock(&this->lease_lock);
+  uint32_t held_frames = this->held_frames;
+  pthread_mutex_unlock(&this->lease_lock);
+  if (held_frames > 0) {
+    LOG_ERROR("streaming_start() called with %u frames still leased", held_frames);
+    return -1;
+  }
+
   /* submit all the transfers */
   atomic_init(&this->active_transfers, 0);
+#ifdef __linux__
+  if (this->usbfs_fd >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &this->last_completion);
+    for (uint32_t i = 0; i < this->num_frames; ++i) {
+      TRACE_URB_SUBMIT(&this->urbs[i]);
+      if (usbfs_submit(this, &this->urbs[i]) < 0) {
+        LOG_ERROR("usbfs URB submit failed: %s", strerror(errno));
+        this->status = STREAMING_STATUS_FAILED;
+        return -1;
+      }
+      atomic_fetch_add(&this->active_transfers, 1);
+    }
+    this->status = STREAMING_STATUS_STREAMING;
+    return 0;
+  }
+#endif
   for (uint32_t i = 0; i < this->num_frames; ++i) {
+    TRACE_TRANSFER_SUBMIT(this->transfers[i]);
     int ret = libusb_submit_transfer(this->transfers[i]);
     if (ret < 0) {
       log_usb_error(ret, __func__, __FILE__, __LINE__);
@@ -274,27 +583,66 @@ int streaming_stop(streaming_t *this)
     return 0;
   }
 
+  /* from now on the released frames are not resubmitted; those resubmitted
+     before are cancelled below */
+  pthread_mutex_lock(&this->lease_lock);
   this->status = STREAMING_STATUS_CANCELLED;
+  pthread_mutex_unlock(&this->lease_lock);
+  /* the deferred transfers are not in flight - just account for them */
+  streaming_flush_deferred(this);
+#ifdef __linux__
+  if (this->usbfs_fd >= 0) {
+    usbfs_discard_all(this);
+    struct pollfd pfd = { this->usbfs_fd, POLLOUT, 0 };
+    for (unsigned int waited = 0; atomic_load(&this->active_transfers) > 0;
+         waited += 100) {
+      if (waited >= BULK_XFER_TIMEOUT) {
+        LOG_ERROR("streaming_stop() timed out with %d URBs still active",
+                  atomic_load(&this->active_transfers));
+        this->status = STREAMING_STATUS_FAILED;
+        return -1;
+      }
+      if (waited > 0 && waited % 1000 == 0) {
+        usbfs_discard_all(this);
+      }
+      pfd.revents = 0;
+      if (poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+        LOG_ERROR("poll() failed: %s", strerror(errno));
+        this->status = STREAMING_STATUS_FAILED;
+        return -1;
+      }
+      usbfs_events(pfd.revents, this);
+    }
+    return 0;
+  }
+#endif
   /* cancel all the active transfers */
-  for (uint32_t i = 0; i < this->num_frames; ++i) {
-    int ret = libusb_cancel_transfer(this->transfers[i]);
+  if (streaming_cancel_all(this) < 0) {
+    this->status = STREAMING_STATUS_FAILED;
+  }
+
+  /* wait for all the transfers to come back, so they can be resubmitted
+     by the next streaming_start() */
+  struct timeval timeout = { 0, 100000 };
+  for (unsigned int waited = 0; atomic_load(&this->active_transfers) > 0;
+       waited += 100) {
+    if (waited > 0 && waited % 1000 == 0) {
+      streaming_cancel_all(this);
+    }
+    if (waited >= BULK_XFER_TIMEOUT) {
+      LOG_ERROR("streaming_stop() timed out with %d transfers still active",
+                atomic_load(&this->active_transfers));
+      this->status = STREAMING_STATUS_FAILED;
+      return -1;
+    }
+    int ret = libusb_handle_events_timeout_completed(this->usb_device->context, &timeout, 0);
     if (ret < 0) {
-      if (ret == LIBUSB_ERROR_NOT_FOUND) {
-        continue;
-      }
       log_usb_error(ret, __func__, __FILE__, __LINE__);
       this->status = STREAMING_STATUS_FAILED;
+      return -1;
     }
   }
 
-  /* flush all the events */
-  struct timeval noblock = { 0, 0 };
-  int ret = libusb_handle_events_timeout_completed(this->usb_device->context, &noblock, 0);
-  if (ret < 0) {
-    log_usb_error(ret, __func__, __FILE__, __LINE__);
-    this->status = STREAMING_STATUS_FAILED;
-  }
-
   return 0;
 }
 
@@ -306,16 +654,17 @@ int streaming_reset_status(streaming_t *this)
       /* nothing to do here */
       return 0;
     case STREAMING_STATUS_CANCELLED:
+    case STREAMING_STATUS_RECOVERING:
     case STREAMING_STATUS_FAILED:
       if (this->active_transfers > 0) {
-        fprintf(stderr, "ERROR - streaming_reset_status() called with %d transfers still active\n",
-                        this->active_transfers);
+        LOG_ERROR("streaming_reset_status() called with %d transfers still active",
+                          this->active_transfers);
         return -1;
       }
       break;
     default:
-      fprintf(stderr, "ERROR - streaming_reset_status() called with invalid status: %d\n",
-                      this->status);
+      LOG_ERROR("streaming_reset_status() called with invalid status: %d",
+                        this->status);
       return -1;
   }
 
@@ -325,6 +674,343 @@ int streaming_reset_status(streaming_t *this)
 }
 
 
+int streaming_needs_recovery(streaming_t *this)
+{
+  if (this->status != STREAMING_STATUS_RECOVERING ||
+      atomic_load(&this->active_transfers) > 0) {
+    return 0;
+  }
+  /* all the transfers are resubmitted together */
+  pthread_mutex_lock(&this->lease_lock);
+  uint32_t held_frames = this->held_frames;
+  pthread_mutex_unlock(&this->lease_lock);
+  return held_frames == 0;
+}
+
+
+double streaming_get_outage(streaming_t *this)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - this->failure_time.tv_sec) +
+         1e-9 * (now.tv_nsec - this->failure_time.tv_nsec);
+}
+
+
+/* resubmit all the transfers after they have been cancelled because of a
+   transfer error; the producer should be stopped while this runs (it
+   handles no events, so no frame is delivered before it returns) */
+int streaming_recover(streaming_t *this)
+{
+  if (!streaming_needs_recovery(this)) {
+    LOG_ERROR("streaming_recover() called with streaming status %d and %d transfers active",
+              this->status, atomic_load(&this->active_transfers));
+    return -1;
+  }
+
+#ifdef __linux__
+  if (this->usbfs_fd >= 0) {
+    unsigned int endpoint = this->usb_device->bulk_in_endpoint_address;
+    if (ioctl(this->usbfs_fd, USBDEVFS_CLEAR_HALT, &endpoint) < 0) {
+      LOG_WARNING("usbfs clear halt failed: %s", strerror(errno));
+    }
+    this->status = STREAMING_STATUS_STREAMING;
+    clock_gettime(CLOCK_MONOTONIC, &this->last_completion);
+    for (uint32_t i = 0; i < this->num_frames; ++i) {
+      TRACE_URB_SUBMIT(&this->urbs[i]);
+      if (usbfs_submit(this, &this->urbs[i]) < 0) {
+        LOG_ERROR("usbfs URB submit failed: %s", strerror(errno));
+        streaming_fail(this, 1);
+        return -1;
+      }
+      atomic_fetch_add(&this->active_transfers, 1);
+    }
+    return 0;
+  }
+#endif
+
+  /* a stalled endpoint must be cleared before it accepts new transfers */
+  int ret = libusb_clear_halt(this->usb_device->dev_handle,
+                              this->usb_device->bulk_in_endpoint_address);
+  if (ret < 0) {
+    log_usb_warning(ret, __func__, __FILE__, __LINE__);
+  }
+
+  this->status = STREAMING_STATUS_STREAMING;
+  for (uint32_t i = 0; i < this->num_frames; ++i) {
+    TRACE_TRANSFER_SUBMIT(this->transfers[i]);
+    ret = libusb_submit_transfer(this->transfers[i]);
+    if (ret < 0) {
+      log_usb_error(ret, __func__, __FILE__, __LINE__);
+      streaming_fail(this, 1);
+      return -1;
+    }
+    atomic_fetch_add(&this->active_transfers, 1);
+  }
+  return 0;
+}
+
+
+uint64_t streaming_get_transfer_errors(streaming_t *this)
+{
+  return this->transfer_errors;
+}
+
+
+int streaming_set_spare_frames(streaming_t *this, uint32_t num_spares)
+{
+  if (this->status != STREAMING_STATUS_READY || this->frames == 0) {
+    LOG_ERROR("spare frames can only be changed when not streaming");
+    return -1;
+  }
+  if (this->lease_stats.leased > 0) {
+    LOG_ERROR("spare frames can not be changed with frames leased");
+    return -1;
+  }
+
+  /* grow the arrays first, so that a failure changes nothing; arrays
+     that did grow are kept - they are only larger than needed */
+  uint32_t total = this->num_buffers + num_spares;
+  if (num_spares > this->num_spares) {
+    uint8_t **frames = (uint8_t **) realloc(this->frames, total * sizeof(uint8_t *));
+    if (frames == 0) {
+      LOG_ERROR("realloc() failed");
+      return -1;
+    }
+    this->frames = frames;
+    uint8_t **free_spares = (uint8_t **) realloc(this->free_spares, num_spares * sizeof(uint8_t *));
+    if (free_spares == 0) {
+      LOG_ERROR("realloc() failed");
+      return -1;
+    }
+    this->free_spares = free_spares;
+  }
+  if (streaming_init_leases(this, total) < 0) {
+    return -1;
+  }
+
+  /* all the spares are in the free list now, but they are not
+     necessarily the buffers that were added as spares */
+  uint32_t old_total = this->num_buffers + this->num_spares;
+  while (this->num_spares > num_spares) {
+    uint8_t *buffer = this->free_spares[--this->nfree_spares];
+    for (uint32_t i = 0; i < old_total; ++i) {
+      if (this->frames[i] == buffer) {
+        this->frames[i] = this->frames[--old_total];
+        break;
+      }
+    }
+    streaming_free_buffer(this, buffer);
+    this->num_spares--;
+  }
+
+  while (this->num_spares < num_spares) {
+    uint8_t *buffer = streaming_alloc_buffer(this);
+    if (buffer == 0) {
+      LOG_ERROR("spare frame allocation failed");
+      break;
+    }
+    this->frames[this->num_buffers + this->num_spares] = buffer;
+    this->free_spares[this->nfree_spares++] = buffer;
+    this->num_spares++;
+  }
+
+  return this->num_spares == num_spares ? 0 : -1;
+}
+
+
+uint32_t streaming_get_spare_frames(streaming_t *this)
+{
+  return this->num_spares;
+}
+
+
+void *streaming_lease_frame(streaming_t *this, int *stall)
+{
+  *stall = 0;
+  if (this->current_frame == 0) {
+    return 0;
+  }
+  if (this->current_lease) {
+    pthread_mutex_lock(&this->lease_lock);
+    this->current_lease->refs++;
+    this->lease_stats.leases++;
+    pthread_mutex_unlock(&this->lease_lock);
+    return this->current_lease;
+  }
+
+  void *transfer = this->current_frame;
+  uint8_t *buffer;
+#ifdef __linux__
+  if (this->usbfs_fd >= 0) {
+    buffer = (uint8_t *) ((struct usbdevfs_urb *) transfer)->buffer;
+  } else
+#endif
+  {
+    buffer = ((struct libusb_transfer *) transfer)->buffer;
+  }
+
+  struct streaming_lease *lease = 0;
+  pthread_mutex_lock(&this->lease_lock);
+  if (this->nfree_spares > 0) {
+    /* the transfer goes back to the USB queue with a spare buffer */
+    uint8_t *spare = this->free_spares[--this->nfree_spares];
+#ifdef __linux__
+    if (this->usbfs_fd >= 0) {
+      ((struct usbdevfs_urb *) transfer)->buffer = spare;
+    } else
+#endif
+    {
+      ((struct libusb_transfer *) transfer)->buffer = spare;
+    }
+    transfer = 0;
+  } else if (this->held_frames < this->num_frames / 2) {
+    /* stall: one transfer less in flight until the frame is released */
+    this->held_frames++;
+    this->current_held = 1;
+    this->lease_stats.stalls++;
+    *stall = 1;
+  } else {
+    /* never take more than half of the transfers out of the USB queue */
+    this->lease_stats.refused++;
+    pthread_mutex_unlock(&this->lease_lock);
+    *stall = 1;
+    return 0;
+  }
+  lease = this->free_leases[--this->nfree_leases];
+  lease->buffer = buffer;
+  lease->transfer = transfer;
+  lease->refs = 1;
+  this->current_lease = lease;
+  this->lease_stats.leases++;
+  this->lease_stats.leased++;
+  if (this->lease_stats.leased > this->lease_stats.max_leased) {
+    this->lease_stats.max_leased = this->lease_stats.leased;
+  }
+  this->lease_stats.held_transfers = this->held_frames;
+  pthread_mutex_unlock(&this->lease_lock);
+  return lease;
+}
+
+
+void streaming_ref_frame(streaming_t *this, void *frame)
+{
+  struct streaming_lease *lease = (struct streaming_lease *) frame;
+  pthread_mutex_lock(&this->lease_lock);
+  lease->refs++;
+  pthread_mutex_unlock(&this->lease_lock);
+  return;
+}
+
+
+void streaming_release_frame(streaming_t *this, void *frame)
+{
+  struct streaming_lease *lease = (struct streaming_lease *) frame;
+  void *transfer = lease->transfer;
+
+  pthread_mutex_lock(&this->lease_lock);
+  if (--lease->refs > 0) {
+    pthread_mutex_unlock(&this->lease_lock);
+    return;
+  }
+  if (transfer == 0) {
+    this->free_spares[this->nfree_spares++] = lease->buffer;
+  } else {
+    this->held_frames--;
+    this->lease_stats.held_transfers = this->held_frames;
+  }
+  this->free_leases[this->nfree_leases++] = lease;
+  this->lease_stats.leased--;
+
+  /* the held back transfer goes back to the USB queue - under the lock,
+     so that streaming_stop() either sees it in flight or it is not
+     resubmitted; after the stop it is just reclaimed */
+  if (transfer && this->status == STREAMING_STATUS_STREAMING) {
+    atomic_fetch_add(&this->active_transfers, 1);
+#ifdef __linux__
+    if (this->usbfs_fd >= 0) {
+      struct usbdevfs_urb *urb = (struct usbdevfs_urb *) transfer;
+      int ret = usbfs_submit(this, urb);
+      TRACE_URB_RESUBMIT(urb, ret < 0 ? -errno : 0);
+      if (ret < 0) {
+        LOG_ERROR("usbfs URB resubmit failed: %s", strerror(errno));
+        streaming_fail(this, errno == ENODEV);
+        atomic_fetch_sub(&this->active_transfers, 1);
+      }
+      pthread_mutex_unlock(&this->lease_lock);
+      return;
+    }
+#endif
+    struct libusb_transfer *usb_transfer = (struct libusb_transfer *) transfer;
+    int ret = libusb_submit_transfer(usb_transfer);
+    TRACE_TRANSFER_RESUBMIT(usb_transfer, ret);
+    if (ret < 0) {
+      log_usb_error(ret, __func__, __FILE__, __LINE__);
+      streaming_fail(this, ret == LIBUSB_ERROR_NO_DEVICE);
+      atomic_fetch_sub(&this->active_transfers, 1);
+    }
+  }
+  pthread_mutex_unlock(&this->lease_lock);
+  return;
+}
+
+
+void streaming_get_lease_stats(streaming_t *this, struct sddc_lease_stats *stats)
+{
+  pthread_mutex_lock(&this->lease_lock);
+  *stats = this->lease_stats;
+  stats->spare_frames = this->num_spares;
+  pthread_mutex_unlock(&this->lease_lock);
+  return;
+}
+
+
+void streaming_defer_frame(streaming_t *this)
+{
+  if (this->current_frame && !this->current_held) {
+    this->current_deferred = 1;
+  }
+  return;
+}
+
+
+/* resubmit the deferred transfers together (or, when the stream is no
+   longer running, just account for them) */
+void streaming_flush_deferred(streaming_t *this)
+{
+  uint32_t ndeferred = this->ndeferred;
+  this->ndeferred = 0;
+  for (uint32_t i = 0; i < ndeferred; ++i) {
+    if (this->status == STREAMING_STATUS_STREAMING) {
+#ifdef __linux__
+      if (this->usbfs_fd >= 0) {
+        struct usbdevfs_urb *urb = (struct usbdevfs_urb *) this->deferred[i];
+        int ret = usbfs_submit(this, urb);
+        TRACE_URB_RESUBMIT(urb, ret < 0 ? -errno : 0);
+        if (ret == 0) {
+          continue;
+        }
+        LOG_ERROR("usbfs URB resubmit failed: %s", strerror(errno));
+        streaming_fail(this, errno == ENODEV);
+        atomic_fetch_sub(&this->active_transfers, 1);
+        continue;
+      }
+#endif
+      struct libusb_transfer *transfer = (struct libusb_transfer *) this->deferred[i];
+      int ret = libusb_submit_transfer(transfer);
+      TRACE_TRANSFER_RESUBMIT(transfer, ret);
+      if (ret == 0) {
+        continue;
+      }
+      log_usb_error(ret, __func__, __FILE__, __LINE__);
+      streaming_fail(this, ret == LIBUSB_ERROR_NO_DEVICE);
+    }
+    atomic_fetch_sub(&this->active_transfers, 1);
+  }
+  return;
+}
+
+
 int streaming_read_sync(streaming_t *this, uint8_t *data, int length, int *transferred)
 {
   int ret = libusb_bulk_transfer(this->usb_device->dev_handle,
@@ -337,13 +1023,7 @@ int streaming_read_sync(streaming_t *this, uint8_t *data, int length, int *trans
 
   /* remove ADC randomization */
   if (this->random) {
-    uint16_t *samples = (uint16_t *) data;
-    int n = *transferred / 2;
-    for (int i = 0; i < n; ++i) {
-      if (samples[i] & 1) {
-        samples[i] ^= 0xfffe;
-      }
-    }
+    dsp_derandomize((uint16_t *) data, *transferred / 2);
   }
 
   return 0;
@@ -354,6 +1034,7 @@ int streaming_read_sync(streaming_t *this, uint8_t *data, int length, int *trans
 static void LIBUSB_CALL streaming_read_async_callback(struct libusb_transfer *transfer)
 {
   streaming_t *this = (streaming_t *) transfer->user_data;
+  TRACE_TRANSFER_COMPLETE(transfer);
   int ret;
   switch (transfer->status) {
     case LIBUSB_TRANSFER_COMPLETED:
@@ -361,47 +1042,345 @@ static void LIBUSB_CALL streaming_read_async_callback(struct libusb_transfer *tr
       if (this->status == STREAMING_STATUS_STREAMING) {
         /* remove ADC randomization */
         if (this->random) {
-          uint16_t *samples = (uint16_t *) transfer->buffer;
-          int n = transfer->actual_length / 2;
-          for (int i = 0; i < n; ++i) {
-            if (samples[i] & 1) {
-              samples[i] ^= 0xfffe;
-            }
-          }
+          dsp_derandomize((uint16_t *) transfer->buffer,
+                          transfer->actual_length / 2);
         }
+        TRACE_CALLBACK_ENTER(transfer);
+        this->current_frame = transfer;
+        this->current_held = 0;
+        this->current_deferred = 0;
+        this->current_lease = 0;
         this->callback(transfer->actual_length, transfer->buffer,
                        this->callback_context);
+        this->current_frame = 0;
+        TRACE_CALLBACK_EXIT(transfer);
+        if (this->current_held) {
+          /* not in flight until streaming_release_frame() resubmits it */
+          atomic_fetch_sub(&this->active_transfers, 1);
+          return;
+        }
+        if (this->current_deferred) {
+          /* resubmitted by streaming_flush_deferred() */
+          this->deferred[this->ndeferred++] = transfer;
+          return;
+        }
         ret = libusb_submit_transfer(transfer);
+        TRACE_TRANSFER_RESUBMIT(transfer, ret);
         if (ret == 0) {
           return;
         }
         log_usb_error(ret, __func__, __FILE__, __LINE__);
+        streaming_fail(this, ret == LIBUSB_ERROR_NO_DEVICE);
       }
       break;
     case LIBUSB_TRANSFER_CANCELLED:
-      /* librtlsdr does also ignore LIBUSB_TRANSFER_CANCELLED */
-      return;
+      break;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+      LOG_ERROR("USB transfer failed - device disconnected");
+      streaming_fail(this, 1);
+      break;
     case LIBUSB_TRANSFER_ERROR:
     case LIBUSB_TRANSFER_TIMED_OUT:
     case LIBUSB_TRANSFER_STALL:
-    case LIBUSB_TRANSFER_NO_DEVICE:
     case LIBUSB_TRANSFER_OVERFLOW:
-      log_usb_error(transfer->status, __func__, __FILE__, __LINE__);
+      LOG_WARNING("USB transfer failed with status %d", transfer->status);
+      this->transfer_errors++;
+      streaming_fail(this, 0);
       break;
   }
 
-  this->status = STREAMING_STATUS_FAILED;
   atomic_fetch_sub(&this->active_transfers, 1);
-  fprintf(stderr, "Cancelling\n");
-  /* cancel all the active transfers */
+  return;
+}
+
+static uint32_t streaming_round_frame_size(usb_device_t *usb_device,
+                                           uint32_t frame_size)
+{
+  /* frame size must be a multiple of max_packet_size * max_burst */
+  uint32_t max_xfer_size = usb_device->bulk_in_max_packet_size *
+                           usb_device->bulk_in_max_burst;
+  if ( !max_xfer_size ) {
+    LOG_ERROR("maximum transfer size is 0. probably not connected at USB 3 port?!");
+    return 0;
+  }
+
+  frame_size = frame_size > 0 ? frame_size : DEFAULT_FRAME_SIZE;
+  frame_size = max_xfer_size * ((frame_size +max_xfer_size -1) / max_xfer_size);  // round up
+  int iso_packets_per_frame = frame_size / usb_device->bulk_in_max_packet_size;
+  LOG_INFO("frame_size = %u, iso_packets_per_frame = %d", (unsigned)frame_size, iso_packets_per_frame);
+  return frame_size;
+}
+
+/* on the first failure cancel all the other transfers; once they are all
+   back, the stream is either recovered by streaming_recover() or, after a
+   fatal error, it must be stopped */
+static void streaming_fail(streaming_t *this, int fatal)
+{
+  if (this->status != STREAMING_STATUS_STREAMING) {
+    if (fatal && this->status == STREAMING_STATUS_RECOVERING) {
+      this->status = STREAMING_STATUS_FAILED;
+    }
+    return;
+  }
+
+  this->status = fatal ? STREAMING_STATUS_FAILED : STREAMING_STATUS_RECOVERING;
+  clock_gettime(CLOCK_MONOTONIC, &this->failure_time);
+#ifdef __linux__
+  if (this->usbfs_fd >= 0) {
+    usbfs_discard_all(this);
+    return;
+  }
+#endif
+  streaming_cancel_all(this);
+  return;
+}
+
+/* cancel the transfers in flight (the others are not found) */
+static int streaming_cancel_all(streaming_t *this)
+{
+  int status = 0;
   for (uint32_t i = 0; i < this->num_frames; ++i) {
-    int ret = libusb_cancel_transfer(transfer);
-    if (ret < 0) {
-      if (ret == LIBUSB_ERROR_NOT_FOUND) {
+    int ret = libusb_cancel_transfer(this->transfers[i]);
+    TRACE_TRANSFER_CANCEL(this->transfers[i], ret);
+    if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
+      log_usb_error(ret, __func__, __FILE__, __LINE__);
+      status = -1;
+    }
+  }
+  return status;
+}
+
+static uint8_t *streaming_alloc_buffer(streaming_t *this)
+{
+#ifdef __linux__
+  if (this->usbfs_fd >= 0) {
+    if (!this->usbfs_mapped) {
+      return (uint8_t *) malloc(this->buffer_size);
+    }
+    void *buffer = mmap(0, this->buffer_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, this->usbfs_fd, 0);
+    return buffer == MAP_FAILED ? 0 : (uint8_t *) buffer;
+  }
+#endif
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+  return libusb_dev_mem_alloc(this->usb_device->dev_handle, this->buffer_size);
+#else
+  return (uint8_t *) malloc(this->buffer_size);
+#endif
+}
+
+static void streaming_free_buffer(streaming_t *this, uint8_t *buffer)
+{
+#ifdef __linux__
+  if (this->usbfs_fd >= 0) {
+    if (this->usbfs_mapped) {
+      munmap(buffer, this->buffer_size);
+    } else {
+      free(buffer);
+    }
+    return;
+  }
+#endif
+#if defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+  libusb_dev_mem_free(this->usb_device->dev_handle, buffer, this->buffer_size);
+#else
+  free(buffer);
+#endif
+  return;
+}
+
+/* (re)initialize the lease handles - one for each buffer */
+/* a lease handle for each of nleases buffers; on failure the current
+   ones are kept */
+static int streaming_init_leases(streaming_t *this, uint32_t nleases)
+{
+  nleases = nleases > 0 ? nleases : 1;
+  struct streaming_lease *leases = (struct streaming_lease *) calloc(nleases, sizeof(struct streaming_lease));
+  struct streaming_lease **free_leases = (struct streaming_lease **) malloc(nleases * sizeof(struct streaming_lease *));
+  if (leases == 0 || free_leases == 0) {
+    LOG_ERROR("malloc() failed");
+    free(leases);
+    free(free_leases);
+    return -1;
+  }
+  free(this->leases);
+  free(this->free_leases);
+  this->leases = leases;
+  this->free_leases = free_leases;
+  for (uint32_t i = 0; i < nleases; ++i) {
+    this->free_leases[i] = &this->leases[i];
+  }
+  this->nfree_leases = nleases;
+  this->current_frame = 0;
+  this->current_held = 0;
+  this->current_deferred = 0;
+  this->current_lease = 0;
+  this->held_frames = 0;
+  memset(&this->lease_stats, 0, sizeof(this->lease_stats));
+  return 0;
+}
+
+#ifdef __linux__
+/* usbfs backend */
+static int usbfs_open(usb_device_t *usb_device)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u",
+           libusb_get_bus_number(usb_device->dev),
+           libusb_get_device_address(usb_device->dev));
+  int fd = open(path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_ERROR("open(%s) failed: %s", path, strerror(errno));
+    return -1;
+  }
+
+  /* only one file descriptor can claim the interface; libusb keeps using
+     the device for the control transfers, which do not need it */
+  int ret = libusb_release_interface(usb_device->dev_handle, 0);
+  if (ret < 0) {
+    log_usb_error(ret, __func__, __FILE__, __LINE__);
+    close(fd);
+    return -1;
+  }
+  unsigned int interface = 0;
+  if (ioctl(fd, USBDEVFS_CLAIMINTERFACE, &interface) < 0) {
+    LOG_ERROR("usbfs claim interface failed: %s", strerror(errno));
+    libusb_claim_interface(usb_device->dev_handle, 0);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void usbfs_close(usb_device_t *usb_device, int fd)
+{
+  usb_device_set_event_source(usb_device, -1, 0, 0);
+  unsigned int interface = 0;
+  if (ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface) < 0) {
+    LOG_WARNING("usbfs release interface failed: %s", strerror(errno));
+  }
+  close(fd);
+  int ret = libusb_claim_interface(usb_device->dev_handle, 0);
+  if (ret < 0) {
+    log_usb_error(ret, __func__, __FILE__, __LINE__);
+  }
+  return;
+}
+
+static int usbfs_submit(streaming_t *this, struct usbdevfs_urb *urb)
+{
+  urb->status = 0;
+  urb->flags = 0;
+  urb->buffer_length = this->frame_size;
+  urb->actual_length = 0;
+  return ioctl(this->usbfs_fd, USBDEVFS_SUBMITURB, urb);
+}
+
+static void usbfs_discard_all(streaming_t *this)
+{
+  for (uint32_t i = 0; i < this->num_frames; ++i) {
+    /* EINVAL: the URB is not in flight */
+    int ret = ioctl(this->usbfs_fd, USBDEVFS_DISCARDURB, &this->urbs[i]);
+    TRACE_URB_CANCEL(&this->urbs[i], ret < 0 ? -errno : 0);
+    if (ret < 0 && errno != EINVAL) {
+      LOG_ERROR("usbfs discard URB failed: %s", strerror(errno));
+    }
+  }
+  return;
+}
+
+/* reap all the completed URBs, run their callbacks, and only then
+   resubmit them together - one wakeup per batch instead of per frame */
+static void usbfs_events(short revents, void *context)
+{
+  streaming_t *this = (streaming_t *) context;
+  uint32_t nreaped = 0;
+  if (revents & (POLLOUT | POLLERR | POLLHUP)) {
+    struct usbdevfs_urb *urb;
+    while (nreaped < this->num_frames &&
+           ioctl(this->usbfs_fd, USBDEVFS_REAPURBNDELAY, &urb) == 0) {
+      this->reaped[nreaped++] = urb;
+    }
+  }
+
+  uint32_t nresubmit = 0;
+  for (uint32_t i = 0; i < nreaped; ++i) {
+    struct usbdevfs_urb *urb = this->reaped[i];
+    TRACE_URB_COMPLETE(urb);
+    switch (urb->status) {
+      case 0:
+        /* success!!! */
+        if (this->status == STREAMING_STATUS_STREAMING) {
+          /* remove ADC randomization */
+          if (this->random) {
+            dsp_derandomize((uint16_t *) urb->buffer, urb->actual_length / 2);
+          }
+          TRACE_URB_CALLBACK_ENTER(urb);
+          this->current_frame = urb;
+          this->current_held = 0;
+          this->current_deferred = 0;
+          this->current_lease = 0;
+          this->callback(urb->actual_length, (uint8_t *) urb->buffer,
+                         this->callback_context);
+          this->current_frame = 0;
+          TRACE_URB_CALLBACK_EXIT(urb);
+          if (this->current_held) {
+            /* not in flight until streaming_release_frame() resubmits it */
+            atomic_fetch_sub(&this->active_transfers, 1);
+          } else if (this->current_deferred) {
+            this->deferred[this->ndeferred++] = urb;
+          } else {
+            this->reaped[nresubmit++] = urb;
+          }
+          continue;
+        }
+        break;
+      case -ENOENT:
+      case -ECONNRESET:
+        /* discarded */
+        break;
+      case -ENODEV:
+      case -ESHUTDOWN:
+        LOG_ERROR("USB transfer failed - device disconnected");
+        streaming_fail(this, 1);
+        break;
+      default:
+        LOG_WARNING("USB transfer failed with status %d", urb->status);
+        this->transfer_errors++;
+        streaming_fail(this, 0);
+        break;
+    }
+    atomic_fetch_sub(&this->active_transfers, 1);
+  }
+
+  for (uint32_t i = 0; i < nresubmit; ++i) {
+    struct usbdevfs_urb *urb = this->reaped[i];
+    if (this->status == STREAMING_STATUS_STREAMING) {
+      int ret = usbfs_submit(this, urb);
+      TRACE_URB_RESUBMIT(urb, ret < 0 ? -errno : 0);
+      if (ret == 0) {
         continue;
       }
-      log_usb_error(ret, __func__, __FILE__, __LINE__);
+      LOG_ERROR("usbfs URB resubmit failed: %s", strerror(errno));
+      streaming_fail(this, errno == ENODEV);
     }
+    atomic_fetch_sub(&this->active_transfers, 1);
+  }
+
+  /* usbfs has no transfer timeouts, so a stream that stopped delivering
+     is treated like a timed out transfer */
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (nreaped > 0) {
+    this->last_completion = now;
+  } else if (this->status == STREAMING_STATUS_STREAMING &&
+             (now.tv_sec - this->last_completion.tv_sec) * 1000 +
+             (now.tv_nsec - this->last_completion.tv_nsec) / 1000000 >=
+             (long) BULK_XFER_TIMEOUT) {
+    LOG_WARNING("USB transfer failed - no data for %u ms", BULK_XFER_TIMEOUT);
+    this->transfer_errors++;
+    streaming_fail(this, 0);
   }
   return;
 }
+#endif
@@ -39,8 +39,27 @@ streaming_t *streaming_open_async(usb_device_t *usb_device, uint32_t frame_size,
                                   sddc_read_async_cb_t callback,
                                   void *callback_context);
 
+/* Linux only: the bulk transfers go straight through usbfs, bypassing
+   libusb; completed URBs are reaped in batches from
+   usb_device_handle_events() and resubmitted together after their
+   callbacks */
+streaming_t *streaming_open_usbfs(usb_device_t *usb_device, uint32_t frame_size,
+                                  uint32_t num_frames,
+                                  sddc_read_async_cb_t callback,
+                                  void *callback_context);
+
+int streaming_is_usbfs(streaming_t *this);
+
 void streaming_close(streaming_t *this);
 
+int streaming_reconfigure(streaming_t *this, uint32_t frame_size,
+                          uint32_t num_frames, sddc_read_async_cb_t callback,
+                          void *callback_context);
+
+uint32_t streaming_get_frame_size(streaming_t *this);
+
+uint32_t streaming_get_num_frames(streaming_t *this);
+
 int streaming_set_sample_rate(streaming_t *this, uint32_t sample_rate);
 
 int streaming_set_random(streaming_t *this, int random);
@@ -51,6 +70,45 @@ int streaming_stop(streaming_t *this);
 
 int streaming_reset_status(streaming_t *this);
 
+/* true when a transfer error has cancelled all the transfers and the
+   stream can be restarted with streaming_recover() */
+int streaming_needs_recovery(streaming_t *this);
+
+/* seconds since the transfer error that cancelled the transfers */
+double streaming_get_outage(streaming_t *this);
+
+int streaming_recover(streaming_t *this);
+
+uint64_t streaming_get_transfer_errors(streaming_t *this);
+
+/* frame leases: called from the frame callback, keeps its buffer until
+   streaming_release_frame() (from any thread). The transfer is
+   resubmitted at once with a spare buffer; with no spare left the
+   transfer itself is held back (*stall is set), and once half of them
+   are held the lease is refused (returns 0). A held back transfer is not
+   counted as in flight, so streaming_stop() does not wait for it; it is
+   reclaimed when released, and streaming_start() fails until then */
+int streaming_set_spare_frames(streaming_t *this, uint32_t num_spares);
+
+uint32_t streaming_get_spare_frames(streaming_t *this);
+
+void *streaming_lease_frame(streaming_t *this, int *stall);
+
+/* one more reference to a lease */
+void streaming_ref_frame(streaming_t *this, void *frame);
+
+void streaming_release_frame(streaming_t *this, void *frame);
+
+void streaming_get_lease_stats(streaming_t *this, struct sddc_lease_stats *stats);
+
+/* deferred resubmit: called from the frame callback, keeps the frame in
+   its transfer until streaming_flush_deferred(), so that a batch of
+   frames gathered in one event handling pass stays valid (without the
+   lease accounting, since the transfers are back right after the pass) */
+void streaming_defer_frame(streaming_t *this);
+
+void streaming_flush_deferred(streaming_t *this);
+
 int streaming_read_sync(streaming_t *this, uint8_t *data, int length,
                         int *transferred);
 
@@ -0,0 +1,362 @@
+/*
+ * sweep.c - pipelined frequency sweep with per-step spectra
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/* Each step goes through TUNING (the tuner frequency change is queued to
+ * the control thread), SETTLING (the samples up to those captured after
+ * the change, plus the settle time, are dropped) and DWELLING (samples are
+ * copied aside). When the dwell buffer is full, the change for the next
+ * step is queued first, and the spectrum of the step just completed is
+ * computed while the tuner is retuning. Everything but the queueing runs
+ * on the streaming thread.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sweep.h"
+#include "dsp.h"
+#include "fft.h"
+#include "logging.h"
+
+
+typedef struct sweep sweep_t;
+
+/* internal functions */
+static int sweep_tune(sweep_t *this, uint32_t step);
+static void sweep_tune_done(sweep_t *this, int status);
+static void sweep_step_done(sweep_t *this);
+
+
+enum SweepStatus {
+  SWEEP_STATUS_OFF,
+  SWEEP_STATUS_TUNING,
+  SWEEP_STATUS_SETTLING,
+  SWEEP_STATUS_DWELLING,
+  SWEEP_STATUS_FAILED = 0xff
+};
+
+typedef struct sweep {
+  enum SweepStatus status;
+  control_t *control;
+  control_tags_t *control_tags;
+  int64_t ticket;           /* tuner frequency change in the queue */
+  double sample_rate;
+  double *frequencies;
+  uint32_t nsteps;
+  uint32_t step;            /* step being tuned or measured */
+  uint32_t tune_retries;
+  uint64_t settle_samples;
+  uint64_t valid_from;      /* first sample index after settling */
+  uint32_t fft_size;
+  uint32_t nblocks;         /* FFT blocks averaged per step */
+  float *dwell_buffer;
+  uint32_t dwell_samples;
+  uint32_t collected;
+  fft_t *fft;
+  float *window;
+  float *windowed;
+  float *spectrum;
+  double *accumulator;
+  uint32_t *bins;           /* FFT bin for each output bin of a step */
+  uint32_t bins_per_step;
+  double bin_width;
+  double norm;
+  float *power;             /* nsteps * bins_per_step */
+  uint64_t sweep_count;
+  sddc_sweep_cb_t callback;
+  void *callback_context;
+} sweep_t;
+
+
+static const uint32_t MAX_TUNE_RETRIES = 3;
+
+
+sweep_t *sweep_open(control_t *control, control_tags_t *control_tags,
+                    double sample_rate, double if_frequency, int inverted,
+                    const double *frequencies, uint32_t nsteps, double span,
+                    double dwell, double settle, uint32_t fft_size,
+                    sddc_sweep_cb_t callback, void *callback_context)
+{
+  sweep_t *ret_val = 0;
+
+  if (nsteps == 0 || frequencies == 0 || span <= 0 || dwell < 0 ||
+      settle < 0 || sample_rate <= 0) {
+    LOG_ERROR("invalid sweep parameters");
+    return ret_val;
+  }
+
+  sweep_t *this = (sweep_t *) calloc(1, sizeof(sweep_t));
+  if (this == 0) {
+    LOG_ERROR("calloc() failed");
+    return ret_val;
+  }
+
+  this->fft = fft_open(fft_size);
+  if (this->fft == 0) {
+    LOG_ERROR("fft_open() failed");
+    goto FAIL;
+  }
+
+  /* output bins of one step, centered on the IF, in increasing RF order */
+  double bin_width = sample_rate / fft_size;
+  uint32_t bins_per_step = (uint32_t) lround(span / bin_width);
+  bins_per_step = bins_per_step > 0 ? bins_per_step : 1;
+  int64_t center_bin = llround(if_frequency / bin_width);
+  this->bins = (uint32_t *) malloc(bins_per_step * sizeof(uint32_t));
+  if (this->bins == 0) {
+    LOG_ERROR("malloc() failed");
+    goto FAIL;
+  }
+  for (uint32_t i = 0; i < bins_per_step; ++i) {
+    int64_t offset = (int64_t) i - bins_per_step / 2;
+    int64_t bin = center_bin + (inverted ? -offset : offset);
+    if (bin < 0 || bin > fft_size / 2) {
+      LOG_ERROR("sweep span %lf does not fit around the IF", span);
+      goto FAIL;
+    }
+    this->bins[i] = (uint32_t) bin;
+  }
+
+  uint32_t nblocks = (uint32_t) ceil(dwell * sample_rate / fft_size);
+  nblocks = nblocks > 0 ? nblocks : 1;
+
+  this->status = SWEEP_STATUS_OFF;
+  this->control = control;
+  this->control_tags = control_tags;
+  this->ticket = -1;
+  this->sample_rate = sample_rate;
+  this->frequencies = (double *) malloc(nsteps * sizeof(double));
+  this->nsteps = nsteps;
+  this->step = 0;
+  this->tune_retries = 0;
+  this->settle_samples = (uint64_t) ceil(settle * sample_rate);
+  this->valid_from = 0;
+  this->fft_size = fft_size;
+  this->nblocks = nblocks;
+  this->dwell_samples = nblocks * fft_size;
+  this->dwell_buffer = (float *) malloc(this->dwell_samples * sizeof(float));
+  this->collected = 0;
+  this->window = (float *) malloc(fft_size * sizeof(float));
+  this->windowed = (float *) malloc(fft_size * sizeof(float));
+  this->spectrum = (float *) malloc((fft_size + 2) * sizeof(float));
+  this->accumulator = (double *) malloc(bins_per_step * sizeof(double));
+  this->bins_per_step = bins_per_step;
+  this->bin_width = bin_width;
+  this->power = (float *) malloc(nsteps * bins_per_step * sizeof(float));
+  if (this->frequencies == 0 || this->dwell_buffer == 0 ||
+      this->window == 0 || this->windowed == 0 || this->spectrum == 0 ||
+      this->accumulator == 0 || this->power == 0) {
+    LOG_ERROR("malloc() failed");
+    goto FAIL;
+  }
+  memcpy(this->frequencies, frequencies, nsteps * sizeof(double));
+  double window_sum = 0;
+  for (uint32_t i = 0; i < fft_size; ++i) {
+    this->window[i] = (float) (0.5 - 0.5 * cos(2.0 * M_PI * i / fft_size));
+    window_sum += this->window[i];
+  }
+  /* a full scale sine wave has |X| = sum(window) / 2 */
+  this->norm = 1.0 / (nblocks * (window_sum / 2) * (window_sum / 2));
+  for (uint32_t i = 0; i < nsteps * bins_per_step; ++i) {
+    this->power[i] = NAN;
+  }
+  this->sweep_count = 0;
+  this->callback = callback;
+  this->callback_context = callback_context;
+
+  ret_val = this;
+  return ret_val;
+
+FAIL:
+  sweep_close(this);
+  return ret_val;
+}
+
+
+/* a tuner change still queued does not refer to us */
+void sweep_close(sweep_t *this)
+{
+  if (this->fft) {
+    fft_close(this->fft);
+  }
+  free(this->frequencies);
+  free(this->dwell_buffer);
+  free(this->window);
+  free(this->windowed);
+  free(this->spectrum);
+  free(this->accumulator);
+  free(this->bins);
+  free(this->power);
+  free(this);
+  return;
+}
+
+
+int sweep_start(sweep_t *this)
+{
+  this->step = 0;
+  this->sweep_count = 0;
+  return sweep_tune(this, 0);
+}
+
+
+int sweep_is_failed(sweep_t *this)
+{
+  return this->status == SWEEP_STATUS_FAILED;
+}
+
+
+void sweep_process(sweep_t *this, const int16_t *samples, uint32_t nsamples,
+                   uint64_t sample_index)
+{
+  /* the samples handed over until the change is done were captured
+     before it, and so are those still in the USB transfers after it */
+  if (this->status == SWEEP_STATUS_TUNING) {
+    int status = control_wait(this->control, this->ticket, 0);
+    if (status == 1) {
+      return;
+    }
+    this->valid_from = sample_index + nsamples +
+                       control_tags_settle_samples(this->control_tags,
+                                                   SDDC_CONTROL_TUNER_FREQUENCY) +
+                       this->settle_samples;
+    sweep_tune_done(this, status);
+    return;
+  }
+
+  while (nsamples > 0) {
+    switch (this->status) {
+      case SWEEP_STATUS_SETTLING:
+        if (sample_index + nsamples <= this->valid_from) {
+          return;
+        }
+        if (sample_index < this->valid_from) {
+          uint32_t skip = (uint32_t) (this->valid_from - sample_index);
+          samples += skip;
+          nsamples -= skip;
+          sample_index += skip;
+        }
+        this->collected = 0;
+        this->status = SWEEP_STATUS_DWELLING;
+        break;
+      case SWEEP_STATUS_DWELLING: {
+        uint32_t n = this->dwell_samples - this->collected;
+        n = n < nsamples ? n : nsamples;
+        dsp_int16_to_float(samples, this->dwell_buffer + this->collected, n);
+        this->collected += n;
+        samples += n;
+        nsamples -= n;
+        sample_index += n;
+        if (this->collected == this->dwell_samples) {
+          sweep_step_done(this);
+        }
+        break;
+      }
+      default:
+        /* tuning, failed or off - the samples are not usable */
+        return;
+    }
+  }
+  return;
+}
+
+
+/* internal functions */
+static int sweep_tune(sweep_t *this, uint32_t step)
+{
+  this->step = step;
+  this->status = SWEEP_STATUS_TUNING;
+  this->ticket = control_submit(this->control, SDDC_CONTROL_TUNER_FREQUENCY,
+                                this->frequencies[step]);
+  if (this->ticket < 0) {
+    LOG_ERROR("control_submit(SDDC_CONTROL_TUNER_FREQUENCY) failed");
+    this->status = SWEEP_STATUS_FAILED;
+    return -1;
+  }
+  return 0;
+}
+
+
+static void sweep_tune_done(sweep_t *this, int status)
+{
+  if (status < 0) {
+    if (++this->tune_retries > MAX_TUNE_RETRIES) {
+      LOG_ERROR("sweep tuning to %lf failed",
+                this->frequencies[this->step]);
+      this->status = SWEEP_STATUS_FAILED;
+      return;
+    }
+    sweep_tune(this, this->step);
+    return;
+  }
+
+  this->tune_retries = 0;
+  this->status = SWEEP_STATUS_SETTLING;
+  return;
+}
+
+
+static void sweep_step_done(sweep_t *this)
+{
+  uint32_t step = this->step;
+
+  /* get the tuner moving before crunching the numbers */
+  sweep_tune(this, (step + 1) % this->nsteps);
+
+  for (uint32_t i = 0; i < this->bins_per_step; ++i) {
+    this->accumulator[i] = 0.0;
+  }
+  for (uint32_t b = 0; b < this->nblocks; ++b) {
+    const float *block = this->dwell_buffer + b * this->fft_size;
+    for (uint32_t i = 0; i < this->fft_size; ++i) {
+      this->windowed[i] = block[i] * this->window[i];
+    }
+    fft_real_forward(this->fft, this->windowed, this->spectrum);
+    for (uint32_t i = 0; i < this->bins_per_step; ++i) {
+      float re = this->spectrum[2*this->bins[i]];
+      float im = this->spectrum[2*this->bins[i]+1];
+      this->accumulator[i] += re * re + im * im;
+    }
+  }
+  float *power = this->power + step * this->bins_per_step;
+  for (uint32_t i = 0; i < this->bins_per_step; ++i) {
+    power[i] = (float) (10.0 * log10(this->accumulator[i] * this->norm + 1e-20));
+  }
+
+  if (step == this->nsteps - 1) {
+    struct sddc_sweep_spectrum spectrum = {
+      .nsteps = this->nsteps,
+      .bins_per_step = this->bins_per_step,
+      .frequencies = this->frequencies,
+      .bin_width = this->bin_width,
+      .power = this->power,
+      .sweep = this->sweep_count
+    };
+    if (this->callback) {
+      this->callback(&spectrum, this->callback_context);
+    }
+    this->sweep_count++;
+  }
+  return;
+}
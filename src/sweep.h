@@ -0,0 +1,60 @@
+/*
+ * sweep.h - pipelined frequency sweep with per-step spectra
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __SWEEP_H
+#define __SWEEP_H
+
+#include <stdint.h>
+
+#include "libsddc.h"
+#include "control.h"
+#include "control_tags.h"
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct sweep sweep_t;
+
+/* the tuner is retuned through the control queue, and the samples are
+   used from the settle delay of the changes (control_tags) on */
+sweep_t *sweep_open(control_t *control, control_tags_t *control_tags,
+                    double sample_rate, double if_frequency, int inverted,
+                    const double *frequencies, uint32_t nsteps, double span,
+                    double dwell, double settle, uint32_t fft_size,
+                    sddc_sweep_cb_t callback, void *callback_context);
+
+void sweep_close(sweep_t *this);
+
+int sweep_start(sweep_t *this);
+
+int sweep_is_failed(sweep_t *this);
+
+/* streaming thread */
+void sweep_process(sweep_t *this, const int16_t *samples, uint32_t nsamples,
+                   uint64_t sample_index);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SWEEP_H */
@@ -0,0 +1,135 @@
+/*
+ * trace.c - transfer lifecycle tracepoints
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+#include "logging.h"
+
+
+static const char *trace_event_names[TRACE_EVENT_COUNT] = {
+  "transfer_submit",
+  "transfer_complete",
+  "callback_enter",
+  "callback_exit",
+  "transfer_resubmit",
+  "transfer_cancel",
+  "control_submit",
+  "control_complete"
+};
+
+
+const char *trace_event_name(enum TraceEvent event)
+{
+  if ((unsigned int) event >= TRACE_EVENT_COUNT) {
+    return "unknown";
+  }
+  return trace_event_names[event];
+}
+
+
+#ifdef SDDC_TRACE
+
+struct trace_entry {
+  uint64_t timestamp;       /* CLOCK_MONOTONIC in ns (same as bpftrace nsecs) */
+  uint64_t id;
+  int64_t arg;
+  enum TraceEvent event;
+};
+
+#define TRACE_RING_SIZE (65536)   /* must be a power of 2 */
+
+static struct trace_entry trace_ring[TRACE_RING_SIZE];
+static atomic_ullong trace_head;
+
+
+void trace_record(enum TraceEvent event, uint64_t id, int64_t arg)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  unsigned long long pos = atomic_fetch_add_explicit(&trace_head, 1,
+                                                     memory_order_relaxed);
+  struct trace_entry *entry = &trace_ring[pos & (TRACE_RING_SIZE - 1)];
+  entry->timestamp = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  entry->id = id;
+  entry->arg = arg;
+  entry->event = event;
+  return;
+}
+
+/* the ring is not locked while dumping, so entries recorded while the
+   dump is running may come out garbled; dump after streaming has stopped */
+int trace_dump(const char *filename)
+{
+  FILE *fp = fopen(filename, "w");
+  if (fp == 0) {
+    LOG_ERROR("fopen(%s) failed", filename);
+    return -1;
+  }
+  unsigned long long head = atomic_load(&trace_head);
+  unsigned long long tail = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  fprintf(fp, "# libsddc trace - timestamp_ns event id arg\n");
+  if (tail > 0) {
+    fprintf(fp, "# %llu earlier events overwritten\n", tail);
+  }
+  for (unsigned long long pos = tail; pos < head; ++pos) {
+    struct trace_entry *entry = &trace_ring[pos & (TRACE_RING_SIZE - 1)];
+    fprintf(fp, "%llu %s %llx %lld\n", (unsigned long long) entry->timestamp,
+            trace_event_name(entry->event), (unsigned long long) entry->id,
+            (long long) entry->arg);
+  }
+  if (fclose(fp) != 0) {
+    LOG_ERROR("fclose(%s) failed", filename);
+    return -1;
+  }
+  return 0;
+}
+
+void trace_reset()
+{
+  atomic_store(&trace_head, 0);
+  return;
+}
+
+#else
+
+void trace_record(enum TraceEvent event __attribute__((unused)),
+                  uint64_t id __attribute__((unused)),
+                  int64_t arg __attribute__((unused)))
+{
+  return;
+}
+
+int trace_dump(const char *filename __attribute__((unused)))
+{
+  LOG_ERROR("tracing not enabled - rebuild with -DENABLE_TRACE=ON");
+  return -1;
+}
+
+void trace_reset()
+{
+  return;
+}
+
+#endif
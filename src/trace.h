@@ -0,0 +1,120 @@
+/*
+ * trace.h - transfer lifecycle tracepoints
+ *
+ * Copyright (C) 2020 by Franco Venturi
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#include <stdint.h>
+
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* tracepoints are compiled in only with -DSDDC_TRACE (cmake -DENABLE_TRACE=ON);
+   each one records an event in an in-process ring buffer and, when
+   <sys/sdt.h> is available, also fires a USDT probe 'libsddc:<name>' with
+   the same two arguments, so it can be used by bpftrace or perf */
+enum TraceEvent {
+  TRACE_EVENT_TRANSFER_SUBMIT,      /* id: transfer - arg: length */
+  TRACE_EVENT_TRANSFER_COMPLETE,    /* id: transfer - arg: status */
+  TRACE_EVENT_CALLBACK_ENTER,       /* id: transfer - arg: actual length */
+  TRACE_EVENT_CALLBACK_EXIT,        /* id: transfer - arg: 0 */
+  TRACE_EVENT_TRANSFER_RESUBMIT,    /* id: transfer - arg: libusb return code */
+  TRACE_EVENT_TRANSFER_CANCEL,      /* id: transfer - arg: libusb return code */
+  TRACE_EVENT_CONTROL_SUBMIT,       /* id: request - arg: value */
+  TRACE_EVENT_CONTROL_COMPLETE,     /* id: request - arg: 0 on success, -1 on failure */
+  TRACE_EVENT_COUNT
+};
+
+void trace_record(enum TraceEvent event, uint64_t id, int64_t arg);
+
+const char *trace_event_name(enum TraceEvent event);
+
+int trace_dump(const char *filename);
+
+void trace_reset();
+
+#if defined(SDDC_TRACE) && defined(SDDC_TRACE_USDT)
+#include <sys/sdt.h>
+#define TRACE_USDT(probe, id, arg) \
+  DTRACE_PROBE2(libsddc, probe, (uint64_t) (id), (int64_t) (arg))
+#else
+#define TRACE_USDT(probe, id, arg) do { } while (0)
+#endif
+
+#ifdef SDDC_TRACE
+#define TRACE_POINT(event, probe, id, arg) \
+  do { \
+    TRACE_USDT(probe, id, arg); \
+    trace_record(event, (uint64_t) (id), (int64_t) (arg)); \
+  } while (0)
+#else
+#define TRACE_POINT(event, probe, id, arg) do { } while (0)
+#endif
+
+#define TRACE_TRANSFER_SUBMIT(transfer) \
+  TRACE_POINT(TRACE_EVENT_TRANSFER_SUBMIT, transfer_submit, \
+              (uintptr_t) (transfer), (transfer)->length)
+#define TRACE_TRANSFER_COMPLETE(transfer) \
+  TRACE_POINT(TRACE_EVENT_TRANSFER_COMPLETE, transfer_complete, \
+              (uintptr_t) (transfer), (transfer)->status)
+#define TRACE_CALLBACK_ENTER(transfer) \
+  TRACE_POINT(TRACE_EVENT_CALLBACK_ENTER, callback_enter, \
+              (uintptr_t) (transfer), (transfer)->actual_length)
+#define TRACE_CALLBACK_EXIT(transfer) \
+  TRACE_POINT(TRACE_EVENT_CALLBACK_EXIT, callback_exit, \
+              (uintptr_t) (transfer), 0)
+#define TRACE_TRANSFER_RESUBMIT(transfer, ret) \
+  TRACE_POINT(TRACE_EVENT_TRANSFER_RESUBMIT, transfer_resubmit, \
+              (uintptr_t) (transfer), ret)
+#define TRACE_TRANSFER_CANCEL(transfer, ret) \
+  TRACE_POINT(TRACE_EVENT_TRANSFER_CANCEL, transfer_cancel, \
+              (uintptr_t) (transfer), ret)
+/* the same events for the URBs of the usbfs streaming backend */
+#define TRACE_URB_SUBMIT(urb) \
+  TRACE_POINT(TRACE_EVENT_TRANSFER_SUBMIT, transfer_submit, \
+              (uintptr_t) (urb), (urb)->buffer_length)
+#define TRACE_URB_COMPLETE(urb) \
+  TRACE_POINT(TRACE_EVENT_TRANSFER_COMPLETE, transfer_complete, \
+              (uintptr_t) (urb), (urb)->status)
+#define TRACE_URB_CALLBACK_ENTER(urb) \
+  TRACE_POINT(TRACE_EVENT_CALLBACK_ENTER, callback_enter, \
+              (uintptr_t) (urb), (urb)->actual_length)
+#define TRACE_URB_CALLBACK_EXIT(urb) \
+  TRACE_POINT(TRACE_EVENT_CALLBACK_EXIT, callback_exit, \
+              (uintptr_t) (urb), 0)
+#define TRACE_URB_RESUBMIT(urb, ret) \
+  TRACE_POINT(TRACE_EVENT_TRANSFER_RESUBMIT, transfer_resubmit, \
+              (uintptr_t) (urb), ret)
+#define TRACE_URB_CANCEL(urb, ret) \
+  TRACE_POINT(TRACE_EVENT_TRANSFER_CANCEL, transfer_cancel, \
+              (uintptr_t) (urb), ret)
+#define TRACE_CONTROL_SUBMIT(request, value) \
+  TRACE_POINT(TRACE_EVENT_CONTROL_SUBMIT, control_submit, request, value)
+#define TRACE_CONTROL_COMPLETE(request, status) \
+  TRACE_POINT(TRACE_EVENT_CONTROL_COMPLETE, control_complete, request, status)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TRACE_H */
@@ -29,16 +29,19 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <libusb.h>
 
 #include "usb_device.h"
 #include "usb_device_internals.h"
 #include "ezusb.h"
 #include "logging.h"
+#include "trace.h"
 
 
 typedef struct usb_device usb_device_t;
@@ -54,6 +57,18 @@ static int transfer_image(const uint8_t *image,
 static int list_endpoints(struct libusb_endpoint_descriptor endpoints[],
                           struct libusb_ss_endpoint_companion_descriptor ss_endpoints[],
                           libusb_device *device);
+static int usb_device_control_sync(usb_device_t *this, uint8_t request,
+                                   uint16_t value, uint16_t index,
+                                   uint8_t *data, uint16_t length);
+static void LIBUSB_CALL usb_device_control_async_callback(struct libusb_transfer *transfer);
+static int usb_device_control_remote(usb_device_t *this, uint8_t request,
+                                     uint16_t value, uint16_t index,
+                                     uint8_t *data, uint16_t length);
+static void usb_device_control_remote_callback(int status, void *context);
+static int usb_device_poll_events(usb_device_t *this);
+static void LIBUSB_CALL usb_device_pollfd_added(int fd, short events,
+                                                void *user_data);
+static void LIBUSB_CALL usb_device_pollfd_removed(int fd, void *user_data);
 
 
 struct usb_device_id {
@@ -115,7 +130,7 @@ int usb_device_get_device_list(struct usb_device_info **usb_device_infos)
   int ret_val = -1;
 
   if (usb_device_infos == 0) {
-    log_error("argument usb_device_infos is a null pointer", __func__, __FILE__, __LINE__);
+    LOG_ERROR("argument usb_device_infos is a null pointer");
     goto FAIL0;
   }
 
@@ -254,7 +269,7 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
   if (needs_firmware) {
     ret = load_image(dev_handle, imagefile);
     if (ret != 0) {
-      log_error("load_image() failed", __func__, __FILE__, __LINE__);
+      LOG_ERROR("load_image() failed");
       goto FAIL2;
     }
 
@@ -270,14 +285,14 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
       goto FAIL1;
     }
     if (needs_firmware) {
-      log_error("device is still in boot loader mode", __func__, __FILE__, __LINE__);
+      LOG_ERROR("device is still in boot loader mode");
       goto FAIL2;
     }
   }
 
   int speed = libusb_get_device_speed(device);
   if ( speed == LIBUSB_SPEED_LOW || speed == LIBUSB_SPEED_FULL || speed == LIBUSB_SPEED_HIGH ) {
-      log_error("USB 3.x SuperSpeed connection failed", __func__, __FILE__, __LINE__);
+      LOG_ERROR("USB 3.x SuperSpeed connection failed");
       goto FAIL2;
   }
 
@@ -286,7 +301,7 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
   struct libusb_ss_endpoint_companion_descriptor ss_endpoints[MAX_ENDPOINTS];
   ret = list_endpoints(endpoints, ss_endpoints, device);
   if (ret < 0) {
-    log_error("list_endpoints() failed", __func__, __FILE__, __LINE__);
+    LOG_ERROR("list_endpoints() failed");
     goto FAIL2;
   }
   int nendpoints = ret;
@@ -304,12 +319,16 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
     }
   }
   if (bulk_in_endpoint_address == 0) {
-    fprintf(stderr, "ERROR - bulk in endpoint not found\n");
+    LOG_ERROR("bulk in endpoint not found");
     goto FAIL2;
   }
 
   /* we are good here - create and initialize the usb_device */
   usb_device_t *this = (usb_device_t *) malloc(sizeof(usb_device_t));
+  if (this == 0) {
+    LOG_ERROR("malloc() failed");
+    goto FAIL2;
+  }
   this->dev = device;
   this->dev_handle = dev_handle;
   this->context = ctx;
@@ -323,8 +342,32 @@ usb_device_t *usb_device_open(int index, const char* imagefile,
   this->bulk_in_endpoint_address = bulk_in_endpoint_address;
   this->bulk_in_max_packet_size = bulk_in_max_packet_size;
   this->bulk_in_max_burst = bulk_in_max_burst;
-  this->gpio_register = gpio_register;
-  memset(this->fw_registers, 0, sizeof(this->fw_registers));
+  atomic_init(&this->gpio_register, gpio_register);
+  for (int i = 0; i < MAX_FW_REGISTERS; ++i) {
+    atomic_init(&this->fw_registers[i], 0);
+  }
+  for (int i = 0; i < MAX_ASYNC_CONTROLS; ++i) {
+    this->control_transfers[i] = libusb_alloc_transfer(0);
+    atomic_init(&this->control_busy[i], 0);
+  }
+  atomic_init(&this->events_owned, 0);
+  atomic_init(&this->events_thread, pthread_self());
+  pthread_mutex_init(&this->control_lock, 0);
+  pthread_cond_init(&this->control_done, 0);
+  this->event_fd = -1;
+  this->event_callback = 0;
+  this->event_callback_context = 0;
+
+  /* the poll set is built once here, so polling allocates nothing */
+  pthread_mutex_init(&this->poll_lock, 0);
+  this->npoll_fds = 0;
+  libusb_set_pollfd_notifiers(ctx, usb_device_pollfd_added,
+                              usb_device_pollfd_removed, this);
+  const struct libusb_pollfd **pollfds = libusb_get_pollfds(ctx);
+  for (int i = 0; pollfds && pollfds[i]; ++i) {
+    usb_device_pollfd_added(pollfds[i]->fd, pollfds[i]->events, this);
+  }
+  libusb_free_pollfds(pollfds);
 
   ret_val = this;
   return ret_val;
@@ -340,6 +383,13 @@ FAIL0:
 
 void usb_device_close(usb_device_t *this)
 {
+  libusb_set_pollfd_notifiers(this->context, 0, 0, 0);
+  pthread_mutex_destroy(&this->poll_lock);
+  for (int i = 0; i < MAX_ASYNC_CONTROLS; ++i) {
+    libusb_free_transfer(this->control_transfers[i]);
+  }
+  pthread_cond_destroy(&this->control_done);
+  pthread_mutex_destroy(&this->control_lock);
   libusb_close(this->dev_handle);
   free(this);
   libusb_exit(0);
@@ -349,12 +399,74 @@ void usb_device_close(usb_device_t *this)
 
 int usb_device_handle_events(usb_device_t *this)
 {
+  usb_device_claim_events(this);
+  if (this->event_fd >= 0) {
+    return usb_device_poll_events(this);
+  }
   return libusb_handle_events_completed(this->context, &this->completed);
 }
 
 
+void usb_device_claim_events(usb_device_t *this)
+{
+  pthread_t self = pthread_self();
+  if (!atomic_load(&this->events_owned) ||
+      !pthread_equal(atomic_load(&this->events_thread), self)) {
+    atomic_store(&this->events_thread, self);
+    atomic_store(&this->events_owned, 1);
+  }
+  return;
+}
+
+
+int usb_device_owns_events(usb_device_t *this)
+{
+  return atomic_load(&this->events_owned) &&
+         pthread_equal(atomic_load(&this->events_thread), pthread_self());
+}
+
+
+void usb_device_release_events(usb_device_t *this)
+{
+  atomic_store(&this->events_owned, 0);
+  pthread_mutex_lock(&this->control_lock);
+  pthread_cond_broadcast(&this->control_done);
+  pthread_mutex_unlock(&this->control_lock);
+  return;
+}
+
+
+int usb_device_set_event_source(usb_device_t *this, int fd,
+                                usb_device_event_cb_t callback,
+                                void *callback_context)
+{
+  this->event_fd = fd < 0 ? -1 : fd;
+  this->event_callback = fd < 0 ? 0 : callback;
+  this->event_callback_context = fd < 0 ? 0 : callback_context;
+  return 0;
+}
+
+
 int usb_device_control(usb_device_t *this, uint8_t request, uint16_t value,
                        uint16_t index, uint8_t *data, uint16_t length) {
+  /* the write requests from other threads than the event handling one
+     complete there, rather than handling the events (and so running the
+     streaming callbacks) in this thread */
+  if (request != TESTFX3 && request != I2CRFX3 &&
+      atomic_load(&this->events_owned) && !usb_device_owns_events(this)) {
+    return usb_device_control_remote(this, request, value, index, data,
+                                     length);
+  }
+  TRACE_CONTROL_SUBMIT(request, value);
+  int ret = usb_device_control_sync(this, request, value, index, data, length);
+  TRACE_CONTROL_COMPLETE(request, ret);
+  return ret;
+}
+
+
+static int usb_device_control_sync(usb_device_t *this, uint8_t request,
+                                   uint16_t value, uint16_t index,
+                                   uint8_t *data, uint16_t length) {
 
   const uint8_t bmWriteRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
   const uint8_t bmReadRequestType = LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
@@ -409,49 +521,124 @@ int usb_device_control(usb_device_t *this, uint8_t request, uint16_t value,
       }
       break;
     default:
-      fprintf(stderr, "ERROR - unknown USB device control request: 0x%02x\n",
-              request);
+      LOG_ERROR("unknown USB device control request: 0x%02x",
+                request);
       return -1;
   }
   return 0;
 }
 
 
+/* asynchronous version of usb_device_control() for the write requests;
+   it can be called from within a libusb callback (for instance the
+   streaming callback) since it does not wait for the transfer to complete.
+   The optional callback is invoked from the event handling thread with
+   status 0 on success and -1 on failure */
+int usb_device_control_async(usb_device_t *this, uint8_t request,
+                             uint16_t value, uint16_t index, uint8_t *data,
+                             uint16_t length, usb_device_control_cb_t callback,
+                             void *callback_context) {
+
+  const uint8_t bmWriteRequestType = LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE;
+  const unsigned int timeout = 5000;        // timeout (in ms) for each command
+
+  uint8_t dummy[] = { 0 };
+
+  switch (request) {
+    case STARTFX3:
+    case STOPFX3:
+    case RESETFX3:
+    case R82XXSTDBY:
+      value = 0;
+      index = 0;
+      data = dummy;
+      length = sizeof(dummy);
+      break;
+    case GPIOFX3:
+    case I2CWFX3:
+    case STARTADC:
+    case R82XXINIT:
+    case R82XXTUNE:
+      break;
+    case SETARGFX3:
+      data = dummy;
+      length = sizeof(dummy);
+      break;
+    default:
+      LOG_ERROR("unsupported USB device async control request: 0x%02x",
+                request);
+      return -1;
+  }
+  if (length > MAX_ASYNC_CONTROL_DATA) {
+    LOG_ERROR("USB device async control data too long: %d",
+              length);
+    return -1;
+  }
+
+  /* grab a free control transfer slot */
+  int slot = -1;
+  for (int i = 0; i < MAX_ASYNC_CONTROLS; ++i) {
+    if (atomic_exchange(&this->control_busy[i], 1) == 0) {
+      slot = i;
+      break;
+    }
+  }
+  if (slot < 0) {
+    LOG_ERROR("no free async control transfers");
+    return -1;
+  }
+
+  this->control_callbacks[slot] = callback;
+  this->control_callback_contexts[slot] = callback_context;
+  uint8_t *buffer = this->control_buffers[slot];
+  libusb_fill_control_setup(buffer, bmWriteRequestType, request, value, index,
+                            length);
+  memcpy(buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+  struct libusb_transfer *transfer = this->control_transfers[slot];
+  libusb_fill_control_transfer(transfer, this->dev_handle, buffer,
+                               usb_device_control_async_callback, this,
+                               timeout);
+  TRACE_CONTROL_SUBMIT(request, value);
+  int ret = libusb_submit_transfer(transfer);
+  if (ret < 0) {
+    log_usb_error(ret, __func__, __FILE__, __LINE__);
+    atomic_store(&this->control_busy[slot], 0);
+    return -1;
+  }
+  return 0;
+}
+
+
 uint16_t usb_device_gpio_get(usb_device_t *this) {
-  return this->gpio_register;
+  return atomic_load(&this->gpio_register);
 }
 
 
+/* the shadow register has a single writer (the control thread), so the
+   read-modify-write needs no lock; each transfer sends its own copy */
 int usb_device_gpio_set(usb_device_t *this, uint16_t bit_pattern,
                         uint16_t bit_mask) {
-  this->gpio_register = (this->gpio_register & ~bit_mask) | bit_pattern;
-  return usb_device_control(this, GPIOFX3, 0, 0,
-                            (uint8_t *) &this->gpio_register,
-                            sizeof(this->gpio_register));
+  uint16_t gpio_register = (atomic_load(&this->gpio_register) & ~bit_mask) |
+                           bit_pattern;
+  atomic_store(&this->gpio_register, gpio_register);
+  return usb_device_control(this, GPIOFX3, 0, 0, (uint8_t *) &gpio_register,
+                            sizeof(gpio_register));
 }
 
 
 int usb_device_gpio_on(usb_device_t *this, uint16_t bit_pattern) {
-  this->gpio_register |= bit_pattern;
-  return usb_device_control(this, GPIOFX3, 0, 0,
-                            (uint8_t *) &this->gpio_register,
-                            sizeof(this->gpio_register));
+  return usb_device_gpio_set(this, bit_pattern, bit_pattern);
 }
 
 
 int usb_device_gpio_off(usb_device_t *this, uint16_t bit_pattern) {
-  this->gpio_register &= ~bit_pattern;
-  return usb_device_control(this, GPIOFX3, 0, 0,
-                            (uint8_t *) &this->gpio_register,
-                            sizeof(this->gpio_register));
+  return usb_device_gpio_set(this, 0, bit_pattern);
 }
 
 
 int usb_device_gpio_toggle(usb_device_t *this, uint16_t bit_pattern) {
-  this->gpio_register ^= bit_pattern;
-  return usb_device_control(this, GPIOFX3, 0, 0,
-                            (uint8_t *) &this->gpio_register,
-                            sizeof(this->gpio_register));
+  uint16_t gpio_register = atomic_load(&this->gpio_register);
+  return usb_device_gpio_set(this, ~gpio_register & bit_pattern, bit_pattern);
 }
 
 
@@ -485,31 +672,175 @@ int usb_device_i2c_read(usb_device_t *this, uint8_t i2c_address,
 /* firmware registers */
 uint16_t usb_device_get_fw_register(usb_device_t *this, uint16_t address) {
   if (address >= MAX_FW_REGISTERS) {
-    fprintf(stderr, "ERROR - usb_device_get_fw_register() failed - invalid register address: %d\n", address);
+    LOG_ERROR("usb_device_get_fw_register() failed - invalid register address: %d", address);
   }
-  return this->fw_registers[address];
+  return atomic_load(&this->fw_registers[address]);
 }
 
 
 int usb_device_set_fw_register(usb_device_t *this, uint16_t address,
                                     uint16_t value) {
   if (address >= MAX_FW_REGISTERS) {
-    fprintf(stderr, "ERROR - usb_device_set_fw_register() failed - invalid register address: %d\n", address);
+    LOG_ERROR("usb_device_set_fw_register() failed - invalid register address: %d", address);
   }
   int ret = usb_device_control(this, SETARGFX3, address, value, 0, 0);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - usb_device_control(SETARGFX3) failed\n");
+    LOG_ERROR("usb_device_control(SETARGFX3) failed");
     return -1;
   }
-  this->fw_registers[address] = value;
+  atomic_store(&this->fw_registers[address], value);
   return 0;
 }
 
 
+/* internal functions */
+struct usb_device_completion {
+  usb_device_t *usb_device;
+  int done;
+  int status;
+};
+
+/* submitted asynchronously, with the event handling thread signaling the
+   completion; if that thread lets go of the events in the meantime, the
+   events are handled here */
+static int usb_device_control_remote(usb_device_t *this, uint8_t request,
+                                     uint16_t value, uint16_t index,
+                                     uint8_t *data, uint16_t length)
+{
+  struct usb_device_completion completion = { this, 0, 0 };
+  int ret = usb_device_control_async(this, request, value, index, data,
+                                     length,
+                                     usb_device_control_remote_callback,
+                                     &completion);
+  if (ret < 0) {
+    return -1;
+  }
+
+  const long wait = 100000000L;    /* ns - to look at the owner again */
+  pthread_mutex_lock(&this->control_lock);
+  while (!completion.done) {
+    if (!atomic_load(&this->events_owned)) {
+      pthread_mutex_unlock(&this->control_lock);
+      struct timeval tv = { 0, wait / 1000 };
+      libusb_handle_events_timeout_completed(this->context, &tv, 0);
+      pthread_mutex_lock(&this->control_lock);
+      continue;
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += wait;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&this->control_done, &this->control_lock,
+                           &deadline);
+  }
+  pthread_mutex_unlock(&this->control_lock);
+  return completion.status;
+}
+
+static void usb_device_control_remote_callback(int status, void *context)
+{
+  struct usb_device_completion *completion = (struct usb_device_completion *) context;
+  usb_device_t *this = completion->usb_device;
+  pthread_mutex_lock(&this->control_lock);
+  completion->status = status;
+  completion->done = 1;
+  pthread_cond_broadcast(&this->control_done);
+  pthread_mutex_unlock(&this->control_lock);
+  return;
+}
+
+/* poll the extra event source and the libusb file descriptors together;
+   libusb then only handles its own events (control transfers) when one
+   of its descriptors is ready or one of its timeouts has expired */
+static int usb_device_poll_events(usb_device_t *this)
+{
+  const int max_wait = 1000;    /* ms - the callback also runs on timeouts */
+  struct pollfd fds[MAX_POLL_FDS + 1];
+  nfds_t nfds = 0;
+  fds[nfds].fd = this->event_fd;
+  fds[nfds].events = POLLOUT;
+  fds[nfds].revents = 0;
+  nfds++;
+  pthread_mutex_lock(&this->poll_lock);
+  for (int i = 0; i < this->npoll_fds; ++i) {
+    fds[nfds] = this->poll_fds[i];
+    fds[nfds].revents = 0;
+    nfds++;
+  }
+  pthread_mutex_unlock(&this->poll_lock);
+
+  int timeout = max_wait;
+  struct timeval tv;
+  int libusb_timeout = libusb_get_next_timeout(this->context, &tv) == 1;
+  if (libusb_timeout) {
+    int ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+    timeout = ms < timeout ? ms : timeout;
+  }
 
+  int ret = poll(fds, nfds, timeout);
+  if (ret < 0) {
+    if (errno == EINTR) {
+      return 0;
+    }
+    LOG_ERROR("poll() failed: %s", strerror(errno));
+    return -1;
+  }
 
+  this->event_callback(fds[0].revents, this->event_callback_context);
+
+  int libusb_ready = libusb_timeout && ret == 0;
+  for (nfds_t i = 1; i < nfds; ++i) {
+    libusb_ready |= fds[i].revents != 0;
+  }
+  if (libusb_ready) {
+    struct timeval zero = { 0, 0 };
+    ret = libusb_handle_events_timeout_completed(this->context, &zero, 0);
+    if (ret < 0) {
+      log_usb_error(ret, __func__, __FILE__, __LINE__);
+      return ret;
+    }
+  }
+  return 0;
+}
+
+static void LIBUSB_CALL usb_device_pollfd_added(int fd, short events,
+                                                void *user_data)
+{
+  usb_device_t *this = (usb_device_t *) user_data;
+  pthread_mutex_lock(&this->poll_lock);
+  int i = 0;
+  while (i < this->npoll_fds && this->poll_fds[i].fd != fd) {
+    i++;
+  }
+  if (i == MAX_POLL_FDS) {
+    LOG_WARNING("too many libusb file descriptors - fd %d not polled", fd);
+  } else {
+    this->poll_fds[i].fd = fd;
+    this->poll_fds[i].events = events;
+    this->poll_fds[i].revents = 0;
+    this->npoll_fds += i == this->npoll_fds;
+  }
+  pthread_mutex_unlock(&this->poll_lock);
+  return;
+}
+
+static void LIBUSB_CALL usb_device_pollfd_removed(int fd, void *user_data)
+{
+  usb_device_t *this = (usb_device_t *) user_data;
+  pthread_mutex_lock(&this->poll_lock);
+  for (int i = 0; i < this->npoll_fds; ++i) {
+    if (this->poll_fds[i].fd == fd) {
+      this->poll_fds[i] = this->poll_fds[--this->npoll_fds];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&this->poll_lock);
+  return;
+}
 
-/* internal functions */
 static libusb_device_handle *find_usb_device(int index, libusb_context *ctx,
                              libusb_device **device, int *needs_firmware)
 {
@@ -543,7 +874,7 @@ static libusb_device_handle *find_usb_device(int index, libusb_context *ctx,
   }
 
   if (*device == 0) {
-    fprintf(stderr, "ERROR - usb_device@%d not found\n", index);
+    LOG_ERROR("usb_device@%d not found", index);
     goto FAIL1;
   }
 
@@ -561,7 +892,7 @@ static libusb_device_handle *find_usb_device(int index, libusb_context *ctx,
     goto FAILA;
   }
   if (ret == 1) {
-    fprintf(stderr, "ERROR - device busy\n");
+    LOG_ERROR("device busy");
     goto FAILA;
   }
 
@@ -598,7 +929,7 @@ int load_image(libusb_device_handle *dev_handle, const char *imagefile)
 
   int fd = open(imagefile, O_RDONLY);
   if (fd < 0) {
-    fprintf(stderr, "ERROR - open(%s) failed: %s\n", imagefile, strerror(errno));
+    LOG_ERROR("open(%s) failed: %s", imagefile, strerror(errno));
     goto FAIL0;
   }
 
@@ -606,19 +937,19 @@ int load_image(libusb_device_handle *dev_handle, const char *imagefile)
   struct stat statbuf;
   int ret = fstat(fd, &statbuf);
   if (ret < 0) {
-    fprintf(stderr, "ERROR - fstat(%s) failed: %s\n", imagefile, strerror(errno));
+    LOG_ERROR("fstat(%s) failed: %s", imagefile, strerror(errno));
     goto FAIL1;
   }
   size_t image_size = statbuf.st_size;
   uint8_t *image = (uint8_t *) malloc(image_size);
   if (image == 0) {
-    fprintf(stderr, "ERROR - malloc() failed: %s\n", strerror(errno));
+    LOG_ERROR("malloc() failed: %s", strerror(errno));
     goto FAIL1;
   }
   for (size_t nleft = image_size; nleft != 0; ) {
     ssize_t nr = read(fd, image, nleft);
     if (nr < 0) {
-      fprintf(stderr, "ERROR - read(%s) failed: %s\n", imagefile, strerror(errno));
+      LOG_ERROR("read(%s) failed: %s", imagefile, strerror(errno));
       goto FAIL1;
     }
     nleft -= nr;
@@ -627,12 +958,12 @@ int load_image(libusb_device_handle *dev_handle, const char *imagefile)
   close(fd);
 
   if (validate_image(image, image_size) < 0) {
-    fprintf(stderr, "ERROR - validate_image() failed\n");
+    LOG_ERROR("validate_image() failed");
     goto FAILA;
   }
 
   if (transfer_image(image, dev_handle) < 0) {
-    fprintf(stderr, "ERROR - transfer_image() failed\n");
+    LOG_ERROR("transfer_image() failed");
     goto FAILA;
   }
 
@@ -652,19 +983,19 @@ FAIL0:
 static int validate_image(const uint8_t *image, const size_t size)
 {
   if (size < 10240) {
-    fprintf(stderr, "ERROR - image file is too small\n");
+    LOG_ERROR("image file is too small");
     return -1;
   }
   if (!(image[0] == 'C' && image[1] == 'Y')) {
-    fprintf(stderr, "ERROR - image header does not start with 'CY'\n");
+    LOG_ERROR("image header does not start with 'CY'");
     return -1;
   }
   if (!(image[2] == 0x1c)) {
-    fprintf(stderr, "ERROR - I2C config is not set to 0x1C\n");
+    LOG_ERROR("I2C config is not set to 0x1C");
     return -1;
   }
   if (!(image[3] == 0xb0)) {
-    fprintf(stderr, "ERROR - image type is not binary (0x01)\n");
+    LOG_ERROR("image type is not binary (0x01)");
     return -1;
   }
 
@@ -681,7 +1012,7 @@ static int validate_image(const uint8_t *image, const size_t size)
     uint32_t secStart __attribute__((unused)) = *current++;
     //printf("\tsecStart: 0x%08x\n", secStart);
     if (current + loadSz >= end - 2) {
-      fprintf(stderr, "ERROR - loadSz is too big - loadSz=%u\n", loadSz);
+      LOG_ERROR("loadSz is too big - loadSz=%u", loadSz);
       return -1;
     }
     while (loadSz--) {
@@ -692,11 +1023,11 @@ static int validate_image(const uint8_t *image, const size_t size)
   //printf("entryAddr: 0x%08x\n", entryAddr);
   uint32_t expected_checksum = *current++;
   if (!(current == end)) {
-    fprintf(stderr, "WARNING - image file longer than expected\n");
+    LOG_WARNING("image file longer than expected");
   }
   if (!(checksum == expected_checksum)) {
-      fprintf(stderr, "ERROR - checksum does not match - actual=0x%08x expected=0x%08x\n",
-              checksum, expected_checksum);
+      LOG_ERROR("checksum does not match - actual=0x%08x expected=0x%08x",
+                checksum, expected_checksum);
       return -1;
   }
   return 0;
@@ -732,7 +1063,7 @@ static int transfer_image(const uint8_t *image,
         return -1;
       }
       if (!(ret == wLength)) {
-        fprintf(stderr, "ERROR - libusb_control_transfer() returned less bytes than expected - actual=%d expected=%hu\n", ret, wLength);
+        LOG_ERROR("libusb_control_transfer() returned less bytes than expected - actual=%d expected=%hu", ret, wLength);
         return -1;
       }
       data += wLength;
@@ -778,7 +1109,7 @@ static int list_endpoints(struct libusb_endpoint_descriptor endpoints[],
       for (int endp = 0; endp < setting->bNumEndpoints; ++endp) {
         const struct libusb_endpoint_descriptor *endpoint = &setting->endpoint[endp];
         if (count == MAX_ENDPOINTS) {
-          fprintf(stderr, "WARNING - found too many USB endpoints; returning only the first %d\n", MAX_ENDPOINTS);
+          LOG_WARNING("found too many USB endpoints; returning only the first %d", MAX_ENDPOINTS);
           return count;
         }
         endpoints[count] = *endpoint;
@@ -802,3 +1133,36 @@ static int list_endpoints(struct libusb_endpoint_descriptor endpoints[],
 
   return count;
 }
+
+
+static void LIBUSB_CALL usb_device_control_async_callback(struct libusb_transfer *transfer)
+{
+  usb_device_t *this = (usb_device_t *) transfer->user_data;
+  TRACE_CONTROL_COMPLETE(libusb_control_transfer_get_setup(transfer)->bRequest,
+                         transfer->status == LIBUSB_TRANSFER_COMPLETED ? 0 : -1);
+
+  if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    LOG_ERROR("async control request 0x%02x failed with status %d",
+              libusb_control_transfer_get_setup(transfer)->bRequest,
+              transfer->status);
+  }
+
+  /* release the slot before calling back, so the callback can submit the
+     next request */
+  usb_device_control_cb_t callback = 0;
+  void *callback_context = 0;
+  for (int i = 0; i < MAX_ASYNC_CONTROLS; ++i) {
+    if (this->control_transfers[i] == transfer) {
+      callback = this->control_callbacks[i];
+      callback_context = this->control_callback_contexts[i];
+      atomic_store(&this->control_busy[i], 0);
+      break;
+    }
+  }
+
+  if (callback) {
+    callback(transfer->status == LIBUSB_TRANSFER_COMPLETED ? 0 : -1,
+             callback_context);
+  }
+  return;
+}
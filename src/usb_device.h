@@ -61,13 +61,39 @@ int usb_device_free_device_list(struct usb_device_info *usb_device_infos);
 usb_device_t *usb_device_open(int index, const char* imagefile,
                               uint16_t gpio_register);
 
+/* the thread handling the events owns them: the control write requests
+   from other threads are then completed by it, until it lets go of them
+   with usb_device_release_events() */
 int usb_device_handle_events(usb_device_t *this);
 
+void usb_device_claim_events(usb_device_t *this);
+
+void usb_device_release_events(usb_device_t *this);
+
+int usb_device_owns_events(usb_device_t *this);
+
+/* an extra file descriptor (the usbfs streaming backend) to be polled for
+   POLLOUT by usb_device_handle_events() together with the libusb ones; the
+   callback runs after every poll, with revents 0 on a timeout. A negative
+   fd removes it */
+typedef void (*usb_device_event_cb_t)(short revents, void *context);
+
+int usb_device_set_event_source(usb_device_t *this, int fd,
+                                usb_device_event_cb_t callback,
+                                void *callback_context);
+
 void usb_device_close(usb_device_t *this);
 
 int usb_device_control(usb_device_t *this, uint8_t request, uint16_t value,
                        uint16_t index, uint8_t *data, uint16_t length);
 
+typedef void (*usb_device_control_cb_t)(int status, void *context);
+
+int usb_device_control_async(usb_device_t *this, uint8_t request,
+                             uint16_t value, uint16_t index, uint8_t *data,
+                             uint16_t length, usb_device_control_cb_t callback,
+                             void *callback_context);
+
 uint16_t usb_device_gpio_get(usb_device_t *this);
 
 int usb_device_gpio_set(usb_device_t *this, uint16_t bit_pattern,
@@ -23,6 +23,10 @@
 #ifndef __USB_DEVICE_INTERNALS_H
 #define __USB_DEVICE_INTERNALS_H
 
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
 #include "usb_device.h"
 
 
@@ -42,9 +46,28 @@ typedef struct usb_device {
   uint8_t bulk_in_endpoint_address;
   uint16_t bulk_in_max_packet_size;
   uint8_t bulk_in_max_burst;
-  uint16_t gpio_register;
+  _Atomic uint16_t gpio_register;
 #define MAX_FW_REGISTERS (16)
-  uint16_t fw_registers[MAX_FW_REGISTERS];
+  _Atomic uint16_t fw_registers[MAX_FW_REGISTERS];
+#define MAX_ASYNC_CONTROLS (8)
+#define MAX_ASYNC_CONTROL_DATA (16)
+  struct libusb_transfer *control_transfers[MAX_ASYNC_CONTROLS];
+  uint8_t control_buffers[MAX_ASYNC_CONTROLS][LIBUSB_CONTROL_SETUP_SIZE + MAX_ASYNC_CONTROL_DATA];
+  atomic_int control_busy[MAX_ASYNC_CONTROLS];
+  usb_device_control_cb_t control_callbacks[MAX_ASYNC_CONTROLS];
+  void *control_callback_contexts[MAX_ASYNC_CONTROLS];
+  atomic_int events_owned;      /* a thread is handling the events */
+  _Atomic pthread_t events_thread;
+  pthread_mutex_t control_lock;
+  pthread_cond_t control_done;
+  int event_fd;
+  usb_device_event_cb_t event_callback;
+  void *event_callback_context;
+  /* the libusb file descriptors, kept up to date by its notifiers */
+#define MAX_POLL_FDS (16)
+  pthread_mutex_t poll_lock;
+  struct pollfd poll_fds[MAX_POLL_FDS];
+  int npoll_fds;
 } usb_device_t;
 typedef struct usb_device usb_device_t;
 